@@ -0,0 +1,193 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "arena.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+unsigned long arena::mallocs = 0;
+unsigned long arena::frees = 0;
+unsigned long arena::allocations = 0;
+unsigned long arena::resets = 0;
+
+static pthread_key_t arenaKey;
+static pthread_once_t arenaOnce = PTHREAD_ONCE_INIT;
+
+// All allocations are aligned for any type
+#define ARENA_ALIGN(n) (((n) + sizeof (double) - 1) & ~(sizeof (double) - 1))
+
+/*
+ * Constructor
+ */
+arena::arena () : m_pFirst (NULL), m_pCurrent (NULL), m_pPos (NULL), m_pEnd (NULL),
+		m_nAllocations (0), m_nScopes (0) {
+	// blocks are allocated on first use
+}
+
+/*
+ * Destructor
+ */
+arena::~arena () {
+	block *next;
+	for (block *b = m_pFirst; b; b = next) {
+		next = b->next;
+		free (b);
+		__sync_fetch_and_add (&frees, 1);
+	}
+}
+
+/*
+ * Allocate memory from the arena.
+ *
+ * @param size number of bytes
+ * @return pointer to the memory, throws std::bad_alloc if malloc fails
+ */
+void *arena::allocate (size_t size) {
+	size = ARENA_ALIGN (size);
+	m_nAllocations++;
+
+	while ((size_t)(m_pEnd - m_pPos) < size) {
+		// Move on to the next retained block or get a new one
+		if (m_pCurrent && m_pCurrent->next)
+			m_pCurrent = m_pCurrent->next;
+		else if (m_pCurrent)
+			m_pCurrent = m_pCurrent->next = this->newBlock (size);
+		else
+			m_pCurrent = m_pFirst = this->newBlock (size);
+
+		m_pPos = (char *)m_pCurrent + ARENA_ALIGN (sizeof (block));
+		m_pEnd = m_pPos + m_pCurrent->size;
+	}
+
+	void *p = m_pPos;
+	m_pPos += size;
+	return p;
+}
+
+/*
+ * Copy a string into the arena.
+ *
+ * @param s the string
+ * @param len length of the string
+ * @return null-terminated copy
+ */
+char *arena::copy (const char *s, size_t len) {
+	char *p = (char *)this->allocate (len + 1);
+	memcpy (p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+/*
+ * Make all memory available again. Blocks up to ARENA_MAX_RETAINED
+ * are kept for the next use of the arena.
+ */
+void arena::reset () {
+	size_t retained = 0;
+	block *prev = NULL, *next;
+
+	for (block *b = m_pFirst; b; b = next) {
+		next = b->next;
+		retained += b->size;
+		if (retained > ARENA_MAX_RETAINED && prev) {
+			prev->next = next;
+			free (b);
+			__sync_fetch_and_add (&frees, 1);
+		}
+		else
+			prev = b;
+	}
+
+	m_pCurrent = NULL;
+	m_pPos = m_pEnd = NULL;
+	if (m_pFirst) {
+		m_pCurrent = m_pFirst;
+		m_pPos = (char *)m_pFirst + ARENA_ALIGN (sizeof (block));
+		m_pEnd = m_pPos + m_pFirst->size;
+	}
+	__sync_fetch_and_add (&allocations, m_nAllocations);
+	__sync_fetch_and_add (&resets, 1);
+	m_nAllocations = 0;
+}
+
+/*
+ * Go back to an earlier position, keeping the blocks that were added since.
+ *
+ * @param current the block at the time, NULL if there was none yet
+ * @param pos next free byte in it
+ * @param end end of it
+ */
+void arena::rewind (block *current, char *pos, char *end) {
+	if (current == NULL && m_pFirst) {
+		current = m_pFirst;
+		pos = (char *)m_pFirst + ARENA_ALIGN (sizeof (block));
+		end = pos + m_pFirst->size;
+	}
+	m_pCurrent = current;
+	m_pPos = pos;
+	m_pEnd = end;
+}
+
+static void createArenaKey () {
+	pthread_key_create (&arenaKey, arena::destroyLocal);
+}
+
+/*
+ * Get the arena of the calling thread, creating it if necessary.
+ *
+ * @return the thread's arena
+ */
+arena &arena::local () {
+	pthread_once (&arenaOnce, createArenaKey);
+
+	arena *a = (arena *)pthread_getspecific (arenaKey);
+	if (a == NULL) {
+		a = new arena;
+		pthread_setspecific (arenaKey, a);
+	}
+	return *a;
+}
+
+/*
+ * Free a thread's arena when the thread exits.
+ */
+void arena::destroyLocal (void *p) {
+	delete (arena *)p;
+}
+
+/*
+ * Get a new block from malloc.
+ *
+ * @param size minimum usable size of the block
+ * @return the block
+ */
+arena::block *arena::newBlock (size_t size) {
+	if (size < ARENA_BLOCK_SIZE)
+		size = ARENA_BLOCK_SIZE;
+
+	block *b = (block *)malloc (ARENA_ALIGN (sizeof (block)) + size);
+	if (b == NULL)
+		throw std::bad_alloc ();
+	b->next = NULL;
+	b->size = size;
+	__sync_fetch_and_add (&mallocs, 1);
+
+	return b;
+}
@@ -0,0 +1,143 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef ARENA_HPP_
+#define ARENA_HPP_
+
+#include <cstddef>
+#include <new>
+
+#include <pthread.h>
+
+// Size of the blocks the arena requests from malloc
+#define ARENA_BLOCK_SIZE 65536
+// Memory kept by an arena across resets, anything above is given back
+#define ARENA_MAX_RETAINED (4 * 1024 * 1024)
+
+/*
+ * arena
+ * A bump allocator for the short-lived parsing state of a write() call.
+ * Memory is never freed individually; reset() makes all of it available again
+ * while keeping the blocks, so a steady-state write doesn't call malloc.
+ */
+class arena {
+	private:
+		struct block;
+
+	public:
+		arena ();
+		~arena ();
+
+		void *allocate (size_t);
+		char *copy (const char *, size_t);
+		void reset ();
+
+		// Arena of the calling thread
+		static arena &local ();
+		static void destroyLocal (void *);
+
+		/*
+		 * Frees what was allocated within it when it goes out of scope; the
+		 * outermost one resets the arena, a nested one only rewinds it, so
+		 * the memory of the enclosing scopes stays valid
+		 */
+		class scope {
+			public:
+				scope (arena &a) : m_arena (a), m_pCurrent (a.m_pCurrent), m_pPos (a.m_pPos),
+						m_pEnd (a.m_pEnd) { a.m_nScopes++; }
+				~scope () {
+					if (--m_arena.m_nScopes == 0)
+						m_arena.reset ();
+					else
+						m_arena.rewind (m_pCurrent, m_pPos, m_pEnd);
+				}
+			private:
+				arena &m_arena;
+				block *m_pCurrent;
+				char *m_pPos;
+				char *m_pEnd;
+		};
+
+		// Counters for all arenas, shown in the .stats file
+		static unsigned long mallocs; // blocks requested from malloc
+		static unsigned long frees; // blocks given back
+		static unsigned long allocations; // allocations served from the arena
+		static unsigned long resets;
+
+	private:
+		struct block {
+			block *next;
+			size_t size;
+		};
+
+		block *newBlock (size_t);
+		void rewind (block *, char *, char *);
+
+	private:
+		block *m_pFirst;
+		block *m_pCurrent;
+		char *m_pPos; // next free byte in the current block
+		char *m_pEnd;
+		unsigned long m_nAllocations; // since the last reset
+		unsigned int m_nScopes; // open scopes
+};
+
+/*
+ * STL allocator that takes its memory from the thread's arena.
+ *
+ * Only use it for containers that don't outlive the arena scope they were
+ * created in, i.e. boost::match_results during a single write().
+ */
+template <class T>
+class arena_allocator {
+	public:
+		typedef T value_type;
+		typedef T *pointer;
+		typedef const T *const_pointer;
+		typedef T &reference;
+		typedef const T &const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <class U> struct rebind { typedef arena_allocator<U> other; };
+
+		arena_allocator () { }
+		template <class U> arena_allocator (const arena_allocator<U> &) { }
+
+		pointer address (reference x) const { return &x; }
+		const_pointer address (const_reference x) const { return &x; }
+		pointer allocate (size_type n, const void * = 0) {
+			return (pointer)arena::local ().allocate (n * sizeof (T));
+		}
+		void deallocate (pointer, size_type) { }
+		size_type max_size () const { return size_t (-1) / sizeof (T); }
+		void construct (pointer p, const T &val) { new ((void *)p) T (val); }
+		void destroy (pointer p) { p->~T (); }
+};
+
+template <class T, class U>
+bool operator== (const arena_allocator<T> &, const arena_allocator<U> &) { return true; }
+template <class T, class U>
+bool operator!= (const arena_allocator<T> &, const arena_allocator<U> &) { return false; }
+
+#endif /*ARENA_HPP_*/
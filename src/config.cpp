@@ -18,10 +18,10 @@
  * 02111-1307, USA.
  */
 #include "config.hpp"
+#include "messages.hpp"
 
-#ifdef _DEBUG
-	#include <iostream>
-#endif
+#include <algorithm>
+#include <sstream>
 
 using namespace std;
 
@@ -51,22 +51,18 @@ bool config::load (string filename) {
     xmlXPathContextPtr xpathCtx; 
     xmlXPathObjectPtr xpathObj;
 
-	cerr << "Loading " << filename << endl;
+	message (LEVEL_INFO, "Loading %s", filename.c_str ());
     /* Load XML document */
     doc = xmlParseFile(filename.c_str ());
     if (doc == NULL) {
-    	#ifdef _DEBUG
-			cerr << "Error: Unable to load schema file\n";
-		#endif
+		message (LEVEL_DEBUG, "Unable to load %s", filename.c_str ());
 		return false;
     }
 
     /* Create xpath evaluation context */
     xpathCtx = xmlXPathNewContext(doc);
     if(xpathCtx == NULL) {
-    	#ifdef _DEBUG
-        	cerr << "Error: unable to create new XPath context\n";
-        #endif
+        message (LEVEL_DEBUG, "Unable to create new XPath context");
         xmlFreeDoc (doc); 
         return false;
     }
@@ -74,9 +70,7 @@ bool config::load (string filename) {
     /* Evaluate xpath expression */
     xpathObj = xmlXPathEvalExpression (xpathExpr, xpathCtx);
     if(xpathObj == NULL) {
-    	#ifdef _DEBUG
-        	cerr << "Error: unable to evaluate xpath expression " <<  xpathExpr << endl;
-        #endif
+        message (LEVEL_DEBUG, "Unable to evaluate xpath expression %s", (const char *)xpathExpr);
         xmlXPathFreeContext (xpathCtx); 
         xmlFreeDoc (doc); 
         return false;
@@ -106,6 +100,7 @@ void config::parseNodeset (xmlNodeSetPtr nodes) {
     string strLocation;//, strSoftware, strServer, strDatabase, strUsername, strPassword, strFormat;
     string strTmp;
     struct logInfo tmpInfo;
+    vector<xmlNodePtr> vDestinations;
     
     size = (nodes) ? nodes->nodeNr : 0;
     for(i = 0; i < size; ++i) {
@@ -114,6 +109,31 @@ void config::parseNodeset (xmlNodeSetPtr nodes) {
 	    
 	    // Initialize the tmpInfo struct
 	    tmpInfo.uid = tmpInfo.gid = tmpInfo.port = tmpInfo.permissions = 0;
+	    tmpInfo.matchBudget = DEFAULT_MATCH_BUDGET;
+	    tmpInfo.weight = DEFAULT_WEIGHT;
+	    tmpInfo.rateLimit = tmpInfo.rateBurst = 0;
+	    tmpInfo.rateDrop = true;
+	    tmpInfo.parseCache = DEFAULT_PARSE_CACHE;
+	    tmpInfo.maxPaths = DEFAULT_MAX_PATHS;
+	    tmpInfo.repeatColumn = "";
+	    tmpInfo.wildcardColumns.clear ();
+	    tmpInfo.sources.clear ();
+	    tmpInfo.destinations.clear ();
+	    tmpInfo.queueSize = DEFAULT_QUEUE_SIZE;
+	    tmpInfo.path = "";
+	    vDestinations.clear ();
+	    tmpInfo.batchSize = DEFAULT_BATCH_SIZE;
+	    tmpInfo.inFlight = DEFAULT_IN_FLIGHT;
+	    tmpInfo.loadData = false;
+	    tmpInfo.partition = PARTITION_NONE;
+	    tmpInfo.partitionAhead = DEFAULT_PARTITION_AHEAD;
+	    tmpInfo.retention = 0;
+	    tmpInfo.eventTime = "";
+	    tmpInfo.multiline.start = tmpInfo.multiline.continuation = "";
+	    tmpInfo.multiline.maxLines = DEFAULT_MULTILINE_MAX_LINES;
+	    tmpInfo.multiline.timeout = DEFAULT_MULTILINE_TIMEOUT;
+	    tmpInfo.shard = tmpInfo.shardKey = "";
+	    tmpInfo.shardWeight = 1;
 	    
 	    for (tmpNode = cur->children; tmpNode; tmpNode = tmpNode->next) {
 	    	if (tmpNode->type == XML_ELEMENT_NODE) {
@@ -121,6 +141,29 @@ void config::parseNodeset (xmlNodeSetPtr nodes) {
 	    		if (strncmp ((const char *)tmpNode->name, "location",
 	    				strlen ("location")) == 0) {
 	    			strLocation = (const char *)tmpNode->children->content;
+	    			// Wildcard segments are stored in these columns
+	    			xmlChar *column = xmlGetProp (tmpNode, (const xmlChar *)"column");
+	    			if (column) {
+	    				split ((const char *)column, ',', &(tmpInfo.wildcardColumns));
+	    				for (unsigned int i = 0; i < tmpInfo.wildcardColumns.size(); i++)
+	    					tmpInfo.wildcardColumns[i] = trim (tmpInfo.wildcardColumns[i]);
+	    				xmlFree (column);
+	    			}
+	    		}
+	    		// Additional sources of lines
+	    		else if (strncmp ((const char *)tmpNode->name, "source",
+	    				strlen ("source")) == 0) {
+	    			sourceInfo source;
+	    			for (xmlAttrPtr attr = tmpNode->properties; attr; attr = attr->next) {
+	    				xmlChar *value = xmlNodeListGetString (tmpNode->doc, attr->children, 1);
+	    				if (xmlStrcmp (attr->name, (const xmlChar *)"type") == 0)
+	    					source.type = value ? (const char *)value : "";
+	    				else
+	    					source.options[(const char *)attr->name] = value ? (const char *)value : "";
+	    				if (value)
+	    					xmlFree (value);
+	    			}
+	    			tmpInfo.sources.push_back (source);
 	    		}
 	    		// Schemas
 	    		else if (strncmp ((const char *)tmpNode->name, "schemas",
@@ -130,43 +173,6 @@ void config::parseNodeset (xmlNodeSetPtr nodes) {
 	    			for (unsigned int i = 0; i < tmpInfo.schemas.size(); i++)
 	    				tmpInfo.schemas[i] = trim (tmpInfo.schemas[i]);
 	    		}
-	    		// Database software
-	    		else if (strncmp ((const char *)tmpNode->name, "database-software",
-	    				strlen ("database-software")) == 0) {
-	    			tmpInfo.software = (const char *)tmpNode->children->content;
-	    		}
-	    		// Database
-	    		else if (strncmp ((const char *)tmpNode->name, "database",
-	    				strlen ("database")) == 0) {
-	    			tmpInfo.database = (const char *)tmpNode->children->content;
-	    		}
-	    		// Table
-	    		else if (strncmp ((const char *)tmpNode->name, "table",
-	    				strlen ("table")) == 0) {
-	    			tmpInfo.table = (const char *)tmpNode->children->content;
-	    		}
-	    		// Server
-	    		else if (strncmp ((const char *)tmpNode->name, "server",
-	    				strlen ("server")) == 0) {
-	    			tmpInfo.server = (const char *)tmpNode->children->content;
-	    		}
-	    		// Username
-	    		else if (strncmp ((const char *)tmpNode->name, "username",
-	    				strlen ("username")) == 0) {
-	    			tmpInfo.username = (const char *)tmpNode->children->content;
-	    		}
-	    		// Password
-	    		else if (strncmp ((const char *)tmpNode->name, "password",
-	    				strlen ("password")) == 0) {
-	    			if (!tmpNode->children)
-	    				tmpInfo.password = "";
-	    			else
-	    				tmpInfo.password = (const char *)tmpNode->children->content;
-	    		}
-	    		else if (strncmp ((const char *)tmpNode->name, "port",
-	    				strlen ("port")) == 0) {
-	    			tmpInfo.port = strtoint ((const char *)tmpNode->children->content);
-	    		}
 	    		// File Owner
 	    		else if (strncmp ((const char *)tmpNode->name, "uid",
 	    				strlen ("uid")) == 0) {
@@ -197,13 +203,263 @@ void config::parseNodeset (xmlNodeSetPtr nodes) {
 	    				strlen ("permissions")) == 0) {
 	    			tmpInfo.permissions = strtooct ((const char *)tmpNode->children->content);
 	    		}
+	    		// Regex matching budget per line
+	    		else if (strncmp ((const char *)tmpNode->name, "match-budget",
+	    				strlen ("match-budget")) == 0) {
+	    			tmpInfo.matchBudget = strtoint ((const char *)tmpNode->children->content);
+	    		}
+	    		// Share of the ingest workers
+	    		else if (strncmp ((const char *)tmpNode->name, "weight", strlen ("weight")) == 0) {
+	    			tmpInfo.weight = strtoint ((const char *)tmpNode->children->content);
+	    			if (tmpInfo.weight < 1) {
+	    				message (LEVEL_WARNING, "The weight of a log file must be at least 1");
+	    				tmpInfo.weight = 1;
+	    			}
+	    		}
+	    		// Token bucket in lines per second
+	    		else if (strncmp ((const char *)tmpNode->name, "rate-limit", strlen ("rate-limit")) == 0) {
+	    			tmpInfo.rateLimit = strtoint ((const char *)tmpNode->children->content);
+	    		}
+	    		else if (strncmp ((const char *)tmpNode->name, "rate-burst", strlen ("rate-burst")) == 0) {
+	    			tmpInfo.rateBurst = strtoint ((const char *)tmpNode->children->content);
+	    		}
+	    		// What happens to the lines over the limit: drop or delay
+	    		else if (strncmp ((const char *)tmpNode->name, "rate-excess", strlen ("rate-excess")) == 0) {
+	    			string strExcess = trim ((const char *)tmpNode->children->content);
+	    			if (strExcess == "delay")
+	    				tmpInfo.rateDrop = false;
+	    			else if (strExcess == "drop")
+	    				tmpInfo.rateDrop = true;
+	    			else
+	    				message (LEVEL_WARNING, "Unknown rate-excess %s, dropping the excess lines",
+	    						strExcess.c_str ());
+	    		}
+	    		// Parse results of repeated lines
+	    		else if (strncmp ((const char *)tmpNode->name, "parse-cache", strlen ("parse-cache")) == 0) {
+	    			tmpInfo.parseCache = strtoint ((const char *)tmpNode->children->content);
+	    			if (tmpInfo.parseCache < 0)
+	    				tmpInfo.parseCache = 0;
+	    		}
+	    		// Log files a wildcard location may add
+	    		else if (xmlStrcmp (tmpNode->name, (const xmlChar *)"max-paths") == 0) {
+	    			tmpInfo.maxPaths = strtoint ((const char *)tmpNode->children->content);
+	    			if (tmpInfo.maxPaths < 0)
+	    				tmpInfo.maxPaths = 0;
+	    		}
+	    		// Count identical lines instead of storing them one by one
+	    		else if (strncmp ((const char *)tmpNode->name, "repeat-column", strlen ("repeat-column")) == 0) {
+	    			tmpInfo.repeatColumn = trim ((const char *)tmpNode->children->content);
+	    		}
+	    		// Additional destinations, parsed once the defaults are known
+	    		else if (strncmp ((const char *)tmpNode->name, "destination",
+	    				strlen ("destination")) == 0) {
+	    			vDestinations.push_back (tmpNode);
+	    		}
+	    		// Route rows by a captured column instead of the ingest time
+	    		else if (strncmp ((const char *)tmpNode->name, "event-time",
+	    				strlen ("event-time")) == 0) {
+	    			tmpInfo.eventTime = trim ((const char *)tmpNode->children->content);
+	    		}
+	    		// Column that picks the shard of a row (must come before <shard>)
+	    		else if (strncmp ((const char *)tmpNode->name, "shard-key",
+	    				strlen ("shard-key")) == 0) {
+	    			tmpInfo.shardKey = trim ((const char *)tmpNode->children->content);
+	    			if (tmpInfo.shardKey == "round-robin")
+	    				tmpInfo.shardKey = "";
+	    		}
+	    		// Lines that belong together, i.e. stack traces
+	    		else if (strncmp ((const char *)tmpNode->name, "multiline",
+	    				strlen ("multiline")) == 0) {
+	    			parseMultiline (tmpNode, tmpInfo.multiline);
+	    		}
+	    		else
+	    			parseDestination (tmpNode, tmpInfo);
 	    	}
 	    }
+	    
+	    // Every <destination> starts w/ the settings of the log file
+	    for (vector<xmlNodePtr>::iterator node = vDestinations.begin ();
+	    		node != vDestinations.end (); node++) {
+	    	destinationInfo destination = tmpInfo;
+	    	for (tmpNode = (*node)->children; tmpNode; tmpNode = tmpNode->next)
+	    		if (tmpNode->type == XML_ELEMENT_NODE && !parseDestination (tmpNode, destination))
+	    			message (LEVEL_WARNING, "Unknown destination setting %s for %s",
+	    					(const char *)tmpNode->name, strLocation.c_str ());
+	    	tmpInfo.destinations.push_back (destination);
+	    }
+	    if (tmpInfo.destinations.empty ())
+	    	tmpInfo.destinations.push_back (tmpInfo);
+	    // The burst defaults to a second's worth of lines
+	    if (tmpInfo.rateLimit > 0 && tmpInfo.rateBurst < 1)
+	    	tmpInfo.rateBurst = tmpInfo.rateLimit;
+	    // Locations are relative to the mount point
+	    strLocation = trim (strLocation);
+	    while (!strLocation.empty () && strLocation[0] == '/')
+	    	strLocation.erase (0, 1);
+	    
+	    // Every wildcard segment needs a column, default to wildcard1, wildcard2, ...
+	    vector<string> vSegments;
+	    split (strLocation, '/', &vSegments);
+	    unsigned int wildcards = count (vSegments.begin (), vSegments.end (), "*");
+	    if (tmpInfo.wildcardColumns.size () > wildcards)
+	    	tmpInfo.wildcardColumns.resize (wildcards);
+	    while (tmpInfo.wildcardColumns.size () < wildcards) {
+	    	ostringstream strColumn;
+	    	strColumn << "wildcard" << tmpInfo.wildcardColumns.size () + 1;
+	    	tmpInfo.wildcardColumns.push_back (strColumn.str ());
+	    }
+	    
 	    // Put the log file information into the map
 	    m_mLogs[strLocation] = tmpInfo;
     }
 }
 
+/*
+ * Parse the <multiline> element of a log file.
+ * 
+ * @param node the element
+ * @param info receives the rules
+ */
+void config::parseMultiline (xmlNodePtr node, multilineInfo &info) {
+	for (xmlNodePtr tmpNode = node->children; tmpNode; tmpNode = tmpNode->next) {
+		if (tmpNode->type != XML_ELEMENT_NODE)
+			continue;
+		// The regexes may depend on leading whitespace, they aren't trimmed
+		const char *content = tmpNode->children ? (const char *)tmpNode->children->content : "";
+		if (strncmp ((const char *)tmpNode->name, "start", strlen ("start")) == 0)
+			info.start = content;
+		else if (strncmp ((const char *)tmpNode->name, "continue", strlen ("continue")) == 0)
+			info.continuation = content;
+		else if (strncmp ((const char *)tmpNode->name, "max-lines", strlen ("max-lines")) == 0)
+			info.maxLines = strtoint (content);
+		else if (strncmp ((const char *)tmpNode->name, "timeout", strlen ("timeout")) == 0)
+			info.timeout = strtoint (content);
+		else
+			message (LEVEL_WARNING, "Unknown multiline setting %s", (const char *)tmpNode->name);
+	}
+	if (info.maxLines < 1)
+		info.maxLines = 1;
+	if (info.timeout < 0)
+		info.timeout = 0;
+}
+
+/*
+ * Parse an element that describes where the rows go.
+ * 
+ * @param node the element
+ * @param info receives the setting
+ * @return true if the element is a destination setting, false otherwise
+ */
+bool config::parseDestination (xmlNodePtr node, destinationInfo &info) {
+	string strTmp;
+	
+	// Database software
+	if (strncmp ((const char *)node->name, "database-software",
+			strlen ("database-software")) == 0) {
+		info.software = (const char *)node->children->content;
+	}
+	// Database
+	else if (strncmp ((const char *)node->name, "database",
+			strlen ("database")) == 0) {
+		info.database = (const char *)node->children->content;
+	}
+	// Table
+	else if (strncmp ((const char *)node->name, "table",
+			strlen ("table")) == 0) {
+		info.table = (const char *)node->children->content;
+	}
+	// Server
+	else if (strncmp ((const char *)node->name, "server",
+			strlen ("server")) == 0) {
+		info.server = (const char *)node->children->content;
+	}
+	// Username
+	else if (strncmp ((const char *)node->name, "username",
+			strlen ("username")) == 0) {
+		info.username = (const char *)node->children->content;
+	}
+	// Password
+	else if (strncmp ((const char *)node->name, "password",
+			strlen ("password")) == 0) {
+		if (!node->children)
+			info.password = "";
+		else
+			info.password = (const char *)node->children->content;
+	}
+	else if (strncmp ((const char *)node->name, "port",
+			strlen ("port")) == 0) {
+		info.port = strtoint ((const char *)node->children->content);
+	}
+	// File of a file destination
+	else if (strncmp ((const char *)node->name, "path",
+			strlen ("path")) == 0) {
+		info.path = trim ((const char *)node->children->content);
+	}
+	// Rows per INSERT statement
+	else if (strncmp ((const char *)node->name, "batch-size",
+			strlen ("batch-size")) == 0) {
+		info.batchSize = strtoint ((const char *)node->children->content);
+		if (info.batchSize < 1)
+			info.batchSize = 1;
+	}
+	// Unacknowledged batches
+	else if (strncmp ((const char *)node->name, "in-flight",
+			strlen ("in-flight")) == 0) {
+		info.inFlight = strtoint ((const char *)node->children->content);
+		if (info.inFlight < 1)
+			info.inFlight = 1;
+	}
+	// Batches waiting to be sent
+	else if (strncmp ((const char *)node->name, "queue-size",
+			strlen ("queue-size")) == 0) {
+		info.queueSize = strtoint ((const char *)node->children->content);
+		if (info.queueSize < 1)
+			info.queueSize = 1;
+	}
+	// Bulk loading (MySQL)
+	else if (strncmp ((const char *)node->name, "load-data",
+			strlen ("load-data")) == 0) {
+		strTmp = trim ((const char *)node->children->content);
+		info.loadData = (strTmp == "true" || strTmp == "yes" || strTmp == "1");
+	}
+	// Partitions created in advance
+	else if (xmlStrcmp (node->name, (const xmlChar *)"partition-ahead") == 0) {
+		info.partitionAhead = strtoint ((const char *)node->children->content);
+	}
+	// Partitioning of the table: hourly or daily
+	else if (xmlStrcmp (node->name, (const xmlChar *)"partition") == 0) {
+		strTmp = trim ((const char *)node->children->content);
+		if (strTmp == "hourly")
+			info.partition = PARTITION_HOURLY;
+		else if (strTmp == "daily")
+			info.partition = PARTITION_DAILY;
+		else if (strTmp != "none")
+			message (LEVEL_WARNING, "Unknown partitioning %s, use hourly or daily", strTmp.c_str ());
+
+	}
+	// Number of partitions to keep
+	else if (xmlStrcmp (node->name, (const xmlChar *)"retention") == 0) {
+		info.retention = strtoint ((const char *)node->children->content);
+	}
+	// One of the shards of the log file, w/ a share of the keys
+	else if (strncmp ((const char *)node->name, "shard", strlen ("shard")) == 0) {
+		info.shard = trim ((const char *)node->children->content);
+		xmlChar *weight = xmlGetProp (node, (const xmlChar *)"weight");
+		if (weight) {
+			info.shardWeight = strtoint ((const char *)weight);
+			if (info.shardWeight < 1) {
+				message (LEVEL_WARNING, "The weight of shard %s must be at least 1", info.shard.c_str ());
+				info.shardWeight = 1;
+			}
+			xmlFree (weight);
+		}
+	}
+	else
+		return false;
+	
+	return true;
+}
+
 /*
  * Return a std::map containing the schemas.
  * 
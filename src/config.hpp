@@ -41,18 +41,90 @@
 
 #include "general.hpp"
 
-struct logInfo {
-	std::string software;
+// Time (in milliseconds) a single line may spend in regex matching
+#define DEFAULT_MATCH_BUDGET 50
+// Rows per INSERT statement
+#define DEFAULT_BATCH_SIZE 100
+// Batches that may wait for an acknowledgement from the database at a time
+#define DEFAULT_IN_FLIGHT 8
+// Batches of a destination that may wait to be sent
+#define DEFAULT_QUEUE_SIZE 64
+// Share of the ingest workers of a log file, relative to the others
+#define DEFAULT_WEIGHT 1
+// Lines whose parse results a log file keeps, 0 = no cache
+#define DEFAULT_PARSE_CACHE 0
+// Number of future partitions that are created in advance
+#define DEFAULT_PARTITION_AHEAD 3
+// Lines a multi-line record may have, the next one starts a new record
+#define DEFAULT_MULTILINE_MAX_LINES 500
+// Milliseconds after the last line until a multi-line record is complete
+#define DEFAULT_MULTILINE_TIMEOUT 1000
+// Log files a wildcard location may add, further paths are refused
+#define DEFAULT_MAX_PATHS 10000
+
+// Time range covered by each partition of a log's table
+enum partitionPeriod {
+	PARTITION_NONE = 0,
+	PARTITION_HOURLY,
+	PARTITION_DAILY
+};
+
+// A <source> of a log file other than the mount point, i.e. a syslog listener
+struct sourceInfo {
+	std::string type;
+	std::map<std::string, std::string> options; // the other attributes of the element
+};
+
+// Where the rows of a log file go: a database table or a file
+struct destinationInfo {
+	std::string software; // "file" for a local file
 	std::string server;
 	std::string database;
 	std::string table;
 	std::string username;
 	std::string password;
+	std::string path; // of a file destination
 	int port;
+	int batchSize;
+	int inFlight;
+	int queueSize; // batches waiting to be sent, more are dropped
+	bool loadData; // MySQL: LOAD DATA LOCAL INFILE instead of INSERTs
+	int partition; // partitionPeriod
+	int partitionAhead;
+	int retention; // partitions to keep, 0 keeps all of them
+	std::string shard; // name on the shard ring of the log file, "" = gets every row
+	int shardWeight; // share of the keys relative to the other shards
+};
+
+// Lines that are parsed together as one record, i.e. a stack trace
+struct multilineInfo {
+	std::string start; // regex of the first line of a record
+	std::string continuation; // regex of the lines that continue it
+	int maxLines;
+	int timeout; // milliseconds w/out a new line until the record is complete
+};
+
+// The settings outside of <destination> are the destination of a log file
+// that has none, and the defaults of the <destination>s otherwise
+struct logInfo : public destinationInfo {
 	int uid;
 	int gid;
 	int permissions;
+	int matchBudget;
+	int weight; // share of the ingest workers
+	int rateLimit; // lines per second, 0 = unlimited
+	int rateBurst; // lines that may exceed the rate at once
+	bool rateDrop; // lines over the rate limit are dropped instead of delayed
+	int parseCache; // lines whose parse results are cached
+	int maxPaths; // log files a wildcard location adds at most, 0 = unlimited
+	std::string repeatColumn; // runs of identical lines are one row w/ their count here, "" = off
+	std::string eventTime; // column that holds the row's time, "" for ingest time
+	multilineInfo multiline; // no regex = one line per record
+	std::string shardKey; // column whose value picks the shard, "" = round robin
 	std::vector<std::string> schemas;
+	std::vector<std::string> wildcardColumns; // columns for the '*' segments of the location
+	std::vector<sourceInfo> sources;
+	std::vector<destinationInfo> destinations; // at least one
 };
 
 class config {
@@ -68,6 +140,8 @@ class config {
 	 */
 	private:
 		void parseNodeset(xmlNodeSetPtr nodes);
+		bool parseDestination (xmlNodePtr, destinationInfo &);
+		void parseMultiline (xmlNodePtr, multilineInfo &);
 	
 	/*
 	 * Private variables
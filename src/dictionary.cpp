@@ -0,0 +1,220 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "dictionary.hpp"
+#include "general.hpp"
+#include "messages.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static unsigned long long aKey[2];
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Read the key of the ids, or create it if there's none yet. A key that can't
+ * be saved only lasts until the next restart, the values are stored again w/
+ * new ids then.
+ */
+static void loadKey () {
+	int fd = open (DICTIONARY_KEY_FILE, O_RDONLY);
+	if (fd >= 0) {
+		ssize_t n = read (fd, aKey, sizeof (aKey));
+		close (fd);
+		if (n == (ssize_t)sizeof (aKey))
+			return;
+		message (LEVEL_WARNING, "%s is too short, the dictionary ids of this run are new",
+				DICTIONARY_KEY_FILE);
+	}
+	int nError = errno;
+
+	fd = open ("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read (fd, aKey, sizeof (aKey)) != (ssize_t)sizeof (aKey)) {
+		message (LEVEL_WARNING, "Couldn't read /dev/urandom: %s", strerror (errno));
+		aKey[0] ^= (unsigned long long)time (NULL) * 0x9e3779b97f4a7c15ULL;
+		aKey[1] ^= (unsigned long long)getpid () * 0xbf58476d1ce4e5b9ULL;
+	}
+	if (fd >= 0)
+		close (fd);
+	if (nError != ENOENT)
+		return;
+
+	string strPath = DICTIONARY_KEY_FILE;
+	mkdir (strPath.substr (0, strPath.rfind ('/')).c_str (), 0755);
+	fd = open (DICTIONARY_KEY_FILE, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || write (fd, aKey, sizeof (aKey)) != (ssize_t)sizeof (aKey))
+		message (LEVEL_WARNING, "Couldn't save the key of the dictionary ids to %s: %s, "
+				"values are stored again after a restart", DICTIONARY_KEY_FILE, strerror (errno));
+	if (fd >= 0)
+		close (fd);
+}
+
+#define SIP_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+	do { \
+		v0 += v1; v1 = SIP_ROTATE (v1, 13); v1 ^= v0; v0 = SIP_ROTATE (v0, 32); \
+		v2 += v3; v3 = SIP_ROTATE (v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIP_ROTATE (v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIP_ROTATE (v1, 17); v1 ^= v2; v2 = SIP_ROTATE (v2, 32); \
+	} while (0)
+
+/*
+ * SipHash-2-4 of a string. Little endian byte order is assumed.
+ */
+static unsigned long long sipHash (const unsigned long long *key, const char *s, size_t length) {
+	unsigned long long v0 = key[0] ^ 0x736f6d6570736575ULL;
+	unsigned long long v1 = key[1] ^ 0x646f72616e646f6dULL;
+	unsigned long long v2 = key[0] ^ 0x6c7967656e657261ULL;
+	unsigned long long v3 = key[1] ^ 0x7465646279746573ULL;
+	unsigned long long word;
+
+	size_t remaining = length;
+	for (; remaining >= 8; s += 8, remaining -= 8) {
+		memcpy (&word, s, 8);
+		v3 ^= word;
+		SIP_ROUND (v0, v1, v2, v3);
+		SIP_ROUND (v0, v1, v2, v3);
+		v0 ^= word;
+	}
+	word = 0;
+	memcpy (&word, s, remaining);
+	word |= (unsigned long long)(length & 0xff) << 56;
+	v3 ^= word;
+	SIP_ROUND (v0, v1, v2, v3);
+	SIP_ROUND (v0, v1, v2, v3);
+	v0 ^= word;
+
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; i++)
+		SIP_ROUND (v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Constructor
+ *
+ * @param strColumn the column
+ */
+dictionary::dictionary (const string &strColumn) : column (strColumn), m_nSize (0) {
+	pthread_mutex_init (&m_lock, NULL);
+	m_vIds.assign (1024, 0);
+}
+
+/*
+ * Destructor
+ */
+dictionary::~dictionary () {
+	pthread_mutex_destroy (&m_lock);
+}
+
+/*
+ * The id of a value.
+ *
+ * @param first start of the value
+ * @param last end of the value
+ * @return the id, 0 for an empty value
+ */
+unsigned long long dictionary::id (const char *first, const char *last) {
+	if (first == last)
+		return 0;
+	pthread_once (&keyOnce, loadKey);
+	// Positive as a signed bigint, and never 0
+	unsigned long long id = sipHash (aKey, first, last - first) >> 1;
+	return id ? id : 1;
+}
+
+/*
+ * Remember that an id has been stored.
+ *
+ * @param id the id
+ * @return true if it's new, false if it was stored before
+ */
+bool dictionary::add (unsigned long long id) {
+	pthread_mutex_lock (&m_lock);
+	size_t mask = m_vIds.size () - 1;
+	size_t i = id & mask;
+	while (m_vIds[i] != 0 && m_vIds[i] != id)
+		i = (i + 1) & mask;
+	bool bNew = (m_vIds[i] == 0);
+	if (bNew) {
+		m_vIds[i] = id;
+		// Keep at most half of the slots in use
+		if (++m_nSize * 2 > m_vIds.size ())
+			this->grow ();
+	}
+	pthread_mutex_unlock (&m_lock);
+	return bNew;
+}
+
+/*
+ * Forget an id whose row didn't make it into the database. The ids after it
+ * in its probe sequence move up, so lookups don't stop at the gap.
+ *
+ * @param id the id
+ */
+void dictionary::forget (unsigned long long id) {
+	pthread_mutex_lock (&m_lock);
+	size_t mask = m_vIds.size () - 1;
+	size_t i = id & mask;
+	while (m_vIds[i] != 0 && m_vIds[i] != id)
+		i = (i + 1) & mask;
+	if (m_vIds[i] == id && id != 0) {
+		for (size_t j = (i + 1) & mask; m_vIds[j] != 0; j = (j + 1) & mask) {
+			// Stays if its own slot is between the gap and where it is
+			size_t home = m_vIds[j] & mask;
+			if (i < j ? (i < home && home <= j) : (i < home || home <= j))
+				continue;
+			m_vIds[i] = m_vIds[j];
+			i = j;
+		}
+		m_vIds[i] = 0;
+		m_nSize--;
+	}
+	pthread_mutex_unlock (&m_lock);
+}
+
+/*
+ * Double the table, or forget all ids once it has reached its maximum size.
+ * Must be called w/ the lock held.
+ */
+void dictionary::grow () {
+	if (m_vIds.size () >= 2 * DICTIONARY_MAX_IDS) {
+		m_vIds.assign (m_vIds.size (), 0);
+		m_nSize = 0;
+		return;
+	}
+
+	vector<unsigned long long> vIds (2 * m_vIds.size (), 0);
+	size_t mask = vIds.size () - 1;
+	for (size_t j = 0; j < m_vIds.size (); j++) {
+		if (m_vIds[j] == 0)
+			continue;
+		size_t i = m_vIds[j] & mask;
+		while (vIds[i] != 0)
+			i = (i + 1) & mask;
+		vIds[i] = m_vIds[j];
+	}
+	m_vIds.swap (vIds);
+}
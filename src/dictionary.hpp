@@ -0,0 +1,72 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef DICTIONARY_HPP_
+#define DICTIONARY_HPP_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+// Ids a dictionary remembers as stored, it starts over once it has this many
+#define DICTIONARY_MAX_IDS (1024 * 1024)
+// Secret key of the ids, created w/ the first dictionary
+#define DICTIONARY_KEY_FILE "/var/lib/loggerfs/dictionary.key"
+
+/*
+ * dictionary
+ * A column whose values are stored in a lookup table, <table>_<column>(id,
+ * value), while the log's table only gets the id. The id is a 63 bit keyed
+ * hash (SipHash-2-4) of the value, so it's known w/out asking the database,
+ * and two values w/ the same id can't be made up w/out the secret key in
+ * DICTIONARY_KEY_FILE; 0 stands for an empty value. The ids that have been sent are remembered, so a value is only sent
+ * the first time it's seen (after a restart or a reload it's sent once more,
+ * the database ignores ids it has already). The ids of rows that were dropped
+ * or failed are forgotten again, so they're sent w/ their next line.
+ */
+class dictionary {
+	public:
+		dictionary (const std::string &);
+		~dictionary ();
+
+		static unsigned long long id (const char *, const char *);
+		// Remember an id, false if it was known already
+		bool add (unsigned long long);
+		// The row of an id was lost, send it again
+		void forget (unsigned long long);
+
+	public:
+		std::string column;
+		std::vector<std::string> insertPrefix; // per sink, see sink::dictionaryPrefix ()
+
+	private:
+		void grow ();
+
+	private:
+		pthread_mutex_t m_lock;
+		std::vector<unsigned long long> m_vIds; // open addressing, 0 = empty slot
+		size_t m_nSize;
+};
+
+#endif /*DICTIONARY_HPP_*/
@@ -17,23 +17,48 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
  * 02111-1307, USA.
  */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
 #ifndef FUSEXX_H_
 #define FUSEXX_H_
 
-#define FUSE_USE_VERSION 26 // earlier versions have deprecated functions
+#ifdef HAVE_FUSE3
+	#define FUSE_USE_VERSION 32 // fuse_loop_mt() w/ a struct fuse_loop_config
+#else
+	#define FUSE_USE_VERSION 26 // earlier versions have deprecated functions
+#endif
 
 // C++ Headers
 #include <string> // memset
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
 
 // C Headers
 #include <fuse.h>
+#if FUSE_USE_VERSION >= 30
+	#include <fuse_lowlevel.h> // fuse_parse_cmdline ()
+#endif
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <utime.h>
 
 namespace fusexx {
+#if FUSE_USE_VERSION >= 30
+	// Idle threads the multithreaded loop keeps, unless -o max_idle_threads says otherwise
+	#define FUSEXX_MAX_IDLE_THREADS 10
+
+	// readdir() fills in the entries the FUSE 2 way, libfuse 3 has an extra flags argument
+	typedef int (*fill_dir_t) (void *, const char *, const struct stat *, off_t);
+#else
+	typedef fuse_fill_dir_t fill_dir_t;
+#endif
+
     /*
      * fuse
      * Manages all the fuse operations. A very simple interface to the C fuse_ops struct.
@@ -47,7 +72,7 @@ namespace fusexx {
 			/*
 			 * Main function of fusexx::fuse.
 			 * 
-			 * Calls the fuse 'fuse_main' macro.
+			 * Calls the fuse 'fuse_main' macro, or runs the loop of libfuse 3.
 			 * 
 			 * @param argc the argument counter passed to the main() function
  			 * @param argv the argument vector passed to the main() function
@@ -66,8 +91,12 @@ namespace fusexx {
 					return -1;
 				T::self = t;
 				
+#if FUSE_USE_VERSION >= 30
+				return loop (argc, argv, user_data);
+#else
 				// Execute fuse_main
 				return fuse_main (argc, argv, &T::operations, user_data);
+#endif
 			}
 			
     		static struct fuse_operations operations;
@@ -78,7 +107,9 @@ namespace fusexx {
 		 public:
 			static int readlink (const char *, char *, size_t) { return 0; }
 		    static int getattr (const char *, struct stat * ) { return 0; }
+#if FUSE_USE_VERSION < 30
 		    static int getdir (const char *, fuse_dirh_t, fuse_dirfil_t) { return 0; }
+#endif
 		    static int mknod (const char *, mode_t, dev_t) { return 0; }
 		    static int mkdir (const char *, mode_t) { return 0; }
 		    static int unlink (const char *) { return 0; }
@@ -93,6 +124,30 @@ namespace fusexx {
 		    static int open (const char *, struct fuse_file_info *) { return 0; }
 		    static int read (const char *, char *, size_t, off_t, struct fuse_file_info *) { return 0; }
 		    static int write (const char *, const char *, size_t, off_t,struct fuse_file_info *) { return 0; }
+#ifdef FUSE_CAP_SPLICE_READ
+		    /*
+		     * The data of a write as libfuse got it: in its buffer, or (w/
+		     * FUSE_CAP_SPLICE_READ) spliced from the kernel into a pipe w/out a
+		     * copy. This one passes it on to write(), file systems that can use
+		     * the pipe overload it.
+		     */
+		    static int write_buf (const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+				size_t size = fuse_buf_size (buf);
+				if (buf->count == 1 && buf->off == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+					return T::write (path, (const char *)buf->buf[0].mem, size, off, fi);
+				
+				char *data = (char *)malloc (size);
+				if (data == NULL)
+					return -ENOMEM;
+				struct fuse_bufvec dst = FUSE_BUFVEC_INIT (size);
+				dst.buf[0].mem = data;
+				ssize_t res = fuse_buf_copy (&dst, buf, (enum fuse_buf_copy_flags)0);
+				if (res >= 0)
+					res = T::write (path, data, res, off, fi);
+				free (data);
+				return res;
+			}
+#endif
 		    static int statfs (const char *, struct statvfs *) { return 0; }
 		    static int flush (const char *, struct fuse_file_info *) { return 0; }
 		    static int release (const char *, struct fuse_file_info *) { return 0; }
@@ -101,17 +156,61 @@ namespace fusexx {
 		    static int getxattr (const char *, const char *, char *, size_t) { return 0; }
 		    static int listxattr (const char *, char *, size_t) { return 0; }
 		    static int removexattr (const char *, const char *) { return 0; }
-		    static int readdir (const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *) { return 0; }
+		    static int readdir (const char *, void *, fill_dir_t, off_t, struct fuse_file_info *) { return 0; }
 		    static int opendir (const char *, struct fuse_file_info *) { return 0; }
 		    static int releasedir (const char *, struct fuse_file_info *) { return 0; }
 		    static int fsyncdir (const char *, int, struct fuse_file_info *) { return 0; }
 		    static void *init (struct fuse_conn_info *conn) { return NULL; }
+#if FUSE_USE_VERSION >= 30
+		    static void configure (struct fuse_config *) { }
+		    static void configureLoop (struct fuse_loop_config *) { }
+#endif
 		    static void  destroy (void *) { }
 		    static int access (const char *, int) { return 0; }
 		    static int create (const char *, mode_t, struct fuse_file_info *) { return 0; }
-		    static int ftruncate (const char *, off_t, struct fuse_file_info *) { return 0; }
-		    static int fgetattr (const char *, struct stat *, struct fuse_file_info *) { return 0; }
+		    // W/out a handle of their own, the operations on the path
+		    static int ftruncate (const char *path, off_t size, struct fuse_file_info *) { return T::truncate (path, size); }
+		    static int fgetattr (const char *path, struct stat *stbuf, struct fuse_file_info *) { return T::getattr (path, stbuf); }
 		    		    
+#if FUSE_USE_VERSION >= 30
+		    static void loadOperations () {
+				operations.readlink = T::readlink;
+			    operations.getattr = fuse::getattr3;
+			    operations.mknod = T::mknod;
+			    operations.mkdir = T::mkdir;
+			    operations.unlink = T::unlink;
+			    operations.rmdir = T::rmdir;
+			    operations.symlink = T::symlink;
+			    operations.rename = fuse::rename3;
+			    operations.link = T::link;
+			    operations.chmod = fuse::chmod3;
+			    operations.chown = fuse::chown3;
+			    operations.truncate = fuse::truncate3;
+			    operations.utimens = fuse::utimens3;
+			    operations.open = T::open;
+			    operations.read = T::read;
+			    operations.write = T::write;
+#ifdef FUSE_CAP_SPLICE_READ
+			    operations.write_buf = T::write_buf;
+#endif
+			    operations.statfs = T::statfs;
+			    operations.flush = T::flush;
+			    operations.release = T::release;
+			    operations.fsync = T::fsync;
+			    operations.setxattr = T::setxattr;
+			    operations.getxattr = T::getxattr;
+			    operations.listxattr = T::listxattr;
+			    operations.removexattr = T::removexattr;
+			    operations.readdir = fuse::readdir3;
+			    operations.opendir = T::opendir;
+			    operations.releasedir = T::releasedir;
+			    operations.fsyncdir = T::fsyncdir;
+			    operations.init = fuse::init3;
+			    operations.destroy = T::destroy;
+			    operations.access = T::access;
+			    operations.create = T::create;
+			}
+#else
 		    static void loadOperations () {
 				operations.readlink = T::readlink;
 			    operations.getattr = T::getattr;
@@ -130,6 +229,9 @@ namespace fusexx {
 			    operations.open = T::open;
 			    operations.read = T::read;
 			    operations.write = T::write;
+#ifdef FUSE_CAP_SPLICE_READ
+			    operations.write_buf = T::write_buf;
+#endif
 			    operations.statfs = T::statfs;
 			    operations.flush = T::flush;
 			    operations.release = T::release;
@@ -149,6 +251,115 @@ namespace fusexx {
 			    operations.ftruncate = T::ftruncate;
 			    operations.fgetattr = T::fgetattr;
 			}
+#endif
+			
+#if FUSE_USE_VERSION >= 30
+		/*
+		 * libfuse 3
+		 */
+		private:
+			/*
+			 * What fuse_main does in libfuse 3, except for the multithreaded loop:
+			 * w/ clone_fd every thread reads its requests from its own /dev/fuse fd
+			 * instead of all of them sharing a single queue. -o clone_fd and
+			 * -o max_idle_threads=N are taken from the command line, configureLoop()
+			 * may change them.
+			 * 
+			 * @param argc the argument counter
+			 * @param argv the argument vector
+			 * @param user_data user data set in context for init() method
+			 * @return 0 on success, nonzero on failure
+			 */
+			static int loop (int argc, char **argv, void *user_data) {
+				struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+				struct fuse_cmdline_opts opts;
+				if (fuse_parse_cmdline (&args, &opts) != 0)
+					return 1;
+				
+				int res = 1;
+				if (opts.show_version) {
+					printf ("FUSE library version %s\n", fuse_pkgversion ());
+					fuse_lowlevel_version ();
+					res = 0;
+				}
+				else if (opts.show_help) {
+					fuse_cmdline_help ();
+					fuse_lib_help (&args);
+					res = 0;
+				}
+				else if (opts.mountpoint == NULL)
+					fprintf (stderr, "Error: No mount point given\n");
+				else {
+					struct fuse_loop_config config;
+					config.clone_fd = opts.clone_fd;
+					// Newer versions mark an option that wasn't given w/ UINT_MAX
+					config.max_idle_threads = (opts.max_idle_threads == UINT_MAX) ?
+							FUSEXX_MAX_IDLE_THREADS : opts.max_idle_threads;
+					T::configureLoop (&config);
+					
+					::fuse *f = fuse_new (&args, &operations, sizeof (operations), user_data);
+					if (f && fuse_mount (f, opts.mountpoint) == 0) {
+						struct fuse_session *se = fuse_get_session (f);
+						if (fuse_daemonize (opts.foreground) == 0 && fuse_set_signal_handlers (se) == 0) {
+							res = opts.singlethread ? fuse_loop (f) : fuse_loop_mt (f, &config);
+							fuse_remove_signal_handlers (se);
+						}
+						fuse_unmount (f);
+					}
+					if (f)
+						fuse_destroy (f);
+				}
+				free (opts.mountpoint);
+				fuse_opt_free_args (&args);
+				return res ? 1 : 0;
+			}
+			
+			/*
+			 * The operations whose arguments changed, mapped to the FUSE 2 ones
+			 */
+			static int getattr3 (const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+				return fi ? T::fgetattr (path, stbuf, fi) : T::getattr (path, stbuf);
+			}
+			static int rename3 (const char *from, const char *to, unsigned int flags) {
+				return flags ? -EINVAL : T::rename (from, to);
+			}
+			static int chmod3 (const char *path, mode_t mode, struct fuse_file_info *) {
+				return T::chmod (path, mode);
+			}
+			static int chown3 (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *) {
+				return T::chown (path, uid, gid);
+			}
+			static int truncate3 (const char *path, off_t size, struct fuse_file_info *fi) {
+				return fi ? T::ftruncate (path, size, fi) : T::truncate (path, size);
+			}
+			static int utimens3 (const char *path, const struct timespec tv[2], struct fuse_file_info *) {
+				struct utimbuf times;
+				times.actime = tv[0].tv_sec;
+				times.modtime = tv[1].tv_sec;
+				return T::utime (path, &times);
+			}
+			
+			struct fillContext {
+				void *buf;
+				fuse_fill_dir_t filler;
+			};
+			static int fill3 (void *buf, const char *name, const struct stat *stbuf, off_t off) {
+				fillContext *context = (fillContext *)buf;
+				return context->filler (context->buf, name, stbuf, off, (enum fuse_fill_dir_flags)0);
+			}
+			static int readdir3 (const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+					struct fuse_file_info *fi, enum fuse_readdir_flags) {
+				fillContext context;
+				context.buf = buf;
+				context.filler = filler;
+				return T::readdir (path, &context, fuse::fill3, off, fi);
+			}
+			
+			static void *init3 (struct fuse_conn_info *conn, struct fuse_config *cfg) {
+				T::configure (cfg);
+				return T::init (conn);
+			}
+#endif
 			
 			/*
 			 * Protected variables
@@ -72,7 +72,22 @@ string trim(string s) {
 	return s.substr(beg, end - beg + 1);
 }
 
-int strtoint (string s) {
+/*
+ * Trim a string in place by moving its boundaries.
+ * 
+ * @param first beginning of the string, moved past leading whitespace
+ * @param last end of the string, moved before trailing whitespace
+ */
+void trim (const char *&first, const char *&last) {
+	static const char *whitespace = " \a\b\f\n\r\t\v";
+	
+	while (first < last && *first && strchr (whitespace, *first))
+		first++;
+	while (last > first && last[-1] && strchr (whitespace, last[-1]))
+		last--;
+}
+
+int strtoint (const string &s) {
 	stringstream stream (s);
 	int out;
 	
@@ -81,7 +96,7 @@ int strtoint (string s) {
 	return out;
 }
 
-int strtooct (string s) {
+int strtooct (const string &s) {
 	stringstream stream (s);
 	int out;
 	
@@ -115,3 +130,62 @@ bool isnumber(const char *args) {
 
 	return !isspace(*args) && strlen(ok) == 0;
 }
+
+/*
+ * Current time of the monotonic clock.
+ * 
+ * @return microseconds since an arbitrary starting point
+ */
+long long monotonicTime () {
+	struct timespec ts;
+	
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * FNV-1a hash of a null-terminated string.
+ * 
+ * @param s the string
+ * @return the hash
+ */
+unsigned long hashString (const char *s) {
+	unsigned long hash = 2166136261UL;
+	
+	for (; *s; s++) {
+		hash ^= (unsigned char)*s;
+		hash *= 16777619UL;
+	}
+	
+	return hash;
+}
+
+/*
+ * 64 bit hash of a byte string, 8 bytes at a time, which is a lot faster
+ * than hashString () for long strings like log lines.
+ * 
+ * @param s the bytes
+ * @param length number of bytes
+ * @return the hash
+ */
+unsigned long long hashBytes (const char *s, size_t length) {
+	unsigned long long hash = length * 0x9e3779b97f4a7c15ULL;
+	unsigned long long word;
+	
+	for (; length >= 8; s += 8, length -= 8) {
+		memcpy (&word, s, 8);
+		hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
+	}
+	if (length > 0) {
+		word = 0;
+		memcpy (&word, s, length);
+		hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ULL;
+	}
+	
+	// The low bits pick the bucket, fold the well mixed high bits into them
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 32;
+	return hash;
+}
@@ -29,10 +29,13 @@
 #include <sstream>
 #include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
 //#include <iostream>
 
 std::vector<std::string> split (std::string s, char c, std::vector<std::string> *vReturn = NULL);
 std::string trim(std::string);
+void trim (const char *&, const char *&);
 
 int strtoint (const std::string &);
 int strtooct (const std::string &);
@@ -41,4 +44,8 @@ int strtooct (const char *);
 
 bool isnumber (const char *);
 
+long long monotonicTime (); // microseconds
+unsigned long hashString (const char *);
+unsigned long long hashBytes (const char *, size_t);
+
 #endif /*GENERAL_HPP_*/
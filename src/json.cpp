@@ -0,0 +1,397 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "json.hpp"
+
+#include <cstring>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/*
+ * State of a line while it's being parsed
+ */
+struct jsonParser {
+	const logFormat *format;
+	const char *end;
+	fieldValue *values; // one per column
+	unsigned int depth;
+};
+
+static const char *parseValue (jsonParser &, const char *, const jsonField *);
+
+/*
+ * Build the tree of keys from the "column=key" entries of the schema.
+ * 
+ * @param format the schema, its keys are read and its fields written
+ */
+void compileJsonFields (logFormat &format) {
+	format.fields.clear ();
+	format.fields.resize (1);
+	format.fields[0].column = 0;
+
+	for (unsigned int i = 0; i < format.keys.size (); i++) {
+		vector<string> vPath;
+		split (format.keys[i], '.', &vPath);
+
+		unsigned int node = 0;
+		for (unsigned int j = 0; j < vPath.size (); j++) {
+			unsigned int next = 0;
+			for (unsigned int k = 0; k < format.fields[node].members.size (); k++)
+				if (format.fields[format.fields[node].members[k]].name == vPath[j])
+					next = format.fields[node].members[k];
+			if (next == 0) {
+				next = format.fields.size ();
+				format.fields.push_back (jsonField ());
+				format.fields[next].name = vPath[j];
+				format.fields[next].column = 0;
+				format.fields[node].members.push_back (next);
+			}
+			node = next;
+		}
+		format.fields[node].column = i + 1;
+	}
+}
+
+static inline const char *skipSpace (const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
+
+/*
+ * Find the next character of a string that ends it or needs a closer look: a
+ * quote, a backslash or a control character.
+ */
+static inline const char *scanString (const char *p, const char *end) {
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8 ('"');
+	const __m128i backslash = _mm_set1_epi8 ('\\');
+	const __m128i control = _mm_set1_epi8 (0x1f);
+	for (; end - p >= 16; p += 16) {
+		__m128i chunk = _mm_loadu_si128 ((const __m128i *)p);
+		__m128i special = _mm_or_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (chunk, quote), _mm_cmpeq_epi8 (chunk, backslash)),
+				// Unsigned chunk <= 0x1f
+				_mm_cmpeq_epi8 (_mm_max_epu8 (chunk, control), control));
+		int mask = _mm_movemask_epi8 (special);
+		if (mask)
+			return p + __builtin_ctz (mask);
+	}
+#endif
+	for (; p < end; p++)
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+			return p;
+	return end;
+}
+
+/*
+ * Parse a string.
+ * 
+ * @param p the character after the opening quote
+ * @param end end of the line
+ * @param value receives the contents, w/out the quotes
+ * @param bEscaped receives whether the contents have escapes
+ * @return the character after the closing quote, NULL if the string is invalid
+ */
+static const char *parseString (const char *p, const char *end, fieldValue &value,
+		bool &bEscaped) {
+	value.first = p;
+	bEscaped = false;
+	while ((p = scanString (p, end)) < end) {
+		if (*p == '"') {
+			value.last = p;
+			return p + 1;
+		}
+		if (*p != '\\' || end - p < 2)
+			return NULL;
+		bEscaped = true;
+		p += 2;
+	}
+	return NULL;
+}
+
+static int hexValue (const char *p) {
+	int n = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		n <<= 4;
+		if (c >= '0' && c <= '9')
+			n |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			n |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			n |= c - 'A' + 10;
+		else
+			return -1;
+	}
+	return n;
+}
+
+/*
+ * Replace the escapes of a string by the characters, in the thread's arena.
+ * 
+ * @param value the contents of the string, changed to the decoded copy
+ * @return false if an escape is invalid
+ */
+static bool unescape (fieldValue &value) {
+	char *out = (char *)arena::local ().allocate (value.last - value.first);
+	char *q = out;
+	for (const char *p = value.first; p < value.last; p++) {
+		if (*p != '\\') {
+			*q++ = *p;
+			continue;
+		}
+		switch (*++p) {
+			case '"': case '\\': case '/': *q++ = *p; break;
+			case 'b': *q++ = '\b'; break;
+			case 'f': *q++ = '\f'; break;
+			case 'n': *q++ = '\n'; break;
+			case 'r': *q++ = '\r'; break;
+			case 't': *q++ = '\t'; break;
+			case 'u': {
+				// \uXXXX is 6 bytes and becomes up to 3, a surrogate pair 12 and 4
+				int c = (value.last - p > 4) ? hexValue (p + 1) : -1;
+				if (c < 0)
+					return false;
+				p += 4;
+				if (c >= 0xd800 && c <= 0xdbff) {
+					int low = (value.last - p > 6 && p[1] == '\\' && p[2] == 'u') ? hexValue (p + 3) : -1;
+					if (low < 0xdc00 || low > 0xdfff)
+						return false;
+					c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+					p += 6;
+				}
+				if (c < 0x80)
+					*q++ = c;
+				else if (c < 0x800) {
+					*q++ = 0xc0 | (c >> 6);
+					*q++ = 0x80 | (c & 0x3f);
+				}
+				else if (c < 0x10000) {
+					*q++ = 0xe0 | (c >> 12);
+					*q++ = 0x80 | ((c >> 6) & 0x3f);
+					*q++ = 0x80 | (c & 0x3f);
+				}
+				else {
+					*q++ = 0xf0 | (c >> 18);
+					*q++ = 0x80 | ((c >> 12) & 0x3f);
+					*q++ = 0x80 | ((c >> 6) & 0x3f);
+					*q++ = 0x80 | (c & 0x3f);
+				}
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	value.first = out;
+	value.last = q;
+	return true;
+}
+
+static inline bool isDigit (const char *p, const char *end) {
+	return p < end && *p >= '0' && *p <= '9';
+}
+
+static const char *parseNumber (const char *p, const char *end) {
+	if (p < end && *p == '-')
+		p++;
+	if (!isDigit (p, end))
+		return NULL;
+	if (*p == '0')
+		p++;
+	else
+		while (isDigit (p, end))
+			p++;
+	if (p < end && *p == '.') {
+		if (!isDigit (++p, end))
+			return NULL;
+		while (isDigit (p, end))
+			p++;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (!isDigit (p, end))
+			return NULL;
+		while (isDigit (p, end))
+			p++;
+	}
+	return p;
+}
+
+/*
+ * Parse the members of an object and store the ones the schema asks for.
+ * 
+ * @param p the character after the opening brace
+ * @param field the key of the object, NULL if none of its members are stored
+ * @return the character after the closing brace, NULL if the object is invalid
+ */
+static const char *parseObject (jsonParser &parser, const char *p, const jsonField *field) {
+	const char *end = parser.end;
+	p = skipSpace (p, end);
+	if (p < end && *p == '}')
+		return p + 1;
+
+	while (p < end) {
+		fieldValue key;
+		bool bEscaped;
+		if (*p != '"' || (p = parseString (p + 1, end, key, bEscaped)) == NULL)
+			return NULL;
+		p = skipSpace (p, end);
+		if (p >= end || *p != ':')
+			return NULL;
+		p = skipSpace (p + 1, end);
+
+		const jsonField *member = NULL;
+		if (field && (!bEscaped || unescape (key))) {
+			size_t length = key.last - key.first;
+			for (unsigned int i = 0; i < field->members.size (); i++) {
+				const jsonField &f = parser.format->fields[field->members[i]];
+				if (f.name.length () == length && memcmp (f.name.data (), key.first, length) == 0) {
+					member = &f;
+					break;
+				}
+			}
+		}
+		if ((p = parseValue (parser, p, member)) == NULL)
+			return NULL;
+
+		p = skipSpace (p, end);
+		if (p < end && *p == '}')
+			return p + 1;
+		if (p >= end || *p != ',')
+			return NULL;
+		p = skipSpace (p + 1, end);
+	}
+	return NULL;
+}
+
+static const char *parseArray (jsonParser &parser, const char *p) {
+	const char *end = parser.end;
+	p = skipSpace (p, end);
+	if (p < end && *p == ']')
+		return p + 1;
+
+	while (p < end) {
+		if ((p = parseValue (parser, p, NULL)) == NULL)
+			return NULL;
+		p = skipSpace (p, end);
+		if (p < end && *p == ']')
+			return p + 1;
+		if (p >= end || *p != ',')
+			return NULL;
+		p = skipSpace (p + 1, end);
+	}
+	return NULL;
+}
+
+/*
+ * Parse a value, and store it if the schema has a column for its key.
+ * 
+ * @param p the first character of the value
+ * @param field the key of the value, NULL if it isn't stored
+ * @return the character after the value, NULL if it's invalid
+ */
+static const char *parseValue (jsonParser &parser, const char *p, const jsonField *field) {
+	const char *end = parser.end;
+	const char *start = p;
+	if (p >= end)
+		return NULL;
+
+	switch (*p) {
+		case '"': {
+			fieldValue value;
+			bool bEscaped;
+			if ((p = parseString (p + 1, end, value, bEscaped)) == NULL)
+				return NULL;
+			if (field && field->column) {
+				if (bEscaped && !unescape (value))
+					return NULL;
+				parser.values[field->column - 1] = value;
+			}
+			return p;
+		}
+		case '{':
+			if (++parser.depth > JSON_MAX_DEPTH)
+				return NULL;
+			// Members are only looked up if any of them are stored
+			p = parseObject (parser, p + 1, (field && !field->members.empty ()) ? field : NULL);
+			parser.depth--;
+			break;
+		case '[':
+			if (++parser.depth > JSON_MAX_DEPTH)
+				return NULL;
+			p = parseArray (parser, p + 1);
+			parser.depth--;
+			break;
+		case 't':
+			p = (end - p >= 4 && memcmp (p, "true", 4) == 0) ? p + 4 : NULL;
+			break;
+		case 'f':
+			p = (end - p >= 5 && memcmp (p, "false", 5) == 0) ? p + 5 : NULL;
+			break;
+		case 'n':
+			// null is a missing value
+			return (end - p >= 4 && memcmp (p, "null", 4) == 0) ? p + 4 : NULL;
+		default:
+			p = parseNumber (p, end);
+	}
+
+	// Numbers and booleans as they are, objects and arrays as JSON
+	if (p && field && field->column) {
+		parser.values[field->column - 1].first = start;
+		parser.values[field->column - 1].last = p;
+	}
+	return p;
+}
+
+/*
+ * Parse a line that's a JSON object.
+ * 
+ * @param format the schema
+ * @param first start of the line
+ * @param last end of the line
+ * @param matches receives the columns
+ * @return MATCH_OK, or MATCH_FAIL if the line isn't a valid JSON object
+ */
+matchResult matchJson (const logFormat &format, const char *first, const char *last,
+		lineMatch &matches) {
+	size_t n = format.columns.size ();
+	jsonParser parser;
+	parser.format = &format;
+	parser.end = last;
+	parser.values = (fieldValue *)arena::local ().allocate (n * sizeof (fieldValue) + 1);
+	parser.depth = 1;
+	for (size_t i = 0; i < n; i++)
+		parser.values[i].first = parser.values[i].last = NULL;
+
+	const char *p = skipSpace (first, last);
+	if (p >= last || *p != '{' || (p = parseObject (parser, p + 1, &format.fields[0])) == NULL
+			|| skipSpace (p, last) != last)
+		return MATCH_FAIL;
+
+	fillMatch (matches, first, last, parser.values, n);
+	return MATCH_OK;
+}
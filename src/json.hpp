@@ -0,0 +1,46 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef JSON_HPP_
+#define JSON_HPP_
+
+#include "schema.hpp"
+
+// Objects nested deeper than this aren't parsed, the line doesn't match
+#define JSON_MAX_DEPTH 64
+
+/*
+ * <parser>json</parser>: every line is a JSON object, the columns are the
+ * values of its keys. A dot in a key reaches into nested objects
+ * ("user_id=user.id"). Strings are stored w/out their quotes and escapes,
+ * objects and arrays as their JSON text, a missing key or null leaves the
+ * column empty.
+ *
+ * The lines are parsed in a single pass w/out building a document, the
+ * parts of strings w/out quotes, backslashes and control characters are
+ * skipped 16 bytes at a time (SSE2).
+ */
+void compileJsonFields (logFormat &);
+matchResult matchJson (const logFormat &, const char *, const char *, lineMatch &);
+
+#endif /*JSON_HPP_*/
@@ -21,10 +21,6 @@
 
 using namespace std;
 
-#ifdef WITH_POSTGRESQL
-	using namespace pqxx;
-#endif
-
 // In case the user got by the configure script, don't allow loggerfs
 // to be compiled w/out database support.
 #if !defined(WITH_POSTGRESQL) && !defined(WITH_MYSQL)
@@ -38,31 +34,35 @@ using namespace std;
 /*
  * Constructor
  */
-loggerfs::loggerfs () {
+loggerfs::loggerfs () : m_scheduler (loggerfs::dispatch) {
 	// Get the hostname of the current machine
 	char hostname[128];
 	gethostname (hostname, 128);
 	m_strHostname = hostname;
+	
+	pthread_rwlock_init (&m_lock, NULL);
+	pthread_mutex_init (&m_queryLock, NULL);
+	
+	m_bStarted = false;
+	m_nGeneration = 0;
+	m_bMaintenance = false;
+	pthread_mutex_init (&m_maintenanceLock, NULL);
+	pthread_cond_init (&m_maintenanceStop, NULL);
 }
 
 /*
  * Destructor
  */
 loggerfs::~loggerfs () {
-	// Clear the connection cache
-	#ifdef WITH_POSTGRESQL
-		for (map<string, connection *>::iterator i = m_mPgsqlCache.begin ();
-				i != m_mPgsqlCache.end (); ++i)
-			delete i->second;
-	#endif
+	for (vector<source *>::iterator iter = m_vSources.begin ();
+			iter != m_vSources.end (); iter++)
+		delete *iter;
 	
-	#ifdef WITH_MYSQL
-		for(map<string, MYSQL *>::iterator i = m_mMysqlCache.begin ();
-				i != m_mMysqlCache.end (); ++i) {
-			mysql_close (i->second);
-			delete i->second;
-		}
-	#endif
+	// m_files closes the pipelines and their connections
+	pthread_rwlock_destroy (&m_lock);
+	pthread_mutex_destroy (&m_queryLock);
+	pthread_cond_destroy (&m_maintenanceStop);
+	pthread_mutex_destroy (&m_maintenanceLock);
 }
 
 /*
@@ -72,9 +72,6 @@ loggerfs::~loggerfs () {
  * some validation to make sure the regex etc. is valid and
  * then creates the tables to hold the data (if they're not already created).
  * 
- * TODO:
- * - make sure that the column names don't conflict w/ SQL syntax (reserved words)
- * 
  * @return true on success, false otherwise
  */
 bool loggerfs::initialize () {
@@ -86,52 +83,57 @@ bool loggerfs::initialize () {
 	if (!Schema.load ("/etc/loggerfs/schemas.xml")
 			&& !Schema.load (strPath + "/etc/loggerfs/schemas.xml")
 			&& !Schema.load ("schemas.xml")) {
-		cout << "Error: Couldn't load the schemas file\n";
+		message (LEVEL_ERROR, "Couldn't load the schemas file");
 		return false;
 	}
-	m_mSchemas = Schema.schemas ();
 	
 	// Load the logs.xml configuration file
 	config Config;
 	if (!Config.load ("/etc/loggerfs/logs.xml")
 			&& !Config.load (strPath + "/etc/loggerfs/logs.xml")
 			&& !Config.load ("logs.xml")) {
-		cout << "Error: Couldn't load the logs configuration file\n";
+		message (LEVEL_ERROR, "Couldn't load the logs configuration file");
 		return false;
 	}
-	m_mLogs = Config.logs ();
 	
-	// Create the tables
-	if (!this->formatTables (m_mSchemas, m_mLogs)) {
-		cerr << "Aborting: Couldn't initialize database tables\n";
+	// Connect to the databases and create the tables
+	map<string, pipeline *> mPipelines;
+	if (!this->compilePipelines (Schema.schemas (), Config.logs (), mPipelines)) {
+		message (LEVEL_ERROR, "Couldn't initialize database tables, aborting");
 		return false;
 	}
+	this->installPipelines (mPipelines);
 	
 	return true;
 }
 
-#ifdef _DEBUG
-	/*
- 	 * Debug helper function
- 	 * 
- 	 * @param args message to output
- 	 */
-	void loggerfs::debug (string args) {
-		ofstream fout ("/tmp/debug.log", fstream::app);
-		if (fout.bad() || !fout.is_open ())
-			return;
-		fout << args;
-		fout.close ();
-	}
-	
-	void loggerfs::debug (const char *args) {
-		ofstream fout ("/tmp/debug.log", fstream::app);
-		if (fout.bad () || !fout.is_open())
-			return;
-		fout << args;
-		fout.close ();
-	}
-#endif
+/*
+ * Attributes of a directory.
+ */
+static void directoryAttributes (struct stat *stbuf, ino_t inode) {
+    stbuf->st_mode = S_IFDIR | 0555; // read + execute
+    stbuf->st_ino = inode;
+    stbuf->st_nlink = 2;
+}
+
+/*
+ * Attributes of a log file.
+ * 
+ * @param info the configuration of the log file
+ */
+static void fileAttributes (struct stat *stbuf, const logInfo &info, ino_t inode) {
+	// Special permissions were defined in the logs file
+	if (info.permissions > 0)
+		stbuf->st_mode = S_IFREG | info.permissions;
+	// Default File permissions
+	else
+		stbuf->st_mode = S_IFREG | 0222; // write only
+	stbuf->st_ino = inode;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = 0;
+	stbuf->st_uid = info.uid;
+	stbuf->st_gid = info.gid;
+}
 
 /**
  * Fuse: getattr
@@ -142,58 +144,98 @@ bool loggerfs::initialize () {
  */
 int loggerfs::getattr(const char *path, struct stat *stbuf) {
     int res = 0;
-    string strPath = path + 1;
-    map<string, logInfo>::iterator iter = self->m_mLogs.find (strPath);
 
     memset(stbuf, 0, sizeof(struct stat));
-    if(strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0555; // read + execute
-        stbuf->st_nlink = 2;
-    }
-    else if (iter != self->m_mLogs.end ()) {
-    	// Special permissions were defined in the logs file
-    	if (iter->second.permissions > 0)
-    		stbuf->st_mode = S_IFREG | iter->second.permissions;
-    	// Default File permissions
+    
+    // Directories and log files are by far the most common case, the kernel
+    // caches the result for attr_timeout seconds
+    pthread_rwlock_rdlock (&self->m_lock);
+    pathNode *node = self->m_files.find (path + 1);
+    if (node == NULL || !node->live) {
+    	// .refresh is a special file that allows reloading of configs/ schemas
+    	if (strcmp (path, "/.refresh") == 0) {
+    		stbuf->st_mode = S_IFREG | 0000;
+    		stbuf->st_ino = REFRESH_INODE;
+    		stbuf->st_nlink = 1;
+    		stbuf->st_size = 0;
+    		pthread_rwlock_unlock (&self->m_lock);
+    		return 0;
+    	}
+    	// .stats contains the per-log counters
+    	else if (strcmp (path, "/.stats") == 0) {
+    		stbuf->st_mode = S_IFREG | 0444;
+    		stbuf->st_ino = STATS_INODE;
+    		stbuf->st_nlink = 1;
+    		stbuf->st_size = 0;
+    		pthread_rwlock_unlock (&self->m_lock);
+    		return 0;
+    	}
+    	// <location>.query reads the rows of a log file back, only for its owner
+    	else if ((node = self->queryTarget (path + 1)) != NULL) {
+    		const logInfo &info = node->file.current->info;
+    		stbuf->st_mode = S_IFREG | 0600;
+    		stbuf->st_ino = node->inode | QUERY_INODE_BIT;
+    		stbuf->st_nlink = 1;
+    		stbuf->st_size = 0;
+    		stbuf->st_uid = info.uid;
+    		stbuf->st_gid = info.gid;
+    		pthread_rwlock_unlock (&self->m_lock);
+    		return 0;
+    	}
+    	// Paths matching a wildcard location exist, but only get a node once
+    	// they're written to
+    	const pathTemplate *tpl = NULL;
+    	int type = self->m_files.matchTemplates (path + 1, &tpl, NULL);
+    	if (type == MATCH_NONE)
+    		res = -ENOENT;
+    	else if (type == MATCH_DIRECTORY)
+    		directoryAttributes (stbuf, pathTable::wildcardInode (path + 1));
     	else
-    		stbuf->st_mode = S_IFREG | 0222; // write only
-    	stbuf->st_nlink = 1;
-    	stbuf->st_size = 0;
-    	stbuf->st_uid = iter->second.uid;
-    	stbuf->st_gid = iter->second.gid;
-    }
-    // .refresh is a special file that allows reloading of configs/ schemas
-    else if (strcmp (path, "/.refresh") == 0) {
-    	stbuf->st_mode = S_IFREG | 0000;
-    	stbuf->st_nlink = 1;
-    	stbuf->st_size = 0;
+    		fileAttributes (stbuf, tpl->current->info, pathTable::wildcardInode (path + 1));
     }
+    else if (node->directory)
+    	directoryAttributes (stbuf, node->inode);
     else
-        res = -ENOENT;
+    	fileAttributes (stbuf, node->file.current->info, node->inode);
+    pthread_rwlock_unlock (&self->m_lock);
 
     return res;
 }
 
-int loggerfs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+int loggerfs::readdir(const char *path, void *buf, fusexx::fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
     (void) offset;
     (void) fi;
 
-    if(strcmp(path, "/") != 0)
+    pthread_rwlock_rdlock (&self->m_lock);
+    pathNode *node = self->lookup (path + 1, false);
+    // A directory of a wildcard location that hasn't been used yet
+    bool bEmpty = (node == NULL && self->m_files.matchTemplates (path + 1, NULL, NULL) == MATCH_DIRECTORY);
+    if ((node == NULL || !node->directory) && !bEmpty) {
+    	pthread_rwlock_unlock (&self->m_lock);
         return -ENOENT;
+    }
 
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
-    // List all the log files
-    for (map<string, logInfo>::iterator iter = self->m_mLogs.begin ();
-    		iter != self->m_mLogs.end (); iter++)
-    	filler (buf, iter->first.c_str(), NULL, 0);
+    // List all the directories/ log files, wildcard locations only show
+    // the paths that are in use
+    for (size_t i = 0; node && i < node->children.size (); i++) {
+    	pathNode *child = node->children[i];
+    	if (!child->live)
+    		continue;
+    	string::size_type pos = child->name.rfind ('/');
+    	filler (buf, child->name.c_str () + (pos == string::npos ? 0 : pos + 1), NULL, 0);
+    }
+    pthread_rwlock_unlock (&self->m_lock);
 
     return 0;
 }
 
 int loggerfs::open(const char *path, struct fuse_file_info *fi) {
+	fi->fh = 0;
+	
 	/*
 	 * Special loggerfs files
 	 */
@@ -206,465 +248,1027 @@ int loggerfs::open(const char *path, struct fuse_file_info *fi) {
 		if (!Schema.load (strPath + "/etc/loggerfs/schemas.xml")
 				&& !Schema.load ("/etc/loggerfs/schemas.xml")
 				&& !Schema.load ("schemas.xml")) {
-			cout << "Error: Couldn't load the schemas file\n";
+			message (LEVEL_ERROR, "Couldn't load the schemas file");
 			return 0;
 		}
-		#ifdef _DEBUG
-			self->debug ("Reloaded schemas.xml\n");
-		#endif
+		message (LEVEL_DEBUG, "Reloaded schemas.xml");
 		
 		// Load the logs.xml configuration file
 		config Config;
 		if (!Config.load (strPath + "/etc/loggerfs/logs.xml")
 				&& !Config.load ("/etc/loggerfs/logs.xml")
 				&& !Config.load ("logs.xml")) {
-			cout << "Error: Couldn't load the logs configuration file\n";
+			message (LEVEL_ERROR, "Couldn't load the logs configuration file");
 			return 0;
 		}
-		#ifdef _DEBUG
-			self->debug ("Reloaded logs.xml\n");
-		#endif
+		message (LEVEL_DEBUG, "Reloaded logs.xml");
 		
 		// Create the tables
-		if (!self->formatTables (Schema.schemas(), Config.logs()))
+		map<string, pipeline *> mPipelines;
+		if (!self->compilePipelines (Schema.schemas(), Config.logs(), mPipelines))
 			return 0;
-		#ifdef _DEBUG
-			self->debug ("Reloaded tables\n");
-		#endif
+		message (LEVEL_INFO, "Reloaded the configuration");
 		
 		// If both were successfully loaded then start actually using them
-		self->m_mSchemas = Schema.schemas ();
-		self->m_mLogs = Config.logs ();
+		self->installPipelines (mPipelines);
 		
 		return 0;
 	}
 	
+	// .stats -> generated on every read, so bypass the page cache
+	if (strcmp (path, "/.stats") == 0) {
+		fi->direct_io = 1;
+		return 0;
+	}
+	
     // Make sure the path exists
-    string strPath = path + 1;
-    map<string, logInfo>::iterator iter = self->m_mLogs.find (strPath);
-    if (iter == self->m_mLogs.end ())
-    	return -ENOENT;
+    int res = 0;
+    // Only writing adds the path of a wildcard location
+    bool bWrite = (fi->flags & O_ACCMODE) != O_RDONLY;
+    pthread_rwlock_rdlock (&self->m_lock);
+    pathNode *target = self->queryTarget (path + 1);
+    pathNode *node = target ? target : self->lookup (path + 1, bWrite);
+    uid_t uid = fuse_get_context ()->uid;
+    if (node == NULL) {
+    	int type = target ? MATCH_NONE : self->m_files.matchTemplates (path + 1, NULL, NULL);
+    	// Written to, but the location has all the log files it may have
+    	if (type == MATCH_FILE)
+    		res = bWrite ? -ENOSPC : -EACCES;
+    	else
+    		res = (type == MATCH_DIRECTORY) ? -EISDIR : -ENOENT;
+    }
+    else if (node->directory)
+    	res = -EISDIR;
+    // Not mounted w/ default_permissions, the owner of a .query file is checked here
+    else if (target && uid != 0 && (int)uid != node->file.current->info.uid)
+    	res = -EACCES;
+    // The file handle points straight to the log file, so write() doesn't need any lookups
+    else {
+    	fileHandle *handle = new fileHandle;
+    	handle->file = &node->file;
+    	__sync_fetch_and_add (&node->file.users, 1);
+    	handle->query = NULL;
+    	pthread_mutex_init (&handle->lock, NULL);
+    	pthread_mutex_init (&handle->syncLock, NULL);
+    	// fsync() reports the rows lost after this
+    	handle->generation = node->file.current ? node->file.current->generation : 0;
+    	if (node->file.current)
+    		for (vector<sink *>::iterator out = node->file.current->sinks.begin ();
+    				out != node->file.current->sinks.end (); out++)
+    			handle->errors.push_back ((*out)->errors ());
+    	fi->fh = (uint64_t)handle;
+    	
+    	// A query has no size and is read once, so bypass the page cache
+    	if (target) {
+    		pthread_mutex_lock (&self->m_queryLock);
+    		handle->query = new logQuery (uid, self->m_mFilters[make_pair (handle->file, uid)]);
+    		pthread_mutex_unlock (&self->m_queryLock);
+    		fi->direct_io = 1;
+    	}
+    }
+    pthread_rwlock_unlock (&self->m_lock);
 
-    return 0;
+    return res;
 }
 
-// Doesn't read anything from the database (yet)
+/**
+ * Fuse: read
+ * 
+ * .stats is generated on every read. A .query file streams the rows that match
+ * its filter, the query starts w/ the first read; log files can't be read.
+ * 
+ * @return number of bytes read, or a negative error
+ */
 int loggerfs::read(const char *path, char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi) {
-    return -EACCES; // don't allow reading of files
+	if (strcmp (path, "/.stats") == 0) {
+		string strStats = self->formatStats ();
+		if (offset >= (off_t)strStats.length ())
+			return 0;
+		if (offset + size > strStats.length ())
+			size = strStats.length () - offset;
+		memcpy (buf, strStats.c_str () + offset, size);
+		return size;
+	}
+	
+	fileHandle *handle = (fileHandle *)fi->fh;
+	if (handle == NULL || handle->query == NULL)
+		return -EACCES; // don't allow reading of log files
+	
+	// The rows are fetched w/out the lock, the cursors don't need the pipeline
+	int res = 0;
+	pthread_mutex_lock (&handle->lock);
+	if (!handle->query->started ()) {
+		pthread_rwlock_rdlock (&self->m_lock);
+		pipeline *p = handle->file->current;
+		res = p ? handle->query->start (p) : -ENOENT;
+		pthread_rwlock_unlock (&self->m_lock);
+	}
+	if (res == 0)
+		res = handle->query->read (buf, size, offset);
+	pthread_mutex_unlock (&handle->lock);
+	
+	return res;
+}
+
+/*
+ * How a log file shares the ingest workers.
+ */
+static flowSettings flowOf (const logInfo &info) {
+	flowSettings settings;
+	settings.weight = info.weight;
+	settings.rateLimit = info.rateLimit;
+	settings.rateBurst = info.rateBurst;
+	settings.rateDrop = info.rateDrop;
+	return settings;
 }
 
 int loggerfs::write(const char *path, const char *buf, size_t size,
                      off_t offset, struct fuse_file_info *fi) {
     // Make sure the log file exists
-    string strPath = path + 1;
-    map<string, logInfo>::iterator lookup = self->m_mLogs.find (strPath);
-    if (lookup == self->m_mLogs.end ())
+    fileHandle *handle = (fileHandle *)fi->fh;
+    if (handle == NULL)
     	return -ENOENT;
-     
-    // Convert the buffer into a string
-    string strBuffer = buf;
-    strBuffer = strBuffer.substr (0, size);
+    logFile *file = handle->file;
     
-    vector<string> vLines = split (strBuffer, '\n');
-    // Loop through all the lines
-    string strLine = "";
-    for (unsigned int i = 0; i < vLines.size(); ++i) {
-	    // Trim the string
-	    strLine = trim (vLines[i]);
-	    
-	    logInfo &info = self->m_mLogs[strPath];
-	    boost::cmatch matches;
-	    // Compare the regex against all schemas assigned to the log file
-	    for (vector<string>::iterator s = info.schemas.begin ();
-	    		s != info.schemas.end (); s++) {
-	    	// Get the regular expression and column names
-	    	logFormat &format = self->m_mSchemas[*s];
-	    	
-	    	// The current line matches the regex
-	    	if (boost::regex_match (strLine.c_str(), matches, format.re)) {
-	    		// The number of matches doesn't equal the number of columns in the table
-	    		if (format.columns.size () != matches.size() - 1)
-	    			continue;
-	    		
-	    		// Insert the line into the database
-	    		self->sqlInsertLogLine (strPath, info, format, matches);
-	    	}
-	    }
+    // The filter of a .query file, kept for the next open() of the user
+    if (handle->query) {
+    	pthread_mutex_lock (&handle->lock);
+    	int res = handle->query->write (buf, size, offset);
+    	if (res >= 0) {
+    		pthread_mutex_lock (&self->m_queryLock);
+    		self->m_mFilters[make_pair (file, handle->query->user ())] = handle->query->filter ();
+    		pthread_mutex_unlock (&self->m_queryLock);
+    	}
+    	pthread_mutex_unlock (&handle->lock);
+    	return res;
     }
     
-    return strBuffer.length ();
+    pthread_rwlock_rdlock (&self->m_lock);
+    if (file->current == NULL) {
+    	pthread_rwlock_unlock (&self->m_lock);
+    	return -ENOENT;
+    }
+    flowSettings settings = flowOf (file->current->info);
+    pthread_rwlock_unlock (&self->m_lock);
+    
+    // The lines are parsed by the ingest workers; w/out the lock, a full
+    // queue may keep the write waiting. A line split over two writes (i.e.
+    // cat bigfile > log) is put together first.
+    const char *last = (const char *)memrchr (buf, '\n', size);
+    pthread_mutex_lock (&handle->lock);
+    if (last == NULL) {
+    	handle->partial.append (buf, size);
+    	if (handle->partial.length () >= HANDLE_MAX_PARTIAL) {
+    		self->m_scheduler.submit (file, handle->partial.data (), handle->partial.length (), settings);
+    		handle->partial.clear ();
+    	}
+    }
+    else {
+    	size_t length = last + 1 - buf;
+    	if (handle->partial.empty ())
+    		self->m_scheduler.submit (file, buf, length, settings);
+    	else {
+    		handle->partial.append (buf, length);
+    		self->m_scheduler.submit (file, handle->partial.data (), handle->partial.length (), settings);
+    	}
+    	handle->partial.assign (last + 1, size - length);
+    }
+    pthread_mutex_unlock (&handle->lock);
+    
+    return size;
+}
+
+#ifdef FUSE_CAP_SPLICE_READ
+/**
+ * Fuse: write_buf
+ * 
+ * Like write(), but data that the kernel spliced into a pipe is read from it
+ * straight into the thread's arena, w/out going through a buffer of libfuse.
+ * 
+ * @return number of bytes written, or a negative error
+ */
+int loggerfs::write_buf (const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi) {
+	size_t size = fuse_buf_size (buf);
+	if (buf->count == 1 && buf->off == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+		return loggerfs::write (path, (const char *)buf->buf[0].mem, size, offset, fi);
+	
+	arena::scope arenaScope (arena::local ());
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT (size);
+	dst.buf[0].mem = arena::local ().allocate (size);
+	ssize_t res = fuse_buf_copy (&dst, buf, (enum fuse_buf_copy_flags)0);
+	if (res < 0)
+		return res;
+	return loggerfs::write (path, (const char *)dst.buf[0].mem, res, offset, fi);
+}
+#endif
+
+/**
+ * Fuse: flush
+ * 
+ * Called on every close() of the file: an incomplete last line is queued as it
+ * is. Doesn't wait for the database, that's what fsync() is for.
+ * 
+ * @return 0 on success, or a negative error
+ */
+int loggerfs::flush (const char *path, struct fuse_file_info *fi) {
+	fileHandle *handle = (fileHandle *)fi->fh;
+	if (handle == NULL)
+		return 0;
+	return self->submitPartial (handle);
+}
+
+/**
+ * Fuse: fsync
+ * 
+ * Durability barrier: returns once the lines written to the log file so far
+ * are parsed and their rows stored in every destination (and on the disk, for
+ * <file> destinations). An incomplete last line isn't part of it, it may still
+ * be continued.
+ * 
+ * @param datasync ignored, there's no metadata to leave out
+ * @return 0 on success, -EIO if a destination is down or rows have been lost
+ * since the handle's last fsync() (or open())
+ */
+int loggerfs::fsync (const char *path, int datasync, struct fuse_file_info *fi) {
+	fileHandle *handle = (fileHandle *)fi->fh;
+	if (handle == NULL || handle->query)
+		return 0;
+	
+	self->m_scheduler.drain (handle->file);
+	
+	// Holding the lock keeps the sinks alive, a reload waits for the barrier.
+	// If a reload replaced the pipeline meanwhile, deleting the old one has
+	// stored its rows.
+	int res = 0;
+	pthread_rwlock_rdlock (&self->m_lock);
+	pipeline *p = handle->file->current;
+	// A multi-line record that's still open is as complete as it gets
+	if (p && handle->file->records && handle->file->records->pending ())
+		self->process (handle->file, NULL, 0, true);
+	if (p) {
+		// Each handle has its own counts, so every one of them hears of a loss.
+		// The sinks of a reload only lost rows after the handle was opened.
+		pthread_mutex_lock (&handle->syncLock);
+		if (handle->generation != p->generation) {
+			handle->generation = p->generation;
+			handle->errors.assign (p->sinks.size (), 0);
+		}
+		for (size_t i = 0; i < p->sinks.size (); i++)
+			if (!p->sinks[i]->sync (handle->errors[i]))
+				res = -EIO;
+		pthread_mutex_unlock (&handle->syncLock);
+	}
+	pthread_rwlock_unlock (&self->m_lock);
+	
+	return res;
+}
+
+/**
+ * Fuse: release
+ * 
+ * The last reference to the file handle is gone: queue what's left in it and
+ * free it.
+ * 
+ * @return 0
+ */
+int loggerfs::release (const char *path, struct fuse_file_info *fi) {
+	fileHandle *handle = (fileHandle *)fi->fh;
+	if (handle == NULL)
+		return 0;
+	
+	self->submitPartial (handle);
+	handle->file->used = time (NULL);
+	__sync_fetch_and_sub (&handle->file->users, 1);
+	pthread_mutex_destroy (&handle->lock);
+	pthread_mutex_destroy (&handle->syncLock);
+	delete handle->query;
+	delete handle;
+	fi->fh = 0;
+	return 0;
+}
+
+/**
+ * Fuse: init
+ * 
+ * Starts the ingest workers, the sources and the maintenance thread. This can't be done in
+ * initialize() because fuse_main() forks into the background, and threads
+ * don't survive the fork.
+ * 
+ * @param conn capabilities of the connection
+ * @return private data of the file system
+ */
+void *loggerfs::init (struct fuse_conn_info *conn) {
+	#if FUSE_USE_VERSION >= 30
+		// Lookups of new wildcard paths by many writers at once don't have to
+		// wait for each other, the path table has its own lock
+		if (conn->capable & FUSE_CAP_PARALLEL_DIROPS)
+			conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+	#endif
+	// A large write (i.e. cat bigfile > log) arrives in requests as large as
+	// max_write allows instead of 4k pages; max_write is left at the largest
+	// the buffers of libfuse can take, unless -o max_write says otherwise
+	#ifdef FUSE_CAP_BIG_WRITES
+		conn->want |= FUSE_CAP_BIG_WRITES;
+	#endif
+	// Their data is spliced from /dev/fuse into a pipe instead of copied
+	#ifdef FUSE_CAP_SPLICE_READ
+		if (conn->capable & FUSE_CAP_SPLICE_READ)
+			conn->want |= FUSE_CAP_SPLICE_READ;
+	#endif
+	
+	// Messages are written by a thread of their own from now on
+	startMessages ();
+	
+	// Sources that don't go through the mount point
+	self->m_bStarted = true;
+	for (vector<source *>::iterator iter = self->m_vSources.begin ();
+			iter != self->m_vSources.end (); iter++)
+		(*iter)->start ();
+	
+	long nWorkers = sysconf (_SC_NPROCESSORS_ONLN);
+	self->m_scheduler.start (nWorkers > 0 ? nWorkers : 1);
+	
+	pthread_mutex_lock (&self->m_maintenanceLock);
+	self->m_bMaintenance = true;
+	if (pthread_create (&self->m_maintenanceThread, NULL, loggerfs::maintenance, NULL) != 0) {
+		message (LEVEL_WARNING, "Couldn't start the maintenance thread, partitions won't be managed");
+		self->m_bMaintenance = false;
+	}
+	pthread_mutex_unlock (&self->m_maintenanceLock);
+	
+	return self;
+}
+
+/**
+ * Fuse: destroy
+ * 
+ * Stops the maintenance thread, the sources and the ingest workers when the
+ * file system is unmounted.
+ */
+void loggerfs::destroy (void *) {
+	pthread_mutex_lock (&self->m_maintenanceLock);
+	bool bRunning = self->m_bMaintenance;
+	self->m_bMaintenance = false;
+	pthread_cond_signal (&self->m_maintenanceStop);
+	pthread_mutex_unlock (&self->m_maintenanceLock);
+	
+	if (bRunning)
+		pthread_join (self->m_maintenanceThread, NULL);
+	
+	for (vector<source *>::iterator iter = self->m_vSources.begin ();
+			iter != self->m_vSources.end (); iter++)
+		(*iter)->stop ();
+	
+	// Whatever is still queued is parsed before the workers exit
+	self->m_scheduler.stop ();
+	stopMessages ();
 }
 
 /************************************************
  * Private Methods
  ************************************************/
-bool loggerfs::formatTables (map<string, struct logFormat> &mSchemas,
-		map<string, struct logInfo> &mLogs) {
-	unsigned int j = 0, k =0;
-	
+
+/*
+ * Build the pipelines for all log files: resolve the schemas, connect to the
+ * databases and create the tables (if they're not already created).
+ * 
+ * @param mSchemas schemas from schemas.xml
+ * @param mLogs log files from logs.xml
+ * @param mPipelines receives the pipelines, keyed by the log file name
+ * @return true on success, false otherwise (mPipelines is empty then)
+ */
+bool loggerfs::compilePipelines (map<string, struct logFormat> &mSchemas,
+		map<string, struct logInfo> &mLogs, map<string, pipeline *> &mPipelines) {
 	// Loop through all the log files
 	for (map<string, logInfo>::iterator iter = mLogs.begin ();
 			iter != mLogs.end (); iter++) {
-		vector<string> vSchemas;
-		map<string, int> mColumns;
-		
-		// Create the connection caches
-		#ifdef WITH_POSTGRESQL
-			if (this->isPostgresql (iter->second.software)) {
-				try {
-					cerr << "Adding cache for " << iter->first << endl;
-					m_mPgsqlCache[iter->first] = 
-							new connection (this->pgConnectionString (iter->second));
-				}
-				catch (...) { }
-			}
-		#endif
-		
-		#ifdef WITH_MYSQL
-			if (this->isMysql (iter->second.software)) {
-				try {
-					MYSQL *con = new MYSQL;
-					// Initialize the connection
-					mysql_init (con);
-					if (!mysql_real_connect (con, iter->second.server.c_str(),
-							iter->second.username.c_str(), iter->second.password.c_str(),
-							iter->second.database.c_str(), 0, NULL, 0)) {
-						cerr << "Error: Couldn't create a MySQL connection to " << iter->second.database.c_str() << endl;
-						return false;
-					}
-					m_mMysqlCache[iter->first] = con;
-				}
-				catch (...) { }
-			}
-		#endif
-		
-		// Don't do anything if the table already exists
-		if (this->tableExists (iter->second)) {
-			#ifdef _DEBUG
-				self->debug ("Table already exists: ");
-				self->debug (iter->second.table);
-				self->debug ("\n");
-			#endif
-			continue;
-		}
+		message (LEVEL_DEBUG, "Compiling pipeline: %s", iter->first.c_str ());
+		pipeline *p = new pipeline (iter->first, iter->second);
+		mPipelines[iter->first] = p;
 		
-		// Get a list of all columns by going through all schemas for the log file
-		vSchemas = iter->second.schemas;
-		for (j = 0; j < vSchemas.size (); j++) {
-			#ifdef _DEBUG
-				self->debug ("Parsing schema: ");
-				self->debug (vSchemas[j]);
-				self->debug ("\n");
-			#endif
-			// Skip the entry if the schema isn't defined
-			if (mSchemas.find (vSchemas[j]) == mSchemas.end ()) {
-				cerr << "Warning: Schema doesn't exist: " << vSchemas[j] << endl;
-				continue;
-			}
-			// Add all columns
-			for (k = 0; k < mSchemas[vSchemas[j]].columns.size (); k++)
-				mColumns[mSchemas[vSchemas[j]].columns[k]] = 1;
-		}
-		
-		// Create the table
-		if (!this->createTable (iter->second, mColumns)) {
-				cerr << "Error: Couldn't create the table " << iter->second.table
-					 << " , please check the permissions\n";
+		if (!p->compile (mSchemas)) {
+			for (map<string, pipeline *>::iterator i = mPipelines.begin ();
+					i != mPipelines.end (); i++)
+				delete i->second;
+			mPipelines.clear ();
 			return false;
 		}
 	}
 	
-	#ifdef _DEBUG
-		self->debug ("Exiting formatTables\n");
-	#endif
 	return true;
+
 }
 
 /*
- * Check if a table exists by trying to fetch zero rows (LIMIT 0).
+ * Start using a new set of pipelines. Log files keep their counters, log files
+ * that are no longer configured disappear from the mount point.
  * 
- * @param info logInfo struct containing database information
- * @param strTable name of the table to check
+ * @param mPipelines the pipelines, the log files take ownership
+ */
+void loggerfs::installPipelines (map<string, pipeline *> &mPipelines) {
+	vector<pipeline *> vRetired, vPipelines;
+	vector<string> vChanged;
+	vector<source *> vSources;
+	
+	// Parse caches compare the generation, a new pipeline may reuse an old address
+	m_nGeneration++;
+	for (map<string, pipeline *>::iterator iter = mPipelines.begin ();
+			iter != mPipelines.end (); iter++) {
+		iter->second->generation = m_nGeneration;
+		vPipelines.push_back (iter->second);
+	}
+	source::create (vPipelines, loggerfs::ingest, vSources);
+	
+	pthread_rwlock_wrlock (&m_lock);
+	m_files.install (mPipelines, vRetired, vChanged);
+	m_vPipelines.swap (vPipelines);
+	m_vSources.swap (vSources);
+	pthread_rwlock_unlock (&m_lock);
+	
+	// The old sources may be waiting for the lock, so stop them after it's released.
+	// They have to be gone before the new ones can bind the same addresses.
+	for (vector<source *>::iterator iter = vSources.begin ();
+			iter != vSources.end (); iter++)
+		delete *iter;
+	if (m_bStarted)
+		for (vector<source *>::iterator iter = m_vSources.begin ();
+				iter != m_vSources.end (); iter++)
+			(*iter)->start ();
+	
+	// No write() can be using the old pipelines anymore
+	for (vector<pipeline *>::iterator iter = vRetired.begin ();
+			iter != vRetired.end (); iter++)
+		delete *iter;
+	
+	// Permissions/ owners may have changed, or the log file is gone
+	for (vector<string>::iterator iter = vChanged.begin ();
+			iter != vChanged.end (); iter++)
+		this->invalidate (*iter);
+}
+
+/*
+ * Look up a path, optionally adding it if it matches a wildcard location. Must
+ * be called w/ the read lock held, which is briefly given up to add the path.
  * 
- * @return true if the table exists, false otherwise
+ * @param path path relative to the mount point
+ * @param bCreate add the path, it's written to
+ * @return the live directory/ log file, NULL if it doesn't exist (or couldn't
+ * be added)
  */
-bool loggerfs::tableExists (const logInfo &info) {
-	#ifdef WITH_POSTGRESQL
-		if (this->isPostgresql (info.software)) {
-			try {
-				connection con (this->pgConnectionString (info));
-				work query (con);
-				
-				ostringstream strTmp;
-				strTmp.str ("");
-				strTmp	<< "SELECT * FROM " << info.table << " LIMIT 0;";
-				query.exec (strTmp.str ());
-				
-				// Don't care how many rows returned, all that matters is that the
-				// query completed successfully.
-				return true;
-			}
-			catch (...) {
-				return false;
-			}
-		}
+pathNode *loggerfs::lookup (const char *path, bool bCreate) {
+	pathNode *node = m_files.find (path);
+	if (node && node->live)
+		return node;
+	if (!bCreate || !m_files.resolvable (path))
+		return NULL;
+	
+	pthread_rwlock_unlock (&m_lock);
+	pthread_rwlock_wrlock (&m_lock);
+	m_files.resolve (path);
+	pthread_rwlock_unlock (&m_lock);
+	pthread_rwlock_rdlock (&m_lock);
+	
+	// The configuration may have been reloaded, or the path evicted in between
+	node = m_files.find (path);
+	return (node && node->live) ? node : NULL;
+}
+
+/*
+ * Find the log file of a <location>.query path. Called w/ the read lock held.
+ * 
+ * @param path path relative to the mount point
+ * @return the log file's node, NULL if the path isn't a .query file (or is a
+ * log file whose location happens to end in .query)
+ */
+pathNode *loggerfs::queryTarget (const char *path) {
+	size_t length = strlen (path);
+	size_t suffix = strlen (".query");
+	if (length <= suffix || strcmp (path + length - suffix, ".query") != 0)
+		return NULL;
+	pathNode *node = m_files.find (path);
+	if (node && node->live)
+		return NULL;
+	
+	node = m_files.find (string (path, length - suffix).c_str ());
+	return (node && node->live && !node->directory) ? node : NULL;
+}
+
+/*
+ * Drop the kernel's cached attributes of a log file.
+ * 
+ * The FUSE 2 high-level API can't notify the kernel, so w/ it the cached
+ * attributes simply expire after attr_timeout/ entry_timeout seconds.
+ * 
+ * @param strPath path relative to the mount point
+ */
+void loggerfs::invalidate (const string &strPath) {
+	#if FUSE_USE_VERSION >= 30
+		struct fuse_context *context = fuse_get_context ();
+		if (context && context->fuse)
+			fuse_invalidate_path (context->fuse, ("/" + strPath).c_str ());
 	#endif
+}
+
+/*
+ * Create the contents of the .stats file.
+ * 
+ * @return one line per log file w/ its counters
+ */
+string loggerfs::formatStats () {
+	ostringstream strStats;
 	
-	#ifdef WITH_MYSQL
-		if (this->isMysql (info.software)) {
-			MYSQL con;
-			
-			// Initialize the connection
-			mysql_init (&con);
-			if (!mysql_real_connect (&con, info.server.c_str(),
-					info.username.c_str(), info.password.c_str(),
-					info.database.c_str(), 0, NULL, 0))
-				return false;
-			
-			char *cstrTable = NULL;
-			try {
-				cstrTable = new char[info.table.length() * 2 + 1];
-				mysql_real_escape_string (&con, cstrTable, info.table.c_str(),
-						info.table.length());
-			}
-			catch (...) {
-				return false;
-			}
-			ostringstream strQuery;
-			strQuery << "SELECT * FROM " << cstrTable << " LIMIT 0;";
-			if (mysql_query (&con, strQuery.str().c_str()))
-				return false;
-			
-			mysql_close (&con);
-			
-			delete[] cstrTable;
-			
-			return true;
+	strStats << "# log lines matched overflow queued limited cached repeated joined\n";
+	pthread_rwlock_rdlock (&m_lock);
+	for (size_t i = 0; i < m_files.size (); i++) {
+		pathNode *node = m_files.at (i);
+		if (node->directory || !node->live)
+			continue;
+		const logStats &stats = node->file.stats;
+		strStats << node->name << " " << stats.lines << " "
+				 << stats.matched << " " << stats.overflow << " " << stats.queued << " "
+				 << stats.limited << " " << stats.cached << " " << stats.repeated << " "
+				 << stats.joined << "\n";
+	}
+	
+	strStats << "# table rows rows/s batches failed failed_rows in_flight queued dropped state reconnects out_of_range\n";
+	for (vector<pipeline *>::iterator iter = m_vPipelines.begin ();
+			iter != m_vPipelines.end (); iter++)
+		for (vector<sink *>::iterator out = (*iter)->sinks.begin ();
+				out != (*iter)->sinks.end (); out++) {
+			const sinkStats &stats = (*out)->stats;
+			strStats << (*out)->name () << " " << stats.rows << " "
+					 << (*out)->rowsPerSecond () << " " << stats.batches << " "
+					 << stats.failed << " " << stats.failedRows << " " << stats.inFlight << " "
+					 << stats.queued << " " << stats.dropped << " " << (*out)->state () << " "
+					 << stats.reconnects << " " << stats.outOfRange << "\n";
 		}
-	#endif
 	
-	return false;
+	strStats << "# source received unrouted errors\n";
+	for (vector<source *>::iterator iter = m_vSources.begin ();
+			iter != m_vSources.end (); iter++) {
+		const sourceStats &stats = (*iter)->stats;
+		strStats << (*iter)->name () << " " << stats.received << " "
+				 << stats.unrouted << " " << stats.errors << "\n";
+	}
+	pthread_rwlock_unlock (&m_lock);
+	
+	// Parsing memory: arena allocations vs. blocks that had to come from malloc
+	strStats << "# arena allocations mallocs frees resets\n"
+			 << "arena " << arena::allocations << " " << arena::mallocs << " "
+			 << arena::frees << " " << arena::resets << "\n";
+	
+	// Messages of loggerfs itself: the ones the thread couldn't keep up w/
+	// and the ones over their rate limit weren't written
+	messageStats messages = getMessageStats ();
+	strStats << "# messages written dropped suppressed\n"
+			 << "messages " << messages.written << " " << messages.dropped << " "
+			 << messages.suppressed << "\n";
+	
+	return strStats.str ();
+}
+
+/*
+ * Create the upcoming partitions and drop expired ones for all partitioned
+ * log tables.
+ */
+void loggerfs::maintainPartitions () {
+	time_t now = time (NULL);
+	
+	pthread_rwlock_rdlock (&m_lock);
+	for (vector<pipeline *>::iterator iter = m_vPipelines.begin ();
+			iter != m_vPipelines.end (); iter++)
+		for (vector<sink *>::iterator out = (*iter)->sinks.begin ();
+				out != (*iter)->sinks.end (); out++)
+			(*out)->maintainPartitions (now);
+	pthread_rwlock_unlock (&m_lock);
 }
 
-bool loggerfs::createTable (const logInfo &info, const map<string, int> &mColumns) {
-	// Create the SQL query
-	string strQuery = sqlCreateTable (info, mColumns);
+/*
+ * Body of the maintenance thread, wakes up every RECORD_CHECK_INTERVAL
+ * milliseconds for the multi-line records and every PARTITION_CHECK_INTERVAL
+ * seconds for the partitions, until destroy() stops it.
+ */
+void *loggerfs::maintenance (void *) {
+	time_t lastPartitionCheck = time (NULL);
+	time_t lastEviction = time (NULL);
+	pthread_mutex_lock (&self->m_maintenanceLock);
+	while (self->m_bMaintenance) {
+		struct timespec wakeup;
+		clock_gettime (CLOCK_REALTIME, &wakeup);
+		wakeup.tv_nsec += RECORD_CHECK_INTERVAL * 1000000L;
+		wakeup.tv_sec += wakeup.tv_nsec / 1000000000;
+		wakeup.tv_nsec %= 1000000000;
+		pthread_cond_timedwait (&self->m_maintenanceStop, &self->m_maintenanceLock, &wakeup);
+		if (!self->m_bMaintenance)
+			break;
 		
-	#ifdef WITH_POSTGRESQL
-		if (this->isPostgresql (info.software)) {
-			try {
-				connection con (this->pgConnectionString (info));
-				work query (con);
-				
-				query.exec (strQuery);
-				query.commit ();
-				
-				return true;
-			}
-			catch (...) {
-				return false;
-			}
+		// Don't block destroy() while talking to the databases
+		pthread_mutex_unlock (&self->m_maintenanceLock);
+		self->flushRecords ();
+		if (time (NULL) - lastPartitionCheck >= PARTITION_CHECK_INTERVAL) {
+			self->maintainPartitions ();
+			lastPartitionCheck = time (NULL);
 		}
-	#endif
-	
-	#ifdef WITH_MYSQL
-		if (this->isMysql (info.software)) {
-			MYSQL con;
-			
-			// Initialize the connection
-			mysql_init (&con);
-			if (!mysql_real_connect (&con, info.server.c_str(),
-					info.username.c_str(), info.password.c_str(),
-					info.database.c_str(), info.port, NULL, 0))
-				return false;
-			
-			if (mysql_query (&con, strQuery.c_str()))
-				return false;
-			mysql_close (&con);
-			
-			return true;
+		if (time (NULL) - lastEviction >= PATH_EVICT_INTERVAL) {
+			self->evictPaths ();
+			lastEviction = time (NULL);
 		}
-	#endif
+		pthread_mutex_lock (&self->m_maintenanceLock);
+	}
+	pthread_mutex_unlock (&self->m_maintenanceLock);
 	
-	return false;
+	return NULL;
 }
+
+/*
+ * Remove the log files of wildcard locations that haven't been used for
+ * PATH_IDLE_TIMEOUT seconds, or that aren't configured anymore, and the
+ * directories that only led to them. A log file that's open, has lines queued
+ * or an open multi-line record is kept.
+ */
+void loggerfs::evictPaths () {
+	time_t now = time (NULL);
+	vector<pathNode *> vIdle;
 	
-string loggerfs::sqlCreateTable (const logInfo &info, const map<string, int> &mColumns) {
-	string strTmp;
-	string strIdColumn = "";
+	pthread_rwlock_wrlock (&m_lock);
+	for (size_t i = 0; i < m_files.size (); i++) {
+		pathNode *node = m_files.at (i);
+		logFile &file = node->file;
+		if (!node->wildcard || node->directory || file.users > 0)
+			continue;
+		if (node->live && now - file.used < PATH_IDLE_TIMEOUT)
+			continue;
+		if ((file.records && file.records->pending ()) || !m_scheduler.forget (&file))
+			continue;
+		vIdle.push_back (node);
+	}
 	
-	#ifdef WITH_POSTGRESQL
-		if (this->isPostgresql (info.software)) {
-			strIdColumn = "id serial not null primary key,";
+	if (!vIdle.empty ()) {
+		pthread_mutex_lock (&m_queryLock);
+		for (vector<pathNode *>::iterator iter = vIdle.begin (); iter != vIdle.end (); iter++) {
+			logFile *file = &(*iter)->file;
+			map<pair<logFile *, uid_t>, string>::iterator f = m_mFilters.lower_bound (make_pair (file, (uid_t)0));
+			while (f != m_mFilters.end () && f->first.first == file)
+				m_mFilters.erase (f++);
 		}
-	#endif
-	#ifdef WITH_MYSQL
-		if (this->isMysql (info.software)) {
-			strIdColumn = "id bigint not null primary key unique auto_increment,";
-		}
-	#endif
-	
-	ostringstream strQuery;
-	strQuery << "CREATE TABLE " << info.table << "(" << strIdColumn
-			 << "timestamp timestamp default now(),";
-	for (map<string, int>::const_iterator iter = mColumns.begin ();
-			iter != mColumns.end (); iter++)
-		strQuery << iter->first << " text DEFAULT '' NOT NULL,";
-	
-	strTmp = strQuery.str ();
-	strTmp.erase (strTmp.end() - 1);
-	
-	strTmp += ");";
-	
-	return strTmp;
-}
-
-bool loggerfs::sqlInsertLogLine (const string &strPath, const logInfo &info,
-		const logFormat &format, const boost::cmatch &matches) {
-	#ifdef _DEBUG
-		self->debug ("Calling sqlInsertLogLine: ");
-		self->debug (info.software);
-		self->debug ("\n");
-	#endif				
-	#ifdef WITH_POSTGRESQL
-		if (this->isPostgresql (info.software)) {
-			try {
-//				connection con (this->pgConnectionString (info));
-				work query (*m_mPgsqlCache[strPath]);
-				/*
-				 *  Build the query string
-				 */
-				string strQuery = "";
-				strQuery += "INSERT INTO " + info.table + "(";
-				for (vector<string>::const_iterator iter = format.columns.begin ();
-						iter != format.columns.end (); iter++)
-					strQuery += *iter + ",";
-				
-				strQuery.erase (strQuery.end() - 1); // remove the last ','
-				strQuery += ") VALUES (";
-				
-				// Skip the 0-th match because that just contains the original string
-				for (boost::cmatch::const_iterator iter = matches.begin () + 1;
-						iter != matches.end (); iter++) {
-					string strMatch (iter->first, iter->second);
-					strQuery += "'" + query.esc (strMatch) + "',";
-				}
-				
-				strQuery.erase (strQuery.end() - 1); // remove the last ','
-				strQuery += ");";
-				
-				query.exec (strQuery);
-				query.commit ();
-				
-				return true;
-			}
-			catch (...) {
-				return false;
+		pthread_mutex_unlock (&m_queryLock);
+		
+		for (vector<pathNode *>::iterator iter = vIdle.begin (); iter != vIdle.end (); iter++)
+			m_files.evict (*iter);
+		message (LEVEL_DEBUG, "Evicted %lu idle log files", (unsigned long)vIdle.size ());
+	}
+	pthread_rwlock_unlock (&m_lock);
+}
+
+/*
+ * Parse the multi-line records that have waited for another line longer than
+ * the timeout of their log file.
+ */
+void loggerfs::flushRecords () {
+	long long now = monotonicTime ();
+	pthread_rwlock_rdlock (&m_lock);
+	for (size_t i = 0; i < m_files.size (); i++) {
+		logFile *file = &m_files.at (i)->file;
+		if (file->records && file->current && file->records->expired (file->current->multiline, now))
+			this->process (file, NULL, 0);
+	}
+	pthread_rwlock_unlock (&m_lock);
+}
+
+/*
+ * Parse lines and store the ones that match a schema of the log file. Must be
+ * called w/ the read lock held.
+ * 
+ * @param file the log file
+ * @param buf the lines, NULL to only parse a multi-line record that timed out
+ * @param size length of buf
+ * @param bFlush true if a multi-line record that's still open is complete
+ */
+void loggerfs::process (logFile *file, const char *buf, size_t size, bool bFlush) {
+	// All parsing state lives in the thread's arena until the lines are done
+	arena::scope arenaScope (arena::local ());
+    pipeline *p = file->current;
+    
+    // Parse results of lines seen before
+    parseCache *cache = NULL;
+    if (p->info.parseCache > 0) {
+    	if (file->cache == NULL) {
+    		parseCache *created = new parseCache;
+    		if (!__sync_bool_compare_and_swap (&file->cache, (parseCache *)NULL, created))
+    			delete created;
+    	}
+    	cache = file->cache;
+    	cache->acquire (p->generation, p->info.parseCache);
+    }
+    // Lines that belong together are parsed as one record
+    recordAssembler *records = NULL;
+    if (p->multiline.enabled && file->records == NULL) {
+    	recordAssembler *created = new recordAssembler;
+    	if (!__sync_bool_compare_and_swap (&file->records, (recordAssembler *)NULL, created))
+    		delete created;
+    }
+    // W/out rules (anymore), a carried record is parsed first
+    if (file->records && (p->multiline.enabled || file->records->pending ())) {
+    	records = file->records;
+    	records->acquire ();
+    	records->begin (p->multiline, buf, size, bFlush);
+    }
+    // A run of identical lines is stored once, the repeat count follows the wildcards
+    bool bCollapse = !p->info.repeatColumn.empty () && records == NULL;
+    vector<string> vCounted;
+    if (bCollapse) {
+    	vCounted = file->wildcards;
+    	vCounted.push_back ("1");
+    }
+    const vector<string> &vExtra = bCollapse ? vCounted : file->wildcards;
+    
+    vector<newValue> vNewValues;
+    
+    // Loop through all the lines (or records), w/out copying them out of the buffer
+    lineMatch matches;
+    const char *end = buf + size;
+    for (const char *next = buf; ; ) {
+	    const char *first, *last;
+	    unsigned int lines = 1;
+	    if (records) {
+	    	if (!records->next (first, last, lines))
+	    		break;
+	    }
+	    else {
+	    	if (next >= end)
+	    		break;
+		    first = next;
+		    last = (const char *)memchr (next, '\n', end - next);
+		    if (last == NULL)
+		    	last = end;
+		    next = last + 1;
+	    }
+	    
+	    // Trim the line and skip empty ones
+	    trim (first, last);
+	    if (first == last)
+	    	continue;
+	    
+	    unsigned long repeats = 1;
+	    if (bCollapse) {
+	    	while (next < end) {
+	    		const char *nextEnd = (const char *)memchr (next, '\n', end - next);
+	    		if (nextEnd == NULL)
+	    			nextEnd = end;
+	    		const char *nextFirst = next, *nextLast = nextEnd;
+	    		trim (nextFirst, nextLast);
+	    		if (nextLast - nextFirst != last - first || memcmp (nextFirst, first, last - first) != 0)
+	    			break;
+	    		next = nextEnd + 1;
+	    		repeats++;
+	    	}
+	    	char count[32];
+	    	vCounted.back ().assign (count, snprintf (count, sizeof (count), "%lu", repeats));
+	    }
+	    
+	    bool bMatched = false, bOverflow = false;
+	    unsigned long hash = 0;
+	    const cachedLine *hit = NULL;
+	    if (cache) {
+	    	hash = hashBytes (first, last - first);
+	    	hit = cache->find (first, last, hash);
+	    }
+	    
+	    // Same line as before: the same schemas match, w/ the same captures
+	    if (hit) {
+	    	for (size_t pos = 0; pos < hit->results.size (); ) {
+	    		unsigned int index;
+	    		pos = cache->restore (hit, pos, index, matches);
+	    		this->store (p, p->schemas[index], matches, vExtra, repeats, vNewValues);
+	    		bMatched = true;
+	    	}
+	    	__sync_fetch_and_add (&file->stats.cached, 1);
+	    }
+	    else {
+	    	cachedLine *entry = cache ? cache->add (first, last, hash) : NULL;
+	    	long long deadline = monotonicTime () + p->info.matchBudget * 1000LL;
+	    	// Compare the regex against all schemas assigned to the log file
+	    	for (vector<compiledSchema>::iterator s = p->schemas.begin ();
+	    			s != p->schemas.end (); s++) {
+	    		// Don't let a single line hog the thread; a single match is
+	    		// bounded by the regex engine (MATCH_OVERFLOW)
+	    		if (monotonicTime () > deadline) {
+	    			bOverflow = true;
+	    			break;
+	    		}
+	    		
+	    		matchResult result = matchLine (s->format, first, last, matches);
+	    		if (result == MATCH_OVERFLOW) {
+	    			bOverflow = true;
+	    			break;
+	    		}
+	    		
+	    		// The current line matches the regex
+	    		if (result == MATCH_OK) {
+	    			// The number of matches doesn't equal the number of columns in the table
+	    			if (s->format.columns.size () != matches.size() - 1)
+	    				continue;
+	    			
+	    			this->store (p, *s, matches, vExtra, repeats, vNewValues);
+	    			if (entry)
+	    				cache->store (entry, s - p->schemas.begin (), matches);
+	    			bMatched = true;
+	    		}
+	    	}
+	    	// Running out of time may not happen the next time, don't cache it
+	    	if (entry && bOverflow)
+	    		cache->discard (entry);
+	    }
+	    
+	    __sync_fetch_and_add (&file->stats.lines, repeats * lines);
+	    if (repeats > 1)
+	    	__sync_fetch_and_add (&file->stats.repeated, repeats - 1);
+	    if (lines > 1)
+	    	__sync_fetch_and_add (&file->stats.joined, lines - 1);
+	    if (bMatched)
+	    	__sync_fetch_and_add (&file->stats.matched, repeats * lines);
+	    if (bOverflow)
+	    	__sync_fetch_and_add (&file->stats.overflow, 1);
+    }
+    // After the rows: the ids don't depend on the values being stored first
+    if (!vNewValues.empty ())
+    	this->storeValues (p, vNewValues);
+    if (cache)
+    	cache->release ();
+    if (records)
+    	records->release ();
+    
+    // Queue the rest of the batches, w/out waiting for the acknowledgement
+    for (vector<sink *>::iterator out = p->sinks.begin (); out != p->sinks.end (); out++)
+    	(*out)->flush ();
+}
+
+/*
+ * Insert the row of a line into every destination; of the shards, only one
+ * gets it.
+ * 
+ * @param p the pipeline of the log file
+ * @param s the schema the line matched
+ * @param matches its captures
+ * @param vExtra values of the wildcards (and the repeat count)
+ * @param repeats number of identical lines the row stands for; destinations
+ * that store the lines themselves get them all
+ * @param vNewValues receives the values of dictionary columns that haven't
+ * been stored yet
+ */
+void loggerfs::store (pipeline *p, const compiledSchema &s, const lineMatch &matches,
+		const vector<string> &vExtra, unsigned long repeats, vector<newValue> &vNewValues) {
+	// Dictionary columns get the id of their value instead
+	const lineMatch *row = &matches;
+	lineMatch encoded;
+	if (!s.encoded.empty ()) {
+		encoded = matches;
+		for (vector<encodedColumn>::const_iterator e = s.encoded.begin (); e != s.encoded.end (); e++) {
+			const char *first = matches[e->capture].first, *last = matches[e->capture].second;
+			if (!matches[e->capture].matched)
+				first = last = NULL;
+			unsigned long long id = dictionary::id (first, last);
+			char *text = (char *)arena::local ().allocate (24);
+			int length = snprintf (text, 24, "%llu", id);
+			encoded.set_first (text, e->capture);
+			encoded.set_second (text + length, e->capture);
+			
+			if (id != 0 && e->values->add (id)) {
+				newValue value;
+				value.values = e->values;
+				value.key = id;
+				value.id = text;
+				// A cached line's captures go away when a later line replaces its entry
+				value.first = arena::local ().copy (first, last - first);
+				value.last = value.first + (last - first);
+				vNewValues.push_back (value);
 			}
 		}
-	#endif
+		row = &encoded;
+	}
 	
-	#ifdef WITH_MYSQL
-		if (this->isMysql (info.software)) {
-			MYSQL con = *m_mMysqlCache[strPath];
-			
-			#ifdef _DEBUG
-				self->debug ("Connecting to mysql server\n");
-			#endif
-			// Initialize the connection
-//			mysql_init (&con);
-//			if (!mysql_real_connect (&con, info.server.c_str(),
-//					info.username.c_str(), info.password.c_str(),
-//					info.database.c_str(), 0, NULL, 0))
-//				return false;
-			
-			/*
-			 *  Build the query string
-			 */
-			string strQuery = "";
-			strQuery += "INSERT INTO " + info.table + "(";
-			for (vector<string>::const_iterator iter = format.columns.begin ();
-					iter != format.columns.end (); iter++)
-				strQuery += *iter + ",";
-			
-			strQuery.erase (strQuery.end() - 1); // remove the last ','
-			strQuery += ") VALUES (";
-			
-			char *cstrMatch = NULL;
-			// Skip the 0-th match because that just contains the original string
-			for (boost::cmatch::const_iterator iter = matches.begin () + 1;
-					iter != matches.end (); iter++) {
-				string strMatch (iter->first, iter->second);
-				// I'm using mysql_real_escape_string because it considers the character
-				// set, which mysql_escape_string doesn't. But it doesn't work elegantly
-				// w/ the STL string class.
-				try {
-					cstrMatch = new char[strMatch.length() * 2 + 1];
-					mysql_real_escape_string (&con, cstrMatch, strMatch.c_str(),
-							strMatch.length());
-				
-					strQuery += "'";
-					strQuery += cstrMatch;
-					strQuery += "',";
-					delete[] cstrMatch;
-				}
-				catch (...) {
-					return false;
-				}
-			}
-			
-			strQuery.erase (strQuery.end() - 1); // remove the last ','
-			strQuery += ");";
-			
-			#ifdef _DEBUG
-				self->debug (strQuery);
-			#endif
-			
-			// execute the query
-			if (mysql_query (&con, strQuery.c_str ()))
-				return false;
-			
-//			mysql_close (&con);
+	// Of the shards, only the one the key (or the turn) picks gets the row
+	unsigned int shard = 0;
+	if (!p->shards.empty ()) {
+		if (s.shardKey > 0) {
+			const char *first = matches[s.shardKey].first, *last = matches[s.shardKey].second;
+			if (!matches[s.shardKey].matched)
+				first = last = NULL;
+			shard = p->shards.find (first, last);
 		}
-	#endif
+		else
+			shard = p->shards.next ();
+	}
 	
-	return false;
+	for (size_t i = 0; i < p->sinks.size (); i++) {
+		if (p->sharded[i] && i != shard)
+			continue;
+		unsigned long n = p->sinks[i]->storesLines () ? repeats : 1;
+		for (unsigned long j = 0; j < n; j++)
+			p->sinks[i]->insert (s.insertPrefix[i], *row, s.eventTime, vExtra);
+	}
 }
 
-#ifdef WITH_POSTGRESQL
-	/*
- 	* PostgreSQL Helper functions
- 	*/
-	bool loggerfs::isPostgresql (const string &args) {
-		return (args == "postgresql" || args == "pgsql") ? true : false;
+/*
+ * Insert the values that were seen for the first time into the lookup tables
+ * of their columns, the rows of a column are batched together.
+ * 
+ * @param p the pipeline of the log file
+ * @param vNewValues the values, in any order
+ */
+void loggerfs::storeValues (pipeline *p, vector<newValue> &vNewValues) {
+	vector<string> vNone;
+	lineMatch row;
+	for (map<string, dictionary *>::iterator d = p->dictionaries.begin ();
+			d != p->dictionaries.end (); d++)
+		for (vector<newValue>::iterator v = vNewValues.begin (); v != vNewValues.end (); v++) {
+			if (v->values != d->second)
+				continue;
+			fieldValue values[2];
+			values[0].first = v->id;
+			values[0].last = v->id + strlen (v->id);
+			values[1].first = v->first;
+			values[1].last = v->last;
+			fillMatch (row, v->first, v->last, values, 2);
+			for (size_t i = 0; i < p->sinks.size (); i++)
+				if (!d->second->insertPrefix[i].empty ())
+					p->sinks[i]->insert (d->second->insertPrefix[i], row, 0, vNone, v->values, v->key);
+		}
+}
+
+/*
+ * Hand lines to the log file at a location, the entry point of the sources
+ * that don't go through the mount point.
+ * 
+ * @param strLocation path relative to the mount point
+ * @param buf the lines
+ * @param size length of buf
+ * @param bWait return once the lines are parsed, i.e. their rows are handed
+ * to the sinks
+ * @return false if there's no such log file
+ */
+bool loggerfs::ingest (const string &strLocation, const char *buf, size_t size, bool bWait) {
+	pthread_rwlock_rdlock (&self->m_lock);
+	pathNode *node = self->lookup (strLocation.c_str (), true);
+	bool bResult = (node && !node->directory && node->file.current);
+	flowSettings settings;
+	if (bResult) {
+		settings = flowOf (node->file.current->info);
+		__sync_fetch_and_add (&node->file.users, 1);
 	}
+	pthread_rwlock_unlock (&self->m_lock);
 	
-	/*
-	 * Creates a PostgreSQL connection string based on the logInfo struct.
-	 * 
-	 * @param info the logInfo struct
-	 * 
-	 * @return string containing the postgresql connection string
-	 */
-	string loggerfs::pgConnectionString (const logInfo &info) {
-		ostringstream strTmp;
-		strTmp	<< "dbname=" << info.database
-				<< " user=" << info.username
-				<< " password=" << info.password
-				<< " host=" << info.server;
-		if (info.port > 0)
-			strTmp << " port=" << info.port;
-		cerr << "Connection string: " << strTmp.str() << endl;
-		return strTmp.str ();
+	// Log files aren't evicted while they're used, the node stays valid w/out the lock
+	if (bResult) {
+		self->m_scheduler.submit (&node->file, buf, size, settings);
+		if (bWait)
+			self->m_scheduler.drain (&node->file);
+		node->file.used = time (NULL);
+		__sync_fetch_and_sub (&node->file.users, 1);
 	}
-#endif
+	return bResult;
+}
 
-#ifdef WITH_MYSQL
-	/*
- 	* MySQL Helper functions
- 	*/
-	bool loggerfs::isMysql (const string &args) {
-		return args == "mysql" ? true : false;
+/*
+ * Parse lines the scheduler picked, called by the ingest workers.
+ * 
+ * @param file the log file
+ * @param buf the lines
+ * @param size length of buf
+ */
+void loggerfs::dispatch (logFile *file, const char *buf, size_t size) {
+	// The pipeline can't be swapped by a reload while the lines are parsed
+	pthread_rwlock_rdlock (&self->m_lock);
+	if (file->current)
+		self->process (file, buf, size);
+	pthread_rwlock_unlock (&self->m_lock);
+}
+
+/*
+ * Queue the incomplete last line of a file handle as a line of its own.
+ * 
+ * @param handle the file handle
+ * @return 0 on success, -ENOENT if the log file is gone
+ */
+int loggerfs::submitPartial (fileHandle *handle) {
+	int res = 0;
+	pthread_mutex_lock (&handle->lock);
+	if (!handle->partial.empty ()) {
+		pthread_rwlock_rdlock (&m_lock);
+		pipeline *p = handle->file->current;
+		flowSettings settings;
+		if (p)
+			settings = flowOf (p->info);
+		pthread_rwlock_unlock (&m_lock);
+		
+		if (p)
+			m_scheduler.submit (handle->file, handle->partial.data (), handle->partial.length (), settings);
+		else
+			res = -ENOENT;
+		handle->partial.clear ();
 	}
-#endif
+	pthread_mutex_unlock (&handle->lock);
+	return res;
+}
@@ -27,24 +27,47 @@
 #include "fusexx.hpp"
 #include "schema.hpp"
 #include "config.hpp"
+#include "arena.hpp"
+#include "pipeline.hpp"
+#include "pathtable.hpp"
+#include "source.hpp"
+#include "scheduler.hpp"
+#include "parsecache.hpp"
+#include "messages.hpp"
+#include "query.hpp"
 
 #include <string>
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <vector>
 
 // C-headers (required for uid lookup in passwd file)
 #include <sys/types.h>
 #include <pwd.h>
+#include <pthread.h>
 
-#ifdef WITH_POSTGRESQL
-	#include <pqxx/pqxx>
-#endif
+// Seconds between two runs of the partition maintenance
+#define PARTITION_CHECK_INTERVAL 300
+// Milliseconds between two checks for multi-line records that timed out
+#define RECORD_CHECK_INTERVAL 250
+// Bytes of an incomplete line a file handle keeps, a longer line is cut
+#define HANDLE_MAX_PARTIAL (64 * 1024)
 
-#ifdef WITH_MYSQL
-	#include <mysql.h>
-#endif
+/*
+ * An open log file, the FUSE file handle. Only complete lines are queued: the
+ * end of a write() that isn't followed by a newline waits here for the next
+ * write(), or is queued when the file is closed.
+ */
+struct fileHandle {
+	logFile *file;
+	pthread_mutex_t lock; // writes through the handle
+	std::string partial;
+	logQuery *query; // the handle of a <location>.query file, NULL for the log file
+	// errors () of the pipeline's sinks at open() or the last fsync()
+	pthread_mutex_t syncLock;
+	unsigned long generation;
+	std::vector<unsigned long> errors;
+};
 
 class loggerfs : public fusexx::fuse<loggerfs> {
 	public:
@@ -54,43 +77,54 @@ class loggerfs : public fusexx::fuse<loggerfs> {
 		~loggerfs ();
 		bool initialize ();
 		
-		#ifdef _DEBUG
-			// Debug method
-			void debug (std::string);
-			void debug (const char *);
-		#endif
-		
 		/*
 		 * Static Fuse functions
 		 */
 		static int getattr (const char *, struct stat *);
-		static int readdir (const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
+		static int readdir (const char *, void *, fusexx::fill_dir_t, off_t, struct fuse_file_info *);
 		static int open (const char *, struct fuse_file_info *);
 		static int read (const char *, char *, size_t, off_t, struct fuse_file_info *);
 		static int write (const char *, const char *, size_t, off_t, struct fuse_file_info *);
+#ifdef FUSE_CAP_SPLICE_READ
+		static int write_buf (const char *, struct fuse_bufvec *, off_t, struct fuse_file_info *);
+#endif
+		static int flush (const char *, struct fuse_file_info *);
+		static int fsync (const char *, int, struct fuse_file_info *);
+		static int release (const char *, struct fuse_file_info *);
+		static void *init (struct fuse_conn_info *);
+		static void destroy (void *);
 	
 	/*
 	 * Private methods
 	 */
 	private:
-		bool formatTables (std::map<std::string, struct logFormat> &,
-				std::map<std::string, struct logInfo> &);
-		bool tableExists (const logInfo &);
-		bool createTable (const logInfo &, const std::map<std::string, int> &);
-		
-		#ifdef WITH_POSTGRESQL
-			// PostgreSQL helper functions
-			bool isPostgresql (const std::string &);
-			std::string pgConnectionString (const logInfo &);
-		#endif
-		
-		#ifdef WITH_MYSQL
-			bool isMysql (const std::string &);
-		#endif
-		
-		// SQL helper functions
-		std::string sqlCreateTable (const logInfo &, const std::map<std::string, int> &);
-		bool sqlInsertLogLine (const std::string &, const logInfo &, const logFormat &, const boost::cmatch &); 
+		bool compilePipelines (std::map<std::string, struct logFormat> &,
+				std::map<std::string, struct logInfo> &,
+				std::map<std::string, pipeline *> &);
+		void installPipelines (std::map<std::string, pipeline *> &);
+		void invalidate (const std::string &);
+		pathNode *lookup (const char *, bool);
+		pathNode *queryTarget (const char *);
+		std::string formatStats ();
+		void maintainPartitions ();
+		void evictPaths ();
+		void process (logFile *, const char *, size_t, bool = false);
+		void flushRecords ();
+		// A value seen for the first time, stored once the chunk is done
+		struct newValue {
+			dictionary *values;
+			unsigned long long key; // the id
+			const char *id; // as text
+			const char *first; // copied into the arena
+			const char *last;
+		};
+		void store (pipeline *, const compiledSchema &, const lineMatch &,
+				const std::vector<std::string> &, unsigned long, std::vector<newValue> &);
+		void storeValues (pipeline *, std::vector<newValue> &);
+		int submitPartial (fileHandle *);
+		static bool ingest (const std::string &, const char *, size_t, bool);
+		static void dispatch (logFile *, const char *, size_t);
+		static void *maintenance (void *);
 		
 	/*
 	 * Private variables
@@ -98,16 +132,26 @@ class loggerfs : public fusexx::fuse<loggerfs> {
 	private:
 		std::string m_strDatabase;
 		std::string m_strHostname;
-		std::map<std::string, struct logFormat> m_mSchemas;
-		std::map<std::string, struct logInfo> m_mLogs;
+		pathTable m_files;
+		
+		std::vector<pipeline *> m_vPipelines; // all pipelines in m_files
+		std::vector<source *> m_vSources;
+		bool m_bStarted; // init() was called, sources may run
+		unsigned long m_nGeneration; // number of installPipelines() calls
+		scheduler m_scheduler; // parses the lines w/ a pool of workers
+		
+		// Protects m_files and the pipelines against a concurrent reload
+		pthread_rwlock_t m_lock;
 		
-		#ifdef WITH_POSTGRESQL
-			std::map<std::string, pqxx::connection *> m_mPgsqlCache;
-		#endif
+		// The filter each user wrote last to the .query file of a log file
+		std::map<std::pair<logFile *, uid_t>, std::string> m_mFilters;
+		pthread_mutex_t m_queryLock;
 		
-		#ifdef WITH_MYSQL
-			std::map<std::string, MYSQL *> m_mMysqlCache;
-		#endif
+		// Background thread that creates/ drops partitions and evicts idle paths
+		pthread_t m_maintenanceThread;
+		bool m_bMaintenance; // the thread is running, cleared to stop it
+		pthread_mutex_t m_maintenanceLock;
+		pthread_cond_t m_maintenanceStop;
 };
 
 #endif /*LOGGERFS_HPP_*/
@@ -20,6 +20,17 @@
 #include "loggerfs.hpp"
 
 #include <iostream>
+#include <vector>
+
+// Seconds the kernel may cache attributes/ lookups of log files. Can be
+// overridden w/ -o attr_timeout=N,entry_timeout=N
+#define DEFAULT_CACHE_OPTIONS "use_ino,attr_timeout=5,entry_timeout=5"
+#if FUSE_USE_VERSION >= 30
+	// Every thread of the loop reads from its own /dev/fuse fd
+	#define DEFAULT_OPTIONS DEFAULT_CACHE_OPTIONS ",clone_fd"
+#else
+	#define DEFAULT_OPTIONS DEFAULT_CACHE_OPTIONS
+#endif
 
 void printUsage ();
 
@@ -29,10 +40,18 @@ int main (int argc, char **argv) {
 		printUsage ();
 		return 1;
 	}
+	setupMessages ();
 	loggerfs LogFS;
 	if (!LogFS.initialize ())
 		return -1;
-	return loggerfs::main (argc, argv, NULL, &LogFS);
+	
+	// Put the default options first, so the ones given by the user take precedence
+	std::vector<char *> vArgs (argv, argv + argc);
+	vArgs.insert (vArgs.begin () + 1, (char *)"-o");
+	vArgs.insert (vArgs.begin () + 2, (char *)DEFAULT_OPTIONS);
+	vArgs.push_back (NULL);
+	
+	return loggerfs::main (vArgs.size () - 1, &vArgs[0], NULL, &LogFS);
 }
 
 void printUsage () {
@@ -0,0 +1,307 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "messages.hpp"
+
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * A slot of the ring. Its sequence tells who may use it: a writer may claim
+ * it when sequence == position, the thread may read it when sequence ==
+ * position + 1, and hands it to the next round w/ position + MESSAGE_SLOTS.
+ */
+struct messageSlot {
+	volatile unsigned long sequence;
+	int level;
+	time_t time;
+	char text[MESSAGE_MAX_LENGTH];
+};
+
+#ifdef _DEBUG
+	volatile int g_nMessageLevel = LEVEL_DEBUG;
+#else
+	volatile int g_nMessageLevel = LEVEL_INFO;
+#endif
+
+static const char *s_levels[] = { "Error: ", "Warning: ", "", "Debug: " };
+
+static messageSlot s_slots[MESSAGE_SLOTS];
+static volatile unsigned long s_nHead; // next position to claim
+static unsigned long s_nTail; // next position to write, only used by the thread
+static volatile bool s_bRunning;
+static volatile bool s_bStop;
+static pthread_t s_thread;
+static FILE *s_pOut;
+static string s_strPath (MESSAGE_LOG_FILE);
+
+static volatile unsigned long s_nWritten;
+static volatile unsigned long s_nDropped;
+static volatile unsigned long s_nSuppressed;
+static unsigned long s_nReportedDrops;
+
+/*
+ * Write a message out, w/ the time unless it goes to the terminal.
+ */
+static void writeMessage (int level, time_t time, const char *text) {
+	FILE *out = s_pOut ? s_pOut : stderr;
+	if (out != stderr) {
+		struct tm tm;
+		char date[32];
+		strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S ", localtime_r (&time, &tm));
+		fputs (date, out);
+	}
+	fputs (s_levels[level], out);
+	fputs (text, out);
+	fputc ('\n', out);
+	__sync_fetch_and_add (&s_nWritten, 1);
+}
+
+/*
+ * Format a message into the ring, or write it right away if the thread isn't
+ * running.
+ *
+ * @param level the level
+ * @param suppressed messages of the same kind that were over the rate limit
+ */
+static void post (messageLevel level, unsigned int suppressed, const char *format,
+		va_list args) {
+	char buf[MESSAGE_MAX_LENGTH];
+	char *text = buf;
+	messageSlot *slot = NULL;
+	unsigned long pos = 0;
+
+	if (s_bRunning) {
+		pos = s_nHead;
+		for (;;) {
+			slot = &s_slots[pos & (MESSAGE_SLOTS - 1)];
+			long diff = (long)(slot->sequence - pos);
+			if (diff == 0) {
+				if (__sync_bool_compare_and_swap (&s_nHead, pos, pos + 1))
+					break;
+			}
+			// Full, the thread can't keep up
+			else if (diff < 0) {
+				__sync_fetch_and_add (&s_nDropped, 1);
+				return;
+			}
+			pos = s_nHead;
+		}
+		text = slot->text;
+	}
+
+	int length = vsnprintf (text, MESSAGE_MAX_LENGTH, format, args);
+	if (length >= MESSAGE_MAX_LENGTH)
+		length = MESSAGE_MAX_LENGTH - 1;
+	// Error messages of the client libraries end w/ a newline
+	while (length > 0 && text[length - 1] == '\n')
+		text[--length] = '\0';
+	if (suppressed > 0 && length >= 0)
+		snprintf (text + length, MESSAGE_MAX_LENGTH - length,
+				" (%u more in the last %d seconds)", suppressed, MESSAGE_LIMIT_WINDOW);
+
+	if (slot == NULL) {
+		writeMessage (level, time (NULL), text);
+		fflush (s_pOut ? s_pOut : stderr);
+		return;
+	}
+	slot->level = level;
+	slot->time = time (NULL);
+	// The message has to be visible before the slot is handed to the thread
+	__sync_synchronize ();
+	slot->sequence = pos + 1;
+}
+
+/*
+ * Write the messages in the ring.
+ *
+ * @return true if there were any
+ */
+static bool drain () {
+	bool bWritten = false;
+	for (;;) {
+		messageSlot *slot = &s_slots[s_nTail & (MESSAGE_SLOTS - 1)];
+		if (slot->sequence != s_nTail + 1)
+			break;
+		__sync_synchronize ();
+		writeMessage (slot->level, slot->time, slot->text);
+		__sync_synchronize ();
+		slot->sequence = s_nTail + MESSAGE_SLOTS;
+		s_nTail++;
+		bWritten = true;
+	}
+
+	unsigned long dropped = s_nDropped;
+	if (dropped != s_nReportedDrops) {
+		char text[64];
+		snprintf (text, sizeof (text), "%lu messages were dropped", dropped - s_nReportedDrops);
+		writeMessage (LEVEL_WARNING, time (NULL), text);
+		s_nReportedDrops = dropped;
+		bWritten = true;
+	}
+	if (bWritten)
+		fflush (s_pOut ? s_pOut : stderr);
+	return bWritten;
+}
+
+static void *run (void *) {
+	struct timespec delay;
+	delay.tv_sec = MESSAGE_POLL_INTERVAL / 1000;
+	delay.tv_nsec = (MESSAGE_POLL_INTERVAL % 1000) * 1000000;
+	while (!s_bStop)
+		if (!drain ())
+			nanosleep (&delay, NULL);
+	drain ();
+	return NULL;
+}
+
+/*
+ * Take the level and the file from the environment. Called once, before
+ * anything is reported.
+ */
+void setupMessages () {
+	const char *level = getenv ("LOGGERFS_LOG_LEVEL");
+	if (level != NULL) {
+		int i;
+		for (i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++) {
+			const char *names[] = { "error", "warning", "info", "debug" };
+			if (strcmp (level, names[i]) == 0)
+				break;
+		}
+		if (i <= LEVEL_DEBUG)
+			g_nMessageLevel = i;
+		else
+			message (LEVEL_WARNING, "Unknown LOGGERFS_LOG_LEVEL %s, use error, warning, info or debug",
+					level);
+	}
+	const char *path = getenv ("LOGGERFS_LOG");
+	if (path != NULL && *path)
+		s_strPath = path;
+}
+
+/*
+ * Open the file and start the thread. Called once loggerfs runs in the
+ * background; stderr is gone by then, unless it was started in the
+ * foreground.
+ *
+ * @return true on success, false if messages are still written right away
+ */
+bool startMessages () {
+	if (s_bRunning)
+		return true;
+	if (!isatty (STDERR_FILENO)) {
+		FILE *fp = fopen (s_strPath.c_str (), "a");
+		if (fp == NULL)
+			message (LEVEL_WARNING, "Couldn't open %s, writing messages to stderr", s_strPath.c_str ());
+		else {
+			fcntl (fileno (fp), F_SETFD, FD_CLOEXEC);
+			s_pOut = fp;
+		}
+	}
+
+	for (unsigned long i = 0; i < MESSAGE_SLOTS; i++)
+		s_slots[i].sequence = i;
+	s_nHead = s_nTail = 0;
+	s_bStop = false;
+	if (pthread_create (&s_thread, NULL, run, NULL) != 0) {
+		message (LEVEL_WARNING, "Couldn't start the message thread, messages are written right away");
+		return false;
+	}
+	__sync_synchronize ();
+	s_bRunning = true;
+	return true;
+}
+
+/*
+ * Write the waiting messages and stop the thread, later messages are written
+ * right away.
+ */
+void stopMessages () {
+	if (!s_bRunning)
+		return;
+	s_bRunning = false;
+	__sync_synchronize ();
+	s_bStop = true;
+	pthread_join (s_thread, NULL);
+	// Messages that were being formatted while the thread stopped
+	drain ();
+}
+
+/*
+ * Report a message.
+ *
+ * @param level messages above the configured level are ignored
+ * @param format printf format of the text, w/out a newline
+ */
+void message (messageLevel level, const char *format, ...) {
+	if (!messageEnabled (level))
+		return;
+	va_list args;
+	va_start (args, format);
+	post (level, 0, format, args);
+	va_end (args);
+}
+
+/*
+ * Report a message that may be repeated often (i.e. for every failed
+ * batch). The messages over the limit are counted, and the count is added to
+ * the first message of the next window.
+ *
+ * @param limit the rate limit of this message
+ * @param level messages above the configured level are ignored
+ * @param format printf format of the text, w/out a newline
+ */
+void messageLimited (messageLimit &limit, messageLevel level, const char *format, ...) {
+	if (!messageEnabled (level))
+		return;
+	time_t now = time (NULL);
+	time_t window = limit.window;
+	unsigned int suppressed = 0;
+	if (now - window >= MESSAGE_LIMIT_WINDOW
+			&& __sync_bool_compare_and_swap (&limit.window, window, now)) {
+		suppressed = __sync_lock_test_and_set (&limit.suppressed, 0);
+		limit.count = 0;
+	}
+	if (__sync_add_and_fetch (&limit.count, 1) > MESSAGE_LIMIT_BURST) {
+		__sync_fetch_and_add (&limit.suppressed, 1);
+		__sync_fetch_and_add (&s_nSuppressed, 1);
+		return;
+	}
+	va_list args;
+	va_start (args, format);
+	post (level, suppressed, format, args);
+	va_end (args);
+}
+
+messageStats getMessageStats () {
+	messageStats stats;
+	stats.written = s_nWritten;
+	stats.dropped = s_nDropped;
+	stats.suppressed = s_nSuppressed;
+	return stats;
+}
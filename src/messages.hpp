@@ -0,0 +1,99 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef MESSAGES_HPP_
+#define MESSAGES_HPP_
+
+#include <ctime>
+
+/*
+ * Messages of loggerfs itself (errors, warnings, diagnostics). A message is
+ * formatted straight into a slot of a lock-free ring and written out by a
+ * background thread, so the thread that reports it never waits for the disk
+ * or another thread. While the thread isn't running (on startup, before the
+ * file system is mounted) messages are written to stderr right away.
+ *
+ * The thread writes to stderr if it's a terminal, otherwise (in the
+ * background) to MESSAGE_LOG_FILE. The environment variables LOGGERFS_LOG
+ * and LOGGERFS_LOG_LEVEL (error, warning, info or debug) override the file
+ * and the level.
+ */
+
+enum messageLevel {
+	LEVEL_ERROR = 0,
+	LEVEL_WARNING,
+	LEVEL_INFO,
+	LEVEL_DEBUG
+};
+
+// Where the messages go once loggerfs runs in the background
+#define MESSAGE_LOG_FILE "/var/log/loggerfs.log"
+// Messages that may wait to be written, a power of 2
+#define MESSAGE_SLOTS 1024
+// Longer messages are cut
+#define MESSAGE_MAX_LENGTH 500
+// Milliseconds the thread sleeps when there's nothing to write
+#define MESSAGE_POLL_INTERVAL 100
+// A rate limited message is written at most MESSAGE_LIMIT_BURST times per
+// MESSAGE_LIMIT_WINDOW seconds, the others are counted
+#define MESSAGE_LIMIT_BURST 10
+#define MESSAGE_LIMIT_WINDOW 60
+
+/*
+ * The rate limit of a message, usually a static next to the code that
+ * reports it:
+ *
+ *   static messageLimit limit;
+ *   messageLimited (limit, LEVEL_WARNING, "Lost a batch for %s", ...);
+ */
+struct messageLimit {
+	messageLimit () : window (0), count (0), suppressed (0) {}
+	volatile time_t window; // start of the current window
+	volatile unsigned int count; // messages in the window
+	volatile unsigned int suppressed; // not written in the window
+};
+
+// Counters for .stats
+struct messageStats {
+	unsigned long written;
+	unsigned long dropped; // the ring was full
+	unsigned long suppressed; // over the rate limit
+};
+
+extern volatile int g_nMessageLevel;
+
+// Cheap enough to guard expensive diagnostics
+static inline bool messageEnabled (messageLevel level) {
+	return (int)level <= g_nMessageLevel;
+}
+
+void setupMessages ();
+bool startMessages ();
+void stopMessages ();
+void message (messageLevel, const char *, ...)
+		__attribute__ ((format (printf, 2, 3)));
+void messageLimited (messageLimit &, messageLevel, const char *, ...)
+		__attribute__ ((format (printf, 3, 4)));
+messageStats getMessageStats ();
+
+#endif /*MESSAGES_HPP_*/
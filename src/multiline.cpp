@@ -0,0 +1,239 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "multiline.hpp"
+#include "messages.hpp"
+#include "general.hpp"
+#include "arena.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+/*
+ * Compile the <multiline> rules of a log file. The rules stay disabled if
+ * there are none or a regex is invalid.
+ *
+ * @param info the settings
+ * @param strName the log file
+ */
+void multilineRules::compile (const multilineInfo &info, const string &strName) {
+	enabled = false;
+	hasStart = !info.start.empty ();
+	hasContinuation = !info.continuation.empty ();
+	if (!hasStart && !hasContinuation)
+		return;
+	try {
+		if (hasStart)
+			start.assign (info.start);
+		if (hasContinuation)
+			continuation.assign (info.continuation);
+	}
+	catch (boost::regex_error &e) {
+		message (LEVEL_ERROR, "Invalid multiline regex for %s, parsing its lines one by one: %s",
+				strName.c_str (), e.what ());
+		return;
+	}
+	maxLines = (info.maxLines > 0) ? info.maxLines : 1;
+	timeout = info.timeout * 1000LL;
+	enabled = true;
+}
+
+/*
+ * Decide how a line fits into the records. A line matching the continuation
+ * regex continues the record before it; otherwise a line matching the start
+ * regex starts a record. A line that matches neither continues the record if
+ * there's only a start regex, and is a record of its own if there are both.
+ *
+ * @param first start of the line
+ * @param last end of the line
+ */
+recordLine multilineRules::classify (const char *first, const char *last) const {
+	try {
+		if (hasContinuation && boost::regex_search (first, last, continuation))
+			return RECORD_CONTINUATION;
+		if (hasStart) {
+			if (boost::regex_search (first, last, start))
+				return RECORD_START;
+			return hasContinuation ? RECORD_SINGLE : RECORD_CONTINUATION;
+		}
+	}
+	catch (std::runtime_error &) {
+		// Too complex for the regex engine
+		return RECORD_SINGLE;
+	}
+	return RECORD_START;
+}
+
+/*
+ * Constructor
+ */
+recordAssembler::recordAssembler () : m_pRules (NULL), m_pPos (NULL), m_pEnd (NULL),
+		m_bFlush (false), m_bExpired (false), m_bAdded (false), m_pFirst (NULL), m_pLast (NULL),
+		m_nLines (0), m_bSealed (false), m_bPending (false), m_nLastLine (0) {
+	pthread_mutex_init (&m_lock, NULL);
+}
+
+/*
+ * Destructor
+ */
+recordAssembler::~recordAssembler () {
+	pthread_mutex_destroy (&m_lock);
+}
+
+void recordAssembler::acquire () {
+	pthread_mutex_lock (&m_lock);
+}
+
+void recordAssembler::release () {
+	pthread_mutex_unlock (&m_lock);
+}
+
+/*
+ * Start on a chunk, the records of the previous one are done w/.
+ *
+ * @param rules the rules of the log file
+ * @param buf the lines, NULL to only collect a record that timed out
+ * @param size length of buf
+ * @param bFlush true if the record that's open at the end of the chunk is
+ * complete (i.e. for fsync())
+ */
+void recordAssembler::begin (const multilineRules &rules, const char *buf, size_t size,
+		bool bFlush) {
+	m_pRules = &rules;
+	m_pPos = buf;
+	m_pEnd = buf + size;
+	m_bFlush = bFlush;
+	m_bAdded = false;
+	// The rules may have been removed by a reload
+	m_bExpired = m_bPending && (!rules.enabled || monotonicTime () - m_nLastLine >= rules.timeout);
+}
+
+/*
+ * Check whether the carried record has waited longer than the timeout.
+ *
+ * @param rules the rules of the log file
+ * @param now monotonicTime ()
+ */
+bool recordAssembler::expired (const multilineRules &rules, long long now) const {
+	return m_bPending && (!rules.enabled || now - m_nLastLine >= rules.timeout);
+}
+
+/*
+ * Get the next complete record of the chunk. It stays valid until the chunk
+ * is done (and the thread's arena is reset).
+ *
+ * @param first receives the start of the record
+ * @param last receives the end of its last line
+ * @param lines receives the number of lines in the record
+ * @return false if there are no more complete records
+ */
+bool recordAssembler::next (const char *&first, const char *&last, unsigned int &lines) {
+	// Timed out before the chunk arrived, its lines can't continue it anymore
+	if (m_bExpired) {
+		m_bExpired = false;
+		this->take (first, last, lines);
+		return true;
+	}
+
+	while (m_pPos < m_pEnd) {
+		const char *lineFirst = m_pPos;
+		const char *lineLast = (const char *)memchr (m_pPos, '\n', m_pEnd - m_pPos);
+		if (lineLast == NULL)
+			lineLast = m_pEnd;
+		m_pPos = lineLast + 1;
+
+		// Blank lines don't start or continue anything. The leading
+		// whitespace is what marks many continuation lines, it stays.
+		const char *trimmed = lineFirst;
+		trim (trimmed, lineLast);
+		if (trimmed == lineLast)
+			continue;
+		m_bAdded = true;
+
+		recordLine kind = m_pRules->classify (lineFirst, lineLast);
+		if (m_nLines > 0 && kind == RECORD_CONTINUATION && !m_bSealed) {
+			if (m_pFirst)
+				m_pLast = lineLast;
+			else {
+				m_strCarried += '\n';
+				m_strCarried.append (lineFirst, lineLast);
+			}
+			if (++m_nLines >= m_pRules->maxLines)
+				m_bSealed = true;
+			continue;
+		}
+
+		// The line starts the next record, so the open one is complete
+		if (m_nLines > 0) {
+			this->take (first, last, lines);
+			this->open (lineFirst, lineLast, kind);
+			return true;
+		}
+		this->open (lineFirst, lineLast, kind);
+	}
+
+	if (m_nLines > 0 && (m_bSealed || m_bFlush)) {
+		this->take (first, last, lines);
+		return true;
+	}
+	// The next chunk may continue the open record, the data of this one is gone by then
+	if (m_pFirst) {
+		m_strCarried.assign (m_pFirst, m_pLast);
+		m_pFirst = m_pLast = NULL;
+		m_bPending = true;
+	}
+	if (m_bAdded) {
+		m_nLastLine = monotonicTime ();
+		m_bAdded = false;
+	}
+	return false;
+}
+
+/*
+ * Open a record w/ its first line.
+ */
+void recordAssembler::open (const char *first, const char *last, recordLine kind) {
+	m_pFirst = first;
+	m_pLast = last;
+	m_nLines = 1;
+	m_bSealed = (kind == RECORD_SINGLE || m_pRules->maxLines <= 1);
+}
+
+/*
+ * Hand out the open record. A carried one is copied to the thread's arena, so
+ * the next one can be carried.
+ */
+void recordAssembler::take (const char *&first, const char *&last, unsigned int &lines) {
+	if (m_pFirst) {
+		first = m_pFirst;
+		last = m_pLast;
+		m_pFirst = m_pLast = NULL;
+	}
+	else {
+		first = arena::local ().copy (m_strCarried.data (), m_strCarried.length ());
+		last = first + m_strCarried.length ();
+		m_strCarried.clear ();
+		m_bPending = false;
+	}
+	lines = m_nLines;
+	m_nLines = 0;
+	m_bSealed = false;
+}
@@ -0,0 +1,116 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef MULTILINE_HPP_
+#define MULTILINE_HPP_
+
+#include <string>
+
+#include <pthread.h>
+
+#include "config.hpp"
+#include "schema.hpp" // boost::regex w/ the ceiling on the steps of a match
+
+// How a line continues the record before it
+enum recordLine {
+	RECORD_START = 0, // starts a record
+	RECORD_CONTINUATION, // belongs to the record before it
+	RECORD_SINGLE // a record of its own
+};
+
+/*
+ * The <multiline> rules of a log file, compiled
+ */
+struct multilineRules {
+	multilineRules () : enabled (false), hasStart (false), hasContinuation (false),
+			maxLines (0), timeout (0) {}
+
+	void compile (const multilineInfo &, const std::string &);
+	recordLine classify (const char *, const char *) const;
+
+	bool enabled;
+	bool hasStart;
+	bool hasContinuation;
+	boost::regex start;
+	boost::regex continuation;
+	unsigned int maxLines;
+	long long timeout; // microseconds
+};
+
+/*
+ * recordAssembler
+ * Puts the lines of a log file together into records, one chunk at a time:
+ *
+ *   records.begin (rules, buf, size, false);
+ *   while (records.next (first, last, lines))
+ *       ...
+ *
+ * A record whose lines are all in the chunk is returned where it is, only a
+ * record that's still open at the end of a chunk is copied, since the next
+ * chunk may continue it. It's complete once a line starts the next record,
+ * or once no line has been added for the timeout of the rules.
+ *
+ * The chunks of a log file are processed one at a time, but the records that
+ * timed out are collected by another thread: the owner holds the assembler
+ * between acquire() and release().
+ */
+class recordAssembler {
+	public:
+		recordAssembler ();
+		~recordAssembler ();
+
+		void acquire ();
+		void release ();
+
+		void begin (const multilineRules &, const char *, size_t, bool);
+		bool next (const char *&, const char *&, unsigned int &);
+
+		// Cheap checks w/out the lock, the next chunk may have changed it
+		bool pending () const { return m_bPending; }
+		bool expired (const multilineRules &, long long) const;
+
+	private:
+		void open (const char *, const char *, recordLine);
+		void take (const char *&, const char *&, unsigned int &);
+
+	private:
+		pthread_mutex_t m_lock;
+		const multilineRules *m_pRules;
+		const char *m_pPos; // next line of the chunk
+		const char *m_pEnd;
+		bool m_bFlush; // the chunk completes the open record
+		bool m_bExpired; // the carried record timed out before the chunk
+		bool m_bAdded; // the chunk added lines
+
+		// The open record: in the chunk, or carried over from an earlier one
+		const char *m_pFirst;
+		const char *m_pLast;
+		std::string m_strCarried;
+		unsigned int m_nLines;
+		bool m_bSealed; // no line can be added anymore
+
+		volatile bool m_bPending; // a record is carried
+		volatile long long m_nLastLine; // when a line was added last
+};
+
+#endif /*MULTILINE_HPP_*/
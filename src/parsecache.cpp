@@ -0,0 +1,244 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "parsecache.hpp"
+#include "arena.hpp"
+
+#include <cstring>
+
+using namespace std;
+
+/*
+ * Constructor
+ */
+parseCache::parseCache () : m_nGeneration (0), m_nCapacity (0), m_nSize (0),
+		m_pNewest (NULL), m_pOldest (NULL) {
+	pthread_mutex_init (&m_lock, NULL);
+}
+
+/*
+ * Destructor
+ */
+parseCache::~parseCache () {
+	this->clear ();
+	pthread_mutex_destroy (&m_lock);
+}
+
+/*
+ * Lock the cache. Results of an earlier reload are thrown away: the pipeline
+ * they were parsed w/ is gone, even if a new one got its address.
+ *
+ * @param generation the reload that installed the pipeline the lines are parsed w/
+ * @param capacity number of lines to keep
+ */
+void parseCache::acquire (unsigned long generation, size_t capacity) {
+	pthread_mutex_lock (&m_lock);
+	if (generation == m_nGeneration && capacity == m_nCapacity)
+		return;
+
+	this->clear ();
+	m_nGeneration = generation;
+	m_nCapacity = capacity;
+	size_t nBuckets = 16;
+	while (nBuckets < capacity)
+		nBuckets <<= 1;
+	m_vBuckets.assign (nBuckets, (cachedLine *)NULL);
+}
+
+void parseCache::release () {
+	pthread_mutex_unlock (&m_lock);
+}
+
+void parseCache::clear () {
+	cachedLine *older;
+	for (cachedLine *line = m_pNewest; line; line = older) {
+		older = line->older;
+		delete line;
+	}
+	m_pNewest = m_pOldest = NULL;
+	m_nSize = 0;
+	m_vBuckets.clear ();
+}
+
+/*
+ * Look up a line, which becomes the most recently used one.
+ *
+ * @param first start of the line
+ * @param last end of the line
+ * @param hash hashBytes () of the line
+ * @return the cached line, NULL if it isn't cached
+ */
+const cachedLine *parseCache::find (const char *first, const char *last, unsigned long hash) {
+	if (m_vBuckets.empty ())
+		return NULL;
+	size_t length = last - first;
+	for (cachedLine *line = m_vBuckets[hash & (m_vBuckets.size () - 1)]; line; line = line->next)
+		if (line->hash == hash && line->length == length
+				&& memcmp (line->data.data (), first, length) == 0) {
+			if (line != m_pNewest) {
+				this->unlink (line);
+				this->pushFront (line);
+			}
+			return line;
+		}
+	return NULL;
+}
+
+/*
+ * Add a line w/out results, replacing the least recently used one if the
+ * cache is full. The results are added w/ store ().
+ *
+ * @param first start of the line
+ * @param last end of the line
+ * @param hash hashBytes () of the line
+ * @return the new entry, NULL if the line isn't cached
+ */
+cachedLine *parseCache::add (const char *first, const char *last, unsigned long hash) {
+	if (m_nCapacity == 0 || last - first > PARSE_CACHE_MAX_LINE)
+		return NULL;
+
+	cachedLine *line;
+	if (m_nSize < m_nCapacity) {
+		line = new cachedLine;
+		m_nSize++;
+	}
+	// Reuse the oldest one, w/ its memory
+	else {
+		line = m_pOldest;
+		this->unlink (line);
+		this->unbucket (line);
+	}
+
+	line->hash = hash;
+	line->length = last - first;
+	line->data.assign (first, last);
+	line->results.clear ();
+	cachedLine *&bucket = m_vBuckets[hash & (m_vBuckets.size () - 1)];
+	line->next = bucket;
+	bucket = line;
+	this->pushFront (line);
+	return line;
+}
+
+/*
+ * Add the captures of a schema the line matched.
+ *
+ * @param line from add ()
+ * @param schema index of the schema in the pipeline
+ * @param matches the captures, matches[0] is the line
+ */
+void parseCache::store (cachedLine *line, unsigned int schema, const lineMatch &matches) {
+	const char *first = matches[0].first;
+	line->results.push_back (schema);
+	line->results.push_back (matches.size () - 1);
+	for (size_t i = 1; i < matches.size (); i++) {
+		if (!matches[i].matched) {
+			line->results.push_back (PARSE_CACHE_UNMATCHED);
+			line->results.push_back (PARSE_CACHE_UNMATCHED);
+			continue;
+		}
+		size_t length = matches[i].second - matches[i].first;
+		size_t offset;
+		if (matches[i].first >= first && matches[i].second <= first + line->length)
+			offset = matches[i].first - first;
+		else {
+			offset = line->data.length ();
+			line->data.append (matches[i].first, length);
+		}
+		line->results.push_back (offset);
+		line->results.push_back (offset + length);
+	}
+}
+
+/*
+ * Remove a line, i.e. one whose results are incomplete.
+ */
+void parseCache::discard (cachedLine *line) {
+	this->unlink (line);
+	this->unbucket (line);
+	delete line;
+	m_nSize--;
+}
+
+/*
+ * Get the captures of a schema the line matched. They point into the cache,
+ * so they're valid until the cache is released.
+ *
+ * @param line from find ()
+ * @param pos position in the results, 0 for the first schema
+ * @param schema receives the index of the schema
+ * @param matches receives the captures
+ * @return position of the next schema, line->results.size () after the last
+ */
+size_t parseCache::restore (const cachedLine *line, size_t pos, unsigned int &schema,
+		lineMatch &matches) const {
+	const char *data = line->data.data ();
+	schema = line->results[pos];
+	size_t n = line->results[pos + 1];
+	pos += 2;
+
+	fieldValue *values = (fieldValue *)arena::local ().allocate (n * sizeof (fieldValue));
+	for (size_t i = 0; i < n; i++, pos += 2) {
+		if (line->results[pos] == PARSE_CACHE_UNMATCHED)
+			values[i].first = values[i].last = NULL;
+		else {
+			values[i].first = data + line->results[pos];
+			values[i].last = data + line->results[pos + 1];
+		}
+	}
+	fillMatch (matches, data, data + line->length, values, n);
+	return pos;
+}
+
+/*
+ * Take a line out of the LRU list.
+ */
+void parseCache::unlink (cachedLine *line) {
+	if (line->newer)
+		line->newer->older = line->older;
+	else
+		m_pNewest = line->older;
+	if (line->older)
+		line->older->newer = line->newer;
+	else
+		m_pOldest = line->newer;
+}
+
+/*
+ * Take a line out of its hash bucket.
+ */
+void parseCache::unbucket (cachedLine *line) {
+	cachedLine **bucket = &m_vBuckets[line->hash & (m_vBuckets.size () - 1)];
+	while (*bucket != line)
+		bucket = &(*bucket)->next;
+	*bucket = line->next;
+}
+
+/*
+ * Make a line the most recently used one.
+ */
+void parseCache::pushFront (cachedLine *line) {
+	line->newer = NULL;
+	line->older = m_pNewest;
+	if (m_pNewest)
+		m_pNewest->newer = line;
+	m_pNewest = line;
+	if (m_pOldest == NULL)
+		m_pOldest = line;
+}
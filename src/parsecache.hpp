@@ -0,0 +1,95 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef PARSECACHE_HPP_
+#define PARSECACHE_HPP_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "schema.hpp"
+
+// Lines longer than this aren't cached
+#define PARSE_CACHE_MAX_LINE 2048
+
+/*
+ * A line and its parse results: the schemas it matched and where their
+ * captures are. Captures that aren't part of the line (i.e. unescaped JSON
+ * strings) are stored after it.
+ */
+struct cachedLine {
+	unsigned long hash;
+	size_t length; // of the line at the start of data
+	std::string data;
+	// Per matched schema: its index, the number of captures and their
+	// first/last offsets in data (PARSE_CACHE_UNMATCHED if the capture didn't match)
+	std::vector<unsigned int> results;
+	cachedLine *next; // in the bucket
+	cachedLine *newer;
+	cachedLine *older;
+};
+
+#define PARSE_CACHE_UNMATCHED ((unsigned int)-1)
+
+/*
+ * parseCache
+ * Bounded LRU cache of the parse results of a log file's lines, so a line
+ * that's repeated (cron, "connection refused", ...) only goes through the
+ * schemas once. Lines are looked up by a hash and compared byte by byte. The
+ * results belong to the pipelines of one reload, the next reload starts over. A log file's chunks
+ * are processed by one worker at a time, so the lock is held per chunk.
+ */
+class parseCache {
+	public:
+		parseCache ();
+		~parseCache ();
+
+		// Lock the cache for the lines of a reload, emptied if it changed
+		void acquire (unsigned long, size_t);
+		void release ();
+
+		const cachedLine *find (const char *, const char *, unsigned long);
+		cachedLine *add (const char *, const char *, unsigned long);
+		void store (cachedLine *, unsigned int, const lineMatch &);
+		void discard (cachedLine *);
+		size_t restore (const cachedLine *, size_t, unsigned int &, lineMatch &) const;
+
+	private:
+		void clear ();
+		void unlink (cachedLine *);
+		void unbucket (cachedLine *);
+		void pushFront (cachedLine *);
+
+	private:
+		pthread_mutex_t m_lock;
+		unsigned long m_nGeneration; // the reload of the results, 0 if none
+		size_t m_nCapacity;
+		size_t m_nSize;
+		std::vector<cachedLine *> m_vBuckets;
+		cachedLine *m_pNewest;
+		cachedLine *m_pOldest;
+};
+
+#endif /*PARSECACHE_HPP_*/
@@ -0,0 +1,408 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "pathtable.hpp"
+#include "parsecache.hpp"
+#include "messages.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+/*
+ * Constructor
+ */
+pathTable::pathTable () : m_vBuckets (64, (entry *)NULL), m_nNextInode (FIRST_NODE_INODE) {
+	pathNode *root = this->insert ("", true, false);
+	root->inode = ROOT_INODE;
+	root->live = true;
+}
+
+/*
+ * Destructor
+ */
+pathTable::~pathTable () {
+	entry *next;
+	for (size_t i = 0; i < m_vBuckets.size (); i++)
+		for (entry *e = m_vBuckets[i]; e; e = next) {
+			next = e->next;
+			delete e;
+		}
+
+	// Log files of a wildcard location share its pipeline
+	map<pipeline *, bool> mPipelines;
+	for (size_t i = 0; i < m_vNodes.size (); i++) {
+		if (m_vNodes[i]->file.current)
+			mPipelines[m_vNodes[i]->file.current] = true;
+		delete m_vNodes[i]->file.cache;
+		delete m_vNodes[i]->file.records;
+		delete m_vNodes[i];
+	}
+	for (size_t i = 0; i < m_vTemplates.size (); i++)
+		if (m_vTemplates[i].current)
+			mPipelines[m_vTemplates[i].current] = true;
+	for (map<pipeline *, bool>::iterator iter = mPipelines.begin ();
+			iter != mPipelines.end (); iter++)
+		delete iter->first;
+}
+
+/*
+ * Look up a directory or log file.
+ *
+ * @param path path relative to the mount point (w/out leading '/')
+ * @return the node, NULL if it doesn't exist (yet)
+ */
+pathNode *pathTable::find (const char *path) const {
+	unsigned long hash = hashString (path);
+
+	for (entry *e = m_vBuckets[hash & (m_vBuckets.size () - 1)]; e; e = e->next)
+		if (e->hash == hash && e->node->name == path)
+			return e->node;
+
+	return NULL;
+}
+
+/*
+ * Check if a path matches a wildcard location, i.e. if resolve() would add it.
+ *
+ * @param path path relative to the mount point
+ * @return true if it matches, false otherwise
+ */
+bool pathTable::resolvable (const char *path) const {
+	return this->matchTemplates (path, NULL, NULL) != MATCH_NONE;
+}
+
+/*
+ * Add a path that matches a wildcard location, i.e. because it's written to.
+ * Every location adds at most <max-paths> log files. The caller must hold the
+ * write lock.
+ *
+ * @param path path relative to the mount point
+ * @return the live node, NULL if the path doesn't exist or the location is full
+ */
+pathNode *pathTable::resolve (const char *path) {
+	pathNode *node = this->find (path);
+	if (node && node->live)
+		return node;
+
+	const pathTemplate *tpl = NULL;
+	vector<string> vValues;
+	int type = this->matchTemplates (path, &tpl, &vValues);
+	if (type == MATCH_NONE)
+		return NULL;
+	if (node && node->directory != (type == MATCH_DIRECTORY))
+		return NULL;
+
+	if (type == MATCH_FILE && node == NULL) {
+		int &paths = m_mPaths[tpl->location];
+		int maxPaths = tpl->current->info.maxPaths;
+		if (maxPaths > 0 && paths >= maxPaths) {
+			static messageLimit limit;
+			messageLimited (limit, LEVEL_WARNING, "%s already has %d log files (max-paths), not adding %s",
+					tpl->location.c_str (), paths, path);
+			return NULL;
+		}
+		paths++;
+	}
+
+	node = this->insert (path, type == MATCH_DIRECTORY, true);
+	if (type == MATCH_FILE) {
+		node->file.location = tpl->location;
+		node->file.wildcards = vValues;
+		node->file.current = tpl->current;
+	}
+
+	// The directories leading to it are part of the template as well
+	for (pathNode *parent = node; parent; ) {
+		parent->live = true;
+		string::size_type pos = parent->name.rfind ('/');
+		if (parent->name.empty ())
+			break;
+		parent = this->find (pos == string::npos ? "" : parent->name.substr (0, pos).c_str ());
+	}
+
+	return node;
+}
+
+/*
+ * Inode of a path of a wildcard location, the same whether or not it has a
+ * node.
+ *
+ * @param path path relative to the mount point
+ */
+ino_t pathTable::wildcardInode (const char *path) {
+	return WILDCARD_INODE_BIT | (hashString (path) & (QUERY_INODE_BIT - 1));
+}
+
+/*
+ * Remove a log file added by resolve (), along w/ the directories that were
+ * added for it and lead to nothing else now. The caller must hold the write
+ * lock and make sure nothing refers to the log file anymore.
+ *
+ * @param node the log file
+ */
+void pathTable::evict (pathNode *node) {
+	if (!node->wildcard || node->directory)
+		return;
+	map<string, int>::iterator paths = m_mPaths.find (node->file.location);
+	if (paths != m_mPaths.end () && --paths->second <= 0)
+		m_mPaths.erase (paths);
+
+	while (node && node->wildcard && (!node->directory || node->children.empty ())) {
+		string::size_type pos = node->name.rfind ('/');
+		pathNode *parent = this->find (pos == string::npos ? "" : node->name.substr (0, pos).c_str ());
+		this->remove (node);
+		node = parent;
+	}
+}
+
+/*
+ * Start using a new set of pipelines. Log files that are no longer configured
+ * stay in the table, but aren't live anymore.
+ *
+ * @param mPipelines the new pipelines, keyed by <location>
+ * @param vRetired receives the pipelines that were replaced
+ * @param vChanged receives the paths of all log files that were live
+ */
+void pathTable::install (map<string, pipeline *> &mPipelines,
+		vector<pipeline *> &vRetired, vector<string> &vChanged) {
+	map<pipeline *, bool> mRetired;
+
+	for (size_t i = 0; i < m_vNodes.size (); i++) {
+		pathNode *node = m_vNodes[i];
+		if (node->file.current) {
+			mRetired[node->file.current] = true;
+			vChanged.push_back (node->name);
+		}
+		node->file.current = NULL;
+		node->live = node->inode == ROOT_INODE;
+	}
+	for (size_t i = 0; i < m_vTemplates.size (); i++)
+		if (m_vTemplates[i].current)
+			mRetired[m_vTemplates[i].current] = true;
+	m_vTemplates.clear ();
+
+	// Static locations get their nodes right away, wildcard ones on first lookup
+	for (map<string, pipeline *>::iterator iter = mPipelines.begin ();
+			iter != mPipelines.end (); iter++) {
+		pathTemplate tpl;
+		tpl.location = iter->first;
+		tpl.current = iter->second;
+		split (iter->first, '/', &tpl.segments);
+		if (std::find (tpl.segments.begin (), tpl.segments.end (), "*") != tpl.segments.end ())
+			m_vTemplates.push_back (tpl);
+		else {
+			pathNode *node = this->insert (iter->first, false, false);
+			if (!node->directory)
+				node->file.location = iter->first;
+		}
+	}
+
+	// Reattach the log files (including wildcard instances) to their pipelines
+	for (size_t i = 0; i < m_vNodes.size (); i++) {
+		pathNode *node = m_vNodes[i];
+		if (node->directory)
+			continue;
+		map<string, pipeline *>::iterator p = mPipelines.find (node->file.location);
+		if (p == mPipelines.end ())
+			continue;
+		if (!node->file.wildcards.empty () && this->matchTemplates (node->name,
+				NULL, NULL) != MATCH_FILE)
+			continue;
+		node->file.current = p->second;
+		node->live = true;
+	}
+
+	// A directory is live if it leads to a live log file or a wildcard location.
+	// Children are always added after their parents.
+	for (size_t i = m_vNodes.size (); i > 0; i--) {
+		pathNode *node = m_vNodes[i - 1];
+		if (!node->directory || node->live)
+			continue;
+		node->live = this->matchTemplates (node->name, NULL, NULL) == MATCH_DIRECTORY;
+		for (size_t j = 0; j < node->children.size () && !node->live; j++)
+			node->live = node->children[j]->live;
+	}
+
+	// Log files a location has added, a configured location may have taken one over
+	m_mPaths.clear ();
+	for (size_t i = 0; i < m_vNodes.size (); i++)
+		if (m_vNodes[i]->wildcard && !m_vNodes[i]->directory)
+			m_mPaths[m_vNodes[i]->file.location]++;
+
+	for (map<pipeline *, bool>::iterator iter = mRetired.begin ();
+			iter != mRetired.end (); iter++)
+		vRetired.push_back (iter->first);
+}
+
+/*
+ * Add a node and all directories leading to it.
+ *
+ * @param strPath path relative to the mount point
+ * @param bDirectory whether the node is a directory
+ * @param bWildcard the node is added for a wildcard location
+ * @return the new or already existing node
+ */
+pathNode *pathTable::insert (const string &strPath, bool bDirectory, bool bWildcard) {
+	pathNode *node = this->find (strPath.c_str ());
+	if (node) {
+		// Configured locations stay, and so do the directories leading to them
+		if (!bWildcard)
+			node->wildcard = false;
+		return node;
+	}
+
+	pathNode *parent = NULL;
+	if (!strPath.empty ()) {
+		string::size_type pos = strPath.rfind ('/');
+		parent = this->insert (pos == string::npos ? "" : strPath.substr (0, pos), true, bWildcard);
+	}
+
+	node = new pathNode;
+	node->name = strPath;
+	node->inode = bWildcard ? pathTable::wildcardInode (strPath.c_str ()) : m_nNextInode++;
+	node->directory = bDirectory;
+	node->live = false;
+	node->wildcard = bWildcard;
+	node->file.current = NULL;
+	node->file.users = 0;
+	node->file.used = time (NULL);
+	node->file.stats.lines = node->file.stats.matched = node->file.stats.overflow = 0;
+	node->file.stats.queued = node->file.stats.limited = 0;
+	node->file.stats.cached = node->file.stats.repeated = node->file.stats.joined = 0;
+	node->file.cache = NULL;
+	node->file.records = NULL;
+	m_vNodes.push_back (node);
+	if (parent)
+		parent->children.push_back (node);
+
+	entry *e = new entry;
+	e->hash = hashString (strPath.c_str ());
+	e->node = node;
+	entry *&bucket = m_vBuckets[e->hash & (m_vBuckets.size () - 1)];
+	e->next = bucket;
+	bucket = e;
+
+	// Keep the chains short
+	if (m_vNodes.size () > m_vBuckets.size ())
+		this->grow ();
+
+	return node;
+}
+
+/*
+ * Delete a node that has no children.
+ */
+void pathTable::remove (pathNode *node) {
+	for (entry **e = &m_vBuckets[hashString (node->name.c_str ()) & (m_vBuckets.size () - 1)];
+			*e; e = &(*e)->next)
+		if ((*e)->node == node) {
+			entry *next = (*e)->next;
+			delete *e;
+			*e = next;
+			break;
+		}
+
+	string::size_type pos = node->name.rfind ('/');
+	pathNode *parent = this->find (pos == string::npos ? "" : node->name.substr (0, pos).c_str ());
+	if (parent)
+		parent->children.erase (std::find (parent->children.begin (), parent->children.end (), node));
+	m_vNodes.erase (std::find (m_vNodes.begin (), m_vNodes.end (), node));
+
+	delete node->file.cache;
+	delete node->file.records;
+	delete node;
+}
+
+/*
+ * Match path segments against a wildcard location.
+ *
+ * @param vSegments the segments of the path
+ * @param tpl the location, may be longer than the path
+ * @param vValues receives the segments that matched a wildcard (optional)
+ * @return true if the path matches the location or a leading part of it
+ */
+bool pathTable::match (const vector<string> &vSegments, const pathTemplate &tpl,
+		vector<string> *vValues) const {
+	if (vSegments.size () > tpl.segments.size ())
+		return false;
+
+	for (size_t i = 0; i < vSegments.size (); i++) {
+		if (tpl.segments[i] == "*") {
+			if (vValues)
+				vValues->push_back (vSegments[i]);
+		}
+		else if (tpl.segments[i] != vSegments[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Match a path against all wildcard locations.
+ *
+ * @param strPath path relative to the mount point
+ * @param tpl receives the matching location (optional)
+ * @param vValues receives the segments that matched a wildcard (optional)
+ * @return MATCH_FILE, MATCH_DIRECTORY or MATCH_NONE
+ */
+int pathTable::matchTemplates (const string &strPath, const pathTemplate **tpl,
+		vector<string> *vValues) const {
+	if (m_vTemplates.empty () || strPath.empty ())
+		return MATCH_NONE;
+
+	vector<string> vSegments;
+	split (strPath, '/', &vSegments);
+
+	int result = MATCH_NONE;
+	for (size_t i = 0; i < m_vTemplates.size (); i++) {
+		vector<string> vTmp;
+		if (!this->match (vSegments, m_vTemplates[i], &vTmp))
+			continue;
+		if (vSegments.size () < m_vTemplates[i].segments.size ()) {
+			result = MATCH_DIRECTORY;
+			continue;
+		}
+		if (tpl)
+			*tpl = &m_vTemplates[i];
+		if (vValues)
+			*vValues = vTmp;
+		return MATCH_FILE;
+	}
+
+	return result;
+}
+
+/*
+ * Double the number of buckets.
+ */
+void pathTable::grow () {
+	vector<entry *> vBuckets (m_vBuckets.size () * 2, (entry *)NULL);
+	entry *next;
+
+	for (size_t i = 0; i < m_vBuckets.size (); i++)
+		for (entry *e = m_vBuckets[i]; e; e = next) {
+			next = e->next;
+			entry *&bucket = vBuckets[e->hash & (vBuckets.size () - 1)];
+			e->next = bucket;
+			bucket = e;
+		}
+
+	m_vBuckets.swap (vBuckets);
+}
@@ -0,0 +1,127 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef PATHTABLE_HPP_
+#define PATHTABLE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "pipeline.hpp"
+
+// Inode numbers of the special files, everything else is numbered from FIRST_NODE_INODE
+#define ROOT_INODE 1
+#define REFRESH_INODE 2
+#define STATS_INODE 3
+#define FIRST_NODE_INODE 16
+// The <location>.query file of a log file has the inode of the log file w/ this bit set
+#define QUERY_INODE_BIT ((ino_t)1 << 48)
+// Paths of wildcard locations are numbered by the hash of the path w/ this bit
+// set, so they keep their inode when they're evicted and added again
+#define WILDCARD_INODE_BIT ((ino_t)1 << 49)
+// Seconds a wildcard log file has to be unused before it's evicted
+#define PATH_IDLE_TIMEOUT 600
+// Seconds between two checks for idle wildcard log files
+#define PATH_EVICT_INTERVAL 60
+
+// Results of pathTable::matchTemplates
+#define MATCH_NONE 0
+#define MATCH_DIRECTORY 1
+#define MATCH_FILE 2
+
+/*
+ * A directory or log file in the mount point
+ */
+struct pathNode {
+	std::string name; // path relative to the mount point, "" for the root
+	ino_t inode;
+	bool directory;
+	bool live; // still part of the configuration
+	bool wildcard; // added for a wildcard location, evicted once it's idle
+	std::vector<pathNode *> children; // directories only
+	logFile file; // log files only
+};
+
+/*
+ * A <location> w/ wildcards, i.e. "hosts/ * /access.log"
+ */
+struct pathTemplate {
+	std::string location;
+	std::vector<std::string> segments;
+	pipeline *current;
+};
+
+/*
+ * pathTable
+ * Hash table of all directories and log files in the mount point, looked up by
+ * the C string path FUSE hands us (w/out building a std::string). Paths that
+ * match a wildcard location are only added when they're written to, share the
+ * pipeline of the location and are removed again once they're idle; until
+ * then they exist w/out a node (see matchTemplates ()). Configured locations
+ * are never removed, so inode numbers are stable for the lifetime of the
+ * mount.
+ */
+class pathTable {
+	public:
+		pathTable ();
+		~pathTable ();
+
+		pathNode *find (const char *) const;
+		bool resolvable (const char *) const;
+		pathNode *resolve (const char *);
+		int matchTemplates (const std::string &, const pathTemplate **,
+				std::vector<std::string> *) const;
+		static ino_t wildcardInode (const char *);
+		// Remove a node added by resolve (), and the directories that only led to it
+		void evict (pathNode *);
+
+		void install (std::map<std::string, pipeline *> &, std::vector<pipeline *> &,
+				std::vector<std::string> &);
+
+		// Nodes in the order they were added
+		size_t size () const { return m_vNodes.size (); }
+		pathNode *at (size_t i) const { return m_vNodes[i]; }
+
+	private:
+		struct entry {
+			unsigned long hash;
+			pathNode *node;
+			entry *next;
+		};
+
+		pathNode *insert (const std::string &, bool, bool);
+		void remove (pathNode *);
+		bool match (const std::vector<std::string> &, const pathTemplate &,
+				std::vector<std::string> *) const;
+		void grow ();
+
+	private:
+		std::vector<entry *> m_vBuckets;
+		std::vector<pathNode *> m_vNodes;
+		std::vector<pathTemplate> m_vTemplates;
+		ino_t m_nNextInode; // of a configured location
+		std::map<std::string, int> m_mPaths; // log files added per wildcard location
+};
+
+#endif /*PATHTABLE_HPP_*/
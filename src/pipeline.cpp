@@ -0,0 +1,189 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "pipeline.hpp"
+#include "messages.hpp"
+
+#include <set>
+
+using namespace std;
+
+/*
+ * Constructor
+ */
+pipeline::pipeline (const string &strName, const logInfo &logConfig)
+		: name (strName), info (logConfig), generation (0) {
+	// compile() resolves the schemas and connects the sinks
+}
+
+/*
+ * Destructor
+ */
+pipeline::~pipeline () {
+	// Don't lose the rows that are still pending, stop all sinks before the
+	// first is deleted so they finish in parallel
+	for (vector<sink *>::iterator iter = sinks.begin (); iter != sinks.end (); iter++)
+		(*iter)->flush ();
+	for (vector<sink *>::iterator iter = sinks.begin (); iter != sinks.end (); iter++) {
+		(*iter)->stop ();
+		delete *iter;
+	}
+	for (map<string, dictionary *>::iterator iter = dictionaries.begin ();
+			iter != dictionaries.end (); iter++)
+		delete iter->second;
+}
+
+/*
+ * Connect the sinks, resolve the schemas of the log file and precompute the
+ * INSERT statements. A destination whose database is down is retried in the
+ * background, one whose table can't be created is left out.
+ *
+ * @param mSchemas all schemas from schemas.xml
+ * @return true on success, false otherwise
+ */
+bool pipeline::compile (map<string, logFormat> &mSchemas) {
+	map<string, int> mColumns;
+	multiline.compile (info.multiline, name);
+
+	// Connect to the databases, the statements depend on their software
+	for (vector<destinationInfo>::iterator d = info.destinations.begin ();
+			d != info.destinations.end (); d++) {
+		sink *out = sink::create (*d);
+		if (out == NULL)
+			message (LEVEL_ERROR, "Unsupported database software %s for %s", d->software.c_str (),
+					name.c_str ());
+		else {
+			if (!out->connect ())
+				out->disconnected ();
+			sinks.push_back (out);
+		}
+	}
+
+	// A column of the table is encoded if any of the schemas asks for it
+	vector<string> vDictionaries;
+	for (vector<string>::iterator s = info.schemas.begin ();
+			s != info.schemas.end (); s++) {
+		map<string, logFormat>::iterator format = mSchemas.find (*s);
+		if (format == mSchemas.end ())
+			continue;
+		for (vector<string>::iterator c = format->second.dictionary.begin ();
+				c != format->second.dictionary.end (); c++) {
+			if (*c == info.eventTime)
+				message (LEVEL_WARNING, "The event time %s of %s can't be a dictionary column",
+						c->c_str (), name.c_str ());
+			else if (dictionaries.find (*c) == dictionaries.end ()) {
+				dictionary *values = new dictionary (*c);
+				for (vector<sink *>::iterator out = sinks.begin (); out != sinks.end (); out++)
+					values->insertPrefix.push_back ((*out)->dictionaryPrefix (*c));
+				dictionaries[*c] = values;
+				vDictionaries.push_back (*c);
+			}
+		}
+	}
+
+	for (vector<string>::iterator s = info.schemas.begin ();
+			s != info.schemas.end (); s++) {
+		// Skip the entry if the schema isn't defined
+		map<string, logFormat>::iterator format = mSchemas.find (*s);
+		if (format == mSchemas.end ()) {
+			message (LEVEL_WARNING, "Schema doesn't exist: %s", s->c_str ());
+			continue;
+		}
+
+		compiledSchema compiled;
+		compiled.format = format->second;
+		compiled.eventTime = 0;
+		compiled.shardKey = 0;
+		vector<string> vInsertColumns (format->second.columns);
+		for (vector<string>::iterator c = format->second.columns.begin ();
+				c != format->second.columns.end (); c++) {
+			mColumns[*c] = 1;
+			if (*c == info.eventTime)
+				compiled.eventTime = c - format->second.columns.begin () + 1;
+			if (*c == info.shardKey)
+				compiled.shardKey = c - format->second.columns.begin () + 1;
+			map<string, dictionary *>::iterator values = dictionaries.find (*c);
+			if (values != dictionaries.end ()) {
+				encodedColumn encoded;
+				encoded.capture = c - format->second.columns.begin () + 1;
+				encoded.values = values->second;
+				compiled.encoded.push_back (encoded);
+			}
+		}
+		// The event time is stored a second time, in the timestamp column
+		if (compiled.eventTime > 0)
+			vInsertColumns.push_back ("timestamp");
+		else if (!info.eventTime.empty ())
+			message (LEVEL_WARNING, "Schema %s has no column %s, using the ingest time for %s",
+					s->c_str (), info.eventTime.c_str (), name.c_str ());
+		if (compiled.shardKey == 0 && !info.shardKey.empty ())
+			message (LEVEL_WARNING, "Schema %s has no column %s, its rows go to the shards of %s in turn",
+					s->c_str (), info.shardKey.c_str (), name.c_str ());
+		// Values of the wildcard segments of the location come last
+		for (vector<string>::iterator c = info.wildcardColumns.begin ();
+				c != info.wildcardColumns.end (); c++) {
+			vInsertColumns.push_back (*c);
+			mColumns[*c] = 1;
+		}
+		// Number of identical lines the row stands for
+		if (!info.repeatColumn.empty ()) {
+			vInsertColumns.push_back (info.repeatColumn);
+			mColumns[info.repeatColumn] = 1;
+		}
+		for (vector<sink *>::iterator out = sinks.begin (); out != sinks.end (); out++)
+			compiled.insertPrefix.push_back ((*out)->insertPrefix (vInsertColumns));
+		schemas.push_back (compiled);
+	}
+
+	for (map<string, int>::iterator c = mColumns.begin (); c != mColumns.end (); c++)
+		columns.push_back (c->first);
+
+	for (vector<sink *>::iterator out = sinks.begin (); out != sinks.end (); ) {
+		// Create the table if it doesn't already exist
+		if (!(*out)->prepare (columns, vDictionaries)) {
+			message (LEVEL_ERROR, "Couldn't create the table %s, please check the permissions",
+					(*out)->name ().c_str ());
+
+			delete *out;
+			out = sinks.erase (out);
+			for (vector<compiledSchema>::iterator s = schemas.begin (); s != schemas.end (); s++)
+				s->insertPrefix.erase (s->insertPrefix.begin () + (out - sinks.begin ()));
+			for (map<string, dictionary *>::iterator d = dictionaries.begin (); d != dictionaries.end (); d++)
+				d->second->insertPrefix.erase (d->second->insertPrefix.begin () + (out - sinks.begin ()));
+			continue;
+		}
+		out++;
+	}
+
+	// The ring only has the shards whose table is there, the keys of a
+	// missing one go to its neighbours
+	set<string> names;
+	for (size_t i = 0; i < sinks.size (); i++) {
+		const destinationInfo &d = sinks[i]->destination ();
+		sharded.push_back (!d.shard.empty ());
+		if (d.shard.empty ())
+			continue;
+		if (!names.insert (d.shard).second)
+			message (LEVEL_WARNING, "The shard name %s is used twice for %s, use a name per shard",
+					d.shard.c_str (), name.c_str ());
+		shards.add (i, d.shard, d.shardWeight);
+	}
+
+	return !sinks.empty ();
+}
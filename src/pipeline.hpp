@@ -0,0 +1,110 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "config.hpp"
+#include "schema.hpp"
+#include "sink.hpp"
+#include "dictionary.hpp"
+#include "multiline.hpp"
+#include "shard.hpp"
+
+class parseCache;
+
+// Per-log counters, shown in the .stats file
+struct logStats {
+	unsigned long lines;
+	unsigned long matched;
+	unsigned long overflow; // lines that exceeded the regex matching budget
+	unsigned long queued; // bytes waiting for an ingest worker
+	unsigned long limited; // lines dropped by the rate limit
+	unsigned long cached; // lines whose parse results came from the cache
+	unsigned long repeated; // lines counted in the row of an identical line
+	unsigned long joined; // lines parsed as part of the multi-line record before them
+};
+
+// A capture that's stored as the id of its value
+struct encodedColumn {
+	unsigned int capture;
+	dictionary *values;
+};
+
+// A schema resolved for a specific log file
+struct compiledSchema {
+	logFormat format;
+	std::vector<std::string> insertPrefix; // per sink: statement the rows are appended to, see sink::insertPrefix ()
+	int eventTime; // capture group w/ the time of the row, 0 for the ingest time
+	std::vector<encodedColumn> encoded;
+	int shardKey; // capture w/ the key of the row's shard, 0 for round robin
+};
+
+/*
+ * pipeline
+ * Everything write() needs to ingest lines into a log file, resolved once
+ * when the configuration is loaded. A line is parsed once and its rows go to
+ * every destination.
+ */
+class pipeline {
+	public:
+		pipeline (const std::string &, const logInfo &);
+		~pipeline ();
+
+		bool compile (std::map<std::string, logFormat> &);
+
+	public:
+		std::string name;
+		logInfo info;
+		std::vector<compiledSchema> schemas;
+		std::vector<std::string> columns; // all columns of the table, sorted
+		std::vector<sink *> sinks; // one per destination
+		std::map<std::string, dictionary *> dictionaries; // by column
+		multilineRules multiline;
+		shardRing shards;
+		std::vector<bool> sharded; // per sink: only gets the rows of its shard
+		unsigned long generation; // the reload that installed it, starts at 1
+};
+
+/*
+ * A log file in the mount point. Open file handles point to it directly, a
+ * reload only swaps the pipeline. It isn't deleted while it's in use, so the
+ * handles stay valid even if the log file is removed from the configuration
+ * (current == NULL); only idle log files of wildcard locations are.
+ */
+struct logFile {
+	std::string location; // <location> of the pipeline
+	std::vector<std::string> wildcards; // path segments matched by '*' in the location
+	pipeline *current;
+	unsigned int users; // open handles and sources handing it lines, atomic
+	time_t used; // when the last user was done w/ it
+	logStats stats;
+	parseCache *cache; // created on first use if the pipeline has a <parse-cache>
+	recordAssembler *records; // created on first use if the pipeline has <multiline> rules
+};
+
+#endif /*PIPELINE_HPP_*/
@@ -0,0 +1,537 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "query.hpp"
+#include "general.hpp"
+#include "messages.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+
+using namespace std;
+
+/*
+ * Check if a value of a from/ to condition looks like a time, i.e.
+ * 2026-10-18 06:00:00; parsing it is left to the database.
+ */
+static bool isTime (const string &strTime) {
+	return !strTime.empty () && isdigit (strTime[0])
+			&& strTime.find_first_not_of ("0123456789-:. T+Z") == string::npos;
+}
+
+/*
+ * Parse the filter of a .query file. Empty lines and lines starting w/ '#'
+ * are skipped, the conditions are combined w/ AND.
+ *
+ * @param strFilter the text written to the file
+ * @param vColumns the columns of the log's table, sorted
+ * @param filter receives the conditions
+ * @param strError receives the reason if the filter is invalid
+ * @return true on success, false otherwise
+ */
+bool parseQueryFilter (const string &strFilter, const vector<string> &vColumns,
+		queryFilter &filter, string &strError) {
+	vector<string> vLines;
+	split (strFilter, '\n', &vLines);
+	for (vector<string>::iterator iter = vLines.begin (); iter != vLines.end (); iter++) {
+		string strLine = trim (*iter);
+		if (strLine.empty () || strLine[0] == '#')
+			continue;
+
+		string::size_type equals = strLine.find ('=');
+		string strWord = strLine.substr (0, strLine.find_first_of (" \t"));
+		string strArgument = trim (strLine.substr (strWord.length ()));
+		if (equals == string::npos && (strWord == "from" || strWord == "to")) {
+			if (!isTime (strArgument)) {
+				strError = "not a time: " + strLine;
+				return false;
+			}
+			(strWord == "from" ? filter.from : filter.to) = strArgument;
+		}
+		else if (equals == string::npos && strWord == "limit") {
+			if (strArgument.empty () || strArgument.find_first_not_of ("0123456789") != string::npos) {
+				strError = "not a number: " + strLine;
+				return false;
+			}
+			filter.limit = strtoul (strArgument.c_str (), NULL, 10);
+		}
+		else if (equals != string::npos) {
+			string strColumn = trim (strLine.substr (0, equals));
+			string strValue = trim (strLine.substr (equals + 1));
+			// Quotes keep the spaces at the ends of a value
+			if (strValue.length () >= 2 && strValue[0] == '"' && strValue[strValue.length () - 1] == '"')
+				strValue = strValue.substr (1, strValue.length () - 2);
+			if (!binary_search (vColumns.begin (), vColumns.end (), strColumn)) {
+				strError = "no column " + strColumn;
+				return false;
+			}
+			filter.equals.push_back (make_pair (strColumn, strValue));
+		}
+		else {
+			strError = "unknown condition: " + strLine;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Append a value to a line, w/ the tabs, newlines and backslashes in it
+ * escaped so the line stays a line.
+ */
+void queryCursor::appendField (string &strOut, const char *value, size_t length) {
+	for (const char *p = value; p < value + length; p++) {
+		switch (*p) {
+			case '\\': strOut += "\\\\"; break;
+			case '\t': strOut += "\\t"; break;
+			case '\n': strOut += "\\n"; break;
+			case '\r': strOut += "\\r"; break;
+			default: strOut += *p;
+		}
+	}
+}
+
+/*
+ * Put the quoted parameters in place of the '?'s in the statement. The
+ * statement is generated, so the only '?'s in it are the placeholders.
+ *
+ * @param strQuery receives the statement
+ * @return true on success, false if a parameter couldn't be quoted
+ */
+bool queryCursor::bind (string &strQuery) {
+	vector<string>::const_iterator parameter = parameters.begin ();
+	for (string::const_iterator iter = statement.begin (); iter != statement.end (); iter++) {
+		if (*iter != '?' || parameter == parameters.end ())
+			strQuery += *iter;
+		else if (!this->quote (strQuery, *parameter++))
+			return false;
+	}
+	return true;
+}
+
+#ifdef WITH_POSTGRESQL
+	/*
+	 * Constructor
+	 *
+	 * @param strConnection the connection string of the sink
+	 */
+	pgsqlCursor::pgsqlCursor (const string &strConnection) : m_strConnection (strConnection),
+			m_pConnection (NULL) {
+		// The first fetch() connects
+	}
+
+	/*
+	 * Destructor. Closing the connection ends the transaction, which frees the
+	 * cursor on the server.
+	 */
+	pgsqlCursor::~pgsqlCursor () {
+		if (m_pConnection)
+			PQfinish (m_pConnection);
+	}
+
+	/*
+	 * Quote a value the way the connection's encoding and
+	 * standard_conforming_strings setting need it.
+	 */
+	bool pgsqlCursor::quote (string &strOut, const string &strValue) {
+		size_t pos = strOut.length ();
+		strOut.resize (pos + 2 * strValue.length () + 2);
+		strOut[pos] = '\'';
+		int error = 0;
+		size_t length = PQescapeStringConn (m_pConnection, &strOut[pos + 1], strValue.data (),
+				strValue.length (), &error);
+		// I.e. not a valid string in the client encoding
+		if (error) {
+			message (LEVEL_WARNING, "Couldn't quote a value of a query: %s",
+					PQerrorMessage (m_pConnection));
+			return false;
+		}
+		strOut.resize (pos + 1 + length);
+		strOut += '\'';
+		return true;
+	}
+
+	/*
+	 * Connect and declare the cursor.
+	 *
+	 * @return true on success, false otherwise
+	 */
+	bool pgsqlCursor::open () {
+		m_pConnection = PQconnectdb (m_strConnection.c_str ());
+		if (PQstatus (m_pConnection) != CONNECTION_OK) {
+			message (LEVEL_WARNING, "Couldn't connect to PostgreSQL for a query: %s",
+					PQerrorMessage (m_pConnection));
+			return false;
+		}
+
+		// A cursor only lives as long as its transaction
+		string strDeclare = "DECLARE loggerfs_query NO SCROLL CURSOR FOR ";
+		if (!this->bind (strDeclare))
+			return false;
+		strDeclare += ";";
+		const char *aStatements[] = { "BEGIN READ ONLY;", strDeclare.c_str () };
+		for (size_t i = 0; i < sizeof (aStatements) / sizeof (*aStatements); i++) {
+			PGresult *result = PQexec (m_pConnection, aStatements[i]);
+			bool bResult = PQresultStatus (result) == PGRES_COMMAND_OK;
+			if (!bResult)
+				message (LEVEL_WARNING, "Query failed: %s", PQresultErrorMessage (result));
+			PQclear (result);
+			if (!bResult)
+				return false;
+		}
+		return true;
+	}
+
+	int pgsqlCursor::fetch (string &strOut, unsigned int rows) {
+		if (m_pConnection == NULL && !this->open ())
+			return -1;
+
+		char strFetch[64];
+		snprintf (strFetch, sizeof (strFetch), "FETCH FORWARD %u FROM loggerfs_query;", rows);
+		PGresult *result = PQexec (m_pConnection, strFetch);
+		if (PQresultStatus (result) != PGRES_TUPLES_OK) {
+			message (LEVEL_WARNING, "Query failed: %s", PQresultErrorMessage (result));
+			PQclear (result);
+			return -1;
+		}
+
+		int n = PQntuples (result);
+		int fields = PQnfields (result);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < fields; j++) {
+				if (j > 0)
+					strOut += '\t';
+				if (!PQgetisnull (result, i, j))
+					appendField (strOut, PQgetvalue (result, i, j), PQgetlength (result, i, j));
+			}
+			strOut += '\n';
+		}
+		PQclear (result);
+		return n;
+	}
+#endif
+
+#ifdef WITH_MYSQL
+	/*
+	 * Constructor
+	 *
+	 * @param info the destination of the sink
+	 */
+	mysqlCursor::mysqlCursor (const destinationInfo &info) : m_info (info),
+			m_pConnection (NULL), m_pResult (NULL) {
+		// The first fetch() connects
+	}
+
+	/*
+	 * Destructor. Freeing an unbuffered result reads the rows that are left,
+	 * a LIMIT in the filter keeps that short when a query isn't read to the end.
+	 */
+	mysqlCursor::~mysqlCursor () {
+		if (m_pResult)
+			mysql_free_result (m_pResult);
+		if (m_pConnection) {
+			mysql_close (m_pConnection);
+			delete m_pConnection;
+		}
+	}
+
+	/*
+	 * Quote w/ mysql_real_escape_string, which considers the character set and
+	 * the SQL mode of the connection.
+	 */
+	bool mysqlCursor::quote (string &strOut, const string &strValue) {
+		size_t pos = strOut.length ();
+		strOut.resize (pos + 2 * strValue.length () + 2);
+		strOut[pos] = '\'';
+		unsigned long length = mysql_real_escape_string (m_pConnection, &strOut[pos + 1],
+				strValue.data (), strValue.length ());
+		// Refused, i.e. under NO_BACKSLASH_ESCAPES by clients that can't handle it
+		if (length == (unsigned long)-1) {
+			message (LEVEL_WARNING, "Couldn't quote a value of a query: %s", mysql_error (m_pConnection));
+			return false;
+		}
+		strOut.resize (pos + 1 + length);
+		strOut += '\'';
+		return true;
+	}
+
+	/*
+	 * Connect and run the query.
+	 *
+	 * @return true on success, false otherwise
+	 */
+	bool mysqlCursor::open () {
+		m_pConnection = new MYSQL;
+		mysql_init (m_pConnection);
+		unsigned int nTimeout = SINK_CONNECT_TIMEOUT;
+		mysql_options (m_pConnection, MYSQL_OPT_CONNECT_TIMEOUT, &nTimeout);
+		mysql_options (m_pConnection, MYSQL_SET_CHARSET_NAME, MYSQL_CHARSET);
+		if (!mysql_real_connect (m_pConnection, m_info.server.c_str(),
+				m_info.username.c_str(), m_info.password.c_str(),
+				m_info.database.c_str(), m_info.port, NULL, 0)) {
+			message (LEVEL_WARNING, "Couldn't connect to MySQL for a query: %s",
+					mysql_error (m_pConnection));
+			return false;
+		}
+
+		string strQuery;
+		if (!this->bind (strQuery))
+			return false;
+		if (mysql_real_query (m_pConnection, strQuery.data (), strQuery.length ()) != 0
+				|| (m_pResult = mysql_use_result (m_pConnection)) == NULL) {
+			message (LEVEL_WARNING, "Query failed: %s", mysql_error (m_pConnection));
+			return false;
+		}
+		return true;
+	}
+
+	int mysqlCursor::fetch (string &strOut, unsigned int rows) {
+		if (m_pConnection == NULL && !this->open ())
+			return -1;
+		if (m_pResult == NULL)
+			return -1;
+
+		unsigned int fields = mysql_num_fields (m_pResult);
+		unsigned int n = 0;
+		for (; n < rows; n++) {
+			MYSQL_ROW row = mysql_fetch_row (m_pResult);
+			if (row == NULL) {
+				if (mysql_errno (m_pConnection) != 0) {
+					message (LEVEL_WARNING, "Query failed: %s", mysql_error (m_pConnection));
+					return -1;
+				}
+				break;
+			}
+			unsigned long *lengths = mysql_fetch_lengths (m_pResult);
+			for (unsigned int j = 0; j < fields; j++) {
+				if (j > 0)
+					strOut += '\t';
+				if (row[j])
+					appendField (strOut, row[j], lengths[j]);
+			}
+			strOut += '\n';
+		}
+		return n;
+	}
+#endif
+
+/*
+ * Constructor
+ *
+ * @param uid the user who opened the file
+ * @param strFilter the filter the user wrote last, the query runs w/ it unless
+ * a new one is written
+ */
+logQuery::logQuery (uid_t uid, const string &strFilter) : m_uid (uid),
+		m_strFilter (strFilter), m_bStarted (false), m_nError (0),
+		m_nRemaining (0), m_nBufferOffset (-1) {
+}
+
+/*
+ * Destructor
+ */
+logQuery::~logQuery () {
+	this->close ();
+}
+
+/*
+ * Forget the query and its cursors.
+ */
+void logQuery::close () {
+	this->closeCursors ();
+	m_bStarted = false;
+	m_nError = 0;
+	m_strBuffer.clear ();
+	m_nBufferOffset = -1;
+}
+
+/*
+ * Free the cursors and the rows they have left, i.e. once the limit is
+ * reached.
+ */
+void logQuery::closeCursors () {
+	for (vector<pendingRows>::iterator iter = m_vCursors.begin (); iter != m_vCursors.end (); iter++)
+		delete iter->cursor;
+	m_vCursors.clear ();
+}
+
+/*
+ * Add to the filter. Writing from the start replaces it, and a query that's
+ * being read.
+ *
+ * @return bytes written, or a negative error
+ */
+int logQuery::write (const char *buf, size_t size, off_t offset) {
+	if (offset == 0) {
+		this->close ();
+		m_strFilter.clear ();
+	}
+	if (offset > (off_t)m_strFilter.length ())
+		return -EINVAL;
+	if (offset + size > QUERY_MAX_FILTER)
+		return -EFBIG;
+	m_strFilter.erase (offset);
+	m_strFilter.append (buf, size);
+	return size;
+}
+
+/*
+ * Parse the filter and create a cursor per destination that's queried: one
+ * that gets every row, otherwise every shard. Every cursor applies the
+ * limit, the first rows of the merged result are among theirs. The first
+ * line is a header w/ the names of the columns.
+ *
+ * @param p the pipeline of the log file
+ * @return 0 on success, -EINVAL if the filter is invalid, -EOPNOTSUPP if
+ * there's no database to query
+ */
+int logQuery::start (pipeline *p) {
+	m_bStarted = true;
+
+	queryFilter filter;
+	string strError;
+	if (!parseQueryFilter (m_strFilter, p->columns, filter, strError)) {
+		message (LEVEL_WARNING, "Invalid query of %s: %s", p->name.c_str (), strError.c_str ());
+		return m_nError = -EINVAL;
+	}
+	m_nRemaining = filter.limit ? filter.limit : ULONG_MAX;
+
+	vector<queryCursor *> vCursors;
+	for (size_t i = 0; i < p->sinks.size () && vCursors.empty (); i++) {
+		queryCursor *cursor = p->sharded[i] ? NULL : p->sinks[i]->openQuery (filter, p->columns);
+		if (cursor)
+			vCursors.push_back (cursor);
+	}
+	if (vCursors.empty ())
+		for (size_t i = 0; i < p->sinks.size (); i++) {
+			queryCursor *cursor = p->sharded[i] ? p->sinks[i]->openQuery (filter, p->columns) : NULL;
+			if (cursor)
+				vCursors.push_back (cursor);
+		}
+	m_vCursors.resize (vCursors.size ());
+	for (size_t i = 0; i < vCursors.size (); i++) {
+		m_vCursors[i].cursor = vCursors[i];
+		m_vCursors[i].pos = 0;
+	}
+	if (m_vCursors.empty ()) {
+		message (LEVEL_WARNING, "%s has no database destination to query", p->name.c_str ());
+		return m_nError = -EOPNOTSUPP;
+	}
+
+	m_strBuffer = "#timestamp";
+	for (vector<string>::iterator c = p->columns.begin (); c != p->columns.end (); c++)
+		m_strBuffer += "\t" + *c;
+	m_strBuffer += "\n";
+	return 0;
+}
+
+/*
+ * Move the row w/ the earliest timestamp of all cursors to the buffer,
+ * fetching more rows from a cursor that has run out. Each cursor has its
+ * rows sorted by time, so the merged rows are too. The timestamps are
+ * compared as text, they're all written in the database's format.
+ *
+ * @return 1 if a row was added, 0 if there are none left, -1 on error
+ */
+int logQuery::mergeRow () {
+	pendingRows *earliest = NULL;
+	size_t earliestLength = 0;
+	for (vector<pendingRows>::iterator iter = m_vCursors.begin (); iter != m_vCursors.end (); iter++) {
+		if (iter->pos == iter->rows.length () && iter->cursor) {
+			iter->rows.clear ();
+			iter->pos = 0;
+			unsigned int rows = (unsigned int)min (m_nRemaining, (unsigned long)QUERY_FETCH_ROWS);
+			int n = iter->cursor->fetch (iter->rows, rows);
+			if (n < 0)
+				return -1;
+			// A cursor that has fewer rows than asked for is done
+			if ((unsigned int)n < rows) {
+				delete iter->cursor;
+				iter->cursor = NULL;
+			}
+		}
+		if (iter->pos == iter->rows.length ())
+			continue;
+
+		// The timestamp is the first field, every row ends w/ a newline
+		size_t length = iter->rows.find_first_of ("\t\n", iter->pos) - iter->pos;
+		if (earliest == NULL || iter->rows.compare (iter->pos, length,
+				earliest->rows, earliest->pos, earliestLength) < 0) {
+			earliest = &*iter;
+			earliestLength = length;
+		}
+	}
+	if (earliest == NULL)
+		return 0;
+
+	size_t end = earliest->rows.find ('\n', earliest->pos) + 1;
+	m_strBuffer.append (earliest->rows, earliest->pos, end - earliest->pos);
+	earliest->pos = end;
+	return 1;
+}
+
+/*
+ * Drop the part of the buffer before an offset, it has been read.
+ */
+void logQuery::consume (off_t offset) {
+	size_t length = min ((size_t)(offset - m_nBufferOffset), m_strBuffer.length ());
+	m_strBuffer.erase (0, length);
+	m_nBufferOffset += length;
+}
+
+/*
+ * Read the rows, fetching more once the buffer runs out. The result has no
+ * size, so reads go on until one returns 0.
+ *
+ * @return bytes read, or a negative error
+ */
+int logQuery::read (char *buf, size_t size, off_t offset) {
+	if (m_nError)
+		return m_nError;
+	// The first read may follow the filter on the same file descriptor
+	if (m_nBufferOffset < 0)
+		m_nBufferOffset = offset;
+	if (offset < m_nBufferOffset)
+		return -ESPIPE;
+
+	while (m_nBufferOffset + (off_t)m_strBuffer.length () < offset + (off_t)size
+			&& !m_vCursors.empty ()) {
+		this->consume (offset);
+		int n = this->mergeRow ();
+		if (n < 0) {
+			this->close ();
+			m_bStarted = true;
+			return m_nError = -EIO;
+		}
+		if (n == 0 || --m_nRemaining == 0)
+			this->closeCursors ();
+	}
+
+	this->consume (offset);
+	if (offset > m_nBufferOffset)
+		return 0;
+	size_t length = min (size, m_strBuffer.length ());
+	memcpy (buf, m_strBuffer.data (), length);
+	return length;
+}
@@ -0,0 +1,178 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef QUERY_HPP_
+#define QUERY_HPP_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <sys/types.h>
+
+#include "pipeline.hpp"
+
+// Rows fetched from the database at a time
+#define QUERY_FETCH_ROWS 500
+// Longest filter a .query file takes
+#define QUERY_MAX_FILTER 4096
+
+/*
+ * The filter written to a <location>.query file, one condition per line:
+ *
+ *   from 2026-10-18 00:00
+ *   to 2026-10-18 06:00
+ *   status = 500
+ *   limit 100
+ */
+struct queryFilter {
+	queryFilter () : limit (0) {}
+
+	std::string from; // timestamp >= from, "" for no lower bound
+	std::string to; // timestamp < to, "" for no upper bound
+	std::vector<std::pair<std::string, std::string> > equals; // column, value
+	unsigned long limit; // rows, 0 for all of them
+};
+
+bool parseQueryFilter (const std::string &, const std::vector<std::string> &,
+		queryFilter &, std::string &);
+
+/*
+ * queryCursor
+ * The result of a .query, read a chunk of rows at a time. It has a connection
+ * of its own (the sink's connection belongs to its sender thread), which is
+ * opened by the first fetch(), so creating the cursor never waits for the
+ * database.
+ */
+class queryCursor {
+	public:
+		virtual ~queryCursor () {}
+
+		// Append a value as a quoted string constant of the database, false if
+		// it can't be quoted; needs the connection
+		virtual bool quote (std::string &, const std::string &) = 0;
+		// Append up to n rows as lines of tab separated values, -1 on error
+		virtual int fetch (std::string &, unsigned int) = 0;
+
+	protected:
+		static void appendField (std::string &, const char *, size_t);
+		// The statement w/ its parameters quoted in place
+		bool bind (std::string &);
+
+	public:
+		std::string statement; // the SELECT w/ a '?' per parameter, see sink::openQuery ()
+		std::vector<std::string> parameters;
+};
+
+#ifdef WITH_POSTGRESQL
+	/*
+	 * A server side cursor (DECLARE ... CURSOR) in a read only transaction, the
+	 * server keeps the result and hands out QUERY_FETCH_ROWS rows per FETCH.
+	 */
+	class pgsqlCursor : public queryCursor {
+		public:
+			pgsqlCursor (const std::string &);
+			~pgsqlCursor ();
+
+			bool quote (std::string &, const std::string &);
+			int fetch (std::string &, unsigned int);
+
+		private:
+			bool open ();
+
+		private:
+			std::string m_strConnection;
+			PGconn *m_pConnection;
+	};
+#endif
+
+#ifdef WITH_MYSQL
+	/*
+	 * An unbuffered result (mysql_use_result), the rows are read from the
+	 * connection as they're fetched instead of all at once.
+	 */
+	class mysqlCursor : public queryCursor {
+		public:
+			mysqlCursor (const destinationInfo &);
+			~mysqlCursor ();
+
+			bool quote (std::string &, const std::string &);
+			int fetch (std::string &, unsigned int);
+
+		private:
+			bool open ();
+
+		private:
+			destinationInfo m_info;
+			MYSQL *m_pConnection;
+			MYSQL_RES *m_pResult;
+	};
+#endif
+
+/*
+ * logQuery
+ * An open <location>.query file: the filter written to it, then the cursors
+ * the rows are read from, one per destination that's queried (every shard,
+ * merged by time). Reads only go forward, the rows that have been read are
+ * gone.
+ */
+class logQuery {
+	public:
+		logQuery (uid_t, const std::string &);
+		~logQuery ();
+
+		uid_t user () const { return m_uid; }
+		const std::string &filter () const { return m_strFilter; }
+		bool started () const { return m_bStarted; }
+
+		int write (const char *, size_t, off_t);
+		// Create the cursors, w/ the lock that keeps the pipeline alive
+		int start (pipeline *);
+		// Fetch rows as the reads reach them, w/out the lock
+		int read (char *, size_t, off_t);
+
+	private:
+		void close ();
+		void closeCursors ();
+		int mergeRow ();
+		void consume (off_t);
+
+	private:
+		// A cursor and the rows fetched from it that haven't been merged yet
+		struct pendingRows {
+			queryCursor *cursor; // NULL once all of its rows are fetched
+			std::string rows;
+			size_t pos; // start of the next row
+		};
+
+		uid_t m_uid;
+		std::string m_strFilter;
+		bool m_bStarted;
+		int m_nError; // of the query, returned by every read
+		std::vector<pendingRows> m_vCursors;
+		unsigned long m_nRemaining; // rows, of the filter's limit
+		std::string m_strBuffer; // fetched, but not read yet
+		off_t m_nBufferOffset; // file offset of the start of m_strBuffer
+};
+
+#endif /*QUERY_HPP_*/
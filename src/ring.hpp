@@ -0,0 +1,282 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * Shared memory rings: the layout shared w/ loggerfs and the client.
+ *
+ * This header is all an application needs (link w/ -lrt), it doesn't depend
+ * on the rest of loggerfs:
+ *
+ *   ringWriter log;
+ *   if (log.open ("app"))
+ *       log.write ("GET /index.html 200\n", 20);
+ *
+ * Every writer creates its own ring, named /loggerfs.<name>.<pid>.<n>, and
+ * is its only producer; loggerfs is the only consumer. A ring holds whole
+ * lines: a line that doesn't fit before the end of the ring is moved to the
+ * start and the gap is filled w/ newlines (empty lines are skipped by
+ * loggerfs), so the consumer can pass the data on as it is.
+ *
+ * loggerfs sleeps on a futex in a small "doorbell" segment
+ * (/loggerfs.<name>) when all rings are empty, and writers only make a
+ * system call when it's sleeping.
+ */
+#ifndef RING_HPP_
+#define RING_HPP_
+
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RING_MAGIC 0x474e4952 // "RING"
+#define RING_DOORBELL_MAGIC 0x4c4c4542 // "BELL"
+#define RING_VERSION 1
+#define RING_DEFAULT_SIZE (4 * 1024 * 1024)
+// Records between attempts to find the doorbell, if loggerfs wasn't running
+#define RING_DOORBELL_RETRY 4096
+// Writers outside of loggerfs's group can't ring, their lines are picked up
+// when loggerfs wakes up by itself
+#define RING_DOORBELL_MODE 0660
+
+/*
+ * Start of a ring segment, followed by the data. head and tail count bytes
+ * ever written/ consumed, the position in the data is the count modulo the
+ * capacity. They're on their own cache lines, the producer only writes head,
+ * the consumer only tail.
+ */
+struct ringHeader {
+	uint32_t magic; // set last, after the rest has been initialized
+	uint32_t version;
+	uint32_t capacity; // bytes of data, a power of 2
+	int32_t pid; // of the producer
+	char pad0[48];
+	volatile uint64_t head;
+	volatile uint64_t dropped; // lines that didn't fit
+	char pad1[48];
+	volatile uint64_t tail;
+	char pad2[56];
+};
+
+/*
+ * The futex the consumer sleeps on
+ */
+struct ringDoorbell {
+	uint32_t magic;
+	volatile int32_t sleeping; // 1 while the consumer waits
+	volatile int32_t sequence; // the futex word, bumped on every wake up
+};
+
+static inline long ringFutex (volatile int32_t *addr, int op, int32_t val,
+		const struct timespec *timeout) {
+	return syscall (SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+ * Wake the consumer, if it's sleeping. Called after head has been published.
+ */
+static inline void ringRing (ringDoorbell *bell) {
+	__sync_synchronize ();
+	if (bell->sleeping && __sync_bool_compare_and_swap (&bell->sleeping, 1, 0)) {
+		__sync_fetch_and_add (&bell->sequence, 1);
+		ringFutex (&bell->sequence, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+/*
+ * Map the doorbell of a ring name.
+ *
+ * @param strName name of the rings
+ * @param bCreate true to create it (loggerfs), false if it must exist (writers)
+ * @return the doorbell or NULL
+ */
+static inline ringDoorbell *ringOpenDoorbell (const std::string &strName, bool bCreate) {
+	std::string strPath = "/loggerfs." + strName;
+	int fd = shm_open (strPath.c_str (), bCreate ? O_RDWR | O_CREAT : O_RDWR, RING_DOORBELL_MODE);
+	if (fd < 0)
+		return NULL;
+	// Not one somebody else created before loggerfs started, and w/out the umask
+	struct stat st;
+	if (bCreate && fstat (fd, &st) == 0 && st.st_uid != geteuid ()) {
+		close (fd);
+		errno = EPERM;
+		return NULL;
+	}
+	if (bCreate && (fchmod (fd, RING_DOORBELL_MODE) != 0 || ftruncate (fd, sizeof (ringDoorbell)) != 0)) {
+		close (fd);
+		return NULL;
+	}
+	void *ptr = mmap (NULL, sizeof (ringDoorbell), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	ringDoorbell *bell = (ringDoorbell *)ptr;
+	if (bCreate)
+		bell->magic = RING_DOORBELL_MAGIC;
+	else if (bell->magic != RING_DOORBELL_MAGIC) {
+		munmap (ptr, sizeof (ringDoorbell));
+		return NULL;
+	}
+	return bell;
+}
+
+/*
+ * ringWriter
+ * The producer side of a ring. Not thread safe: give every thread that logs
+ * its own writer.
+ */
+class ringWriter {
+	public:
+		ringWriter () : m_pHeader (NULL), m_pData (NULL), m_pBell (NULL), m_nRetry (0) {}
+		~ringWriter () { this->close (); }
+
+		/*
+		 * Create the ring.
+		 *
+		 * @param strName the name in the <source type="ring"> of the log file
+		 * @param size capacity in bytes, rounded up to a power of 2
+		 * @return true on success, false otherwise
+		 */
+		bool open (const std::string &strName, size_t size = RING_DEFAULT_SIZE) {
+			static int counter = 0;
+			this->close ();
+
+			uint32_t capacity = 4096;
+			while (capacity < size)
+				capacity <<= 1;
+
+			char suffix[64];
+			snprintf (suffix, sizeof (suffix), ".%d.%d", (int)getpid (),
+					__sync_fetch_and_add (&counter, 1));
+			m_strPath = "/loggerfs." + strName + suffix;
+			m_strName = strName;
+
+			int fd = shm_open (m_strPath.c_str (), O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd < 0)
+				return false;
+			if (ftruncate (fd, sizeof (ringHeader) + capacity) != 0) {
+				::close (fd);
+				shm_unlink (m_strPath.c_str ());
+				return false;
+			}
+			void *ptr = mmap (NULL, sizeof (ringHeader) + capacity, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+			::close (fd);
+			if (ptr == MAP_FAILED) {
+				shm_unlink (m_strPath.c_str ());
+				return false;
+			}
+
+			m_pHeader = (ringHeader *)ptr;
+			m_pData = (char *)ptr + sizeof (ringHeader);
+			m_pHeader->version = RING_VERSION;
+			m_pHeader->capacity = capacity;
+			m_pHeader->pid = getpid ();
+			__sync_synchronize ();
+			m_pHeader->magic = RING_MAGIC;
+
+			m_pBell = ringOpenDoorbell (strName, false);
+			return true;
+		}
+
+		/*
+		 * Unmap the ring. loggerfs removes it once it has been drained.
+		 */
+		void close () {
+			if (m_pHeader == NULL)
+				return;
+			if (m_pBell) {
+				ringRing (m_pBell);
+				munmap (m_pBell, sizeof (ringDoorbell));
+			}
+			munmap (m_pHeader, sizeof (ringHeader) + m_pHeader->capacity);
+			m_pHeader = NULL;
+			m_pBell = NULL;
+		}
+
+		/*
+		 * Append a line, w/out a system call unless loggerfs is sleeping.
+		 *
+		 * @param line the line, a newline is added if it has none
+		 * @param length length of line
+		 * @return false if the ring is full (the line is dropped) or the line
+		 * is longer than half the ring
+		 */
+		bool write (const char *line, size_t length) {
+			if (m_pHeader == NULL)
+				return false;
+			bool bNewline = (length == 0 || line[length - 1] != '\n');
+			uint64_t need = length + (bNewline ? 1 : 0);
+			uint32_t capacity = m_pHeader->capacity;
+			uint64_t head = m_pHeader->head;
+			uint64_t offset = head & (capacity - 1);
+			uint64_t gap = (need > capacity - offset) ? capacity - offset : 0;
+
+			if (need > capacity / 2 || head + gap + need - m_pHeader->tail > capacity) {
+				m_pHeader->dropped++;
+				return false;
+			}
+			// Complete lines only, move the line to the start of the ring
+			if (gap) {
+				memset (m_pData + offset, '\n', gap);
+				offset = 0;
+			}
+			memcpy (m_pData + offset, line, length);
+			if (bNewline)
+				m_pData[offset + length] = '\n';
+
+			// The data has to be visible before the new head
+			__sync_synchronize ();
+			m_pHeader->head = head + gap + need;
+
+			if (m_pBell == NULL && ++m_nRetry % RING_DOORBELL_RETRY == 0)
+				m_pBell = ringOpenDoorbell (m_strName, false);
+			if (m_pBell)
+				ringRing (m_pBell);
+			return true;
+		}
+
+		bool write (const std::string &strLine) {
+			return this->write (strLine.data (), strLine.length ());
+		}
+
+		// Lines dropped because the ring was full
+		uint64_t dropped () const { return m_pHeader ? m_pHeader->dropped : 0; }
+
+	private:
+		std::string m_strName;
+		std::string m_strPath;
+		ringHeader *m_pHeader;
+		char *m_pData;
+		ringDoorbell *m_pBell;
+		unsigned int m_nRetry;
+};
+
+#endif /*RING_HPP_*/
@@ -0,0 +1,363 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "ringsource.hpp"
+#include "messages.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <dirent.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pwd.h>
+#include <grp.h>
+
+using namespace std;
+
+// Where a SIGBUS of the calling thread returns to while it reads a ring, a
+// writer may have truncated the segment; NULL outside of a read
+static __thread sigjmp_buf *pRingFault = NULL;
+static pthread_once_t faultOnce = PTHREAD_ONCE_INIT;
+
+static void ringFault (int nSignal) {
+	if (pRingFault)
+		siglongjmp (*pRingFault, 1);
+	// Not reading a ring, crash as usual
+	signal (nSignal, SIG_DFL);
+	raise (nSignal);
+}
+
+/*
+ * The handler doesn't block SIGBUS, so jumping out of it needn't restore the
+ * signal mask.
+ */
+static void installFaultHandler () {
+	struct sigaction action;
+	memset (&action, 0, sizeof (action));
+	action.sa_handler = ringFault;
+	action.sa_flags = SA_NODEFER;
+	sigemptyset (&action.sa_mask);
+	sigaction (SIGBUS, &action, NULL);
+}
+
+/*
+ * Copy the header of a ring, which may have been truncated.
+ *
+ * @return false if it's gone
+ */
+static bool readHeader (const ringHeader *header, ringHeader &copy) {
+	sigjmp_buf fault;
+	if (sigsetjmp (fault, 0)) {
+		pRingFault = NULL;
+		return false;
+	}
+	pRingFault = &fault;
+	memcpy (&copy, (const void *)header, sizeof (copy));
+	pRingFault = NULL;
+	return true;
+}
+
+/*
+ * Writers loggerfs trusts, like the ones that can ring the doorbell
+ * (RING_DOORBELL_MODE): its own user, and the users in its group.
+ */
+static bool trustedOwner (const struct stat &st) {
+	if (st.st_uid == geteuid () || st.st_uid == 0 || st.st_gid == getegid ())
+		return true;
+
+	vector<char> vBuffer (16384);
+	struct passwd pwd, *user = NULL;
+	if (getpwuid_r (st.st_uid, &pwd, &vBuffer[0], vBuffer.size (), &user) != 0 || user == NULL)
+		return false;
+	if (user->pw_gid == getegid ())
+		return true;
+	string strUser = user->pw_name;
+	struct group grp, *group = NULL;
+	if (getgrgid_r (getegid (), &grp, &vBuffer[0], vBuffer.size (), &group) != 0 || group == NULL)
+		return false;
+	for (char **member = group->gr_mem; *member; member++)
+		if (strUser == *member)
+			return true;
+	return false;
+}
+
+/*
+ * Constructor
+ *
+ * @param fnIngest receives the lines
+ * @param strLocation log file the lines are written to
+ * @param strName name the writers use
+ */
+ringSource::ringSource (ingestFunction fnIngest, const string &strLocation,
+		const string &strName) : source (fnIngest), m_strLocation (strLocation),
+		m_strName (strName), m_pBell (NULL) {
+	// open() creates the doorbell
+}
+
+/*
+ * Destructor. The rings stay, the writers may still be using them.
+ */
+ringSource::~ringSource () {
+	this->stop ();
+	for (map<string, mappedRing>::iterator iter = m_mRings.begin ();
+			iter != m_mRings.end (); iter++)
+		munmap (iter->second.header, iter->second.size);
+	if (m_pBell)
+		munmap (m_pBell, sizeof (ringDoorbell));
+}
+
+string ringSource::name () {
+	return "ring:" + m_strName;
+}
+
+/*
+ * Create (or reuse, after a restart) the doorbell and map the existing rings.
+ *
+ * @return true on success, false otherwise
+ */
+bool ringSource::open () {
+	if (m_pBell)
+		return true;
+	pthread_once (&faultOnce, installFaultHandler);
+	m_pBell = ringOpenDoorbell (m_strName, true);
+	if (m_pBell == NULL) {
+		message (LEVEL_ERROR, "Couldn't create the shared memory segment /loggerfs.%s: %s",
+				m_strName.c_str (), strerror (errno));
+
+		return false;
+	}
+	this->scan ();
+	return true;
+}
+
+/*
+ * Map the rings that have been created since the last scan, and remove the
+ * ones whose writer has exited once they're empty. Rings of users loggerfs
+ * doesn't trust are left alone.
+ */
+void ringSource::scan () {
+	DIR *dir = opendir ("/dev/shm");
+	if (dir == NULL)
+		return;
+
+	// loggerfs.<name>.<pid>.<n>
+	string strPrefix = "loggerfs." + m_strName + ".";
+	set<string> sRefused;
+	struct dirent *entry;
+	while ((entry = readdir (dir)) != NULL) {
+		if (strncmp (entry->d_name, strPrefix.c_str (), strPrefix.length ()) != 0)
+			continue;
+		const char *p = entry->d_name + strPrefix.length ();
+		unsigned int pid, n;
+		char tail;
+		if (sscanf (p, "%u.%u%c", &pid, &n, &tail) != 2
+				|| m_mRings.find (entry->d_name) != m_mRings.end ())
+			continue;
+		if (m_sRefused.count (entry->d_name)) {
+			sRefused.insert (entry->d_name);
+			continue;
+		}
+
+		string strPath = string ("/") + entry->d_name;
+		int fd = shm_open (strPath.c_str (), O_RDWR, 0);
+		struct stat st;
+		if (fd < 0 || fstat (fd, &st) != 0 || st.st_size < (off_t)sizeof (ringHeader)) {
+			if (fd >= 0)
+				close (fd);
+			continue;
+		}
+		if (!trustedOwner (st)) {
+			close (fd);
+			message (LEVEL_WARNING, "Ignoring the ring /dev/shm/%s of %s, its owner (uid %u) isn't in loggerfs's group",
+					entry->d_name, m_strLocation.c_str (), (unsigned int)st.st_uid);
+			sRefused.insert (entry->d_name);
+			continue;
+		}
+		void *ptr = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close (fd);
+		if (ptr == MAP_FAILED)
+			continue;
+
+		// A writer that's still initializing the ring is picked up next time
+		ringHeader *header = (ringHeader *)ptr, copy;
+		__sync_synchronize ();
+		if (!readHeader (header, copy) || copy.magic != RING_MAGIC || copy.version != RING_VERSION
+				|| copy.capacity == 0 || (copy.capacity & (copy.capacity - 1)) != 0
+				|| sizeof (ringHeader) + copy.capacity != (size_t)st.st_size) {
+			munmap (ptr, st.st_size);
+			continue;
+		}
+
+		mappedRing &ring = m_mRings[entry->d_name];
+		ring.header = header;
+		ring.data = (char *)ptr + sizeof (ringHeader);
+		ring.size = st.st_size;
+		ring.capacity = copy.capacity;
+		ring.dropped = copy.dropped;
+	}
+	closedir (dir);
+	// Forget the ones that are gone
+	m_sRefused.swap (sRefused);
+
+	for (map<string, mappedRing>::iterator iter = m_mRings.begin ();
+			iter != m_mRings.end (); ) {
+		ringHeader *header = iter->second.header, copy;
+		if (!readHeader (header, copy) || (copy.head == copy.tail
+				&& kill (copy.pid, 0) != 0 && errno == ESRCH)) {
+			munmap (header, iter->second.size);
+			shm_unlink (("/" + iter->first).c_str ());
+			m_mRings.erase (iter++);
+		}
+		else
+			iter++;
+	}
+}
+
+/*
+ * Ingest everything that has been written to the rings. A ring that was
+ * truncated under the mapping is dropped.
+ *
+ * @return true if there was anything
+ */
+bool ringSource::drain () {
+	bool bData = false;
+	for (map<string, mappedRing>::iterator iter = m_mRings.begin ();
+			iter != m_mRings.end (); ) {
+		int nResult = this->drainRing (iter->second);
+		if (nResult < 0) {
+			message (LEVEL_WARNING, "The ring /dev/shm/%s of %s was truncated, ignoring it",
+					iter->first.c_str (), m_strLocation.c_str ());
+			stats.errors++;
+			munmap (iter->second.header, iter->second.size);
+			m_sRefused.insert (iter->first);
+			m_mRings.erase (iter++);
+			continue;
+		}
+		if (nResult > 0)
+			bData = true;
+		iter++;
+	}
+	return bData;
+}
+
+/*
+ * Ingest what has been written to a ring. The data is copied out of the ring
+ * before it's ingested, so a SIGBUS (the segment was truncated) only ever
+ * interrupts a read of the ring.
+ *
+ * @return 1 if there was anything, 0 if not, -1 if the ring was truncated
+ */
+int ringSource::drainRing (mappedRing &ring) {
+	m_vChunk.resize (ring.capacity);
+	sigjmp_buf fault;
+	if (sigsetjmp (fault, 0)) {
+		pRingFault = NULL;
+		return -1;
+	}
+	pRingFault = &fault;
+
+	uint64_t head = ring.header->head;
+	// The data before the head has to be read after the head
+	__sync_synchronize ();
+	uint64_t tail = ring.header->tail;
+	uint64_t capacity = ring.capacity;
+	// More than the ring holds: the writer doesn't play by the rules, skip
+	// what it has overwritten
+	if (head > tail && head - tail > capacity) {
+		stats.errors++;
+		tail = head - capacity;
+	}
+
+	// The writer never lets a line wrap, so the data up to the end of the
+	// ring ends w/ a complete line
+	int nResult = 0;
+	while (tail < head) {
+		uint64_t offset = tail & (capacity - 1);
+		uint64_t length = head - tail;
+		if (length > capacity - offset)
+			length = capacity - offset;
+		memcpy (&m_vChunk[0], ring.data + offset, length);
+		pRingFault = NULL;
+
+		const char *buf = &m_vChunk[0];
+		// Newlines that don't end a line are the padding at the end of the ring
+		for (const char *p = buf; (p = (const char *)memchr (p, '\n', buf + length - p)) != NULL; p++)
+			if (p > buf && p[-1] != '\n')
+				stats.received++;
+		if (!m_fnIngest (m_strLocation, buf, length, false))
+			stats.errors++;
+		tail += length;
+		nResult = 1;
+		pRingFault = &fault;
+	}
+
+	// Done w/ the data before the space is handed back to the writer
+	__sync_synchronize ();
+	ring.header->tail = tail;
+
+	uint64_t dropped = ring.header->dropped;
+	stats.errors += dropped - ring.dropped;
+	ring.dropped = dropped;
+	pRingFault = NULL;
+	return nResult;
+}
+
+/*
+ * Drain the rings, and sleep on the doorbell while they're empty.
+ */
+void ringSource::run () {
+	struct timespec timeout;
+	timeout.tv_sec = RING_POLL_TIMEOUT / 1000;
+	timeout.tv_nsec = (RING_POLL_TIMEOUT % 1000) * 1000000;
+	time_t lastScan = time (NULL);
+	bool bWoken = false;
+
+	while (!this->stopping ()) {
+		time_t now = time (NULL);
+		if (now - lastScan >= RING_SCAN_INTERVAL) {
+			this->scan ();
+			lastScan = now;
+		}
+
+		if (this->drain ())
+			continue;
+		// Rung, but not by a known ring: a new writer
+		if (bWoken) {
+			this->scan ();
+			lastScan = now;
+			bWoken = false;
+			if (this->drain ())
+				continue;
+		}
+
+		// Announce the sleep, then look once more: a writer that published
+		// before it saw the announcement doesn't ring
+		int32_t sequence = m_pBell->sequence;
+		m_pBell->sleeping = 1;
+		__sync_synchronize ();
+		if (this->drain ()) {
+			m_pBell->sleeping = 0;
+			continue;
+		}
+		bWoken = (ringFutex (&m_pBell->sequence, FUTEX_WAIT, sequence, &timeout) == 0);
+		m_pBell->sleeping = 0;
+	}
+}
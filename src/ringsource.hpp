@@ -0,0 +1,79 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef RINGSOURCE_HPP_
+#define RINGSOURCE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "source.hpp"
+#include "ring.hpp"
+
+// Milliseconds the consumer sleeps at most, to notice that it's stopped
+#define RING_POLL_TIMEOUT 250
+// Seconds between looking for new rings and removing abandoned ones
+#define RING_SCAN_INTERVAL 1
+
+/*
+ * ringSource
+ * Drains the shared memory rings of the applications that log w/ a
+ * ringWriter (see ring.hpp) into a log file.
+ */
+class ringSource : public source {
+	public:
+		ringSource (ingestFunction, const std::string &, const std::string &);
+		~ringSource ();
+
+		std::string name ();
+
+	protected:
+		bool open ();
+		void run ();
+
+	private:
+		// A mapped ring of a writer
+		struct mappedRing {
+			ringHeader *header;
+			char *data;
+			size_t size; // of the mapping
+			uint32_t capacity; // checked against the mapping, the writer may change the header's
+			uint64_t dropped; // reported so far
+		};
+
+		void scan ();
+		bool drain ();
+		int drainRing (mappedRing &);
+
+	private:
+		std::string m_strLocation;
+		std::string m_strName;
+		ringDoorbell *m_pBell;
+		std::map<std::string, mappedRing> m_mRings; // by segment name
+		std::set<std::string> m_sRefused; // segments that aren't mapped, warned about
+		std::vector<char> m_vChunk; // data copied out of a ring
+};
+
+#endif /*RINGSOURCE_HPP_*/
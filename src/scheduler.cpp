@@ -0,0 +1,368 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "scheduler.hpp"
+#include "messages.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+using namespace std;
+
+/*
+ * Constructor
+ *
+ * @param fnProcess parses the lines of a log file
+ */
+scheduler::scheduler (processFunction fnProcess) : m_fnProcess (fnProcess),
+		m_bStop (false), m_nDraining (0) {
+	pthread_mutex_init (&m_lock, NULL);
+	pthread_cond_init (&m_work, NULL);
+	pthread_cond_init (&m_space, NULL);
+	pthread_cond_init (&m_processed, NULL);
+}
+
+/*
+ * Destructor
+ */
+scheduler::~scheduler () {
+	this->stop ();
+	for (map<logFile *, flow>::iterator iter = m_mFlows.begin ();
+			iter != m_mFlows.end (); iter++)
+		for (size_t i = 0; i < iter->second.chunks.size (); i++)
+			free (iter->second.chunks[i].data);
+	pthread_cond_destroy (&m_processed);
+	pthread_cond_destroy (&m_space);
+	pthread_cond_destroy (&m_work);
+	pthread_mutex_destroy (&m_lock);
+}
+
+/*
+ * Start the workers. Until then, and once they're stopped, lines are parsed
+ * by the thread that submits them.
+ *
+ * @param nWorkers number of workers
+ * @return true if any worker could be started
+ */
+bool scheduler::start (unsigned int nWorkers) {
+	pthread_mutex_lock (&m_lock);
+	m_bStop = false;
+	for (unsigned int i = 0; i < nWorkers; i++) {
+		pthread_t thread;
+		if (pthread_create (&thread, NULL, scheduler::worker, this) != 0) {
+			message (LEVEL_WARNING, "Couldn't start more than %u of %u ingest workers",
+					(unsigned int)i, (unsigned int)nWorkers);
+			break;
+		}
+		m_vWorkers.push_back (thread);
+	}
+	bool bStarted = !m_vWorkers.empty ();
+	pthread_mutex_unlock (&m_lock);
+	return bStarted;
+}
+
+/*
+ * Stop the workers once they've processed everything that's queued, rate
+ * limits don't delay it anymore.
+ */
+void scheduler::stop () {
+	pthread_mutex_lock (&m_lock);
+	m_bStop = true;
+	pthread_cond_broadcast (&m_work);
+	pthread_cond_broadcast (&m_space);
+	vector<pthread_t> vWorkers;
+	vWorkers.swap (m_vWorkers);
+	pthread_mutex_unlock (&m_lock);
+
+	for (size_t i = 0; i < vWorkers.size (); i++)
+		pthread_join (vWorkers[i], NULL);
+}
+
+/*
+ * Queue lines written to a log file. Waits while the log file's queue is
+ * full, and applies its rate limit.
+ *
+ * @param file the log file
+ * @param buf the lines, copied
+ * @param size length of buf
+ * @param settings the log file's share of the workers
+ */
+void scheduler::submit (logFile *file, const char *buf, size_t size,
+		const flowSettings &settings) {
+	pthread_mutex_lock (&m_lock);
+	if (m_vWorkers.empty ()) {
+		pthread_mutex_unlock (&m_lock);
+		m_fnProcess (file, buf, size);
+		return;
+	}
+	flow &f = this->getFlow (file, settings);
+
+	unsigned int lines = 0;
+	if (f.settings.rateLimit > 0) {
+		for (const char *p = buf; (p = (const char *)memchr (p, '\n', buf + size - p)) != NULL; p++)
+			lines++;
+		if (size > 0 && buf[size - 1] != '\n')
+			lines++;
+
+		// Keep the lines there are tokens for, the rest is dropped right away
+		if (f.settings.rateDrop) {
+			this->refill (f, monotonicTime ());
+			if (f.tokens < lines) {
+				unsigned int keep = (f.tokens > 0) ? (unsigned int)f.tokens : 0;
+				const char *end = buf;
+				for (unsigned int i = 0; i < keep; i++)
+					end = (const char *)memchr (end, '\n', buf + size - end) + 1;
+				__sync_fetch_and_add (&file->stats.limited, lines - keep);
+				size = end - buf;
+				lines = keep;
+			}
+			f.tokens -= lines;
+			if (size == 0) {
+				pthread_mutex_unlock (&m_lock);
+				return;
+			}
+		}
+	}
+
+	// A write larger than the whole queue still goes in once the queue is empty
+	while (f.size > 0 && f.size + size > SCHEDULER_QUEUE_SIZE && !m_bStop)
+		pthread_cond_wait (&m_space, &m_lock);
+
+	chunk c;
+	c.data = (char *)malloc (size);
+	if (c.data == NULL) {
+		pthread_mutex_unlock (&m_lock);
+		static messageLimit limit;
+		messageLimited (limit, LEVEL_ERROR, "Couldn't queue %lu bytes for %s", (unsigned long)size,
+				file->location.c_str ());
+
+		return;
+	}
+	memcpy (c.data, buf, size);
+	c.size = size;
+	c.lines = lines;
+	f.chunks.push_back (c);
+	f.size += size;
+	f.submitted++;
+	__sync_fetch_and_add (&file->stats.queued, size);
+
+	if (!f.active) {
+		f.active = true;
+		m_lRound.push_back (&f);
+	}
+	pthread_cond_signal (&m_work);
+	pthread_mutex_unlock (&m_lock);
+}
+
+/*
+ * Wait until the chunks that have been queued for a log file so far are
+ * processed; the ones queued meanwhile don't hold it up. Chunks that wait for
+ * rate limit tokens are waited for as well.
+ *
+ * @param file the log file
+ */
+void scheduler::drain (logFile *file) {
+	pthread_mutex_lock (&m_lock);
+	map<logFile *, flow>::iterator iter = m_mFlows.find (file);
+	if (iter != m_mFlows.end ()) {
+		flow &f = iter->second;
+		unsigned long long target = f.submitted;
+		m_nDraining++;
+		// stop () lets the workers finish the queues, so this always ends
+		while (f.processed < target)
+			pthread_cond_wait (&m_processed, &m_lock);
+		m_nDraining--;
+	}
+	pthread_mutex_unlock (&m_lock);
+}
+
+/*
+ * Drop the queue of a log file that's about to be deleted.
+ *
+ * @param file the log file
+ * @return false if it still has chunks queued or being processed
+ */
+bool scheduler::forget (logFile *file) {
+	pthread_mutex_lock (&m_lock);
+	map<logFile *, flow>::iterator iter = m_mFlows.find (file);
+	bool bIdle = (iter == m_mFlows.end () || (iter->second.chunks.empty () && !iter->second.busy));
+	if (iter != m_mFlows.end () && bIdle) {
+		if (iter->second.active)
+			m_lRound.remove (&iter->second);
+		m_mFlows.erase (iter);
+	}
+	pthread_mutex_unlock (&m_lock);
+	return bIdle;
+}
+
+/*
+ * Get the queue of a log file, w/ the settings of the current configuration.
+ * Must be called w/ the lock held.
+ */
+scheduler::flow &scheduler::getFlow (logFile *file, const flowSettings &settings) {
+	map<logFile *, flow>::iterator iter = m_mFlows.find (file);
+	if (iter == m_mFlows.end ()) {
+		flow &f = m_mFlows[file];
+		f.file = file;
+		f.size = 0;
+		f.deficit = 0;
+		f.active = false;
+		f.busy = false;
+		f.tokens = settings.rateBurst;
+		f.refilled = monotonicTime ();
+		f.submitted = 0;
+		f.processed = 0;
+		f.settings = settings;
+		return f;
+	}
+	// A reload may have changed them
+	iter->second.settings = settings;
+	return iter->second;
+}
+
+/*
+ * Add the tokens a rate limited log file earned since the last time.
+ */
+void scheduler::refill (flow &f, long long now) {
+	if (f.settings.rateLimit <= 0)
+		return;
+	f.tokens += (now - f.refilled) * (double)f.settings.rateLimit / 1000000.0;
+	if (f.tokens > f.settings.rateBurst)
+		f.tokens = f.settings.rateBurst;
+	f.refilled = now;
+}
+
+/*
+ * Pick the log file whose next chunk is processed, by deficit round-robin.
+ * Must be called w/ the lock held.
+ *
+ * @param wait receives the microseconds until a delayed log file has tokens
+ * again, 0 if none is waiting for them
+ * @return the log file, NULL if no chunk can be processed now
+ */
+scheduler::flow *scheduler::next (long long &wait) {
+	long long now = monotonicTime ();
+	wait = 0;
+
+	// Log files that are being worked on or wait for tokens sit out the round
+	bool bReady = false;
+	for (list<flow *>::iterator iter = m_lRound.begin (); iter != m_lRound.end (); iter++) {
+		flow *f = *iter;
+		if (f->busy || f->chunks.empty ())
+			continue;
+		if (f->settings.rateLimit > 0 && !f->settings.rateDrop && !m_bStop) {
+			this->refill (*f, now);
+			if (f->tokens < 1) {
+				long long delay = (long long)((1 - f->tokens) * 1000000.0 / f->settings.rateLimit) + 1;
+				if (wait == 0 || delay < wait)
+					wait = delay;
+				continue;
+			}
+		}
+		bReady = true;
+		break;
+	}
+	if (!bReady)
+		return NULL;
+
+	while (true) {
+		flow *f = m_lRound.front ();
+		if (f->chunks.empty () && !f->busy) {
+			// Drained, it starts over w/out a deficit when it has chunks again
+			f->active = false;
+			f->deficit = 0;
+			m_lRound.pop_front ();
+			continue;
+		}
+		bool bDelayed = (f->settings.rateLimit > 0 && !f->settings.rateDrop && !m_bStop
+				&& f->tokens < 1);
+		if (!f->busy && !f->chunks.empty () && !bDelayed) {
+			if (f->deficit > 0)
+				return f;
+			f->deficit += (long)SCHEDULER_QUANTUM * f->settings.weight;
+		}
+		m_lRound.splice (m_lRound.end (), m_lRound, m_lRound.begin ());
+	}
+}
+
+void *scheduler::worker (void *ptr) {
+	((scheduler *)ptr)->run ();
+	return NULL;
+}
+
+/*
+ * Process chunks until stop() is called and nothing is queued anymore.
+ */
+void scheduler::run () {
+	pthread_mutex_lock (&m_lock);
+	while (true) {
+		long long wait;
+		flow *f = this->next (wait);
+		if (f == NULL) {
+			bool bQueued = false;
+			for (list<flow *>::iterator iter = m_lRound.begin (); iter != m_lRound.end (); iter++)
+				if (!(*iter)->chunks.empty ())
+					bQueued = true;
+			if (m_bStop && !bQueued)
+				break;
+
+			if (wait > 0) {
+				struct timespec until;
+				clock_gettime (CLOCK_REALTIME, &until);
+				until.tv_sec += wait / 1000000;
+				until.tv_nsec += (wait % 1000000) * 1000;
+				if (until.tv_nsec >= 1000000000) {
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait (&m_work, &m_lock, &until);
+			}
+			else
+				pthread_cond_wait (&m_work, &m_lock);
+			continue;
+		}
+
+		chunk c = f->chunks.front ();
+		f->chunks.pop_front ();
+		f->size -= c.size;
+		f->deficit -= c.size;
+		if (f->settings.rateLimit > 0 && !f->settings.rateDrop)
+			f->tokens -= c.lines;
+		f->busy = true;
+		__sync_fetch_and_sub (&f->file->stats.queued, c.size);
+		pthread_cond_broadcast (&m_space);
+		pthread_mutex_unlock (&m_lock);
+
+		m_fnProcess (f->file, c.data, c.size);
+		free (c.data);
+
+		pthread_mutex_lock (&m_lock);
+		f->busy = false;
+		f->processed++;
+		if (m_nDraining > 0)
+			pthread_cond_broadcast (&m_processed);
+		// Its next chunk had to wait for this one; on stop the others may be done
+		if (m_bStop)
+			pthread_cond_broadcast (&m_work);
+		else if (!f->chunks.empty ())
+			pthread_cond_signal (&m_work);
+	}
+	pthread_mutex_unlock (&m_lock);
+}
@@ -0,0 +1,120 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef SCHEDULER_HPP_
+#define SCHEDULER_HPP_
+
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+
+#include <pthread.h>
+
+#include "pipeline.hpp"
+
+// Bytes a log file of weight 1 gets processed per round
+#define SCHEDULER_QUANTUM (64 * 1024)
+// Bytes of a log file that may wait to be processed before its writers wait
+#define SCHEDULER_QUEUE_SIZE (16 * 1024 * 1024)
+
+// Parses lines of a log file, called by the workers
+typedef void (*processFunction) (logFile *, const char *, size_t);
+
+// How a log file shares the workers, from its <log>
+struct flowSettings {
+	int weight;
+	int rateLimit; // lines per second, 0 = unlimited
+	int rateBurst; // lines that may exceed the rate at once
+	bool rateDrop; // lines over the limit are dropped instead of delayed
+};
+
+/*
+ * scheduler
+ * Parses the lines written to all log files w/ a pool of workers. Every log
+ * file has its own queue, and the queues are served by deficit round-robin:
+ * per round a log file gets <weight> times SCHEDULER_QUANTUM bytes parsed, so
+ * a flooded log file can't hold back the others by more than a round. A log
+ * file is only worked on by one worker at a time, which keeps its lines in
+ * order.
+ *
+ * A <rate-limit> is a token bucket in lines per second; the lines over it are
+ * dropped when they're written, or wait in the queue for their tokens. Writers
+ * of a log file whose queue is full wait until there's space again; fsync()
+ * waits until its queue has been worked off.
+ */
+class scheduler {
+	public:
+		scheduler (processFunction);
+		~scheduler ();
+
+		bool start (unsigned int);
+		void stop ();
+		void submit (logFile *, const char *, size_t, const flowSettings &);
+		// Wait until the lines queued for a log file so far are processed
+		void drain (logFile *);
+		// Drop the queue of a log file that's going away, false if it's in use
+		bool forget (logFile *);
+
+	private:
+		struct chunk {
+			char *data;
+			size_t size;
+			unsigned int lines; // only counted for rate limited log files
+		};
+
+		struct flow {
+			logFile *file;
+			flowSettings settings;
+			std::deque<chunk> chunks;
+			size_t size; // bytes in chunks
+			long deficit; // bytes it may still have processed this round
+			bool active; // in the round
+			bool busy; // a worker is processing one of its chunks
+			double tokens;
+			long long refilled; // when the tokens were last added
+			unsigned long long submitted; // chunks ever queued
+			unsigned long long processed; // of those
+		};
+
+		flow &getFlow (logFile *, const flowSettings &);
+		void refill (flow &, long long);
+		flow *next (long long &);
+		static void *worker (void *);
+		void run ();
+
+	private:
+		processFunction m_fnProcess;
+		std::map<logFile *, flow> m_mFlows;
+		std::list<flow *> m_lRound; // log files w/ queued chunks, the first is served
+		std::vector<pthread_t> m_vWorkers;
+		bool m_bStop;
+
+		pthread_mutex_t m_lock;
+		pthread_cond_t m_work; // a chunk was queued
+		pthread_cond_t m_space; // a chunk was taken
+		pthread_cond_t m_processed; // a chunk was processed, while m_nDraining
+		unsigned int m_nDraining; // threads waiting in drain ()
+};
+
+#endif /*SCHEDULER_HPP_*/
@@ -18,10 +18,11 @@
  * 02111-1307, USA.
  */
 #include "schema.hpp"
+#include "messages.hpp"
+#include "json.hpp"
+#include "tokenizer.hpp"
 
-#ifdef _DEBUG
-	#include <iostream>
-#endif
+#include <algorithm>
 
 using namespace std;
 using namespace boost;
@@ -57,18 +58,14 @@ bool schema::load (string filename) {
     /* Load XML document */
     doc = xmlParseFile(filename.c_str ());
     if (doc == NULL) {
-    	#ifdef _DEBUG
-			cerr << "Error: Unable to load schema file\n";
-		#endif
+		message (LEVEL_DEBUG, "Unable to load %s", filename.c_str ());
 		return false;
     }
 
     /* Create xpath evaluation context */
     xpathCtx = xmlXPathNewContext(doc);
     if(xpathCtx == NULL) {
-    	#ifdef _DEBUG
-        	cerr << "Error: unable to create new XPath context\n";
-        #endif
+        message (LEVEL_DEBUG, "Unable to create new XPath context");
         xmlFreeDoc (doc); 
         return false;
     }
@@ -76,9 +73,7 @@ bool schema::load (string filename) {
     /* Evaluate xpath expression */
     xpathObj = xmlXPathEvalExpression (xpathExpr, xpathCtx);
     if(xpathObj == NULL) {
-    	#ifdef _DEBUG
-        	cerr << "Error: unable to evaluate xpath expression " <<  xpathExpr << endl;
-        #endif
+        message (LEVEL_DEBUG, "Unable to evaluate xpath expression %s", (const char *)xpathExpr);
         xmlXPathFreeContext (xpathCtx); 
         xmlFreeDoc (doc); 
         return false;
@@ -113,6 +108,18 @@ void schema::parseNodeset (xmlNodeSetPtr nodes) {
     for(i = 0; i < size; ++i) {
 	    cur = nodes->nodeTab[i];
 	    
+	    // Initialize the tmpFormat struct
+	    tmpFormat.parser = PARSER_REGEX;
+	    tmpFormat.keys.clear ();
+	    tmpFormat.dictionary.clear ();
+	    tmpFormat.fields.clear ();
+	    tmpFormat.positions.clear ();
+	    tmpFormat.delimiter = -1;
+	    tmpFormat.quote = '"';
+	    tmpFormat.escape = ESCAPE_DEFAULT;
+	    tmpFormat.pathological = false;
+	    tmpFormat.maxLength = 0;
+	    
 	    for (tmpNode = cur->children; tmpNode; tmpNode = tmpNode->next) {
 	    	if (tmpNode->type == XML_ELEMENT_NODE) {
 	    		// Schema name
@@ -126,28 +133,273 @@ void schema::parseNodeset (xmlNodeSetPtr nodes) {
 	    				tmpFormat.re.assign ((const char *)tmpNode->children->content);
 	    			}
 	    			catch (regex_error &e) {
-	    				#ifdef _DEBUG
-	    					cerr << e.what () << endl;
-	    				#endif
+	    				message (LEVEL_DEBUG, "%s", e.what ());
 	    				continue;
 	    			}
 	    			elements++;
 	    		}
 	    		else if (strncmp ((const char *)tmpNode->name, "columns", strlen ("columns")) == 0) {
 	    			split ((const char *)tmpNode->children->content, ',', &(tmpFormat.columns));
-	    			//  Trim all entries
-	    			for (unsigned int i = 0; i < tmpFormat.columns.size(); i++)
+	    			//  Trim all entries, "column=key" names the key the parser looks for
+	    			tmpFormat.keys.resize (tmpFormat.columns.size ());
+	    			for (unsigned int i = 0; i < tmpFormat.columns.size(); i++) {
+	    				string::size_type equals = tmpFormat.columns[i].find ('=');
+	    				if (equals != string::npos) {
+	    					tmpFormat.keys[i] = trim (tmpFormat.columns[i].substr (equals + 1));
+	    					tmpFormat.columns[i] = tmpFormat.columns[i].substr (0, equals);
+	    				}
 	    				tmpFormat.columns[i] = trim (tmpFormat.columns[i]);
+	    				if (equals == string::npos)
+	    					tmpFormat.keys[i] = tmpFormat.columns[i];
+	    			}
 	    			elements++;
 	    		}
+	    		// Parser for the lines, a regex unless stated otherwise
+	    		else if (strncmp ((const char *)tmpNode->name, "parser", strlen ("parser")) == 0) {
+	    			string strParser = trim ((const char *)tmpNode->children->content);
+	    			if (strParser == "json")
+	    				tmpFormat.parser = PARSER_JSON;
+	    			else if (strParser == "logfmt")
+	    				tmpFormat.parser = PARSER_LOGFMT;
+	    			else if (strParser == "delimited")
+	    				tmpFormat.parser = PARSER_DELIMITED;
+	    			else if (strParser != "regex")
+	    				message (LEVEL_WARNING, "Unknown parser %s, using a regex", strParser.c_str ());
+	    		}
+	    		// Options of the logfmt and delimited parsers, an empty element for none
+	    		else if (strncmp ((const char *)tmpNode->name, "delimiter", strlen ("delimiter")) == 0) {
+	    			tmpFormat.delimiter = this->parseCharacter (tmpNode);
+	    		}
+	    		else if (strncmp ((const char *)tmpNode->name, "quote", strlen ("quote")) == 0) {
+	    			tmpFormat.quote = this->parseCharacter (tmpNode);
+	    		}
+	    		else if (strncmp ((const char *)tmpNode->name, "escape", strlen ("escape")) == 0) {
+	    			tmpFormat.escape = this->parseCharacter (tmpNode);
+	    			// NUL is a character lines may contain
+	    			if (tmpFormat.escape == 0)
+	    				tmpFormat.escape = ESCAPE_NONE;
+	    		}
+	    		// Repetitive columns whose values are stored once, in a table of their own
+	    		else if (strncmp ((const char *)tmpNode->name, "dictionary", strlen ("dictionary")) == 0) {
+	    			split ((const char *)tmpNode->children->content, ',', &(tmpFormat.dictionary));
+	    			for (unsigned int i = 0; i < tmpFormat.dictionary.size(); i++)
+	    				tmpFormat.dictionary[i] = trim (tmpFormat.dictionary[i]);
+	    		}
+	    		// Maximum line length that will be matched against the regex
+	    		else if (strncmp ((const char *)tmpNode->name, "max-length", strlen ("max-length")) == 0) {
+	    			tmpFormat.maxLength = strtoint ((const char *)tmpNode->children->content);
+	    		}
 	    		//cout << "Sub-element: '" << tmpNode->name << "'\n";
 	    		//cout << tmpNode->children->content;
 	    	}
 	    }
+	    
+	    for (vector<string>::iterator c = tmpFormat.dictionary.begin (); c != tmpFormat.dictionary.end (); ) {
+	    	if (find (tmpFormat.columns.begin (), tmpFormat.columns.end (), *c) == tmpFormat.columns.end ()) {
+	    		message (LEVEL_WARNING, "Schema %s has no column %s for its dictionary",
+	    				strName.c_str (), c->c_str ());
+	    		c = tmpFormat.dictionary.erase (c);
+	    	}
+	    	else
+	    		c++;
+	    }
+	    if (tmpFormat.parser == PARSER_JSON)
+	    	compileJsonFields (tmpFormat);
+	    else if (tmpFormat.parser == PARSER_LOGFMT || tmpFormat.parser == PARSER_DELIMITED) {
+	    	// logfmt pairs are separated by whitespace and escaped w/ a backslash,
+	    	// delimited fields are comma separated and escape quotes by doubling them
+	    	if (tmpFormat.delimiter < 0)
+	    		tmpFormat.delimiter = (tmpFormat.parser == PARSER_LOGFMT) ? 0 : ',';
+	    	if (tmpFormat.escape == ESCAPE_DEFAULT && tmpFormat.parser == PARSER_LOGFMT)
+	    		tmpFormat.escape = '\\';
+	    	else if (tmpFormat.escape == ESCAPE_DEFAULT)
+	    		tmpFormat.escape = tmpFormat.quote ? tmpFormat.quote : ESCAPE_NONE;
+	    	if (tmpFormat.parser == PARSER_DELIMITED && !compileDelimitedFields (tmpFormat)) {
+	    		message (LEVEL_WARNING, "Schema %s has a column w/out a field number, or mixes numbered columns w/ columns in order, ignoring it",
+	    				strName.c_str ());
+	    		continue;
+	    	}
+	    }
+	    // Guard regexes that can backtrack exponentially against long lines
+	    else if (this->isPathological (tmpFormat.re.str ())) {
+	    	tmpFormat.pathological = true;
+	    	if (tmpFormat.maxLength == 0)
+	    		tmpFormat.maxLength = DEFAULT_PATHOLOGICAL_MAX_LENGTH;
+	    	message (LEVEL_WARNING, "Schema %s is prone to excessive backtracking, limiting it to lines of %u characters",
+	    			strName.c_str (), (unsigned int)tmpFormat.maxLength);
+
+	    }
 	    m_mSchemas[strName] = tmpFormat;
     }
 }
 
+/*
+ * Get the character an option of a parser is set to. Tabs and spaces can be
+ * written as "\t", "tab" and "space".
+ * 
+ * @param node the element
+ * @return the character, 0 if the element is empty
+ */
+int schema::parseCharacter (xmlNodePtr node) {
+	if (node->children == NULL || node->children->content == NULL)
+		return 0;
+	string strValue = (const char *)node->children->content;
+	if (strValue == "\\t" || strValue == "tab")
+		return '\t';
+	if (strValue == "space")
+		return ' ';
+	strValue = trim (strValue);
+	return strValue.empty () ? 0 : (unsigned char)strValue[0];
+}
+
+/*
+ * Check whether the atom that ends before a position is optional, i.e.
+ * followed by '*', '?' or {0,...}.
+ */
+static bool isOptional (const string &strRegex, string::size_type pos) {
+	if (pos >= strRegex.length ())
+		return false;
+	return strRegex[pos] == '*' || strRegex[pos] == '?'
+			|| (strRegex[pos] == '{' && pos + 1 < strRegex.length () && strRegex[pos + 1] == '0');
+}
+
+/*
+ * Check whether a regex is prone to catastrophic backtracking. That's the case
+ * if a quantified group contains another unbounded quantifier, i.e. "(a+)+",
+ * or if unbounded wildcards (".*", ".+") compete for the same input, i.e.
+ * ".*x?.*". Wildcards w/ something in between that has to match, like the
+ * ".*?: *(.*)" of the syslog schema, don't compete.
+ * 
+ * @param strRegex the regular expression
+ * @return true if the regex is pathological, false otherwise
+ */
+bool schema::isPathological (const string &strRegex) {
+	vector<bool> vGroups; // whether each open group contains an unbounded quantifier
+	bool bQuantified = false; // whether the previous atom was a group containing one
+	bool bClass = false;
+	bool bWildcard = false; // an unbounded wildcard since the last atom that has to match
+	
+	for (string::size_type i = 0; i < strRegex.length (); i++) {
+		char c = strRegex[i];
+		bool bUnbounded = false;
+		
+		// Skip escaped characters and character classes
+		if (c == '\\') {
+			i++;
+			bQuantified = false;
+			if (!isOptional (strRegex, i + 1))
+				bWildcard = false;
+			continue;
+		}
+		if (bClass) {
+			if (c == ']') {
+				bClass = false;
+				if (!isOptional (strRegex, i + 1))
+					bWildcard = false;
+			}
+			continue;
+		}
+		
+		switch (c) {
+			case '[':
+				bClass = true;
+				bQuantified = false;
+				break;
+			case '(':
+				vGroups.push_back (false);
+				bQuantified = false;
+				break;
+			case ')':
+				if (vGroups.empty ())
+					break;
+				bQuantified = vGroups.back ();
+				vGroups.pop_back ();
+				if (bQuantified && !vGroups.empty ())
+					vGroups.back () = true;
+				break;
+			case '*':
+			case '+':
+				bUnbounded = true;
+				break;
+			case '{': {
+				// Only {n,} is unbounded
+				string::size_type end = strRegex.find ('}', i);
+				if (end == string::npos)
+					break;
+				bUnbounded = strRegex[end - 1] == ',';
+				i = end;
+				break;
+			}
+			case '.':
+				bQuantified = false;
+				break;
+			case '^':
+			case '$':
+			case '|':
+			case '?':
+				bQuantified = false;
+				break;
+			default:
+				// A literal
+				bQuantified = false;
+				if (!isOptional (strRegex, i + 1))
+					bWildcard = false;
+		}
+		
+		if (!bUnbounded)
+			continue;
+		// A quantifier applied to a group that already contains one
+		if (bQuantified)
+			return true;
+		if (!vGroups.empty ())
+			vGroups.back () = true;
+		if (c != '{' && i > 0 && strRegex[i - 1] == '.' && (i < 2 || strRegex[i - 2] != '\\')) {
+			if (bWildcard)
+				return true;
+			bWildcard = true;
+		}
+		// Skip lazy/ possessive modifiers
+		if (i + 1 < strRegex.length () && (strRegex[i + 1] == '?' || strRegex[i + 1] == '+'))
+			i++;
+	}
+	
+	return false;
+}
+
+/*
+ * Match a line against a schema's regex.
+ * 
+ * boost::regex aborts matches that take more than BOOST_REGEX_MAX_STATE_COUNT
+ * steps by throwing, which (along w/ the maximum line length) puts a ceiling on
+ * the time a single line can spend inside the regex engine.
+ * 
+ * @param format the schema
+ * @param first beginning of the line
+ * @param last end of the line
+ * @param matches the capture groups on success
+ * @return MATCH_OK, MATCH_FAIL or MATCH_OVERFLOW if the budget was exceeded
+ */
+matchResult matchLine (const logFormat &format, const char *first, const char *last,
+		lineMatch &matches) {
+	if (format.maxLength > 0 && (unsigned int)(last - first) > format.maxLength)
+		return MATCH_OVERFLOW;
+	switch (format.parser) {
+		case PARSER_JSON:
+			return matchJson (format, first, last, matches);
+		case PARSER_LOGFMT:
+			return matchLogfmt (format, first, last, matches);
+		case PARSER_DELIMITED:
+			return matchDelimited (format, first, last, matches);
+	}
+	
+	try {
+		return regex_match (first, last, matches, format.re) ? MATCH_OK : MATCH_FAIL;
+	}
+	catch (std::runtime_error &) {
+		return MATCH_OVERFLOW;
+	}
+}
+
 /*
  * Return a std::map containing the schemas.
  * 
@@ -156,3 +408,26 @@ void schema::parseNodeset (xmlNodeSetPtr nodes) {
 map<string, logFormat> & schema::schemas () {
 	return m_mSchemas;
 }
+
+/*
+ * Fill the match of a line w/ the columns a parser found, as if a regex had
+ * captured them.
+ * 
+ * @param matches receives the columns
+ * @param first start of the line
+ * @param last end of the line
+ * @param values the columns, in the order of the capture groups
+ * @param n number of columns
+ */
+void fillMatch (lineMatch &matches, const char *first, const char *last,
+		const fieldValue *values, size_t n) {
+	matches.set_size (n + 1, first, last);
+	matches.set_base (first);
+	matches.set_first (first);
+	for (size_t i = 0; i < n; i++)
+		if (values[i].first) {
+			matches.set_first (values[i].first, i + 1);
+			matches.set_second (values[i].last, i + 1);
+		}
+	matches.set_second (last);
+}
@@ -33,15 +33,80 @@
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 
+// Steps a regex may take on a line before boost::regex gives up and throws,
+// which puts a ceiling on the time a single line spends inside the engine
+#ifndef BOOST_REGEX_MAX_STATE_COUNT
+	#define BOOST_REGEX_MAX_STATE_COUNT 1000000
+#endif
+// The instances in libboost_regex are built w/ the default ceiling
+#define BOOST_REGEX_NO_EXTERNAL_TEMPLATES
 #include <boost/regex.hpp>
 
 #include "general.hpp"
+#include "arena.hpp"
+
+// Lines longer than this aren't matched against a pathological regex
+#define DEFAULT_PATHOLOGICAL_MAX_LENGTH 4096
+
+// Result of matching a single line against a schema
+enum matchResult {
+	MATCH_FAIL = 0,
+	MATCH_OK,
+	MATCH_OVERFLOW // the match exceeded its budget and was aborted
+};
+
+// How the lines of a schema are split into columns
+enum parserType {
+	PARSER_REGEX = 0,
+	PARSER_JSON, // one JSON object per line
+	PARSER_LOGFMT, // key=value pairs
+	PARSER_DELIMITED // CSV, TSV etc.
+};
+
+/*
+ * A key of the JSON objects that's stored in a column, or whose object
+ * contains one. The fields of a schema form a tree, the first is the root.
+ */
+struct jsonField {
+	std::string name;
+	unsigned int column; // capture index, 0 if only its members are stored
+	std::vector<unsigned int> members; // indexes of the nested keys
+};
+
+// logFormat::escape of a schema that turned escaping off, and of one that
+// didn't say (the parser's default)
+#define ESCAPE_NONE -1
+#define ESCAPE_DEFAULT -2
 
 struct logFormat {
+	int parser;
 	boost::regex re;
 	std::vector<std::string> columns;
+	std::vector<std::string> keys; // where the parser finds each column
+	std::vector<std::string> dictionary; // columns stored as ids of a lookup table
+	std::vector<jsonField> fields;
+	std::vector<unsigned int> positions; // delimited: column of each field, 0 if not stored
+	int delimiter; // between fields (delimited) or pairs (logfmt), 0 = whitespace
+	int quote; // 0 = values aren't quoted
+	int escape; // makes the next character literal, ESCAPE_NONE = none
+	bool pathological; // regex is prone to catastrophic backtracking
+	unsigned int maxLength; // 0 = unlimited
 };
 
+// Capture groups of a line, stored in the thread's arena
+typedef boost::match_results<const char *,
+		arena_allocator<boost::sub_match<const char *> > > lineMatch;
+
+// Value of a column found by a parser other than the regex, first is NULL if
+// the line doesn't have it
+struct fieldValue {
+	const char *first;
+	const char *last;
+};
+
+matchResult matchLine (const logFormat &, const char *, const char *, lineMatch &);
+void fillMatch (lineMatch &, const char *, const char *, const fieldValue *, size_t);
+
 class schema
 {
 	/*
@@ -59,6 +124,8 @@ class schema
 	 */
 	private:
 		void parseNodeset(xmlNodeSetPtr nodes);
+		bool isPathological (const std::string &);
+		int parseCharacter (xmlNodePtr);
 	
 	/*
 	 * Private variables
@@ -0,0 +1,79 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "shard.hpp"
+#include "general.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+/*
+ * Constructor
+ */
+shardRing::shardRing () : m_nNext (0) {
+	// shards are added by the pipeline
+}
+
+/*
+ * Put a shard on the ring.
+ *
+ * @param shard index of its sink
+ * @param strName name of the shard, its points depend on nothing else
+ * @param weight share of the keys relative to the other shards
+ */
+void shardRing::add (unsigned int shard, const string &strName, int weight) {
+	if (weight < 1)
+		weight = 1;
+	for (int i = 0; i < SHARD_POINTS * weight; i++) {
+		char suffix[16];
+		string strPoint = strName + string (suffix, snprintf (suffix, sizeof (suffix), "#%d", i));
+		point p;
+		p.hash = hashBytes (strPoint.data (), strPoint.length ());
+		p.shard = shard;
+		m_vPoints.insert (upper_bound (m_vPoints.begin (), m_vPoints.end (), p), p);
+	}
+	m_vShards.push_back (shard);
+}
+
+/*
+ * Get the shard of a key. Must not be called on an empty ring.
+ *
+ * @param first start of the key
+ * @param last end of the key
+ * @return index of the shard's sink
+ */
+unsigned int shardRing::find (const char *first, const char *last) const {
+	point key;
+	key.hash = hashBytes (first, last - first);
+	vector<point>::const_iterator p = lower_bound (m_vPoints.begin (), m_vPoints.end (), key);
+	if (p == m_vPoints.end ())
+		p = m_vPoints.begin ();
+	return p->shard;
+}
+
+/*
+ * Get the next shard in turn. Must not be called on an empty ring.
+ *
+ * @return index of the shard's sink
+ */
+unsigned int shardRing::next () {
+	return m_vShards[__sync_fetch_and_add (&m_nNext, 1) % m_vShards.size ()];
+}
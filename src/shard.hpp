@@ -0,0 +1,67 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef SHARD_HPP_
+#define SHARD_HPP_
+
+#include <string>
+#include <vector>
+
+// Points of a shard on the ring per unit of its weight
+#define SHARD_POINTS 128
+
+/*
+ * shardRing
+ * Spreads the rows of a log file over its shard destinations by consistent
+ * hashing. Every shard owns SHARD_POINTS * weight points on a ring of 64 bit
+ * hashes, placed by hashing its name; a key belongs to the shard of the first
+ * point at or after the key's hash. The points only depend on the names, so
+ * a shard that's added only takes over the keys in front of its own points
+ * (about 1/n of them) and all other keys stay on their shard.
+ */
+class shardRing {
+	public:
+		shardRing ();
+
+		void add (unsigned int, const std::string &, int);
+		bool empty () const { return m_vShards.empty (); }
+
+		// Shard of a key, the index of its sink
+		unsigned int find (const char *, const char *) const;
+		// Shards in turn, for log files w/out a key
+		unsigned int next ();
+
+	private:
+		struct point {
+			unsigned long long hash;
+			unsigned int shard;
+			bool operator< (const point &other) const { return hash < other.hash; }
+		};
+
+	private:
+		std::vector<point> m_vPoints; // sorted by hash
+		std::vector<unsigned int> m_vShards;
+		volatile unsigned long m_nNext;
+};
+
+#endif /*SHARD_HPP_*/
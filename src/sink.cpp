@@ -0,0 +1,1998 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "sink.hpp"
+#include "messages.hpp"
+#include "query.hpp"
+#include "dictionary.hpp"
+
+#include <sstream>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/*
+ * Append a string to a buffer that's known to be large enough.
+ *
+ * @return position after the appended string
+ */
+static char *append (char *dst, const char *src, size_t len) {
+	memcpy (dst, src, len);
+	return dst + len;
+}
+
+static char *append (char *dst, const char *src) {
+	return append (dst, src, strlen (src));
+}
+
+/*
+ * Format a time (UTC) w/ strftime.
+ */
+static string formatTime (const char *format, time_t t) {
+	struct tm tmTime;
+	char buf[64];
+	gmtime_r (&t, &tmTime);
+	strftime (buf, sizeof (buf), format, &tmTime);
+	return buf;
+}
+
+/*
+ * Length of a partition in seconds.
+ *
+ * @param period partitionPeriod
+ */
+time_t partitionLength (int period) {
+	return period == PARTITION_HOURLY ? 3600 : 86400;
+}
+
+/*
+ * Start of the partition that contains a point in time. Partitions are
+ * aligned to UTC hours/ days.
+ */
+time_t partitionStart (int period, time_t t) {
+	return t - t % partitionLength (period);
+}
+
+/*
+ * Name of the partition that starts at a point in time, YYYYMMDD for daily and
+ * YYYYMMDDHH for hourly partitions. Names sort in time order.
+ */
+string partitionName (int period, time_t start) {
+	return formatTime (period == PARTITION_HOURLY ? "%Y%m%d%H" : "%Y%m%d", start);
+}
+
+/*
+ * Check if a string is a partition name of the given period, anything else
+ * (i.e. partitions created by hand) is left alone.
+ */
+static bool isPartitionName (int period, const string &strName) {
+	if (strName.length () != (period == PARTITION_HOURLY ? 10u : 8u))
+		return false;
+	for (string::const_iterator iter = strName.begin (); iter != strName.end (); iter++)
+		if (!isdigit (*iter))
+			return false;
+	return true;
+}
+
+/*
+ * Constructor
+ */
+sink::sink (const destinationInfo &info) : m_info (info), m_nBatchRows (0), m_pValues (NULL),
+		m_bThread (false), m_bStopThread (false), m_bSending (false), m_nQueuedBatches (0),
+		m_nSettled (0), m_nSplit (0), m_nSyncing (0), m_nState (SINK_UP),
+		m_nBackoff (0), m_nextAttempt (0), m_bPrepared (false), m_bUnpartitioned (false) {
+	// recover () holds the connection while setting up the table, which takes it again
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init (&attr);
+	pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init (&m_lock, &attr);
+	pthread_mutexattr_destroy (&attr);
+	pthread_mutex_init (&m_queueLock, NULL);
+	pthread_cond_init (&m_queueCond, NULL);
+	pthread_cond_init (&m_idleCond, NULL);
+	memset (&stats, 0, sizeof (stats));
+	memset (m_aRateSecond, 0, sizeof (m_aRateSecond));
+	memset (m_aRateRows, 0, sizeof (m_aRateRows));
+}
+
+/*
+ * Destructor
+ */
+sink::~sink () {
+	this->stop ();
+	pthread_cond_destroy (&m_idleCond);
+	pthread_cond_destroy (&m_queueCond);
+	pthread_mutex_destroy (&m_queueLock);
+	pthread_mutex_destroy (&m_lock);
+}
+
+/*
+ * Create the sink for the database software of a destination.
+ *
+ * @param info the destination
+ * @return the (not yet connected) sink, NULL if the software isn't supported
+ */
+sink *sink::create (const destinationInfo &info) {
+	if (isFile (info.software))
+		return new fileSink (info);
+
+
+	#ifdef WITH_POSTGRESQL
+		if (isPostgresql (info.software))
+			return new pgsqlSink (info);
+	#endif
+
+	#ifdef WITH_MYSQL
+		if (isMysql (info.software))
+			return new mysqlSink (info);
+	#endif
+
+	return NULL;
+}
+
+string sink::name () {
+	// The shards of a log file usually have the same table
+	return m_info.shard.empty () ? m_info.table : m_info.table + "@" + m_info.shard;
+}
+
+bool sink::storesLines () {
+	return false;
+}
+
+/*
+ * Create the table if it doesn't exist yet, the lookup tables of its
+ * dictionary columns and the current partitions. If the database is down,
+ * the sender thread does that once it's back.
+ *
+ * @param vColumns names of all columns, excluding the id and timestamp
+ * @param vDictionaries the columns that hold dictionary ids
+ * @return false if the table couldn't be created
+ */
+bool sink::prepare (const vector<string> &vColumns, const vector<string> &vDictionaries) {
+	m_vColumns = vColumns;
+	m_vDictionaries = vDictionaries;
+	return m_nState != SINK_UP || this->setUp ();
+}
+
+bool sink::setUp () {
+	if (!this->tableExists () && !this->createTable (m_vColumns))
+		return false;
+	for (vector<string>::iterator iter = m_vDictionaries.begin ();
+			iter != m_vDictionaries.end (); iter++)
+		if (!this->createDictionary (*iter))
+			return false;
+
+	// Rows can't be inserted until their partition exists
+	if (!this->maintainPartitions (time (NULL)))
+		message (LEVEL_WARNING, "Couldn't set up the partitions of %s", this->name ().c_str ());
+	m_bPrepared = true;
+	return true;
+}
+
+/*
+ * Open the circuit: stop sending until the next attempt to reconnect, which
+ * comes later after every failed one.
+ */
+void sink::disconnected () {
+	m_nBackoff = (m_nBackoff == 0) ? SINK_RETRY_MIN : min (2 * m_nBackoff, SINK_RETRY_MAX);
+	m_nextAttempt = time (NULL) + m_nBackoff;
+	if (m_nState == SINK_UP)
+		message (LEVEL_WARNING, "Lost the connection for %s, queueing its rows until it's back",
+				this->name ().c_str ());
+	m_nState = SINK_DOWN;
+}
+
+/*
+ * Reconnect, and finish setting up if the database was down from the start.
+ * The maintenance thread can't use the connection in between.
+ *
+ * @return true if the sink is up again
+ */
+bool sink::recover () {
+	m_nState = SINK_CONNECTING;
+	pthread_mutex_lock (&m_lock);
+	bool bUp = this->connect ();
+	if (bUp) {
+		m_nState = SINK_UP;
+		if (!m_bPrepared && !this->setUp ()) {
+			message (LEVEL_ERROR, "Couldn't create the table %s", this->name ().c_str ());
+			bUp = false;
+		}
+	}
+	pthread_mutex_unlock (&m_lock);
+
+	if (!bUp) {
+		m_nState = SINK_CONNECTING;
+		this->disconnected ();
+		return false;
+	}
+
+	message (LEVEL_INFO, "Reconnected %s", this->name ().c_str ());
+	m_nBackoff = 0;
+	stats.reconnects++;
+	return true;
+}
+
+/*
+ * Name of the state for the .stats file.
+ */
+const char *sink::state () {
+	switch (m_nState) {
+		case SINK_UP:
+			return "up";
+		case SINK_DOWN:
+			return "down";
+		default:
+			return "connecting";
+	}
+}
+
+bool sink::healthy () {
+	return true;
+}
+
+/*
+ * Create the table for the log file.
+ *
+ * TODO:
+ * - make sure that the column names don't conflict w/ SQL syntax (reserved words)
+ *
+ * @param vColumns names of all columns, excluding the id and timestamp
+ * @return true on success, false otherwise
+ */
+bool sink::createTable (const vector<string> &vColumns) {
+	ostringstream strQuery;
+	strQuery << "CREATE TABLE " << m_info.table << "(" << this->idColumn ()
+			 << this->timestampColumn ();
+	for (vector<string>::const_iterator iter = vColumns.begin ();
+			iter != vColumns.end (); iter++) {
+		if (find (m_vDictionaries.begin (), m_vDictionaries.end (), *iter) != m_vDictionaries.end ())
+			strQuery << "," << *iter << " bigint DEFAULT 0 NOT NULL";
+		else
+			strQuery << "," << *iter << " text DEFAULT '' NOT NULL";
+	}
+	strQuery << ")" << this->tableOptions () << ";";
+
+	pthread_mutex_lock (&m_lock);
+	bool bResult = this->execute (strQuery.str ().c_str (), strQuery.str ().length ());
+	pthread_mutex_unlock (&m_lock);
+
+	return bResult;
+}
+
+/*
+ * Name of the lookup table of a dictionary column.
+ */
+string sink::dictionaryTable (const string &strColumn) {
+	return m_info.table + "_" + strColumn;
+}
+
+/*
+ * Create the lookup table of a dictionary column. The ids aren't generated by
+ * the database, they're the hashes of the values.
+ *
+ * @param strColumn the column
+ * @return true on success, false otherwise
+ */
+bool sink::createDictionary (const string &strColumn) {
+	string strQuery = "CREATE TABLE IF NOT EXISTS " + this->dictionaryTable (strColumn)
+			+ "(id bigint not null primary key,value text not null);";
+
+	pthread_mutex_lock (&m_lock);
+	bool bResult = this->execute (strQuery.c_str (), strQuery.length ());
+	pthread_mutex_unlock (&m_lock);
+
+	return bResult;
+}
+
+/*
+ * Precompile the statement prefix for the rows of a dictionary.
+ *
+ * @param strColumn the dictionary column
+ * @return "INSERT INTO table_column(id,value) VALUES "
+ */
+string sink::dictionaryPrefix (const string &strColumn) {
+	return "INSERT INTO " + this->dictionaryTable (strColumn) + "(id,value) VALUES ";
+}
+
+/*
+ * End of the statement of a batch of dictionary rows, after the rows.
+ */
+string sink::dictionarySuffix (const string &) {
+	return "";
+}
+
+/*
+ * Precompile the statement prefix for rows w/ the given columns.
+ *
+ * @param vColumns columns in the order of the values of a row
+ * @return "INSERT INTO table(columns) VALUES "
+ */
+string sink::insertPrefix (const vector<string> &vColumns) {
+	string strPrefix = "INSERT INTO " + m_info.table + "(";
+	for (vector<string>::const_iterator iter = vColumns.begin ();
+			iter != vColumns.end (); iter++) {
+		if (iter != vColumns.begin ())
+			strPrefix += ",";
+		strPrefix += *iter;
+	}
+	return strPrefix + ") VALUES ";
+}
+
+/*
+ * Add a row to the pending batch of the log's table. The batch is queued as a
+ * single statement once it's full, or by flush(). Values are escaped straight
+ * into the batch buffer, which keeps its memory from one batch to the next.
+ *
+ * @param strPrefix precompiled by insertPrefix()
+ * @param matches the capture groups, one per column
+ * @param eventTime capture group that's also stored in the timestamp column, 0 for none
+ * @param vExtra values of the remaining columns, i.e. wildcard segments
+ * @param values the dictionary of an (id, value) row, it forgets the id if
+ * the row is lost; NULL for a row of the log's table
+ * @param id the id of the row
+ * @return true on success, false if a batch had to be dropped
+ */
+bool sink::insert (const string &strPrefix, const lineMatch &matches, int eventTime,
+		const vector<string> &vExtra, dictionary *values, unsigned long long id) {
+	// Fail fast while the database is down and there's no room left
+	if (m_nState != SINK_UP && stats.queued >= (unsigned long)m_info.queueSize) {
+		__sync_fetch_and_add (&stats.dropped, 1);
+		if (values)
+			values->forget (id);
+		return false;
+	}
+	size_t length = this->rowLength (matches, eventTime, vExtra);
+
+	pthread_mutex_lock (&m_queueLock);
+	// Rows for other columns (i.e. another schema) can't share the statement
+	bool bResult = true;
+	if (m_nBatchRows > 0 && m_strPrefix != strPrefix)
+		bResult = this->queueBatch ();
+	if (m_nBatchRows == 0) {
+		m_strPrefix = strPrefix;
+		m_strBatch.assign (strPrefix);
+		m_pValues = values;
+	}
+
+	size_t pos = m_strBatch.length ();
+	m_strBatch.resize (pos + length);
+	char *p = this->formatRow (&m_strBatch[pos], m_nBatchRows == 0, matches, eventTime, vExtra);
+	m_strBatch.resize (p - m_strBatch.data ());
+	// Where the row is, in case the batch has to be split
+	if (m_nBatchRows > 0)
+		pos += this->separatorLength ();
+	m_vSpans.push_back (make_pair (pos, m_strBatch.length ()));
+	if (values)
+		m_vIds.push_back (id);
+	m_nBatchRows++;
+
+	if (m_nBatchRows >= (unsigned int)m_info.batchSize || m_strBatch.length () >= SINK_MAX_BATCH_BYTES)
+		bResult = this->queueBatch () && bResult;
+	pthread_mutex_unlock (&m_queueLock);
+
+	return bResult;
+}
+
+/*
+ * Every value is at most escaped to twice its length, plus quotes and
+ * separators.
+ */
+size_t sink::rowLength (const lineMatch &matches, int eventTime, const vector<string> &vExtra) {
+	size_t length = 4;
+	if (eventTime > 0)
+		length += 2 * matches[eventTime].length () + 8;
+	// Skip the 0-th match because that just contains the original string
+	for (lineMatch::const_iterator iter = matches.begin () + 1;
+			iter != matches.end (); iter++)
+		length += 2 * (iter->second - iter->first) + 4;
+	for (vector<string>::const_iterator iter = vExtra.begin ();
+			iter != vExtra.end (); iter++)
+		length += 2 * iter->length () + 4;
+	return length;
+}
+
+/*
+ * Write a row as a VALUES tuple.
+ *
+ * @param dst room for the row, see insert()
+ * @param bFirst first row of the batch (no separator)
+ * @return position after the row
+ */
+char *sink::formatRow (char *dst, bool bFirst, const lineMatch &matches, int eventTime,
+		const vector<string> &vExtra) {
+	if (!bFirst)
+		*dst++ = ',';
+	*dst++ = '(';
+	for (lineMatch::const_iterator iter = matches.begin () + 1;
+			iter != matches.end (); iter++) {
+		if (iter != matches.begin () + 1)
+			*dst++ = ',';
+		dst = this->escape (dst, iter->first, iter->second);
+	}
+	// Fall back to the ingest time if the line didn't have a time
+	if (eventTime > 0) {
+		*dst++ = ',';
+		if (matches[eventTime].length () > 0)
+			dst = this->escape (dst, matches[eventTime].first, matches[eventTime].second);
+		else
+			dst = append (dst, "now()");
+	}
+	for (vector<string>::const_iterator iter = vExtra.begin ();
+			iter != vExtra.end (); iter++) {
+		*dst++ = ',';
+		dst = this->escape (dst, iter->c_str (), iter->c_str () + iter->length ());
+	}
+	*dst++ = ')';
+	return dst;
+}
+
+size_t sink::separatorLength () {
+	return 1;
+}
+
+/*
+ * Count rows the database has stored.
+ */
+void sink::stored (unsigned int rows) {
+	stats.rows += rows;
+
+	// One bucket per second of the rate window
+	time_t now = time (NULL);
+	int i = now % SINK_RATE_WINDOW;
+	if (m_aRateSecond[i] != now) {
+		m_aRateSecond[i] = now;
+		m_aRateRows[i] = 0;
+	}
+	m_aRateRows[i] += rows;
+}
+
+/*
+ * Average number of rows stored per second over the last SINK_RATE_WINDOW
+ * seconds.
+ */
+double sink::rowsPerSecond () {
+	time_t now = time (NULL);
+	unsigned long rows = 0;
+
+	pthread_mutex_lock (&m_lock);
+	for (int i = 0; i < SINK_RATE_WINDOW; i++)
+		if (m_aRateSecond[i] > now - SINK_RATE_WINDOW)
+			rows += m_aRateRows[i];
+	pthread_mutex_unlock (&m_lock);
+
+	return (double)rows / SINK_RATE_WINDOW;
+}
+
+/*
+ * Queue the pending rows.
+ *
+ * @param bWait wait until the database acknowledged all batches, unless it's
+ * down
+ * @return true on success, false if the rows had to be dropped
+ */
+bool sink::flush (bool bWait) {
+	pthread_mutex_lock (&m_queueLock);
+	bool bResult = m_nBatchRows > 0 ? this->queueBatch () : true;
+	while (bWait && m_nState == SINK_UP && (!m_dQueue.empty () || m_bSending))
+		pthread_cond_wait (&m_idleCond, &m_queueLock);
+	pthread_mutex_unlock (&m_queueLock);
+
+	return bResult;
+}
+
+/*
+ * Durability barrier: queue the pending rows and wait until every batch
+ * queued up to now has been acknowledged by the database. Batches queued
+ * meanwhile don't hold it up. Losses are reported to every caller that hasn't
+ * seen them yet, each one keeps its own count.
+ *
+ * @param nErrors errors () when the caller last synced, updated
+ * @return false if the sink is down (the rows are queued, not stored), or
+ * batches failed/ rows were dropped since nErrors
+ */
+bool sink::sync (unsigned long &nErrors) {
+	pthread_mutex_lock (&m_queueLock);
+	bool bResult = m_nBatchRows > 0 ? this->queueBatch () : true;
+	unsigned long target = m_nQueuedBatches;
+	m_nSyncing++;
+	while (m_nSettled < target && m_nState == SINK_UP && m_bThread)
+		pthread_cond_wait (&m_idleCond, &m_queueLock);
+	m_nSyncing--;
+	if (m_nSettled < target)
+		bResult = false;
+
+	unsigned long errors = stats.failed + stats.dropped;
+	if (errors != nErrors) {
+		nErrors = errors;
+		bResult = false;
+	}
+	pthread_mutex_unlock (&m_queueLock);
+
+	return bResult;
+}
+
+/*
+ * Losses so far, the starting point for sync ().
+ */
+unsigned long sink::errors () {
+	pthread_mutex_lock (&m_queueLock);
+	unsigned long errors = stats.failed + stats.dropped;
+	pthread_mutex_unlock (&m_queueLock);
+	return errors;
+}
+
+/*
+ * Store the pending rows and stop the sender thread.
+ */
+void sink::stop () {
+	this->flush (true);
+
+	pthread_mutex_lock (&m_queueLock);
+	bool bThread = m_bThread;
+	m_bStopThread = true;
+	pthread_cond_signal (&m_queueCond);
+	pthread_mutex_unlock (&m_queueLock);
+
+	if (bThread)
+		pthread_join (m_thread, NULL);
+	m_bThread = false;
+}
+
+/*
+ * Hand the pending batch to the sender thread, must be called w/ the queue
+ * lock held. The thread is started w/ the first batch, fuse_main() forks
+ * after the sinks have been created.
+ *
+ * @return true on success, false if the queue was full and the batch dropped
+ */
+bool sink::queueBatch () {
+	bool bResult = true;
+	if (!m_bThread && !m_bStopThread) {
+		if (pthread_create (&m_thread, NULL, sink::thread, this) == 0)
+			m_bThread = true;
+		else
+			message (LEVEL_ERROR, "Couldn't create a thread for %s", this->name ().c_str ());
+	}
+
+	if (!m_bThread || m_dQueue.size () >= (size_t)m_info.queueSize) {
+		stats.dropped += m_nBatchRows;
+		m_strBatch.clear ();
+		if (m_pValues)
+			for (vector<unsigned long long>::iterator iter = m_vIds.begin ();
+					iter != m_vIds.end (); iter++)
+				m_pValues->forget (*iter);
+		bResult = false;
+	}
+	else {
+		if (m_pValues)
+			m_strBatch += this->dictionarySuffix (m_pValues->column);
+		m_dQueue.push_back (queuedBatch ());
+		m_dQueue.back ().query.swap (m_strBatch);
+		m_dQueue.back ().prefixLength = m_strPrefix.length ();
+		m_dQueue.back ().rows = m_nBatchRows;
+		m_dQueue.back ().spans.swap (m_vSpans);
+		m_dQueue.back ().values = m_pValues;
+		m_dQueue.back ().ids.swap (m_vIds);
+		m_nQueuedBatches++;
+		stats.queued = m_dQueue.size ();
+		// Keep the memory of an earlier batch
+		if (!m_vSpare.empty ()) {
+			m_strBatch.swap (m_vSpare.back ());
+			m_vSpare.pop_back ();
+		}
+		pthread_cond_signal (&m_queueCond);
+	}
+	m_nBatchRows = 0;
+	m_vSpans.clear ();
+	m_pValues = NULL;
+	m_vIds.clear ();
+	return bResult;
+}
+
+/*
+ * Number of batches that have been stored or failed. A split batch is counted
+ * once for each of its rows in stats.batches, but only settles w/ the last.
+ */
+unsigned long sink::settled () {
+	return stats.batches > m_nSplit ? stats.batches - m_nSplit : 0;
+}
+
+void *sink::thread (void *ptr) {
+	((sink *)ptr)->run ();
+	return NULL;
+}
+
+/*
+ * Send the queued batches. Once the queue is empty, wait for the batches in
+ * flight to be acknowledged. While the database is down the batches stay in
+ * the queue, and the connection is retried from time to time.
+ */
+void sink::run () {
+	queuedBatch batch;
+
+	pthread_mutex_lock (&m_queueLock);
+	while (!m_bStopThread || !m_dQueue.empty ()) {
+		if (m_dQueue.empty ()) {
+			pthread_cond_wait (&m_queueCond, &m_queueLock);
+			continue;
+		}
+		if (m_nState != SINK_UP) {
+			if (!m_bStopThread && time (NULL) < m_nextAttempt) {
+				struct timespec until;
+				until.tv_sec = m_nextAttempt;
+				until.tv_nsec = 0;
+				pthread_cond_timedwait (&m_queueCond, &m_queueLock, &until);
+				continue;
+			}
+			pthread_mutex_unlock (&m_queueLock);
+			bool bUp = this->recover ();
+			pthread_mutex_lock (&m_queueLock);
+
+			// Stopped: one last attempt, then the queue is given up
+			if (!bUp && m_bStopThread) {
+				for (deque<queuedBatch>::iterator iter = m_dQueue.begin ();
+						iter != m_dQueue.end (); iter++)
+					this->fail (*iter);
+				m_dQueue.clear ();
+				stats.queued = 0;
+				m_nSettled = this->settled ();
+				pthread_cond_broadcast (&m_idleCond);
+			}
+			continue;
+		}
+
+		batch.query.swap (m_dQueue.front ().query);
+		batch.prefixLength = m_dQueue.front ().prefixLength;
+		batch.rows = m_dQueue.front ().rows;
+		batch.spans.swap (m_dQueue.front ().spans);
+		batch.values = m_dQueue.front ().values;
+		batch.ids.swap (m_dQueue.front ().ids);
+		m_dQueue.pop_front ();
+		stats.queued = m_dQueue.size ();
+		m_bSending = true;
+		pthread_mutex_unlock (&m_queueLock);
+
+		// A batch that's in flight or was put back into the queue took the query
+		pthread_mutex_lock (&m_lock);
+		this->send (batch);
+		this->collect (m_info.inFlight);
+		if (!this->healthy ())
+			this->disconnected ();
+		pthread_mutex_unlock (&m_lock);
+
+		pthread_mutex_lock (&m_queueLock);
+		batch.query.clear ();
+		if (m_vSpare.size () < 2) {
+			m_vSpare.push_back (string ());
+			m_vSpare.back ().swap (batch.query);
+		}
+		if (m_dQueue.empty () && m_nState == SINK_UP) {
+			pthread_mutex_unlock (&m_queueLock);
+			pthread_mutex_lock (&m_lock);
+			this->collect (0);
+			if (!this->healthy ())
+				this->disconnected ();
+			pthread_mutex_unlock (&m_lock);
+			pthread_mutex_lock (&m_queueLock);
+		}
+		// Every batch is counted in stats.batches once it's acknowledged or lost
+		m_nSettled = this->settled ();
+		// Nothing left to wait for, or nothing can be done about it now
+		if (m_dQueue.empty () || m_nState != SINK_UP) {
+			m_bSending = false;
+			pthread_cond_broadcast (&m_idleCond);
+		}
+		else if (m_nSyncing > 0)
+			pthread_cond_broadcast (&m_idleCond);
+	}
+	pthread_mutex_unlock (&m_queueLock);
+}
+
+/*
+ * Send a batch and wait for the result. Sinks that can have several batches
+ * in flight override this, along w/ collect().
+ *
+ * @param batch the INSERT statement, its prefix (see insertPrefix ()) and
+ * number of rows
+ * @return true on success, false otherwise
+ */
+bool sink::send (queuedBatch &batch) {
+	return this->account (this->execute (batch.query.c_str (), batch.query.length ()), batch);
+}
+
+/*
+ * Count a batch that was sent synchronously. If it failed because the
+ * connection was lost, it's sent again later instead; if the database
+ * rejected it, its rows are retried one by one.
+ *
+ * @return bResult
+ */
+bool sink::account (bool bResult, queuedBatch &batch) {
+	// Lost w/ the connection
+	if (!bResult && !this->healthy ()) {
+		this->requeue (batch);
+		return false;
+	}
+	if (!bResult && this->split (batch))
+		return false;
+
+	if (bResult) {
+		stats.batches++;
+		this->stored (batch.rows);
+	}
+	else
+		this->fail (batch);
+	return bResult;
+}
+
+/*
+ * Count a batch that failed and won't be sent again. The dictionary of its
+ * rows forgets their ids, so the values are sent again when they're seen
+ * next.
+ *
+ * @param batch the batch
+ */
+void sink::fail (queuedBatch &batch) {
+	stats.batches++;
+	stats.failed++;
+	stats.failedRows += batch.rows;
+	if (batch.values)
+		for (vector<unsigned long long>::iterator iter = batch.ids.begin ();
+				iter != batch.ids.end (); iter++)
+			batch.values->forget (*iter);
+}
+
+/*
+ * Put a batch back at the front of the queue, it's sent again once the sink
+ * has reconnected. Batches that are put back one after the other end up in
+ * the reverse order, so the oldest has to come last. May be called w/ the
+ * connection lock held.
+ *
+ * @param batch the batch, its query is moved into the queue
+ */
+void sink::requeue (queuedBatch &batch) {
+	pthread_mutex_lock (&m_queueLock);
+	m_dQueue.push_front (queuedBatch ());
+	m_dQueue.front ().query.swap (batch.query);
+	m_dQueue.front ().prefixLength = batch.prefixLength;
+	m_dQueue.front ().rows = batch.rows;
+	m_dQueue.front ().spans.swap (batch.spans);
+	m_dQueue.front ().values = batch.values;
+	m_dQueue.front ().ids.swap (batch.ids);
+	stats.queued = m_dQueue.size ();
+	pthread_cond_signal (&m_queueCond);
+	pthread_mutex_unlock (&m_queueLock);
+}
+
+/*
+ * A single bad value fails the whole statement, so the rows of a batch the
+ * database rejected go back to the front of the queue as batches of one row;
+ * only the bad ones fail then. Lines written to a file aren't split, the
+ * file itself failed. May be called w/ the connection lock held.
+ *
+ * @param batch the failed batch
+ * @return false if it can't be split, i.e. it has a single row
+ */
+bool sink::split (queuedBatch &batch) {
+	if (batch.rows < 2 || batch.spans.size () != batch.rows || this->storesLines ()
+			|| (batch.values && batch.ids.size () != batch.rows))
+		return false;
+	static messageLimit limit;
+	messageLimited (limit, LEVEL_INFO, "Retrying the %u rows of a failed batch for %s one by one",
+			batch.rows, this->name ().c_str ());
+
+	pthread_mutex_lock (&m_queueLock);
+	for (size_t i = batch.spans.size (); i-- > 0; ) {
+		const pair<size_t, size_t> &span = batch.spans[i];
+		m_dQueue.push_front (queuedBatch ());
+		queuedBatch &row = m_dQueue.front ();
+		row.query.reserve (batch.prefixLength + span.second - span.first);
+		row.query.assign (batch.query, 0, batch.prefixLength);
+		row.query.append (batch.query, span.first, span.second - span.first);
+		row.prefixLength = batch.prefixLength;
+		row.rows = 1;
+		row.spans.push_back (make_pair (batch.prefixLength, row.query.length ()));
+		row.values = batch.values;
+		if (batch.values) {
+			row.ids.push_back (batch.ids[i]);
+			row.query += this->dictionarySuffix (batch.values->column);
+		}
+	}
+	// Settled once all of its rows are
+	m_nSplit += batch.rows - 1;
+	stats.queued = m_dQueue.size ();
+	pthread_cond_signal (&m_queueCond);
+	pthread_mutex_unlock (&m_queueLock);
+	return true;
+}
+
+/*
+ * Wait until at most the given number of batches are unacknowledged.
+ */
+bool sink::collect (size_t) {
+	return true;
+}
+
+/*
+ * Create the current partition and the next ones (<partition-ahead>) if they
+ * don't exist yet, then drop the partitions that are older than the
+ * retention. Called when the table is set up and periodically from the
+ * maintenance thread.
+ *
+ * @param now current time
+ * @return true on success, false if any partition couldn't be created/ dropped
+ */
+bool sink::maintainPartitions (time_t now) {
+	// Done when the database is back
+	if (m_info.partition == PARTITION_NONE || m_nState != SINK_UP)
+		return true;
+
+	time_t length = partitionLength (m_info.partition);
+	time_t current = partitionStart (m_info.partition, now);
+	set<string> sPartitions;
+	bool bResult = true;
+
+	pthread_mutex_lock (&m_lock);
+	// Ask the database every time, partitions may have been changed by hand
+	if (!this->listPartitions (sPartitions)) {
+		// Once, an existing table isn't going to be partitioned by itself
+		bool bWarn = !m_bUnpartitioned;
+		m_bUnpartitioned = true;
+		pthread_mutex_unlock (&m_lock);
+		if (bWarn)
+			message (LEVEL_WARNING, "Couldn't list the partitions of %s, is it a partitioned table?",
+					m_info.table.c_str ());
+		return false;
+	}
+	m_bUnpartitioned = false;
+
+	for (int i = 0; i <= m_info.partitionAhead; i++) {
+		time_t start = current + i * length;
+		string strName = partitionName (m_info.partition, start);
+		if (sPartitions.count (strName))
+			continue;
+		if (this->addPartition (strName, start, start + length))
+			sPartitions.insert (strName);
+		else {
+			message (LEVEL_WARNING, "Couldn't create partition %s of %s", strName.c_str (),
+					m_info.table.c_str ());
+			bResult = false;
+		}
+	}
+
+	// Drop whole partitions instead of deleting rows
+	if (m_info.retention > 0) {
+		string strOldest = partitionName (m_info.partition,
+				current - (m_info.retention - 1) * length);
+		for (set<string>::iterator iter = sPartitions.begin ();
+				iter != sPartitions.end () && *iter < strOldest; iter++) {
+			if (!isPartitionName (m_info.partition, *iter))
+				continue;
+			if (!this->dropPartition (*iter)) {
+				message (LEVEL_WARNING, "Couldn't drop partition %s of %s", iter->c_str (),
+						m_info.table.c_str ());
+				bResult = false;
+			}
+		}
+	}
+
+	// Rows whose time is outside of the partitions above
+	if (!this->maintainCatchAll (m_info.retention > 0 ? current - (m_info.retention - 1) * length : 0)) {
+		message (LEVEL_WARNING, "Couldn't maintain the catch-all partition of %s, rows outside "
+				"of the partitions are rejected", m_info.table.c_str ());
+		bResult = false;
+	}
+	pthread_mutex_unlock (&m_lock);
+
+	return bResult;
+}
+
+string sink::timestampColumn () {
+	return "timestamp timestamp default now()";
+}
+
+string sink::tableOptions () {
+	return "";
+}
+
+bool sink::listPartitions (set<string> &) {
+	return false;
+}
+
+bool sink::addPartition (const string &, time_t, time_t) {
+	return false;
+}
+
+bool sink::dropPartition (const string &) {
+	return false;
+}
+
+bool sink::maintainCatchAll (time_t) {
+	return true;
+}
+
+queryCursor *sink::createCursor () {
+	return NULL;
+}
+
+/*
+ * Create the cursor of a .query. The rows have the timestamp and the columns
+ * in the order of vColumns, dictionary columns are looked up in their tables;
+ * they're sorted by time.
+ *
+ * @param filter the conditions
+ * @param vColumns names of all columns, excluding the id and timestamp
+ * @return the cursor (not connected yet), NULL if the sink can't be queried
+ */
+queryCursor *sink::openQuery (const queryFilter &filter, const vector<string> &vColumns) {
+	queryCursor *cursor = this->createCursor ();
+	if (cursor == NULL)
+		return NULL;
+
+	ostringstream strQuery;
+	strQuery << "SELECT t.timestamp";
+	for (vector<string>::const_iterator iter = vColumns.begin ();
+			iter != vColumns.end (); iter++) {
+		if (find (m_vDictionaries.begin (), m_vDictionaries.end (), *iter) != m_vDictionaries.end ())
+			strQuery << ",COALESCE((SELECT value FROM " << this->dictionaryTable (*iter)
+					 << " WHERE id = t." << *iter << "),'')";
+		else
+			strQuery << ",t." << *iter;
+	}
+	strQuery << " FROM " << m_info.table << " t";
+
+	// The values are quoted once the cursor has connected
+	vector<string> vWhere;
+	if (!filter.from.empty ()) {
+		vWhere.push_back ("t.timestamp >= ?");
+		cursor->parameters.push_back (filter.from);
+	}
+	if (!filter.to.empty ()) {
+		vWhere.push_back ("t.timestamp < ?");
+		cursor->parameters.push_back (filter.to);
+	}
+	for (vector<pair<string, string> >::const_iterator iter = filter.equals.begin ();
+			iter != filter.equals.end (); iter++) {
+		const string &strValue = iter->second;
+		// A dictionary column is compared by the ids of the value, they depend
+		// on the key that was used when it was stored
+		if (find (m_vDictionaries.begin (), m_vDictionaries.end (), iter->first) != m_vDictionaries.end ()) {
+			if (strValue.empty ())
+				vWhere.push_back ("t." + iter->first + " = 0");
+			else {
+				vWhere.push_back ("t." + iter->first + " IN (SELECT id FROM "
+						+ this->dictionaryTable (iter->first) + " WHERE value = ?)");
+				cursor->parameters.push_back (strValue);
+			}
+		}
+		else {
+			vWhere.push_back ("t." + iter->first + " = ?");
+			cursor->parameters.push_back (strValue);
+		}
+	}
+	for (vector<string>::iterator iter = vWhere.begin (); iter != vWhere.end (); iter++)
+		strQuery << (iter == vWhere.begin () ? " WHERE " : " AND ") << *iter;
+
+	strQuery << " ORDER BY t.timestamp,t.id";
+	if (filter.limit > 0)
+		strQuery << " LIMIT " << filter.limit;
+	cursor->statement = strQuery.str ();
+	return cursor;
+}
+
+/*
+ * File Helper functions
+ */
+bool isFile (const string &args) {
+	return args == "file";
+}
+
+/*
+ * Constructor
+ */
+fileSink::fileSink (const destinationInfo &info) : sink (info), m_fd (-1), m_inode (0) {
+	// A file has no partitions
+	m_info.partition = PARTITION_NONE;
+}
+
+/*
+ * Destructor
+ */
+fileSink::~fileSink () {
+	this->stop ();
+	if (m_fd >= 0)
+		close (m_fd);
+}
+
+/*
+ * Open (or create) the file for appending.
+ */
+bool fileSink::connect () {
+	if (m_info.path.empty ()) {
+		message (LEVEL_ERROR, "A file destination needs a <path>");
+		return false;
+	}
+	if (m_fd >= 0)
+		close (m_fd);
+
+	struct stat st;
+	m_fd = open (m_info.path.c_str (), O_WRONLY | O_APPEND | O_CREAT, 0640);
+	if (m_fd < 0 || fstat (m_fd, &st) != 0) {
+		message (LEVEL_ERROR, "Couldn't open %s: %s", m_info.path.c_str (), strerror (errno));
+		if (m_fd >= 0)
+			close (m_fd);
+		m_fd = -1;
+		return false;
+	}
+	fcntl (m_fd, F_SETFD, FD_CLOEXEC);
+	m_inode = st.st_ino;
+	return true;
+}
+
+/*
+ * connect() created the file.
+ */
+bool fileSink::tableExists () {
+	return true;
+}
+
+string fileSink::name () {
+	return m_info.path;
+}
+
+bool fileSink::storesLines () {
+	return true;
+}
+
+/*
+ * The lines are stored as they are, w/out dictionaries.
+ */
+string fileSink::dictionaryPrefix (const string &) {
+	return "";
+}
+
+bool fileSink::createDictionary (const string &) {
+	return true;
+}
+
+/*
+ * The file couldn't be (re)opened, i.e. the disk w/ the archive is gone.
+ */
+bool fileSink::healthy () {
+	return m_fd >= 0;
+}
+
+/*
+ * The lines are written as they are.
+ */
+string fileSink::insertPrefix (const vector<string> &) {
+	return "";
+}
+
+string fileSink::idColumn () {
+	return "";
+}
+
+char *fileSink::escape (char *dst, const char *first, const char *last) {
+	return append (dst, first, last - first);
+}
+
+/*
+ * The lines are only durable once they've reached the disk.
+ */
+bool fileSink::sync (unsigned long &nErrors) {
+	bool bResult = sink::sync (nErrors);
+	pthread_mutex_lock (&m_lock);
+	if (m_fd >= 0 && fdatasync (m_fd) != 0) {
+		message (LEVEL_ERROR, "Couldn't sync %s: %s", m_info.path.c_str (), strerror (errno));
+		bResult = false;
+	}
+	pthread_mutex_unlock (&m_lock);
+	return bResult;
+}
+
+/*
+ * Append a batch of lines w/ a single write, reopen the file first if it has
+ * been moved away.
+ */
+bool fileSink::execute (const char *buf, size_t length) {
+	struct stat st;
+	if ((m_fd < 0 || stat (m_info.path.c_str (), &st) != 0 || st.st_ino != m_inode)
+			&& !this->connect ())
+		return false;
+
+	while (length > 0) {
+		ssize_t n = write (m_fd, buf, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			static messageLimit limit;
+			messageLimited (limit, LEVEL_ERROR, "Couldn't write to %s: %s", m_info.path.c_str (),
+					strerror (errno));
+			return false;
+		}
+		buf += n;
+		length -= n;
+	}
+	return true;
+}
+
+size_t fileSink::rowLength (const lineMatch &matches, int, const vector<string> &) {
+	return matches[0].length () + 1;
+}
+
+/*
+ * The whole line, the 0-th match.
+ */
+char *fileSink::formatRow (char *dst, bool, const lineMatch &matches, int,
+		const vector<string> &) {
+	dst = append (dst, matches[0].first, matches[0].length ());
+	*dst++ = '\n';
+	return dst;
+}
+
+size_t fileSink::separatorLength () {
+	return 0;
+}
+
+#ifdef WITH_POSTGRESQL
+	/*
+ 	* PostgreSQL Helper functions
+ 	*/
+	bool isPostgresql (const string &args) {
+		return (args == "postgresql" || args == "pgsql") ? true : false;
+	}
+
+	/*
+	 * Constructor
+	 */
+	pgsqlSink::pgsqlSink (const destinationInfo &info) : sink (info), m_pConnection (NULL),
+			m_bBroken (false), m_nBatchId (0) {
+		// connect() opens the connection
+	}
+
+	/*
+	 * Destructor
+	 */
+	pgsqlSink::~pgsqlSink () {
+		this->stop ();
+		if (m_pConnection)
+			PQfinish (m_pConnection);
+	}
+
+	/*
+	 * Open the connection. Inserts are sent in pipeline mode: a batch goes out
+	 * w/out waiting for the previous ones to be acknowledged, so the throughput
+	 * doesn't depend on the round trip time to the server.
+	 */
+	bool pgsqlSink::connect () {
+		// Reconnecting: what's still in flight on the old connection is sent again
+		if (m_pConnection) {
+			#ifdef LIBPQ_HAS_PIPELINING
+				if (!m_dInFlight.empty ())
+					this->abort ("reconnecting\n");
+			#endif
+			PQfinish (m_pConnection);
+		}
+		m_bBroken = false;
+
+		m_pConnection = PQconnectdb (this->connectionString ().c_str ());
+		if (PQstatus (m_pConnection) != CONNECTION_OK) {
+			message (LEVEL_ERROR, "Couldn't create a PostgreSQL connection to %s: %s",
+					m_info.database.c_str (), PQerrorMessage (m_pConnection));
+			return false;
+		}
+
+		#ifdef LIBPQ_HAS_PIPELINING
+			// Non-blocking, so sending can't deadlock w/ the server sending results
+			if (PQsetnonblocking (m_pConnection, 1) != 0 || !PQenterPipelineMode (m_pConnection)) {
+				message (LEVEL_ERROR, "Couldn't enter pipeline mode: %s", PQerrorMessage (m_pConnection));
+				return false;
+			}
+		#endif
+		return true;
+	}
+
+	bool pgsqlSink::healthy () {
+		return m_pConnection && !m_bBroken && PQstatus (m_pConnection) == CONNECTION_OK;
+	}
+
+	/*
+	 * Check if the table exists by trying to fetch zero rows (LIMIT 0).
+	 *
+	 * @return true if the table exists, false otherwise
+	 */
+	bool pgsqlSink::tableExists () {
+		string strQuery = "SELECT * FROM " + m_info.table + " LIMIT 0;";
+
+		// Don't care how many rows returned, all that matters is that the
+		// query completed successfully.
+		pthread_mutex_lock (&m_lock);
+		bool bResult = this->execute (strQuery.c_str (), strQuery.length ());
+		pthread_mutex_unlock (&m_lock);
+
+		return bResult;
+	}
+
+	/*
+	 * A partitioned table can't have a primary key w/out the partition key, the
+	 * id only has to be unique in practice.
+	 */
+	string pgsqlSink::idColumn () {
+		if (m_info.partition != PARTITION_NONE)
+			return "id bigserial not null,";
+		return "id serial not null primary key,";
+	}
+
+	/*
+	 * Partition bounds are in UTC, so partitioned tables store the time w/ the
+	 * time zone.
+	 */
+	string pgsqlSink::timestampColumn () {
+		if (m_info.partition != PARTITION_NONE)
+			return "timestamp timestamptz default now() not null";
+		return sink::timestampColumn ();
+	}
+
+	/*
+	 * Declarative partitioning, the partitions themselves are created by
+	 * maintainPartitions().
+	 */
+	string pgsqlSink::tableOptions () {
+		if (m_info.partition != PARTITION_NONE)
+			return " PARTITION BY RANGE (timestamp)";
+		return "";
+	}
+	/*
+	 * Lookup tables created by earlier versions skipped duplicate ids w/ a
+	 * rule, which races w/ concurrent inserts of the same id; the rule is
+	 * dropped, see dictionarySuffix ().
+	 */
+	bool pgsqlSink::createDictionary (const string &strColumn) {
+		if (!sink::createDictionary (strColumn))
+			return false;
+
+		string strTable = this->dictionaryTable (strColumn);
+		string strQuery = "DROP RULE IF EXISTS " + strTable + "_known ON " + strTable + ";";
+		pthread_mutex_lock (&m_lock);
+		bool bResult = this->execute (strQuery.c_str (), strQuery.length ());
+		pthread_mutex_unlock (&m_lock);
+
+		return bResult;
+	}
+
+	/*
+	 * Ids that are stored already are skipped, so a value that's sent again
+	 * (i.e. after a restart) doesn't fail the whole batch. An id that's stored
+	 * w/ another value fails the row (id can't be NULL) instead of making it
+	 * read back as the other value.
+	 */
+	string pgsqlSink::dictionarySuffix (const string &strColumn) {
+		return " ON CONFLICT (id) DO UPDATE SET id = NULL WHERE "
+				+ this->dictionaryTable (strColumn) + ".value <> EXCLUDED.value";
+	}
+
+
+	/*
+	 * The partitions are tables named <table>_p<name>.
+	 */
+	bool pgsqlSink::listPartitions (set<string> &sPartitions) {
+		PGresult *result = this->query ("SELECT c.relname FROM pg_inherits i JOIN pg_class c "
+				"ON c.oid = i.inhrelid WHERE i.inhparent = '" + m_info.table + "'::regclass;");
+		if (PQresultStatus (result) != PGRES_TUPLES_OK) {
+			PQclear (result);
+			return false;
+		}
+
+		for (int i = 0; i < PQntuples (result); i++) {
+			string strName = PQgetvalue (result, i, 0);
+			string::size_type pos = strName.rfind ("_p");
+			if (pos != string::npos)
+				sPartitions.insert (strName.substr (pos + 2));
+		}
+		PQclear (result);
+		return true;
+	}
+
+	/*
+	 * A partition can't be created while the default partition holds rows of
+	 * its range; then it's created on its own, those rows are moved into it
+	 * and it's attached, all in one transaction.
+	 */
+	bool pgsqlSink::addPartition (const string &strName, time_t start, time_t end) {
+		string strPartition = m_info.table + "_p" + strName;
+		string strStart = "'" + formatTime ("%Y-%m-%d %H:%M:%S+00", start) + "'";
+		string strEnd = "'" + formatTime ("%Y-%m-%d %H:%M:%S+00", end) + "'";
+		string strQuery = "CREATE TABLE IF NOT EXISTS " + strPartition + " PARTITION OF "
+				+ m_info.table + " FOR VALUES FROM (" + strStart + ") TO (" + strEnd + ");";
+		if (this->execute (strQuery.c_str (), strQuery.length ()))
+			return true;
+
+		strQuery = "CREATE TABLE " + strPartition + " (LIKE " + m_info.table + " INCLUDING DEFAULTS);"
+				"WITH moved AS (DELETE FROM " + m_info.table + "_pdefault WHERE timestamp >= "
+				+ strStart + " AND timestamp < " + strEnd + " RETURNING *) INSERT INTO "
+				+ strPartition + " SELECT * FROM moved;"
+				"ALTER TABLE " + m_info.table + " ATTACH PARTITION " + strPartition
+				+ " FOR VALUES FROM (" + strStart + ") TO (" + strEnd + ");";
+		return this->execute (strQuery.c_str (), strQuery.length ());
+	}
+
+	bool pgsqlSink::dropPartition (const string &strName) {
+		string strQuery = "DROP TABLE IF EXISTS " + m_info.table + "_p" + strName + ";";
+		return this->execute (strQuery.c_str (), strQuery.length ());
+	}
+
+	/*
+	 * The default partition (PostgreSQL 11 or later) takes the rows outside
+	 * of the other partitions; its rows past the retention are deleted one by
+	 * one, since it can't be dropped as a whole.
+	 */
+	bool pgsqlSink::maintainCatchAll (time_t oldest) {
+		string strDefault = m_info.table + "_pdefault";
+		string strQuery = "CREATE TABLE IF NOT EXISTS " + strDefault + " PARTITION OF "
+				+ m_info.table + " DEFAULT;";
+		if (!this->execute (strQuery.c_str (), strQuery.length ()))
+			return false;
+
+		if (oldest > 0) {
+			strQuery = "DELETE FROM " + strDefault + " WHERE timestamp < '"
+					+ formatTime ("%Y-%m-%d %H:%M:%S+00", oldest) + "';";
+			if (!this->execute (strQuery.c_str (), strQuery.length ()))
+				return false;
+		}
+
+		PGresult *result = this->query ("SELECT count(*) FROM " + strDefault + ";");
+		bool bResult = PQresultStatus (result) == PGRES_TUPLES_OK && PQntuples (result) == 1;
+		if (bResult)
+			stats.outOfRange = strtoul (PQgetvalue (result, 0, 0), NULL, 10);
+		PQclear (result);
+		return bResult;
+	}
+
+	/*
+	 * Write a value as an escaped PostgreSQL string constant (E'...'). The
+	 * E'' syntax treats backslashes the same way regardless of the
+	 * standard_conforming_strings setting of the server.
+	 */
+	char *pgsqlSink::escape (char *dst, const char *first, const char *last) {
+		*dst++ = 'E';
+		*dst++ = '\'';
+		for (; first < last; first++) {
+			if (*first == '\'' || *first == '\\')
+				*dst++ = *first;
+			*dst++ = *first;
+		}
+		*dst++ = '\'';
+		return dst;
+	}
+
+	bool pgsqlSink::execute (const char *strQuery, size_t length) {
+		PGresult *result = this->query (strQuery);
+		ExecStatusType status = PQresultStatus (result);
+		PQclear (result);
+		return status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+	}
+
+	/*
+	 * Run a statement synchronously (DDL and other statements that aren't
+	 * inserts). Leaves pipeline mode for it, which requires all batches in
+	 * flight to be acknowledged first.
+	 *
+	 * @param strQuery the statement
+	 * @return the result, to be freed w/ PQclear (NULL if there's no connection)
+	 */
+	PGresult *pgsqlSink::query (const string &strQuery) {
+		if (m_pConnection == NULL)
+			return NULL;
+
+		#ifdef LIBPQ_HAS_PIPELINING
+			this->collect (0);
+			PQexitPipelineMode (m_pConnection);
+		#endif
+		PGresult *result = PQexec (m_pConnection, strQuery.c_str ());
+		#ifdef LIBPQ_HAS_PIPELINING
+			PQenterPipelineMode (m_pConnection);
+		#endif
+		return result;
+	}
+
+	#ifdef LIBPQ_HAS_PIPELINING
+		/*
+		 * Queue a batch in the pipeline. Every batch is followed by a sync, so it
+		 * runs in its own transaction and a failure only affects that batch.
+		 * Waits if there are too many batches in flight (<in-flight>).
+		 *
+		 * @param batch the INSERT statement, the batch keeps it until it's
+		 * acknowledged
+		 * @return false if the batch couldn't be sent (it's sent again after
+		 * reconnecting), errors of the batch itself are reported when it's
+		 * acknowledged
+		 */
+		bool pgsqlSink::send (queuedBatch &batch) {
+			unsigned long id = ++m_nBatchId;
+			if (!this->healthy ()
+					|| !PQsendQueryParams (m_pConnection, batch.query.c_str (), 0, NULL, NULL, NULL, NULL, 0)
+					|| !PQpipelineSync (m_pConnection)) {
+				static messageLimit limit;
+				messageLimited (limit, LEVEL_WARNING, "Couldn't send batch %lu (%u rows) for %s: %s",
+						id, batch.rows, m_info.table.c_str (),
+						m_pConnection ? PQerrorMessage (m_pConnection) : "not connected\n");
+				// The batches in flight are older, they go in front of it
+				this->requeue (batch);
+				return this->abort ("couldn't send\n");
+			}
+			m_dInFlight.push_back (pgBatch ());
+			pgBatch &sent = m_dInFlight.back ();
+			sent.query.swap (batch.query);
+			sent.prefixLength = batch.prefixLength;
+			sent.rows = batch.rows;
+			sent.spans.swap (batch.spans);
+			sent.values = batch.values;
+			sent.ids.swap (batch.ids);
+			sent.id = id;
+			sent.failed = false;
+			stats.inFlight = m_dInFlight.size ();
+
+			return this->collect (m_info.inFlight);
+		}
+
+		/*
+		 * Process the acknowledgements that have arrived, waiting for more
+		 * until at most nMaxInFlight batches are unacknowledged.
+		 *
+		 * @param nMaxInFlight number of batches that may stay in flight
+		 * @return false if the connection failed (all batches in flight are lost)
+		 */
+		bool pgsqlSink::collect (size_t nMaxInFlight) {
+			while (!m_dInFlight.empty ()) {
+				// Send what didn't fit into the socket buffer earlier
+				int nFlush = PQflush (m_pConnection);
+				if (nFlush < 0 || !PQconsumeInput (m_pConnection))
+					return this->abort (PQerrorMessage (m_pConnection));
+
+				bool bProgress = false, bSeparator = false;
+				while (!m_dInFlight.empty () && !PQisBusy (m_pConnection)) {
+					PGresult *result = PQgetResult (m_pConnection);
+					// NULL separates the results of two statements, twice in a
+					// row means there's nothing left to read for now
+					if (result == NULL) {
+						if (bSeparator)
+							break;
+						bSeparator = true;
+						continue;
+					}
+					bSeparator = false;
+					bProgress = true;
+					this->acknowledge (result);
+					PQclear (result);
+				}
+				stats.inFlight = m_dInFlight.size ();
+
+				if (m_dInFlight.size () <= nMaxInFlight)
+					break;
+				// More results may be buffered already, don't wait for the socket
+				if (bProgress)
+					continue;
+
+				// Wait for the server to read/ answer
+				struct pollfd fd;
+				fd.fd = PQsocket (m_pConnection);
+				fd.events = POLLIN | (nFlush ? POLLOUT : 0);
+				if (poll (&fd, 1, PGSQL_ACK_TIMEOUT * 1000) <= 0)
+					return this->abort ("timed out waiting for the server\n");
+			}
+			return true;
+		}
+
+		/*
+		 * Handle a result of the oldest batch in flight: the INSERT's own
+		 * result followed by the one of the sync.
+		 */
+		void pgsqlSink::acknowledge (PGresult *result) {
+			pgBatch &batch = m_dInFlight.front ();
+
+			switch (PQresultStatus (result)) {
+				case PGRES_PIPELINE_SYNC:
+					// Done w/ the batch, or w/ this attempt at its rows
+					if (batch.failed && this->split (batch)) {
+						m_dInFlight.pop_front ();
+						break;
+					}
+					if (batch.failed)
+						this->fail (batch);
+					else {
+						stats.batches++;
+						this->stored (batch.rows);
+					}
+					m_dInFlight.pop_front ();
+					break;
+				case PGRES_COMMAND_OK:
+					break;
+				default:
+					if (!batch.failed) {
+						static messageLimit limit;
+						messageLimited (limit, LEVEL_WARNING, "Batch %lu (%u rows) for %s failed: %s",
+								batch.id, batch.rows, m_info.table.c_str (), PQresultErrorMessage (result));
+					}
+					batch.failed = true;
+					break;
+			}
+		}
+
+		/*
+		 * The connection failed: the batches in flight go back to the front of
+		 * the queue and are sent again after reconnecting; the rows of the ones
+		 * the server has rejected already are retried one by one. A batch that
+		 * was committed, but whose acknowledgement got lost, is stored twice.
+		 *
+		 * @return false
+		 */
+		bool pgsqlSink::abort (const char *strReason) {
+			unsigned long batches = 0, rows = 0;
+			while (!m_dInFlight.empty ()) {
+				pgBatch &batch = m_dInFlight.back ();
+				if (batch.failed && !this->split (batch))
+					this->fail (batch);
+				else if (!batch.failed) {
+					batches++;
+					rows += batch.rows;
+					this->requeue (batch);
+				}
+				m_dInFlight.pop_back ();
+			}
+			if (batches > 0) {
+				static messageLimit limit;
+				messageLimited (limit, LEVEL_WARNING, "Resending %lu batches (%lu rows) for %s: %s",
+						batches, rows, m_info.table.c_str (), strReason);
+			}
+
+			stats.inFlight = 0;
+			m_bBroken = true;
+			return false;
+		}
+	#endif
+
+	/*
+	 * Creates a PostgreSQL connection string based on the logInfo struct.
+	 *
+	 * @return string containing the postgresql connection string
+	 */
+	string pgsqlSink::connectionString () {
+		ostringstream strTmp;
+		strTmp	<< "dbname=" << m_info.database
+				<< " user=" << m_info.username
+				<< " password=" << m_info.password
+				<< " host=" << m_info.server;
+		if (m_info.port > 0)
+			strTmp << " port=" << m_info.port;
+		// Don't hang in connect() while the server is unreachable
+		strTmp << " connect_timeout=" << SINK_CONNECT_TIMEOUT;
+		// Not the whole string, it contains the password
+		message (LEVEL_DEBUG, "Connecting to %s on %s as %s", m_info.database.c_str (),
+				m_info.server.c_str (), m_info.username.c_str ());
+		return strTmp.str ();
+	}
+
+	queryCursor *pgsqlSink::createCursor () {
+		return new pgsqlCursor (this->connectionString ());
+	}
+#endif
+
+#ifdef WITH_MYSQL
+	/*
+ 	* MySQL Helper functions
+ 	*/
+	bool isMysql (const string &args) {
+		return args == "mysql" ? true : false;
+	}
+
+	/*
+	 * Constructor
+	 */
+	mysqlSink::mysqlSink (const destinationInfo &info) : sink (info), m_pConnection (NULL),
+			m_bBroken (false), m_bLoadData (info.loadData), m_bMaxPartition (false),
+			m_pInfile (NULL), m_pInfileEnd (NULL) {
+		// connect() opens the connection
+	}
+
+	/*
+	 * Destructor
+	 */
+	mysqlSink::~mysqlSink () {
+		this->stop ();
+		if (m_pConnection) {
+			mysql_close (m_pConnection);
+			delete m_pConnection;
+		}
+	}
+
+	bool mysqlSink::connect () {
+		if (m_pConnection) {
+			mysql_close (m_pConnection);
+			delete m_pConnection;
+		}
+		m_pConnection = new MYSQL;
+		m_bBroken = false;
+
+		// Initialize the connection, w/ timeouts so a dead server can't block
+		// the sender thread forever
+		mysql_init (m_pConnection);
+		unsigned int nTimeout = SINK_CONNECT_TIMEOUT;
+		mysql_options (m_pConnection, MYSQL_OPT_CONNECT_TIMEOUT, &nTimeout);
+		nTimeout = MYSQL_IO_TIMEOUT;
+		mysql_options (m_pConnection, MYSQL_OPT_READ_TIMEOUT, &nTimeout);
+		mysql_options (m_pConnection, MYSQL_OPT_WRITE_TIMEOUT, &nTimeout);
+		mysql_options (m_pConnection, MYSQL_SET_CHARSET_NAME, MYSQL_CHARSET);
+		if (m_bLoadData) {
+			unsigned int nLocalInfile = 1;
+			mysql_options (m_pConnection, MYSQL_OPT_LOCAL_INFILE, &nLocalInfile);
+		}
+		if (!mysql_real_connect (m_pConnection, m_info.server.c_str(),
+				m_info.username.c_str(), m_info.password.c_str(),
+				m_info.database.c_str(), m_info.port, NULL, 0)) {
+			message (LEVEL_ERROR, "Couldn't create a MySQL connection to %s: %s",
+					m_info.database.c_str (), mysql_error (m_pConnection));
+			return false;
+		}
+
+		// escape () and LOAD DATA rely on backslash escapes
+		const char *strMode = "SET SESSION sql_mode = REPLACE(@@SESSION.sql_mode,'NO_BACKSLASH_ESCAPES','');";
+		if (mysql_query (m_pConnection, strMode) != 0) {
+			message (LEVEL_ERROR, "Couldn't set the SQL mode of the MySQL connection to %s: %s",
+					m_info.database.c_str (), mysql_error (m_pConnection));
+			return false;
+		}
+
+		if (m_bLoadData) {
+			// The server has to allow LOAD DATA LOCAL, otherwise stick to INSERTs
+			MYSQL_ROW row = NULL;
+			MYSQL_RES *result = NULL;
+			if (mysql_query (m_pConnection, "SELECT @@local_infile;") == 0
+					&& (result = mysql_store_result (m_pConnection)) != NULL)
+				row = mysql_fetch_row (result);
+			if (row == NULL || row[0] == NULL || strcmp (row[0], "1") != 0) {
+				message (LEVEL_WARNING, "The MySQL server doesn't allow LOAD DATA LOCAL INFILE, using INSERTs for %s",
+						m_info.table.c_str ());
+				m_bLoadData = false;
+			}
+			if (result)
+				mysql_free_result (result);
+
+			// The batch is the only "file" the server can get from us
+			mysql_set_local_infile_handler (m_pConnection, mysqlSink::infileInit,
+					mysqlSink::infileRead, mysqlSink::infileEnd, mysqlSink::infileError, this);
+		}
+		return true;
+	}
+
+	bool mysqlSink::healthy () {
+		return m_pConnection && !m_bBroken;
+	}
+
+	queryCursor *mysqlSink::createCursor () {
+		return new mysqlCursor (m_info);
+	}
+
+	/*
+	 * Check if the table exists by trying to fetch zero rows (LIMIT 0).
+	 *
+	 * @return true if the table exists, false otherwise
+	 */
+	bool mysqlSink::tableExists () {
+		string strQuery = "SELECT * FROM " + m_info.table + " LIMIT 0;";
+
+		pthread_mutex_lock (&m_lock);
+		bool bResult = this->execute (strQuery.c_str (), strQuery.length ());
+		pthread_mutex_unlock (&m_lock);
+
+		return bResult;
+	}
+
+	/*
+	 * Every unique key of a partitioned table has to contain the partitioning
+	 * column, so the id only gets a plain index (which auto_increment needs).
+	 */
+	string mysqlSink::idColumn () {
+		if (m_info.partition != PARTITION_NONE)
+			return "id bigint not null auto_increment,key (id),";
+		return "id bigint not null primary key unique auto_increment,";
+	}
+
+	/*
+	 * MySQL needs at least one partition in the CREATE TABLE, that's the
+	 * current one, plus pmax for the rows after the last partition; rows
+	 * before the first partition end up in it anyway. UNIX_TIMESTAMP() makes the bounds independent of the time
+	 * zone of the session.
+	 */
+	string mysqlSink::tableOptions () {
+		if (m_info.partition == PARTITION_NONE)
+			return "";
+
+		time_t start = partitionStart (m_info.partition, time (NULL));
+		ostringstream strOptions;
+		strOptions << " PARTITION BY RANGE (UNIX_TIMESTAMP(timestamp)) (PARTITION p"
+				   << partitionName (m_info.partition, start) << " VALUES LESS THAN ("
+				   << start + partitionLength (m_info.partition)
+				   << "), PARTITION pmax VALUES LESS THAN MAXVALUE)";
+		return strOptions.str ();
+	}
+
+	bool mysqlSink::listPartitions (set<string> &sPartitions) {
+		string strQuery = "SELECT PARTITION_NAME FROM information_schema.PARTITIONS "
+				"WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = '" + m_info.table
+				+ "' AND PARTITION_NAME IS NOT NULL;";
+		if (mysql_real_query (m_pConnection, strQuery.c_str (), strQuery.length ()))
+			return false;
+
+		MYSQL_RES *result = mysql_store_result (m_pConnection);
+		if (result == NULL)
+			return false;
+		MYSQL_ROW row;
+		while ((row = mysql_fetch_row (result)) != NULL)
+			if (row[0] && row[0][0] == 'p')
+				sPartitions.insert (row[0] + 1);
+		mysql_free_result (result);
+		m_bMaxPartition = sPartitions.count ("max") > 0;
+
+		// Not a partitioned table
+		return !sPartitions.empty ();
+	}
+
+	/*
+	 * Partitions can only be added after the last one, which is the case
+	 * since maintainPartitions() adds them in time order. Once there's pmax,
+	 * the new partition is split off of it, along w/ its rows.
+	 */
+	bool mysqlSink::addPartition (const string &strName, time_t, time_t end) {
+		ostringstream strQuery;
+		if (m_bMaxPartition)
+			strQuery << "ALTER TABLE " << m_info.table << " REORGANIZE PARTITION pmax INTO (PARTITION p"
+					 << strName << " VALUES LESS THAN (" << end
+					 << "), PARTITION pmax VALUES LESS THAN MAXVALUE);";
+		else
+			strQuery << "ALTER TABLE " << m_info.table << " ADD PARTITION (PARTITION p"
+					 << strName << " VALUES LESS THAN (" << end << "));";
+		return this->execute (strQuery.str ().c_str (), strQuery.str ().length ());
+	}
+
+	bool mysqlSink::dropPartition (const string &strName) {
+		string strQuery = "ALTER TABLE " + m_info.table + " DROP PARTITION p" + strName + ";";
+		return this->execute (strQuery.c_str (), strQuery.length ());
+	}
+
+	/*
+	 * Tables created by earlier versions get pmax after their last partition.
+	 * Rows older than the retention are in the first partition, which is
+	 * dropped as usual.
+	 */
+	bool mysqlSink::maintainCatchAll (time_t) {
+		string strQuery = "ALTER TABLE " + m_info.table
+				+ " ADD PARTITION (PARTITION pmax VALUES LESS THAN MAXVALUE);";
+		if (!m_bMaxPartition) {
+			if (!this->execute (strQuery.c_str (), strQuery.length ()))
+				return false;
+			m_bMaxPartition = true;
+		}
+
+		strQuery = "SELECT COUNT(*) FROM " + m_info.table + " PARTITION (pmax);";
+		if (mysql_real_query (m_pConnection, strQuery.c_str (), strQuery.length ()))
+			return false;
+		MYSQL_RES *result = mysql_store_result (m_pConnection);
+		if (result == NULL)
+			return false;
+		MYSQL_ROW row = mysql_fetch_row (result);
+		if (row && row[0])
+			stats.outOfRange = strtoul (row[0], NULL, 10);
+		mysql_free_result (result);
+		return row != NULL;
+	}
+
+	/*
+	 * Writers format rows while the sender thread may be replacing the
+	 * connection, so the connection can't be asked. The escapes of
+	 * mysql_real_escape_string are safe byte by byte, the connection's
+	 * character set (MYSQL_CHARSET) has no multibyte characters that contain
+	 * ASCII bytes, and connect () turns NO_BACKSLASH_ESCAPES off.
+	 */
+	char *mysqlSink::escape (char *dst, const char *first, const char *last) {
+		*dst++ = '\'';
+		for (; first < last; first++) {
+			switch (*first) {
+				case '\0': *dst++ = '\\'; *dst++ = '0'; break;
+				case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+				case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+				case '\032': *dst++ = '\\'; *dst++ = 'Z'; break;
+				case '\\': case '\'': case '"':
+					*dst++ = '\\';
+					*dst++ = *first;
+					break;
+				default: *dst++ = *first;
+			}
+		}
+		*dst++ = '\'';
+		return dst;
+	}
+
+	/*
+	 * With LOAD DATA the statement is sent once per batch and the rows follow
+	 * as tab separated lines. NULL for the event time means it's missing from
+	 * the line.
+	 */
+	string mysqlSink::insertPrefix (const vector<string> &vColumns) {
+		if (!m_bLoadData)
+			return sink::insertPrefix (vColumns);
+
+		bool bEventTime = false;
+		string strPrefix = "LOAD DATA LOCAL INFILE 'batch' INTO TABLE " + m_info.table
+				+ " FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n' (";
+		for (vector<string>::const_iterator iter = vColumns.begin ();
+				iter != vColumns.end (); iter++) {
+			if (iter != vColumns.begin ())
+				strPrefix += ",";
+			if (*iter == "timestamp") {
+				strPrefix += "@event";
+				bEventTime = true;
+			}
+			else
+				strPrefix += *iter;
+		}
+		strPrefix += ")";
+		if (bEventTime)
+			strPrefix += " SET timestamp = IFNULL(@event, NOW())";
+		return strPrefix;
+	}
+	/*
+	 * IGNORE skips the ids that are stored already.
+	 */
+	string mysqlSink::dictionaryPrefix (const string &strColumn) {
+		string strTable = this->dictionaryTable (strColumn);
+		if (m_bLoadData)
+			return "LOAD DATA LOCAL INFILE 'batch' IGNORE INTO TABLE " + strTable
+					+ " FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n' (id,value)";
+		return "INSERT IGNORE INTO " + strTable + "(id,value) VALUES ";
+	}
+
+
+	char *mysqlSink::formatRow (char *dst, bool bFirst, const lineMatch &matches, int eventTime,
+			const vector<string> &vExtra) {
+		if (!m_bLoadData)
+			return sink::formatRow (dst, bFirst, matches, eventTime, vExtra);
+
+		for (lineMatch::const_iterator iter = matches.begin () + 1;
+				iter != matches.end (); iter++) {
+			if (iter != matches.begin () + 1)
+				*dst++ = '\t';
+			dst = escapeField (dst, iter->first, iter->second);
+		}
+		if (eventTime > 0) {
+			*dst++ = '\t';
+			if (matches[eventTime].length () > 0)
+				dst = escapeField (dst, matches[eventTime].first, matches[eventTime].second);
+			else
+				dst = append (dst, "\\N");
+		}
+		for (vector<string>::const_iterator iter = vExtra.begin ();
+				iter != vExtra.end (); iter++) {
+			*dst++ = '\t';
+			dst = escapeField (dst, iter->c_str (), iter->c_str () + iter->length ());
+		}
+		*dst++ = '\n';
+		return dst;
+	}
+
+	/*
+	 * LOAD DATA lines end w/ a newline instead.
+	 */
+	size_t mysqlSink::separatorLength () {
+		return m_bLoadData ? 0 : 1;
+	}
+
+	/*
+	 * Escape a field of a LOAD DATA line. Only the separators, the escape
+	 * character and NUL have to be escaped.
+	 */
+	char *mysqlSink::escapeField (char *dst, const char *first, const char *last) {
+		for (; first < last; first++) {
+			switch (*first) {
+				case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+				case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+				case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+				case '\0': *dst++ = '\\'; *dst++ = '0'; break;
+				default: *dst++ = *first;
+			}
+		}
+		return dst;
+	}
+
+	/*
+	 * Send a batch w/ LOAD DATA LOCAL INFILE, the server reads the rows from
+	 * the batch buffer through the infile handler.
+	 */
+	bool mysqlSink::send (queuedBatch &batch) {
+		if (!m_bLoadData)
+			return sink::send (batch);
+
+		// The prefix is the statement, the rows are the "file"
+		string strStatement (batch.query, 0, batch.prefixLength);
+		m_pInfile = batch.query.data () + batch.prefixLength;
+		m_pInfileEnd = batch.query.data () + batch.query.length ();
+		bool bResult = this->execute (strStatement.c_str (), strStatement.length ());
+		m_pInfile = m_pInfileEnd = NULL;
+
+		if (!bResult) {
+			static messageLimit limit;
+			messageLimited (limit, LEVEL_WARNING, "Couldn't load %u rows into %s: %s", batch.rows,
+					m_info.table.c_str (), mysql_error (m_pConnection));
+		}
+
+		return this->account (bResult, batch);
+	}
+
+	int mysqlSink::infileInit (void **ptr, const char *, void *userdata) {
+		*ptr = userdata;
+		// Only while a batch is being sent
+		return ((mysqlSink *)userdata)->m_pInfile == NULL ? 1 : 0;
+	}
+
+	int mysqlSink::infileRead (void *ptr, char *buf, unsigned int length) {
+		mysqlSink *self = (mysqlSink *)ptr;
+		if ((size_t)(self->m_pInfileEnd - self->m_pInfile) < length)
+			length = self->m_pInfileEnd - self->m_pInfile;
+		memcpy (buf, self->m_pInfile, length);
+		self->m_pInfile += length;
+		return length;
+	}
+
+	void mysqlSink::infileEnd (void *) {
+		// The batch buffer is owned by the sink
+	}
+
+	int mysqlSink::infileError (void *, char *msg, unsigned int length) {
+		strncpy (msg, "loggerfs only sends its own batches", length);
+		msg[length - 1] = '\0';
+		return CR_UNKNOWN_ERROR;
+	}
+
+	bool mysqlSink::execute (const char *strQuery, size_t length) {
+		if (mysql_real_query (m_pConnection, strQuery, length)) {
+			unsigned int nError = mysql_errno (m_pConnection);
+			if (nError == CR_SERVER_GONE_ERROR || nError == CR_SERVER_LOST
+					|| nError == CR_CONNECTION_ERROR || nError == CR_CONN_HOST_ERROR)
+				m_bBroken = true;
+			return false;
+		}
+
+		// Discard the result set (if any), otherwise the connection is out of sync
+		MYSQL_RES *result = mysql_store_result (m_pConnection);
+		if (result)
+			mysql_free_result (result);
+
+		return true;
+	}
+#endif
@@ -0,0 +1,411 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef SINK_HPP_
+#define SINK_HPP_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+
+#include <ctime>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "config.hpp"
+#include "schema.hpp"
+
+#ifdef WITH_POSTGRESQL
+	#include <libpq-fe.h>
+#endif
+
+struct queryFilter;
+class queryCursor;
+class dictionary;
+
+// Size at which a batch is sent, even if it has fewer than <batch-size> rows
+#define SINK_MAX_BATCH_BYTES (1024 * 1024)
+// Seconds over which the rows/sec rate is averaged
+#define SINK_RATE_WINDOW 10
+// Seconds to wait for the server to acknowledge a batch
+#define PGSQL_ACK_TIMEOUT 30
+// Seconds a read from/ write to the MySQL server may take
+#define MYSQL_IO_TIMEOUT 30
+// Character set of the MySQL connections; ASCII compatible, so values can be
+// escaped byte by byte w/out asking the connection
+#define MYSQL_CHARSET "utf8mb4"
+// Seconds a connection attempt may take
+#define SINK_CONNECT_TIMEOUT 10
+// Seconds between attempts to reconnect, doubled after every failed attempt
+#define SINK_RETRY_MIN 1
+#define SINK_RETRY_MAX 60
+
+// Health of a sink's connection
+enum sinkState {
+	SINK_UP = 0,
+	SINK_DOWN, // rows are queued until the next attempt to reconnect
+	SINK_CONNECTING
+};
+
+// Counters of a sink, shown in the .stats file
+struct sinkStats {
+	unsigned long rows; // stored
+	unsigned long batches; // sent and acknowledged (or failed)
+	unsigned long failed; // batches
+	unsigned long failedRows;
+	unsigned long inFlight; // batches waiting for an acknowledgement
+	unsigned long queued; // batches waiting to be sent
+	unsigned long dropped; // rows, because the queue was full
+	unsigned long reconnects;
+	unsigned long outOfRange; // rows in the catch-all partition, as of the last maintenance
+};
+
+#ifdef WITH_MYSQL
+	#include <mysql.h>
+
+	// Client error codes (errmsg.h): a rejected LOCAL INFILE request, and the
+	// ones that mean the connection is gone
+	#ifndef CR_UNKNOWN_ERROR
+		#define CR_UNKNOWN_ERROR 2000
+	#endif
+	#ifndef CR_CONNECTION_ERROR
+		#define CR_CONNECTION_ERROR 2002
+		#define CR_CONN_HOST_ERROR 2003
+		#define CR_SERVER_GONE_ERROR 2006
+		#define CR_SERVER_LOST 2013
+	#endif
+#endif
+
+/*
+ * sink
+ * A destination of a log file's rows: a database connection plus the SQL
+ * dialect needed to talk to it. Rows are collected into multi-row INSERTs,
+ * full batches are queued and sent by the sink's own thread, so a slow
+ * destination doesn't hold back the writers or the other destinations.
+ * Connections aren't thread-safe, so all operations on the connection are
+ * serialized. A lost connection is reestablished by the sender thread, w/
+ * growing delays; meanwhile the batches wait in the queue, and once it's full
+ * new rows are dropped right away. Batches that were sent, but not
+ * acknowledged before the connection was lost go back to the front of the
+ * queue.
+ */
+class sink {
+	public:
+		sink (const destinationInfo &);
+		virtual ~sink ();
+
+		// Create the sink for the database software of the destination
+		static sink *create (const destinationInfo &);
+
+		// Table or file, for messages and the .stats file
+		virtual std::string name ();
+		const destinationInfo &destination () const { return m_info; }
+		// Rows are the lines as they were written, i.e. can't carry a repeat count
+		virtual bool storesLines ();
+
+		virtual bool connect () = 0;
+		virtual bool tableExists () = 0;
+		bool createTable (const std::vector<std::string> &);
+		// Create the table and its partitions, now or once the database is up;
+		// the second list are the columns that hold dictionary ids
+		bool prepare (const std::vector<std::string> &, const std::vector<std::string> &);
+		// The connection has been lost, retry it later
+		void disconnected ();
+		const char *state ();
+
+		// Statement prefix for rows w/ these columns, i.e. "INSERT INTO table(columns) VALUES "
+		virtual std::string insertPrefix (const std::vector<std::string> &);
+		// Statement prefix for (id, value) rows of a column's dictionary, which
+		// skips the ids that are stored already along w/ dictionarySuffix ();
+		// "" if the sink has none
+		virtual std::string dictionaryPrefix (const std::string &);
+		// Add a row to the batch, prefix from insertPrefix (); the rows of a
+		// dictionary also name it and their id
+		bool insert (const std::string &, const lineMatch &, int,
+				const std::vector<std::string> &, dictionary * = NULL, unsigned long long = 0);
+		// Queue the pending rows, optionally wait until they're stored
+		bool flush (bool = false);
+		// Wait until all rows inserted so far are stored, false if they can't be
+		// or rows have been lost since the caller's count of errors ()
+		virtual bool sync (unsigned long &);
+		// Failed batches plus dropped rows, ever
+		unsigned long errors ();
+		// Store everything that's pending and stop the sender thread, must be
+		// called before a derived class is destroyed
+		void stop ();
+		double rowsPerSecond ();
+
+		// Create upcoming partitions and drop the ones past the retention
+		bool maintainPartitions (time_t);
+
+		// The rows of a .query, NULL if the sink can't be queried
+		queryCursor *openQuery (const queryFilter &, const std::vector<std::string> &);
+
+	protected:
+		// A full batch, waiting for the sender thread
+		struct queuedBatch {
+			std::string query;
+			size_t prefixLength; // the statement prefix at the start of the query
+			unsigned int rows;
+			// Start and end of each row in the query, w/out the separator
+			std::vector<std::pair<size_t, size_t> > spans;
+			dictionary *values; // the rows are (id, value) rows of it, or NULL
+			std::vector<unsigned long long> ids; // of the rows, if values
+		};
+
+		// False if the connection has been lost
+		virtual bool healthy ();
+		virtual std::string idColumn () = 0;
+		virtual std::string timestampColumn ();
+		// Appended to CREATE TABLE, i.e. the partitioning scheme
+		virtual std::string tableOptions ();
+		// Partitions are identified by the start of their range: YYYYMMDD[HH]
+		virtual bool listPartitions (std::set<std::string> &);
+		virtual bool addPartition (const std::string &, time_t, time_t);
+		virtual bool dropPartition (const std::string &);
+		// Create the partition for rows outside of the others if it's missing,
+		// drop its rows older than the given time and count the rest
+		virtual bool maintainCatchAll (time_t);
+		// Lookup table of a dictionary column, if it doesn't exist yet
+		virtual bool createDictionary (const std::string &);
+		std::string dictionaryTable (const std::string &);
+		// Appended to a batch of a column's dictionary rows
+		virtual std::string dictionarySuffix (const std::string &);
+		// A cursor on a connection of its own, NULL if the sink can't be queried
+		virtual queryCursor *createCursor ();
+		// Write a value as a quoted string constant, w/ room for 2 * length + 3 characters
+		virtual char *escape (char *, const char *, const char *) = 0;
+		virtual bool execute (const char *, size_t) = 0;
+		// Room a row needs in the batch, at most
+		virtual size_t rowLength (const lineMatch &, int, const std::vector<std::string> &);
+		// Write a row into the batch, w/ room for what rowLength () estimated
+		virtual char *formatRow (char *, bool, const lineMatch &, int,
+				const std::vector<std::string> &);
+		// Characters formatRow () puts in front of all but the first row
+		virtual size_t separatorLength ();
+		void stored (unsigned int);
+		// Count a batch that failed for good, its ids are sent again
+		void fail (queuedBatch &);
+		bool account (bool, queuedBatch &);
+		// Send the batch again once the sink has reconnected
+		void requeue (queuedBatch &);
+		// Send the rows of a failed batch again one by one
+		bool split (queuedBatch &);
+		// Send a batch of rows, collect the results of the batches in flight
+		virtual bool send (queuedBatch &);
+		virtual bool collect (size_t);
+
+	private:
+		bool queueBatch ();
+		bool setUp ();
+		bool recover ();
+		unsigned long settled ();
+		static void *thread (void *);
+		void run ();
+
+	public:
+		sinkStats stats;
+
+	protected:
+		destinationInfo m_info;
+		pthread_mutex_t m_lock; // the connection, recursive
+
+		// Rows that haven't been queued yet
+		std::string m_strPrefix;
+		std::string m_strBatch; // prefix and rows
+		unsigned int m_nBatchRows;
+		std::vector<std::pair<size_t, size_t> > m_vSpans; // of the rows in the batch
+		dictionary *m_pValues; // of the rows in the batch, if any
+		std::vector<unsigned long long> m_vIds;
+
+	private:
+		pthread_mutex_t m_queueLock; // the batch and the queue
+		pthread_cond_t m_queueCond; // signaled when a batch is queued
+		pthread_cond_t m_idleCond; // signaled when the queue has been sent
+		std::deque<queuedBatch> m_dQueue;
+		std::vector<std::string> m_vSpare; // buffers of sent batches, for reuse
+		pthread_t m_thread;
+		bool m_bThread;
+		bool m_bStopThread;
+		bool m_bSending; // the thread has batches that aren't stored yet
+		unsigned long m_nQueuedBatches; // ever queued
+		unsigned long m_nSettled; // batches stored or failed, stats.batches w/out m_nSplit
+		unsigned long m_nSplit; // batches added by split ()
+		unsigned int m_nSyncing; // threads waiting in sync ()
+
+		volatile int m_nState; // sinkState
+		int m_nBackoff; // seconds until the next attempt after a failed one
+		time_t m_nextAttempt;
+		std::vector<std::string> m_vColumns; // of the table, for prepare ()
+		std::vector<std::string> m_vDictionaries; // columns w/ a lookup table
+		bool m_bPrepared;
+		bool m_bUnpartitioned; // the partitions couldn't be listed, warned about it
+
+	protected:
+
+		// Rows stored per second, for the last SINK_RATE_WINDOW seconds
+		time_t m_aRateSecond[SINK_RATE_WINDOW];
+		unsigned long m_aRateRows[SINK_RATE_WINDOW];
+};
+
+// Length of a partition in seconds, start/ name of the partition containing a time
+time_t partitionLength (int);
+time_t partitionStart (int, time_t);
+std::string partitionName (int, time_t);
+
+bool isFile (const std::string &);
+
+/*
+ * fileSink
+ * Appends the matched lines, as they were written, to a local file, i.e. an
+ * archive next to the database. A file that's moved away (rotated) is
+ * reopened.
+ */
+class fileSink : public sink {
+	public:
+		fileSink (const destinationInfo &);
+		~fileSink ();
+
+		bool connect ();
+		bool tableExists ();
+		std::string name ();
+		bool storesLines ();
+		std::string insertPrefix (const std::vector<std::string> &);
+		std::string dictionaryPrefix (const std::string &);
+		bool sync (unsigned long &);
+
+	private:
+		std::string idColumn ();
+		bool createDictionary (const std::string &);
+		char *escape (char *, const char *, const char *);
+		bool execute (const char *, size_t);
+		bool healthy ();
+		size_t rowLength (const lineMatch &, int, const std::vector<std::string> &);
+		char *formatRow (char *, bool, const lineMatch &, int,
+				const std::vector<std::string> &);
+		size_t separatorLength ();
+
+	private:
+		int m_fd;
+		ino_t m_inode;
+};
+
+#ifdef WITH_POSTGRESQL
+	bool isPostgresql (const std::string &);
+
+	class pgsqlSink : public sink {
+		public:
+			pgsqlSink (const destinationInfo &);
+			~pgsqlSink ();
+
+			bool connect ();
+			bool tableExists ();
+
+		private:
+			std::string idColumn ();
+			std::string timestampColumn ();
+			std::string tableOptions ();
+			bool listPartitions (std::set<std::string> &);
+			bool addPartition (const std::string &, time_t, time_t);
+			bool dropPartition (const std::string &);
+			bool maintainCatchAll (time_t);
+			bool createDictionary (const std::string &);
+			std::string dictionarySuffix (const std::string &);
+			char *escape (char *, const char *, const char *);
+			bool execute (const char *, size_t);
+			bool healthy ();
+			PGresult *query (const std::string &);
+			std::string connectionString ();
+			queryCursor *createCursor ();
+
+			#ifdef LIBPQ_HAS_PIPELINING
+				bool send (queuedBatch &);
+				bool collect (size_t);
+				void acknowledge (PGresult *);
+				bool abort (const char *);
+			#endif
+
+		private:
+			// A batch sent to the server, but not yet acknowledged
+			struct pgBatch : queuedBatch {
+				unsigned long id;
+				bool failed;
+			};
+
+			PGconn *m_pConnection;
+			bool m_bBroken; // the connection failed while waiting for the server
+			std::deque<pgBatch> m_dInFlight;
+			unsigned long m_nBatchId;
+	};
+#endif
+
+#ifdef WITH_MYSQL
+	bool isMysql (const std::string &);
+
+	class mysqlSink : public sink {
+		public:
+			mysqlSink (const destinationInfo &);
+			~mysqlSink ();
+
+			bool connect ();
+			bool tableExists ();
+			std::string insertPrefix (const std::vector<std::string> &);
+			std::string dictionaryPrefix (const std::string &);
+
+		private:
+			std::string idColumn ();
+			std::string tableOptions ();
+			bool listPartitions (std::set<std::string> &);
+			bool addPartition (const std::string &, time_t, time_t);
+			bool dropPartition (const std::string &);
+			bool maintainCatchAll (time_t);
+			char *escape (char *, const char *, const char *);
+			bool execute (const char *, size_t);
+			bool healthy ();
+			queryCursor *createCursor ();
+
+			// LOAD DATA LOCAL INFILE
+			char *formatRow (char *, bool, const lineMatch &, int,
+					const std::vector<std::string> &);
+			size_t separatorLength ();
+			char *escapeField (char *, const char *, const char *);
+			bool send (queuedBatch &);
+
+			static int infileInit (void **, const char *, void *);
+			static int infileRead (void *, char *, unsigned int);
+			static void infileEnd (void *);
+			static int infileError (void *, char *, unsigned int);
+
+		private:
+			MYSQL *m_pConnection;
+			bool m_bBroken; // the last statement failed because of the connection
+			bool m_bLoadData;
+			bool m_bMaxPartition; // the table has the catch-all partition pmax
+			// Rows of the batch that haven't been read by the server yet
+			const char *m_pInfile;
+			const char *m_pInfileEnd;
+	};
+#endif
+
+#endif /*SINK_HPP_*/
@@ -0,0 +1,161 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "source.hpp"
+#include "messages.hpp"
+#include "syslog.hpp"
+#include "tail.hpp"
+#include "ringsource.hpp"
+
+#include <map>
+#include <set>
+#include <cstring>
+
+using namespace std;
+
+/*
+ * Get an attribute of a <source>.
+ *
+ * @param info the source
+ * @param strName name of the attribute
+ * @param strDefault value if the attribute isn't set
+ */
+static string option (const sourceInfo &info, const char *strName, const char *strDefault) {
+	map<string, string>::const_iterator iter = info.options.find (strName);
+	return iter == info.options.end () ? strDefault : iter->second;
+}
+
+/*
+ * Constructor
+ */
+source::source (ingestFunction fnIngest) : m_fnIngest (fnIngest), m_bRunning (false),
+		m_bStop (false) {
+	memset (&stats, 0, sizeof (stats));
+}
+
+/*
+ * Destructor
+ */
+source::~source () {
+	// Derived classes have to be stopped before they're destroyed
+}
+
+/*
+ * Create the sources of all log files. Syslog sources that use the same
+ * address share one listener, every tailed file and ring name gets its own
+ * source.
+ *
+ * @param vPipelines the log files
+ * @param fnIngest receives the lines
+ * @param vSources receives the (not yet started) sources
+ */
+void source::create (const vector<pipeline *> &vPipelines, ingestFunction fnIngest,
+		vector<source *> &vSources) {
+	map<string, syslogListener *> mListeners;
+	set<string> ringNames;
+
+	for (vector<pipeline *>::const_iterator p = vPipelines.begin ();
+			p != vPipelines.end (); p++) {
+		const vector<sourceInfo> &vInfo = (*p)->info.sources;
+		for (vector<sourceInfo>::const_iterator info = vInfo.begin ();
+				info != vInfo.end (); info++) {
+			if (info->type == "syslog") {
+				string strProtocol = option (*info, "protocol", "udp");
+				string strAddress = option (*info, "address", SYSLOG_DEFAULT_ADDRESS);
+				syslogListener *&listener = mListeners[strProtocol + "://" + strAddress];
+				if (listener == NULL) {
+					listener = new syslogListener (fnIngest, strProtocol, strAddress);
+					vSources.push_back (listener);
+				}
+				listener->addRoute ((*p)->name, info->options);
+			}
+			else if (info->type == "tail") {
+				string strPath = option (*info, "path", "");
+				if (strPath.empty ())
+					message (LEVEL_WARNING, "The tail source of %s has no path", (*p)->name.c_str ());
+				else if ((*p)->name.find ('*') != string::npos)
+					message (LEVEL_WARNING, "A tail source can't feed the wildcard location %s",
+							(*p)->name.c_str ());
+				else {
+					string strFrom = option (*info, "from", "end");
+					vSources.push_back (new tailSource (fnIngest, (*p)->name, strPath,
+							option (*info, "state", TAIL_STATE_DIR), strFrom == "start"));
+				}
+			}
+			else if (info->type == "ring") {
+				// The location w/out slashes, unless the writers use another name
+				string strName = (*p)->name;
+				for (string::size_type i = 0; i < strName.length (); i++)
+					if (strName[i] == '/')
+						strName[i] = '_';
+				strName = option (*info, "name", strName.c_str ());
+				if ((*p)->name.find ('*') != string::npos)
+					message (LEVEL_WARNING, "A ring source can't feed the wildcard location %s",
+							(*p)->name.c_str ());
+				else if (!ringNames.insert (strName).second)
+					message (LEVEL_WARNING, "The ring name %s is used by more than one log file, ignoring it for %s",
+							strName.c_str (), (*p)->name.c_str ());
+				else
+					vSources.push_back (new ringSource (fnIngest, (*p)->name, strName));
+			}
+			else
+				message (LEVEL_WARNING, "Unknown source type '%s' for %s", info->type.c_str (),
+						(*p)->name.c_str ());
+		}
+	}
+}
+
+/*
+ * Set the source up and start its thread.
+ *
+ * @return true on success, false otherwise
+ */
+bool source::start () {
+	if (m_bRunning)
+		return true;
+	if (!this->open ()) {
+		message (LEVEL_WARNING, "Couldn't start %s", this->name ().c_str ());
+		return false;
+	}
+
+	m_bStop = false;
+	if (pthread_create (&m_thread, NULL, source::thread, this) != 0) {
+		message (LEVEL_WARNING, "Couldn't create a thread for %s", this->name ().c_str ());
+
+		return false;
+	}
+	m_bRunning = true;
+	return true;
+}
+
+/*
+ * Stop the thread, run() notices within a fraction of a second.
+ */
+void source::stop () {
+	if (!m_bRunning)
+		return;
+	m_bStop = true;
+	pthread_join (m_thread, NULL);
+	m_bRunning = false;
+}
+
+void *source::thread (void *ptr) {
+	((source *)ptr)->run ();
+	return NULL;
+}
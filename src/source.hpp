@@ -0,0 +1,85 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef SOURCE_HPP_
+#define SOURCE_HPP_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "pipeline.hpp"
+
+// Hands lines to the log file at a location (relative to the mount point),
+// as if they had been written to it; optionally waits until they're parsed.
+// Returns false if there's no such log file.
+typedef bool (*ingestFunction) (const std::string &, const char *, size_t, bool);
+
+// Counters of a source, shown in the .stats file
+struct sourceStats {
+	unsigned long received; // messages/ lines
+	unsigned long unrouted; // messages no log file wanted
+	unsigned long errors;
+};
+
+/*
+ * source
+ * Produces lines for log files w/out going through the mount point, i.e. a
+ * network listener. Every source runs in its own thread.
+ */
+class source {
+	public:
+		source (ingestFunction);
+		virtual ~source ();
+
+		// Create the sources configured for the pipelines
+		static void create (const std::vector<pipeline *> &, ingestFunction,
+				std::vector<source *> &);
+
+		bool start ();
+		void stop ();
+		virtual std::string name () = 0;
+
+	public:
+		sourceStats stats;
+
+	protected:
+		// Set up (i.e. bind the socket) and run until stopping() is true
+		virtual bool open () = 0;
+		virtual void run () = 0;
+		bool stopping () const { return m_bStop; }
+
+	private:
+		static void *thread (void *);
+
+	protected:
+		ingestFunction m_fnIngest;
+
+	private:
+		pthread_t m_thread;
+		bool m_bRunning;
+		volatile bool m_bStop;
+};
+
+#endif /*SOURCE_HPP_*/
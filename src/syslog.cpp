@@ -0,0 +1,602 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "syslog.hpp"
+#include "messages.hpp"
+#include "general.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <ctime>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static const char *facilities[] = { "kern", "user", "mail", "daemon", "auth",
+		"syslog", "lpr", "news", "uucp", "cron", "authpriv", "ftp", "ntp", "audit",
+		"alert", "clock", "local0", "local1", "local2", "local3", "local4", "local5",
+		"local6", "local7" };
+
+/*
+ * Get the next space separated field.
+ *
+ * @param p start of the field, moved past the field and the space
+ * @param last end of the message
+ * @return the field
+ */
+static string field (const char *&p, const char *last) {
+	const char *first = p;
+	while (p < last && *p != ' ')
+		p++;
+	string strField (first, p);
+	if (p < last)
+		p++;
+	return strField;
+}
+
+/*
+ * Check for an RFC 3164 timestamp: "Mmm dd hh:mm:ss"
+ */
+static bool isTimestamp (const char *p, const char *last) {
+	if (last - p < 15 || p[3] != ' ' || p[6] != ' ' || p[9] != ':' || p[12] != ':')
+		return false;
+	for (int i = 0; i < 12; i++)
+		if (strncmp (p, months[i], 3) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Limit a field of a time to its range.
+ */
+static unsigned int clamp (int value, int min, int max) {
+	return value < min ? min : (value > max ? max : value);
+}
+
+/*
+ * Format a time in the RFC 3164 format, fields out of range are clamped.
+ *
+ * @param dst receives the time, "Mmm dd hh:mm:ss"
+ * @param size size of dst, at least 16
+ */
+static void formatTimestamp (char *dst, size_t size, int month, int day, int hour,
+		int minute, int second) {
+	snprintf (dst, size, "%s %2u %02u:%02u:%02u", months[clamp (month, 0, 11)],
+			clamp (day, 1, 31), clamp (hour, 0, 23), clamp (minute, 0, 59), clamp (second, 0, 60));
+}
+
+/*
+ * Parse the tag of an RFC 3164 message, "program[pid]: "
+ */
+static void parseTag (const char *&p, const char *last, syslogMessage &msg) {
+	const char *first = p;
+	while (p < last && *p != '[' && *p != ':' && *p != ' ' && p - first < 48)
+		p++;
+	string strProgram (first, p);
+	string strPid;
+	if (p < last && *p == '[') {
+		const char *pid = ++p;
+		while (p < last && *p != ']')
+			p++;
+		strPid.assign (pid, p);
+		if (p < last)
+			p++;
+	}
+
+	// Not a tag after all, the whole content is the message
+	if (p >= last || *p != ':' || strProgram.empty ()) {
+		p = first;
+		return;
+	}
+	msg.program = strProgram;
+	msg.pid = strPid;
+	p++;
+	if (p < last && *p == ' ')
+		p++;
+}
+
+/*
+ * Parse a syslog message. Messages that don't follow either RFC are taken as
+ * the text of a message w/ the default priority (user.notice) and the current
+ * time.
+ *
+ * @param first start of the message
+ * @param last end of the message
+ * @param msg receives the parts of the message
+ */
+void parseSyslog (const char *first, const char *last, syslogMessage &msg) {
+	const char *p = first;
+
+	// Strip the line end some senders add
+	while (last > first && (last[-1] == '\n' || last[-1] == '\r' || last[-1] == '\0'))
+		last--;
+
+	// <PRI>
+	int pri = 13;
+	if (p < last && *p == '<') {
+		const char *digits = ++p;
+		int value = 0;
+		while (p < last && isdigit (*p) && p - digits < 3)
+			value = value * 10 + (*p++ - '0');
+		if (p < last && *p == '>' && p > digits) {
+			pri = value;
+			p++;
+		}
+		else
+			p = first;
+	}
+	msg.facility = pri / 8;
+	msg.severity = pri % 8;
+	msg.host = msg.program = msg.pid = "";
+
+	time_t now = time (NULL);
+	struct tm tmNow;
+	localtime_r (&now, &tmNow);
+	formatTimestamp (msg.timestamp, sizeof (msg.timestamp), tmNow.tm_mon, tmNow.tm_mday, tmNow.tm_hour,
+			tmNow.tm_min, tmNow.tm_sec);
+
+	// RFC 5424: VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA [MSG]
+	if (last - p > 2 && p[0] == '1' && p[1] == ' ') {
+		p += 2;
+		string strTime = field (p, last);
+		// YYYY-MM-DDThh:mm:ss, the time zone is ignored
+		if (strTime.length () >= 19 && strTime[4] == '-' && strTime[10] == 'T')
+			formatTimestamp (msg.timestamp, sizeof (msg.timestamp), atoi (strTime.c_str () + 5) - 1,
+					atoi (strTime.c_str () + 8), atoi (strTime.c_str () + 11), atoi (strTime.c_str () + 14), atoi (strTime.c_str () + 17));
+		msg.host = field (p, last);
+		msg.program = field (p, last);
+		msg.pid = field (p, last);
+		field (p, last); // MSGID
+		if (msg.host == "-")
+			msg.host = "";
+		if (msg.pid == "-")
+			msg.pid = "";
+
+		// Skip the structured data: "-" or [id param="value" ...]...
+		if (p < last && *p == '-')
+			p++;
+		while (p < last && *p == '[') {
+			bool bQuoted = false;
+			for (p++; p < last && (bQuoted || *p != ']'); p++) {
+				if (*p == '\\' && p + 1 < last)
+					p++;
+				else if (*p == '"')
+					bQuoted = !bQuoted;
+			}
+			if (p < last)
+				p++;
+		}
+		if (p < last && *p == ' ')
+			p++;
+		// UTF-8 byte order mark
+		if (last - p >= 3 && memcmp (p, "\xEF\xBB\xBF", 3) == 0)
+			p += 3;
+	}
+	// RFC 3164: TIMESTAMP HOSTNAME TAG: MSG, but the host is often missing
+	else {
+		if (isTimestamp (p, last)) {
+			memcpy (msg.timestamp, p, 15);
+			msg.timestamp[15] = '\0';
+			p += 15;
+			if (p < last && *p == ' ')
+				p++;
+
+			const char *host = p;
+			string strHost = field (p, last);
+			if (strHost.empty () || strHost[strHost.length () - 1] == ':'
+					|| strHost.find ('[') != string::npos)
+				p = host;
+			else
+				msg.host = strHost;
+		}
+		parseTag (p, last, msg);
+	}
+
+	if (msg.program.empty ())
+		msg.program = "-";
+	msg.text = p;
+	msg.textEnd = last;
+}
+
+/*
+ * Format a message as a traditional syslog line, the format of the files
+ * written by syslogd.
+ *
+ * @param msg the message
+ * @param strLine receives the line, w/ a trailing line feed
+ */
+void syslogLine (const syslogMessage &msg, string &strLine) {
+	strLine.append (msg.timestamp);
+	strLine += ' ';
+	strLine += msg.host.empty () ? "-" : msg.host;
+	strLine += ' ';
+	strLine += msg.program;
+	if (!msg.pid.empty ())
+		strLine += "[" + msg.pid + "]";
+	strLine += ": ";
+	// One message is one line
+	for (const char *p = msg.text; p < msg.textEnd; p++)
+		strLine += (*p == '\n' || *p == '\r') ? ' ' : *p;
+	strLine += '\n';
+}
+
+/*
+ * Constructor
+ *
+ * @param fnIngest receives the lines
+ * @param strProtocol "udp" or "tcp"
+ * @param strAddress host:port to listen on
+ */
+syslogListener::syslogListener (ingestFunction fnIngest, const string &strProtocol,
+		const string &strAddress) : source (fnIngest), m_strProtocol (strProtocol),
+		m_strAddress (strAddress), m_fd (-1) {
+	// open() binds the socket
+}
+
+/*
+ * Destructor
+ */
+syslogListener::~syslogListener () {
+	this->stop ();
+	for (vector<connection>::iterator iter = m_vConnections.begin ();
+			iter != m_vConnections.end (); iter++)
+		close (iter->fd);
+	if (m_fd >= 0)
+		close (m_fd);
+}
+
+/*
+ * Send the messages that match the attributes of a <source> to a log file.
+ *
+ * @param strLocation location of the log file, '*' segments are replaced w/
+ * the host name of the message
+ * @param mOptions host/ program (shell patterns) and facility (name or number)
+ */
+void syslogListener::addRoute (const string &strLocation, const map<string, string> &mOptions) {
+	route r;
+	split (strLocation, '/', &r.segments);
+	r.facility = -1;
+
+	map<string, string>::const_iterator iter;
+	if ((iter = mOptions.find ("host")) != mOptions.end ())
+		r.host = iter->second;
+	if ((iter = mOptions.find ("program")) != mOptions.end ())
+		r.program = iter->second;
+	if ((iter = mOptions.find ("facility")) != mOptions.end ()) {
+		if (isnumber (iter->second.c_str ()))
+			r.facility = strtoint (iter->second);
+		for (unsigned int i = 0; i < sizeof (facilities) / sizeof (facilities[0]); i++)
+			if (iter->second == facilities[i])
+				r.facility = i;
+		if (r.facility < 0)
+			message (LEVEL_WARNING, "Unknown syslog facility %s for %s", iter->second.c_str (),
+					strLocation.c_str ());
+	}
+	m_vRoutes.push_back (r);
+}
+
+string syslogListener::name () {
+	return m_strProtocol + "://" + m_strAddress;
+}
+
+/*
+ * Bind the socket.
+ *
+ * @return true on success, false otherwise
+ */
+bool syslogListener::open () {
+	if (m_fd >= 0)
+		return true;
+
+	bool bTcp = (m_strProtocol == "tcp");
+	if (!bTcp && m_strProtocol != "udp") {
+		message (LEVEL_ERROR, "Unknown syslog protocol %s, use udp or tcp", m_strProtocol.c_str ());
+		return false;
+	}
+
+	// host:port, IPv6 addresses in brackets
+	string::size_type colon = m_strAddress.rfind (':');
+	if (colon == string::npos) {
+		message (LEVEL_ERROR, "The syslog address %s has no port", m_strAddress.c_str ());
+		return false;
+	}
+	string strHost = m_strAddress.substr (0, colon);
+	string strPort = m_strAddress.substr (colon + 1);
+	if (strHost.length () >= 2 && strHost[0] == '[')
+		strHost = strHost.substr (1, strHost.length () - 2);
+
+	struct addrinfo hints, *result;
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = bTcp ? SOCK_STREAM : SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo (strHost.empty () ? NULL : strHost.c_str (), strPort.c_str (), &hints, &result) != 0) {
+		message (LEVEL_ERROR, "Couldn't resolve the syslog address %s", m_strAddress.c_str ());
+		return false;
+	}
+
+	m_fd = socket (result->ai_family, result->ai_socktype, result->ai_protocol);
+	int one = 1;
+	if (m_fd >= 0)
+		setsockopt (m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if (m_fd < 0 || bind (m_fd, result->ai_addr, result->ai_addrlen) != 0
+			|| (bTcp && listen (m_fd, SOMAXCONN) != 0)) {
+		message (LEVEL_ERROR, "Couldn't listen on %s: %s", m_strAddress.c_str (), strerror (errno));
+
+		if (m_fd >= 0)
+			close (m_fd);
+		m_fd = -1;
+		freeaddrinfo (result);
+		return false;
+	}
+	freeaddrinfo (result);
+	fcntl (m_fd, F_SETFL, fcntl (m_fd, F_GETFL) | O_NONBLOCK);
+
+	// Room for bursts while the thread is busy w/ the database
+	int size = 1024 * 1024;
+	setsockopt (m_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+
+	m_vBuffer.resize (bTcp ? 65536 : SYSLOG_BATCH * SYSLOG_MAX_MESSAGE);
+	return true;
+}
+
+void syslogListener::run () {
+	if (m_strProtocol == "tcp")
+		this->runTcp ();
+	else
+		this->runUdp ();
+}
+
+/*
+ * Get the numeric address of a peer.
+ */
+static string peerName (const struct sockaddr_storage *addr, socklen_t length) {
+	char host[NI_MAXHOST];
+	if (getnameinfo ((const struct sockaddr *)addr, length, host, sizeof (host), NULL, 0,
+			NI_NUMERICHOST) != 0)
+		return "";
+	return host;
+}
+
+/*
+ * Receive datagrams, up to SYSLOG_BATCH of them w/ a single system call.
+ */
+void syslogListener::runUdp () {
+	struct sockaddr_storage addrs[SYSLOG_BATCH];
+	struct iovec iov[SYSLOG_BATCH];
+	#ifdef MSG_WAITFORONE
+		struct mmsghdr msgs[SYSLOG_BATCH];
+		memset (msgs, 0, sizeof (msgs));
+		for (int i = 0; i < SYSLOG_BATCH; i++) {
+			iov[i].iov_base = &m_vBuffer[i * SYSLOG_MAX_MESSAGE];
+			iov[i].iov_len = SYSLOG_MAX_MESSAGE;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+		}
+	#endif
+
+	while (!this->stopping ()) {
+		struct pollfd fd;
+		fd.fd = m_fd;
+		fd.events = POLLIN;
+		if (poll (&fd, 1, SYSLOG_POLL_TIMEOUT) <= 0)
+			continue;
+
+		#ifdef MSG_WAITFORONE
+			for (int i = 0; i < SYSLOG_BATCH; i++)
+				msgs[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+			int n = recvmmsg (m_fd, msgs, SYSLOG_BATCH, MSG_DONTWAIT, NULL);
+			for (int i = 0; i < n; i++)
+				this->dispatch ((const char *)iov[i].iov_base, (const char *)iov[i].iov_base + msgs[i].msg_len,
+						peerName (&addrs[i], msgs[i].msg_hdr.msg_namelen));
+		#else
+			// No recvmmsg(), drain the socket one datagram at a time
+			for (int i = 0; i < SYSLOG_BATCH; i++) {
+				socklen_t length = sizeof (addrs[0]);
+				ssize_t n = recvfrom (m_fd, &m_vBuffer[0], SYSLOG_MAX_MESSAGE, MSG_DONTWAIT,
+						(struct sockaddr *)&addrs[0], &length);
+				if (n < 0)
+					break;
+				this->dispatch (&m_vBuffer[0], &m_vBuffer[0] + n, peerName (&addrs[0], length));
+			}
+		#endif
+		this->deliver ();
+	}
+}
+
+/*
+ * Accept connections and receive messages, either octet counted
+ * ("LENGTH MESSAGE", RFC 6587) or terminated by a line feed.
+ */
+void syslogListener::runTcp () {
+	vector<struct pollfd> vFds;
+
+	while (!this->stopping ()) {
+		vFds.resize (m_vConnections.size () + 1);
+		vFds[0].fd = m_fd;
+		vFds[0].events = POLLIN;
+		for (size_t i = 0; i < m_vConnections.size (); i++) {
+			vFds[i + 1].fd = m_vConnections[i].fd;
+			vFds[i + 1].events = POLLIN;
+		}
+		if (poll (&vFds[0], vFds.size (), SYSLOG_POLL_TIMEOUT) <= 0)
+			continue;
+
+		// Read from the clients, closed connections are removed
+		size_t j = 0;
+		for (size_t i = 0; i < m_vConnections.size (); i++) {
+			if (vFds[i + 1].revents == 0 || this->receive (m_vConnections[i]))
+				m_vConnections[j++] = m_vConnections[i];
+			else
+				close (m_vConnections[i].fd);
+		}
+		m_vConnections.resize (j);
+
+		// New clients
+		if (vFds[0].revents & POLLIN) {
+			struct sockaddr_storage addr;
+			socklen_t length = sizeof (addr);
+			int fd;
+			while ((fd = accept (m_fd, (struct sockaddr *)&addr, &length)) >= 0) {
+				if (m_vConnections.size () >= SYSLOG_MAX_CONNECTIONS) {
+					close (fd);
+					stats.errors++;
+					continue;
+				}
+				fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+				connection c;
+				c.fd = fd;
+				c.peer = peerName (&addr, length);
+				m_vConnections.push_back (c);
+				length = sizeof (addr);
+			}
+		}
+		this->deliver ();
+	}
+}
+
+/*
+ * Read from a client and dispatch the complete messages.
+ *
+ * @return false if the connection is closed
+ */
+bool syslogListener::receive (connection &c) {
+	ssize_t n = read (c.fd, &m_vBuffer[0], m_vBuffer.size ());
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		return false;
+	if (n > 0)
+		c.buffer.append (&m_vBuffer[0], n);
+
+	const char *p = c.buffer.data ();
+	const char *end = p + c.buffer.length ();
+	while (p < end) {
+		// Line ends between messages
+		if (*p == '\n' || *p == '\r' || *p == ' ') {
+			p++;
+			continue;
+		}
+
+		if (isdigit (*p)) {
+			// Octet counting
+			const char *digits = p;
+			size_t length = 0;
+			while (p < end && isdigit (*p) && p - digits < 8)
+				length = length * 10 + (*p++ - '0');
+			if (p < end && *p == ' ') {
+				if ((size_t)(end - p - 1) < length) {
+					p = digits;
+					break;
+				}
+				this->dispatch (p + 1, p + 1 + length, c.peer);
+				p += 1 + length;
+				continue;
+			}
+			p = digits;
+		}
+
+		// Line feed framing, messages that get too long are cut
+		const char *lf = (const char *)memchr (p, '\n', end - p);
+		if (lf == NULL) {
+			if (end - p < SYSLOG_MAX_MESSAGE)
+				break;
+			lf = p + SYSLOG_MAX_MESSAGE;
+		}
+		this->dispatch (p, lf, c.peer);
+		p = lf;
+	}
+	c.buffer.erase (0, p - c.buffer.data ());
+
+	// An octet count that promises more than we're willing to buffer
+	if (c.buffer.length () > 16 * SYSLOG_MAX_MESSAGE) {
+		stats.errors++;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Route a message to the log files that want it.
+ *
+ * @param first start of the message
+ * @param last end of the message
+ * @param strPeer address of the sender, the host if the message doesn't name one
+ */
+void syslogListener::dispatch (const char *first, const char *last, const string &strPeer) {
+	stats.received++;
+
+	syslogMessage msg;
+	parseSyslog (first, last, msg);
+	if (msg.host.empty ())
+		msg.host = strPeer;
+
+	string strLine;
+	bool bRouted = false;
+	for (vector<route>::iterator r = m_vRoutes.begin (); r != m_vRoutes.end (); r++) {
+		if ((!r->host.empty () && fnmatch (r->host.c_str (), msg.host.c_str (), 0) != 0)
+				|| (!r->program.empty () && fnmatch (r->program.c_str (), msg.program.c_str (), 0) != 0)
+				|| (r->facility >= 0 && r->facility != msg.facility))
+			continue;
+
+		if (strLine.empty ())
+			syslogLine (msg, strLine);
+
+		// Wildcard segments become the host, which must not leave its directory
+		string strLocation;
+		for (vector<string>::iterator s = r->segments.begin (); s != r->segments.end (); s++) {
+			if (s != r->segments.begin ())
+				strLocation += '/';
+			if (*s != "*")
+				strLocation += *s;
+			else if (msg.host.empty () || msg.host[0] == '.' || msg.host.find ('/') != string::npos)
+				strLocation += "unknown";
+			else
+				strLocation += msg.host;
+		}
+		m_mPending[strLocation] += strLine;
+		bRouted = true;
+	}
+	if (!bRouted)
+		stats.unrouted++;
+}
+
+/*
+ * Hand the lines collected from a batch of messages to the log files, one
+ * call per log file.
+ */
+void syslogListener::deliver () {
+	for (map<string, string>::iterator iter = m_mPending.begin ();
+			iter != m_mPending.end (); iter++)
+		if (!m_fnIngest (iter->first, iter->second.data (), iter->second.length (), false))
+			stats.errors++;
+	m_mPending.clear ();
+}
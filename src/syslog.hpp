@@ -0,0 +1,113 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef SYSLOG_HPP_
+#define SYSLOG_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <sys/socket.h>
+
+#include "source.hpp"
+
+#define SYSLOG_DEFAULT_ADDRESS "127.0.0.1:514"
+// Longest message that's accepted, longer ones are truncated
+#define SYSLOG_MAX_MESSAGE 8192
+// Datagrams received w/ a single recvmmsg() call
+#define SYSLOG_BATCH 64
+// Milliseconds between checks whether the listener has been stopped
+#define SYSLOG_POLL_TIMEOUT 250
+#define SYSLOG_MAX_CONNECTIONS 256
+
+/*
+ * A syslog message (RFC 3164 or RFC 5424), pointing into the received data
+ */
+struct syslogMessage {
+	int facility;
+	int severity;
+	char timestamp[16]; // "Mmm dd hh:mm:ss"
+	std::string host; // "" if the message doesn't say
+	std::string program;
+	std::string pid;
+	const char *text;
+	const char *textEnd;
+};
+
+void parseSyslog (const char *, const char *, syslogMessage &);
+void syslogLine (const syslogMessage &, std::string &);
+
+/*
+ * syslogListener
+ * Receives syslog messages over UDP or TCP and routes them to log files. The
+ * messages are turned into traditional syslog lines
+ * ("Mmm dd hh:mm:ss host program[pid]: message") before they're parsed w/ the
+ * log's schemas.
+ */
+class syslogListener : public source {
+	public:
+		syslogListener (ingestFunction, const std::string &, const std::string &);
+		~syslogListener ();
+
+		void addRoute (const std::string &, const std::map<std::string, std::string> &);
+		std::string name ();
+
+	protected:
+		bool open ();
+		void run ();
+
+	private:
+		// A log file and the messages it wants
+		struct route {
+			std::vector<std::string> segments; // of the location, '*' is replaced w/ the host
+			std::string host; // shell pattern, "" for any
+			std::string program;
+			int facility; // -1 for any
+		};
+
+		// A TCP client
+		struct connection {
+			int fd;
+			std::string peer;
+			std::string buffer; // data that doesn't form a complete message yet
+		};
+
+		void runUdp ();
+		void runTcp ();
+		bool receive (connection &);
+		void dispatch (const char *, const char *, const std::string &);
+		void deliver ();
+
+	private:
+		std::string m_strProtocol;
+		std::string m_strAddress;
+		std::vector<route> m_vRoutes;
+		int m_fd;
+		std::vector<connection> m_vConnections;
+		std::vector<char> m_vBuffer;
+		// Lines collected for each location, delivered once per batch of messages
+		std::map<std::string, std::string> m_mPending;
+};
+
+#endif /*SYSLOG_HPP_*/
@@ -0,0 +1,285 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "tail.hpp"
+#include "messages.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+ * Turn a path into a file name.
+ */
+static string flatten (const string &strPath) {
+	string strName;
+	for (string::size_type i = 0; i < strPath.length (); i++) {
+		if (strPath[i] == '/') {
+			if (!strName.empty ())
+				strName += '_';
+		}
+		else
+			strName += strPath[i];
+	}
+	return strName;
+}
+
+/*
+ * Constructor
+ *
+ * @param fnIngest receives the lines
+ * @param strLocation log file the lines are written to
+ * @param strPath file to follow
+ * @param strStateDir directory for the saved read offset
+ * @param bFromStart true to read a file that's seen for the first time from the
+ * start, otherwise only lines added from now on are read
+ */
+tailSource::tailSource (ingestFunction fnIngest, const string &strLocation,
+		const string &strPath, const string &strStateDir, bool bFromStart) :
+		source (fnIngest), m_strLocation (strLocation), m_strPath (strPath),
+		m_bFromStart (bFromStart), m_fd (-1), m_inotify (-1), m_inode (0), m_offset (0),
+		m_nPartial (0) {
+	// A log file may follow several files, and several log files the same file
+	m_strStateFile = strStateDir + "/" + flatten (strLocation) + "@" + flatten (strPath);
+}
+
+/*
+ * Destructor
+ */
+tailSource::~tailSource () {
+	this->stop ();
+	if (m_fd >= 0)
+		close (m_fd);
+	if (m_inotify >= 0)
+		close (m_inotify);
+}
+
+string tailSource::name () {
+	return "tail:" + m_strPath;
+}
+
+/*
+ * Watch the directory of the file and open the file, if it exists already.
+ *
+ * @return true on success, false otherwise
+ */
+bool tailSource::open () {
+	if (m_inotify >= 0)
+		return true;
+
+	// Watch the directory, not the file: the file may not exist yet, and
+	// rotation replaces it
+	string::size_type slash = m_strPath.rfind ('/');
+	string strDir = (slash == string::npos) ? "." : m_strPath.substr (0, slash + 1);
+	m_inotify = inotify_init ();
+	if (m_inotify < 0) {
+		message (LEVEL_ERROR, "Couldn't initialize inotify: %s", strerror (errno));
+		return false;
+	}
+	fcntl (m_inotify, F_SETFL, fcntl (m_inotify, F_GETFL) | O_NONBLOCK);
+	fcntl (m_inotify, F_SETFD, FD_CLOEXEC);
+	if (inotify_add_watch (m_inotify, strDir.c_str (), IN_MODIFY | IN_CREATE | IN_MOVED_TO
+			| IN_MOVED_FROM | IN_DELETE) < 0)
+		message (LEVEL_WARNING, "Couldn't watch %s: %s, checking for changes every %dms",
+				strDir.c_str (), strerror (errno), TAIL_POLL_TIMEOUT);
+
+	string strStateDir = m_strStateFile.substr (0, m_strStateFile.rfind ('/'));
+	mkdir (strStateDir.c_str (), 0755);
+	if (access (strStateDir.c_str (), W_OK) != 0)
+		message (LEVEL_WARNING, "Can't write to %s, the read offset of %s won't survive a restart",
+				strStateDir.c_str (), m_strPath.c_str ());
+
+
+	m_vBuffer.resize (TAIL_READ_SIZE);
+	this->reopen (true);
+	return true;
+}
+
+/*
+ * Open the file at the path.
+ *
+ * @param bResume true to continue at the saved offset, false for a new file
+ * (created or rotated while running) which is read from the start
+ * @return true on success, false if the file doesn't exist
+ */
+bool tailSource::reopen (bool bResume) {
+	if (m_fd >= 0)
+		close (m_fd);
+	m_nPartial = 0;
+	m_offset = 0;
+
+	m_fd = ::open (m_strPath.c_str (), O_RDONLY);
+	struct stat st;
+	if (m_fd < 0 || fstat (m_fd, &st) != 0) {
+		if (m_fd >= 0)
+			close (m_fd);
+		m_fd = -1;
+		return false;
+	}
+	fcntl (m_fd, F_SETFD, FD_CLOEXEC);
+	m_inode = st.st_ino;
+
+	if (bResume) {
+		ino_t inode;
+		off_t offset;
+		this->loadOffset (inode, offset);
+		if (inode == 0)
+			m_offset = m_bFromStart ? 0 : st.st_size;
+		// The same file, unless it has been truncated
+		else if (inode == st.st_ino && offset <= st.st_size)
+			m_offset = offset;
+		// Rotated while not running, the lines still in the old file are lost
+	}
+	lseek (m_fd, m_offset, SEEK_SET);
+	this->saveOffset ();
+	return true;
+}
+
+/*
+ * Read up to the end of the file and ingest all complete lines. An incomplete
+ * last line is kept until its newline is written. The offset is saved once
+ * the lines are parsed; lines that can't be ingested are read again on the
+ * next call.
+ *
+ * @return true if anything was read
+ */
+bool tailSource::readChunks () {
+	bool bRead = false;
+	ssize_t n = 0;
+	while (!this->stopping ()
+			&& (n = read (m_fd, &m_vBuffer[m_nPartial], m_vBuffer.size () - m_nPartial)) > 0) {
+		bRead = true;
+		m_offset += n;
+
+		char *buf = &m_vBuffer[0];
+		size_t size = m_nPartial + n;
+		char *last = (char *)memrchr (buf + m_nPartial, '\n', n);
+		// A line as long as the whole buffer is cut
+		if (last == NULL && size < m_vBuffer.size ()) {
+			m_nPartial = size;
+			continue;
+		}
+		size_t length = (last == NULL) ? size : last + 1 - buf;
+
+		if (!m_fnIngest (m_strLocation, buf, length, true)) {
+			stats.errors++;
+			m_offset -= size;
+			m_nPartial = 0;
+			lseek (m_fd, m_offset, SEEK_SET);
+			break;
+		}
+		for (const char *p = buf; (p = (const char *)memchr (p, '\n', buf + length - p)) != NULL; p++)
+			stats.received++;
+
+		m_nPartial = size - length;
+		memmove (buf, buf + length, m_nPartial);
+		this->saveOffset ();
+	}
+	if (n < 0 && errno != EINTR && errno != EAGAIN)
+		stats.errors++;
+	return bRead;
+}
+
+/*
+ * Get the saved offset.
+ *
+ * @param inode receives the inode of the file, 0 if nothing was saved
+ * @param offset receives the offset of the first byte that hasn't been ingested
+ */
+void tailSource::loadOffset (ino_t &inode, off_t &offset) {
+	inode = 0;
+	offset = 0;
+	FILE *fp = fopen (m_strStateFile.c_str (), "r");
+	if (fp == NULL)
+		return;
+	unsigned long long nInode, nOffset;
+	if (fscanf (fp, "%llu %llu", &nInode, &nOffset) == 2) {
+		inode = nInode;
+		offset = nOffset;
+	}
+	fclose (fp);
+}
+
+/*
+ * Save the offset of the first byte that hasn't been ingested. The file is
+ * replaced atomically, so a crash leaves either the old or the new offset.
+ */
+void tailSource::saveOffset () {
+	string strTemp = m_strStateFile + ".tmp";
+	FILE *fp = fopen (strTemp.c_str (), "w");
+	if (fp == NULL)
+		return;
+	fprintf (fp, "%llu %llu\n", (unsigned long long)m_inode,
+			(unsigned long long)(m_offset - m_nPartial));
+	if (fclose (fp) == 0)
+		rename (strTemp.c_str (), m_strStateFile.c_str ());
+}
+
+/*
+ * Read whenever inotify reports a change in the directory, and check for
+ * rotation and truncation.
+ */
+void tailSource::run () {
+	char events[4096];
+	struct pollfd pfd;
+	pfd.fd = m_inotify;
+	pfd.events = POLLIN;
+
+	while (!this->stopping ()) {
+		if (m_fd < 0)
+			this->reopen (false);
+
+		if (m_fd >= 0) {
+			this->readChunks ();
+
+			struct stat st, stPath;
+			// Rotated: finish the old file (readChunks() did), then follow the new one
+			if (stat (m_strPath.c_str (), &stPath) == 0 && stPath.st_ino != m_inode) {
+				if (m_nPartial > 0) {
+					stats.received++;
+					if (!m_fnIngest (m_strLocation, &m_vBuffer[0], m_nPartial, true))
+						stats.errors++;
+				}
+				this->reopen (false);
+				continue;
+			}
+			// Truncated (i.e. copytruncate), start over
+			if (fstat (m_fd, &st) == 0 && st.st_size < m_offset) {
+				m_offset = 0;
+				m_nPartial = 0;
+				lseek (m_fd, 0, SEEK_SET);
+				this->saveOffset ();
+				continue;
+			}
+		}
+
+		if (poll (&pfd, 1, TAIL_POLL_TIMEOUT) > 0)
+			// Any change is a reason to look, the events themselves don't matter
+			while (read (m_inotify, events, sizeof (events)) > 0)
+				;
+	}
+}
@@ -0,0 +1,80 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef TAIL_HPP_
+#define TAIL_HPP_
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "source.hpp"
+
+// Directory for the read offsets of tailed files
+#define TAIL_STATE_DIR "/var/lib/loggerfs"
+// Bytes read from the file at a time
+#define TAIL_READ_SIZE (1024 * 1024)
+// Milliseconds between checks for changes inotify doesn't report (i.e. NFS)
+#define TAIL_POLL_TIMEOUT 1000
+
+/*
+ * tailSource
+ * Follows a file on disk like tail -F: new data is read as soon as inotify
+ * reports a change, rotation (a new file under the same name) and truncation
+ * are handled. The read offset is saved after every chunk, so a restart
+ * continues where the last run stopped.
+ */
+class tailSource : public source {
+	public:
+		tailSource (ingestFunction, const std::string &, const std::string &,
+				const std::string &, bool);
+		~tailSource ();
+
+		std::string name ();
+
+	protected:
+		bool open ();
+		void run ();
+
+	private:
+		bool reopen (bool);
+		bool readChunks ();
+		void loadOffset (ino_t &, off_t &);
+		void saveOffset ();
+
+	private:
+		std::string m_strLocation; // log file the lines go to
+		std::string m_strPath;
+		std::string m_strStateFile;
+		bool m_bFromStart; // read existing files from the start instead of the end
+
+		int m_fd;
+		int m_inotify;
+		ino_t m_inode;
+		off_t m_offset; // read from the file so far
+		std::vector<char> m_vBuffer;
+		size_t m_nPartial; // bytes of an incomplete last line at the start of the buffer
+};
+
+#endif /*TAIL_HPP_*/
@@ -0,0 +1,254 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#include "tokenizer.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+/*
+ * Map the fields of the lines to the columns. Either all columns have a field
+ * number, or none has and they're the fields in order; a mix would let a
+ * numbered column silently take the field of one in order.
+ * 
+ * @param format the schema, its keys are read and its positions written
+ * @return false if a column has neither its own nor a field number, or if
+ * the schema mixes both
+ */
+bool compileDelimitedFields (logFormat &format) {
+	format.positions.clear ();
+	bool bNumbered = false, bInOrder = false;
+	for (unsigned int i = 0; i < format.keys.size (); i++) {
+		const string &strKey = format.keys[i];
+		unsigned int field = i + 1;
+		if (!strKey.empty () && strKey.find_first_not_of ("0123456789") == string::npos) {
+			field = atoi (strKey.c_str ());
+			bNumbered = true;
+		}
+		else if (strKey != format.columns[i])
+			return false;
+		else
+			bInOrder = true;
+		if (field == 0 || (bNumbered && bInOrder))
+			return false;
+
+		if (format.positions.size () < field)
+			format.positions.resize (field, 0);
+		format.positions[field - 1] = i + 1;
+	}
+	return true;
+}
+
+/*
+ * The options are characters 0-255 (or ESCAPE_NONE), a char may be signed.
+ */
+static inline bool isDelimiter (const logFormat &format, char c) {
+	return format.delimiter ? (unsigned char)c == format.delimiter : (c == ' ' || c == '\t');
+}
+
+static inline bool isQuote (const logFormat &format, char c) {
+	return format.quote && (unsigned char)c == format.quote;
+}
+
+static inline bool isEscape (const logFormat &format, char c) {
+	return (unsigned char)c == format.escape;
+}
+
+/*
+ * Copy a value w/out its escapes into the thread's arena.
+ * 
+ * @param format the schema
+ * @param value the raw value, changed to the copy
+ */
+static void unescape (const logFormat &format, fieldValue &value) {
+	char *out = (char *)arena::local ().allocate (value.last - value.first);
+	char *q = out;
+	for (const char *p = value.first; p < value.last; p++) {
+		if (isEscape (format, *p) && p + 1 < value.last) {
+			p++;
+			if (format.escape == '\\' && *p == 'n')
+				*q++ = '\n';
+			else if (format.escape == '\\' && *p == 't')
+				*q++ = '\t';
+			else if (format.escape == '\\' && *p == 'r')
+				*q++ = '\r';
+			else
+				*q++ = *p;
+		}
+		else
+			*q++ = *p;
+	}
+	value.first = out;
+	value.last = q;
+}
+
+/*
+ * Read a value up to the next delimiter, or up to the closing quote if it's
+ * quoted. A quoted value must be followed by a delimiter.
+ * 
+ * @param format the schema
+ * @param p start of the value
+ * @param end end of the line
+ * @param value receives the value, w/out the quotes and escapes
+ * @param bStore false if the value is skipped, it isn't unescaped then
+ * @return the delimiter after the value or end, NULL if the value is invalid
+ */
+static const char *readValue (const logFormat &format, const char *p, const char *end,
+		fieldValue &value, bool bStore) {
+	bool bEscaped = false;
+	if (p < end && isQuote (format, *p)) {
+		value.first = ++p;
+		while (true) {
+			if (p >= end)
+				return NULL;
+			// Doubled quotes, when the quote is its own escape
+			if (isEscape (format, *p) && p + 1 < end
+					&& (format.escape != format.quote || isQuote (format, p[1]))) {
+				bEscaped = true;
+				p += 2;
+				continue;
+			}
+			if (isQuote (format, *p))
+				break;
+			p++;
+		}
+		value.last = p++;
+		if (p < end && !isDelimiter (format, *p))
+			return NULL;
+	}
+	else {
+		value.first = p;
+		if (format.delimiter && (format.escape == ESCAPE_NONE || format.escape == format.quote)) {
+			// Nothing to look for but the delimiter
+			p = (const char *)memchr (p, format.delimiter, end - p);
+			if (p == NULL)
+				p = end;
+		}
+		else
+			for (; p < end && !isDelimiter (format, *p); p++)
+				if (isEscape (format, *p) && format.escape != format.quote && p + 1 < end) {
+					bEscaped = true;
+					p++;
+				}
+		value.last = p;
+	}
+
+	if (bEscaped && bStore)
+		unescape (format, value);
+	return p;
+}
+
+/*
+ * Parse a line of key=value pairs.
+ * 
+ * @param format the schema
+ * @param first start of the line
+ * @param last end of the line
+ * @param matches receives the columns
+ * @return MATCH_OK, or MATCH_FAIL if the line has no pairs or an unterminated quote
+ */
+matchResult matchLogfmt (const logFormat &format, const char *first, const char *last,
+		lineMatch &matches) {
+	size_t n = format.columns.size ();
+	fieldValue *values = (fieldValue *)arena::local ().allocate (n * sizeof (fieldValue) + 1);
+	for (size_t i = 0; i < n; i++)
+		values[i].first = values[i].last = NULL;
+
+	bool bPairs = false;
+	const char *p = first;
+	while (p < last) {
+		// Delimiters between pairs, a run of them if it's whitespace
+		while (p < last && isDelimiter (format, *p))
+			p++;
+		if (p >= last)
+			break;
+
+		const char *key = p;
+		while (p < last && *p != '=' && !isDelimiter (format, *p))
+			p++;
+		size_t length = p - key;
+		if (length == 0)
+			return MATCH_FAIL;
+
+		size_t column = 0;
+		for (size_t i = 0; i < n; i++)
+			if (format.keys[i].length () == length && memcmp (format.keys[i].data (), key, length) == 0) {
+				column = i + 1;
+				break;
+			}
+
+		fieldValue value;
+		if (p < last && *p == '=') {
+			bPairs = true;
+			if ((p = readValue (format, p + 1, last, value, column != 0)) == NULL)
+				return MATCH_FAIL;
+		}
+		else {
+			// A key on its own is a flag
+			static const char *strTrue = "true";
+			value.first = strTrue;
+			value.last = strTrue + 4;
+		}
+		if (column)
+			values[column - 1] = value;
+	}
+	if (!bPairs)
+		return MATCH_FAIL;
+
+	fillMatch (matches, first, last, values, n);
+	return MATCH_OK;
+}
+
+/*
+ * Parse a line of delimited fields.
+ * 
+ * @param format the schema
+ * @param first start of the line
+ * @param last end of the line
+ * @param matches receives the columns
+ * @return MATCH_OK, or MATCH_FAIL if the line has too few fields or an invalid quote
+ */
+matchResult matchDelimited (const logFormat &format, const char *first, const char *last,
+		lineMatch &matches) {
+	size_t n = format.columns.size ();
+	fieldValue *values = (fieldValue *)arena::local ().allocate (n * sizeof (fieldValue) + 1);
+	for (size_t i = 0; i < n; i++)
+		values[i].first = values[i].last = NULL;
+
+	size_t fields = format.positions.size ();
+	const char *p = first;
+	for (size_t field = 0; field < fields; field++) {
+		// The line ended before all the fields the schema needs
+		if (p > last)
+			return MATCH_FAIL;
+		unsigned int column = format.positions[field];
+		fieldValue value;
+		if ((p = readValue (format, p, last, value, column != 0)) == NULL)
+			return MATCH_FAIL;
+		if (column)
+			values[column - 1] = value;
+		// Past the delimiter, or past the end if there's none
+		p++;
+	}
+
+	fillMatch (matches, first, last, values, n);
+	return MATCH_OK;
+}
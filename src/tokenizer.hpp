@@ -0,0 +1,51 @@
+/*
+ * loggerfs: a virtual file system to store logs in a database
+ * Copyright (C) 2007 John C. Matherly jmath@itauth.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+#ifdef HAVE_CONFIG_H
+	#include <config.h>
+#endif
+
+#ifndef TOKENIZER_HPP_
+#define TOKENIZER_HPP_
+
+#include "schema.hpp"
+
+/*
+ * <parser>logfmt</parser>: lines of key=value pairs separated by whitespace
+ * (or the <delimiter>), i.e. level=info msg="request done" took=12ms. The
+ * columns are the values of the keys of the same name, or of the key after
+ * the '=' ("message=msg"). A key w/out a value is "true", a missing key
+ * leaves the column empty. Lines w/out any pair don't match.
+ * 
+ * <parser>delimited</parser>: CSV, TSV etc. w/ fields separated by the
+ * <delimiter> (',' by default). The columns are the fields in order, or the
+ * field whose number (from 1) follows the '=' ("status=9"). Lines w/ fewer
+ * fields than the schema needs don't match.
+ * 
+ * Values may be enclosed in the <quote> character ('"') to contain
+ * delimiters. The <escape> character makes the next one literal; it's a
+ * backslash for logfmt and the quote for delimited, where "" is a quote as
+ * in CSV. Both are tokenized in a single pass, values are only copied (into
+ * the thread's arena) when they have escapes.
+ */
+bool compileDelimitedFields (logFormat &);
+matchResult matchLogfmt (const logFormat &, const char *, const char *, lineMatch &);
+matchResult matchDelimited (const logFormat &, const char *, const char *, lineMatch &);
+
+#endif /*TOKENIZER_HPP_*/